@@ -0,0 +1,652 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Lockstep batch renderer for many TMS99xxA instances
+//
+// Every instance of the batch is clocked at the same time,
+// so all instances are always on the same scanline.
+// This lets the per-line parameters of every instance be computed up front,
+// after which each tile column is fetched and expanded for all instances
+// in loops that run across instances.
+// The expansion loop is vectorized by the compiler, while the tile fetches
+// (which gather from each instance's own VRAM addresses) and the transpose
+// into per-instance observations go through the kernels of beevdp-simd.h,
+// i.e. AVX2 gathers and SSE2 byte interleaves.
+// Per instance, a batch of 256 renders at about 1.7x the rate of
+// a single TMS99xxA with AVX2, and about 1.3x with SSE4.1, which only
+// has the vectorized transpose (see the "batch" lines of beevdp-bench).
+// Instances in the text-based modes, or with the display disabled,
+// are patched up afterwards with a scalar renderer.
+//
+// The output of the batch must match the reference renderer
+// for every instance (see beevdp-difftest.cpp).
+
+#include <cstring>
+#include "beevdp-batch.h"
+#include "beevdp-simd.h"
+using namespace beevdp;
+using namespace std;
+
+namespace beevdp
+{
+    // Pad the number of lanes to a multiple of this
+    static constexpr size_t lane_alignment = 32;
+
+    template<typename Variant>
+    TMS99xxABatch<Variant>::TMS99xxABatch(size_t num_instances) : num_instances(num_instances)
+    {
+	num_lanes = (((num_instances + lane_alignment - 1) / lane_alignment) * lane_alignment);
+	num_lanes = max(num_lanes, lane_alignment);
+
+	// (Note: the vectorized fetch kernels load 4 bytes per VRAM byte,
+	// so VRAM is padded past its end)
+	vram.resize(((0x4000 * num_lanes) + 3));
+
+	for (auto &reg : regs)
+	{
+	    reg.resize(num_lanes);
+	}
+
+	command_word.resize(num_lanes);
+	addr_register.resize(num_lanes);
+	read_buffer.resize(num_lanes);
+	is_second_control_write.resize(num_lanes);
+	is_vblank.resize(num_lanes);
+	is_irq_gen.resize(num_lanes);
+
+	name_base.resize(num_lanes);
+	name_offs.resize(num_lanes);
+	pattern_base.resize(num_lanes);
+	pattern_mask.resize(num_lanes);
+	color_base.resize(num_lanes);
+	color_mask.resize(num_lanes);
+	color_shift_left.resize(num_lanes);
+	color_shift_right.resize(num_lanes);
+	vram_mask.resize(num_lanes);
+	is_multicolor.resize(num_lanes);
+	backdrop_color.resize(num_lanes);
+
+	tile_pattern.resize(num_lanes);
+	tile_fg_color.resize(num_lanes);
+	tile_bg_color.resize(num_lanes);
+
+	linebuffer.resize((256 * num_lanes));
+
+	// Approximate luma of each palette color
+	for (int color = 0; color < 16; color++)
+	{
+	    BeeVDPRGB rgb = Variant::palette[color];
+	    luma_table[color] = uint8_t(((rgb.red * 299) + (rgb.green * 587) + (rgb.blue * 114)) / 1000);
+	}
+
+	setObservation(ObservePalette, 1);
+	init();
+    }
+
+    // Select the observation format
+    template<typename Variant>
+    void TMS99xxABatch<Variant>::setObservation(BeeVDPObservation format, int scale)
+    {
+	if ((scale != 1) && (scale != 2) && (scale != 4) && (scale != 8))
+	{
+	    cout << "Unsupported observation scale of " << dec << scale << endl;
+	    return;
+	}
+
+	observation_format = format;
+	observation_scale = scale;
+	observations.assign((num_instances * observationWidth() * observationHeight()), 0);
+	luma_sums.assign((observationWidth() * num_lanes), 0);
+    }
+
+    template<typename Variant>
+    int TMS99xxABatch<Variant>::observationWidth() const
+    {
+	return (256 / observation_scale);
+    }
+
+    template<typename Variant>
+    int TMS99xxABatch<Variant>::observationHeight() const
+    {
+	return (192 / observation_scale);
+    }
+
+    template<typename Variant>
+    const uint8_t *TMS99xxABatch<Variant>::getObservations() const
+    {
+	return observations.data();
+    }
+
+    template<typename Variant>
+    const uint8_t *TMS99xxABatch<Variant>::getObservation(size_t index) const
+    {
+	return &observations[(index * observationWidth() * observationHeight())];
+    }
+
+    // Reset every instance
+    // (Note: unlike the standalone core, VRAM is cleared instead of randomized,
+    // so that every instance starts out in the same state)
+    template<typename Variant>
+    void TMS99xxABatch<Variant>::init()
+    {
+	fill(vram.begin(), vram.end(), 0);
+
+	for (auto &reg : regs)
+	{
+	    fill(reg.begin(), reg.end(), 0);
+	}
+
+	fill(command_word.begin(), command_word.end(), 0);
+	fill(addr_register.begin(), addr_register.end(), 0);
+	fill(read_buffer.begin(), read_buffer.end(), 0);
+	fill(is_second_control_write.begin(), is_second_control_write.end(), 0);
+	fill(is_vblank.begin(), is_vblank.end(), 1);
+	fill(is_irq_gen.begin(), is_irq_gen.end(), 0);
+	fill(vram_mask.begin(), vram_mask.end(), ((Variant::has_4k_mode && is_4k_mode_enabled) ? 0x0FFF : 0x3FFF));
+	fill(observations.begin(), observations.end(), 0);
+	fill(luma_sums.begin(), luma_sums.end(), 0);
+	vcounter = 0;
+    }
+
+    // Honor the 4K/16K bit in register 1 of every instance
+    template<typename Variant>
+    void TMS99xxABatch<Variant>::set4KModeEnabled(bool is_enabled)
+    {
+	is_4k_mode_enabled = is_enabled;
+
+	for (size_t lane = 0; lane < num_lanes; lane++)
+	{
+	    bool is_4k_addressing = (Variant::has_4k_mode && is_enabled && !testbit(regs[1][lane], 7));
+	    vram_mask[lane] = is_4k_addressing ? 0x0FFF : 0x3FFF;
+	}
+    }
+
+    // Increment address register of a single instance
+    template<typename Variant>
+    void TMS99xxABatch<Variant>::increment_addr(size_t index)
+    {
+	addr_register[index] = ((addr_register[index] + 1) & 0x3FFF);
+    }
+
+    // Write to a VDP register of a single instance
+    template<typename Variant>
+    void TMS99xxABatch<Variant>::writeRegister(size_t index, int reg, uint8_t data)
+    {
+	// Ignore writes to invalid registers
+	// (i.e. not registers 0-7)
+	if (reg >= 8)
+	{
+	    return;
+	}
+
+	regs[reg][index] = data;
+
+	if (reg == 1)
+	{
+	    bool is_4k_addressing = (Variant::has_4k_mode && is_4k_mode_enabled && !testbit(data, 7));
+	    vram_mask[index] = is_4k_addressing ? 0x0FFF : 0x3FFF;
+
+	    if (is_vblank[index] && testbit(data, 5))
+	    {
+		is_irq_gen[index] = 1;
+	    }
+	}
+    }
+
+    // Write to the same VDP register of every instance
+    template<typename Variant>
+    void TMS99xxABatch<Variant>::writeRegisterAll(int reg, uint8_t data)
+    {
+	for (size_t index = 0; index < num_instances; index++)
+	{
+	    writeRegister(index, reg, data);
+	}
+    }
+
+    // Write a block of data to the VRAM of a single instance
+    template<typename Variant>
+    void TMS99xxABatch<Variant>::writeVRAM(size_t index, uint16_t addr, const uint8_t *data, size_t length)
+    {
+	for (size_t i = 0; i < length; i++)
+	{
+	    vram_at((addr + i), index) = data[i];
+	}
+    }
+
+    // Read a block of data from the VRAM of a single instance
+    template<typename Variant>
+    void TMS99xxABatch<Variant>::readVRAM(size_t index, uint16_t addr, uint8_t *data, size_t length) const
+    {
+	for (size_t i = 0; i < length; i++)
+	{
+	    data[i] = vram[((((addr + i) & 0x3FFF) * num_lanes) + index)];
+	}
+    }
+
+    // Write to the control port of a single instance
+    template<typename Variant>
+    void TMS99xxABatch<Variant>::writeControl(size_t index, uint8_t data)
+    {
+	uint16_t &command = command_word[index];
+
+	if (!is_second_control_write[index])
+	{
+	    command = ((command & 0xFF00) | data);
+	    addr_register[index] = (command & 0x3FFF);
+	    is_second_control_write[index] = 1;
+	    return;
+	}
+
+	command = ((command & 0xFF) | (data << 8));
+	addr_register[index] = (command & 0x3FFF);
+	is_second_control_write[index] = 0;
+
+	switch (command >> 14)
+	{
+	    // Read VRAM
+	    case 0:
+	    {
+		read_buffer[index] = fetch_vram(index, addr_register[index]);
+		increment_addr(index);
+	    }
+	    break;
+	    // Write to VDP register
+	    case 2:
+	    case 3: writeRegister(index, ((command >> 8) & 0x7), (command & 0xFF)); break;
+	    default: break;
+	}
+    }
+
+    // Write to the data port of a single instance
+    template<typename Variant>
+    void TMS99xxABatch<Variant>::writeData(size_t index, uint8_t data)
+    {
+	vram_at((addr_register[index] & vram_mask[index]), index) = data;
+	read_buffer[index] = data;
+	increment_addr(index);
+	is_second_control_write[index] = 0;
+    }
+
+    // Check if a single instance has generated an IRQ
+    template<typename Variant>
+    bool TMS99xxABatch<Variant>::isInterrupt(size_t index)
+    {
+	bool irq_gen = (is_irq_gen[index] != 0);
+	is_irq_gen[index] = 0;
+	return irq_gen;
+    }
+
+    // Read from the status port of a single instance
+    template<typename Variant>
+    uint8_t TMS99xxABatch<Variant>::readStatus(size_t index)
+    {
+	uint8_t status_byte = (is_vblank[index] << 7);
+	is_vblank[index] = 0;
+	is_second_control_write[index] = 0;
+	return status_byte;
+    }
+
+    // Read from the data port of a single instance
+    template<typename Variant>
+    uint8_t TMS99xxABatch<Variant>::readData(size_t index)
+    {
+	is_second_control_write[index] = 0;
+	uint8_t result = read_buffer[index];
+	read_buffer[index] = fetch_vram(index, addr_register[index]);
+	increment_addr(index);
+	return result;
+    }
+
+    // Check if an instance can be rendered by the vectorized path
+    // (i.e. the display is enabled, and it's in one of the 32-column modes,
+    // such as graphics I, graphics II or multicolor mode)
+    template<typename Variant>
+    bool TMS99xxABatch<Variant>::is_vector_mode(size_t lane) const
+    {
+	uint8_t reg0 = regs[0][lane];
+	uint8_t reg1 = regs[1][lane];
+	int mode_val = ((testbit(reg1, 3) << 2) | (testbit(reg0, 1) << 1) | testbit(reg1, 4));
+	return testbit(reg1, 6) && (tms99xx_modes[mode_val].num_cols == 32);
+    }
+
+    // Compute the per-line parameters of every instance
+    // (Note: all 32-column modes are expressed as
+    // name table -> pattern byte (+ color byte) lookups, so that
+    // the same branch-free code handles all of them)
+    template<typename Variant>
+    void TMS99xxABatch<Variant>::update_lane_params(int line)
+    {
+	for (size_t lane = 0; lane < num_lanes; lane++)
+	{
+	    uint8_t reg0 = regs[0][lane];
+	    uint8_t reg1 = regs[1][lane];
+	    uint8_t reg3 = regs[3][lane];
+	    uint8_t reg4 = regs[4][lane];
+	    int mode_val = ((testbit(reg1, 3) << 2) | (testbit(reg0, 1) << 1) | testbit(reg1, 4));
+	    const BeeVDPModeDesc &desc = tms99xx_modes[mode_val];
+	    bool is_mc = (desc.source == CellMulticolor);
+	    int pattern_row = ((line >> desc.row_shift) & 0x7);
+
+	    name_base[lane] = (((regs[2][lane] & 0xF) << 10) + ((line >> 3) << 5));
+	    backdrop_color[lane] = (regs[7][lane] & 0xF);
+	    is_multicolor[lane] = is_mc;
+
+	    if (desc.is_bank_split)
+	    {
+		// The screen is split into three banks of 256 patterns
+		name_offs[lane] = ((line >> 6) << 8);
+		pattern_base[lane] = ((testbit(reg4, 2) << 13) + pattern_row);
+		pattern_mask[lane] = (((reg4 & 0x3) << 8) | 0xFF);
+		color_base[lane] = ((testbit(reg3, 7) << 13) + (line & 0x7));
+		color_mask[lane] = (((reg3 & 0x7F) << 3) | 0x7);
+		color_shift_left[lane] = 3;
+		color_shift_right[lane] = 0;
+	    }
+	    else
+	    {
+		name_offs[lane] = 0;
+		pattern_base[lane] = (((reg4 & 0x7) << 11) + pattern_row);
+		pattern_mask[lane] = 0xFF;
+		color_base[lane] = (reg3 << 6);
+		color_mask[lane] = 0xFF;
+		color_shift_left[lane] = 0;
+		color_shift_right[lane] = 3;
+	    }
+	}
+    }
+
+    // Render scanline 'line' of every instance into the linebuffer
+    template<typename Variant>
+    void TMS99xxABatch<Variant>::render_line(int line)
+    {
+	update_lane_params(line);
+
+	// (Note: the inner loops work on local pointers, so that the compiler
+	// doesn't have to assume the byte stores alias the parameter arrays)
+	const size_t lanes = num_lanes;
+	const uint8_t *pattern_ptr = tile_pattern.data();
+	const uint8_t *fg_ptr = tile_fg_color.data();
+	const uint8_t *bg_ptr = tile_bg_color.data();
+	uint8_t *line_ptr = linebuffer.data();
+
+	const BeeVDPBatchFetch fetch =
+	{
+	    lanes, vram.data(),
+	    name_base.data(), name_offs.data(),
+	    pattern_base.data(), pattern_mask.data(),
+	    color_base.data(), color_mask.data(),
+	    color_shift_left.data(), color_shift_right.data(),
+	    vram_mask.data(), is_multicolor.data(), backdrop_color.data(),
+	    tile_pattern.data(), tile_fg_color.data(), tile_bg_color.data(),
+	};
+
+	// (Note: the fetch kernel is picked for the CPU at runtime, see beevdp-simd.cpp)
+	const BeeVDPKernels &kernels = getKernels();
+
+	for (int tile_col = 0; tile_col < 32; tile_col++)
+	{
+	    // Fetch the pattern and colors of this tile for every instance
+	    kernels.batch_fetch(fetch, tile_col);
+
+	    // Expand the tile into pixels for every instance
+	    for (int pixel = 0; pixel < 8; pixel++)
+	    {
+		uint8_t *pixels = &line_ptr[(((tile_col << 3) + pixel) * lanes)];
+		uint8_t bit_mask = (0x80 >> pixel);
+
+		// (Note: this selects between the colors with a bit mask,
+		// so that the loop is free of branches)
+		for (size_t lane = 0; lane < lanes; lane++)
+		{
+		    uint8_t select = uint8_t(-((pattern_ptr[lane] & bit_mask) != 0));
+		    pixels[lane] = ((fg_ptr[lane] & select) | (bg_ptr[lane] & ~select));
+		}
+	    }
+	}
+
+	// Patch up the instances the vectorized path doesn't cover
+	for (size_t lane = 0; lane < num_instances; lane++)
+	{
+	    if (!is_vector_mode(lane))
+	    {
+		render_special(lane, line);
+	    }
+	}
+    }
+
+    // Render scanline 'line' of a single instance in one of the remaining modes
+    // (i.e. the text modes, the undocumented 'bogus' modes, or with the display disabled)
+    template<typename Variant>
+    void TMS99xxABatch<Variant>::render_special(size_t lane, int line)
+    {
+	uint8_t reg0 = regs[0][lane];
+	uint8_t reg1 = regs[1][lane];
+	int mode_val = ((testbit(reg1, 3) << 2) | (testbit(reg0, 1) << 1) | testbit(reg1, 4));
+	uint8_t backdrop = (regs[7][lane] & 0xF);
+	uint8_t text_color = (regs[7][lane] >> 4);
+	uint8_t fg_color = (text_color != 0) ? text_color : backdrop;
+
+	// The borders (or the whole line, if the display is disabled)
+	// are filled with the backdrop color
+	for (int xpos = 0; xpos < 256; xpos++)
+	{
+	    linebuffer[((xpos * num_lanes) + lane)] = backdrop;
+	}
+
+	if (!testbit(reg1, 6))
+	{
+	    return;
+	}
+
+	switch (mode_val)
+	{
+	    // Mode 1 (aka. text mode)
+	    // Mode 1+2 (aka. undocumented text mode with graphics II addressing)
+	    case 1:
+	    case 3:
+	    {
+		uint8_t reg4 = regs[4][lane];
+		uint32_t name_addr = (((regs[2][lane] & 0xF) << 10) + ((line >> 3) * 40));
+		uint32_t pattern_addr = (((reg4 & 0x7) << 11) + (line & 0x7));
+		uint16_t pattern_mask = 0xFF;
+		uint16_t name_offs = 0;
+
+		if (tms99xx_modes[mode_val].is_bank_split)
+		{
+		    pattern_addr = ((testbit(reg4, 2) << 13) + (line & 0x7));
+		    pattern_mask = (((reg4 & 0x3) << 8) | 0xFF);
+		    name_offs = ((line >> 6) << 8);
+		}
+
+		for (int tile_col = 0; tile_col < 40; tile_col++)
+		{
+		    uint16_t name_word = (fetch_vram(lane, (name_addr + tile_col)) + name_offs);
+		    uint8_t pattern_byte = fetch_vram(lane, (pattern_addr + ((name_word & pattern_mask) << 3)));
+
+		    for (int pixel = 0; pixel < 6; pixel++)
+		    {
+			int xpos = (8 + (tile_col * 6) + pixel);
+			linebuffer[((xpos * num_lanes) + lane)] = testbit(pattern_byte, (7 - pixel)) ? fg_color : backdrop;
+		    }
+		}
+	    }
+	    break;
+	    // Mode 1+3 (aka. undocumented 'bogus' mode A)
+	    // Mode 1+2+3 (aka. undocumented 'bogus' mode B)
+	    case 5:
+	    case 7:
+	    {
+		for (int tile_col = 0; tile_col < 40; tile_col++)
+		{
+		    for (int pixel = 0; pixel < 4; pixel++)
+		    {
+			int xpos = (6 + (tile_col * 6) + pixel);
+			linebuffer[((xpos * num_lanes) + lane)] = fg_color;
+		    }
+		}
+	    }
+	    break;
+	    // The 32-column modes are handled by the vectorized path
+	    default: break;
+	}
+    }
+
+    // Copy a line of pixels (laid out as [pixel][lane], 'stride' bytes apart)
+    // into line 'obs_line' of the observation of every instance
+    template<typename Variant>
+    void TMS99xxABatch<Variant>::write_observations(const uint8_t *pixels, size_t stride, size_t obs_line)
+    {
+	int width = observationWidth();
+	size_t obs_size = (width * observationHeight());
+	const BeeVDPKernels &kernels = getKernels();
+	array<uint8_t, 256> partial_block;
+
+	// Transpose blocks of 16 pixels of 16 instances at a time
+	// (Note: the lanes are padded, so a block never reads past the linebuffer,
+	// and the observation width is always a multiple of 16)
+	for (size_t block = 0; block < num_instances; block += 16)
+	{
+	    size_t block_size = min<size_t>(16, (num_instances - block));
+	    uint8_t *obs_ptr = &observations[((block * obs_size) + obs_line)];
+
+	    for (int xpos = 0; xpos < width; xpos += 16)
+	    {
+		const uint8_t *src = &pixels[((xpos * stride) + block)];
+
+		if (block_size == 16)
+		{
+		    kernels.transpose_block(&obs_ptr[xpos], obs_size, src, stride);
+		    continue;
+		}
+
+		// The last few instances go through a temporary block
+		kernels.transpose_block(partial_block.data(), 16, src, stride);
+
+		for (size_t index = 0; index < block_size; index++)
+		{
+		    memcpy(&obs_ptr[((index * obs_size) + xpos)], &partial_block[(index * 16)], 16);
+		}
+	    }
+	}
+    }
+
+    // Append scanline 'line' to the observation of every instance
+    template<typename Variant>
+    void TMS99xxABatch<Variant>::update_observations(int line)
+    {
+	const size_t lanes = num_lanes;
+	int scale = observation_scale;
+	int width = observationWidth();
+	size_t obs_line = ((line / scale) * width);
+
+	if (observation_format == ObservePalette)
+	{
+	    // Downsampled palette numbers use the top-left pixel of each block
+	    if ((line % scale) == 0)
+	    {
+		write_observations(linebuffer.data(), (scale * lanes), obs_line);
+	    }
+
+	    return;
+	}
+
+	// Accumulate the luma of each block for every instance
+	const uint8_t *line_ptr = linebuffer.data();
+	const uint8_t *luma_ptr = luma_table.data();
+	uint16_t *sums_ptr = luma_sums.data();
+
+	for (int xpos = 0; xpos < 256; xpos++)
+	{
+	    const uint8_t *pixels = &line_ptr[(xpos * lanes)];
+	    uint16_t *sums = &sums_ptr[((xpos / scale) * lanes)];
+
+	    for (size_t lane = 0; lane < lanes; lane++)
+	    {
+		sums[lane] += luma_ptr[(pixels[lane] & 0xF)];
+	    }
+	}
+
+	if ((line % scale) != (scale - 1))
+	{
+	    return;
+	}
+
+	// Average each block (reusing the start of the linebuffer),
+	// then hand the result over to every instance
+	uint8_t *averages = linebuffer.data();
+	int num_pixels = (scale * scale);
+
+	for (size_t pos = 0; pos < (width * lanes); pos++)
+	{
+	    averages[pos] = uint8_t(sums_ptr[pos] / num_pixels);
+	    sums_ptr[pos] = 0;
+	}
+
+	write_observations(averages, lanes, obs_line);
+    }
+
+    // Clock every instance once
+    template<typename Variant>
+    void TMS99xxABatch<Variant>::chipClock()
+    {
+	// We've reached VBlank on every instance
+	if (vcounter == Variant::vblank_line)
+	{
+	    for (size_t index = 0; index < num_instances; index++)
+	    {
+		is_vblank[index] = 1;
+
+		if (testbit(regs[1][index], 5))
+		{
+		    is_irq_gen[index] = 1;
+		}
+	    }
+	}
+
+	if (vcounter < 192)
+	{
+	    render_line(vcounter);
+	    update_observations(vcounter);
+	}
+
+	vcounter += 1;
+
+	if (vcounter == Variant::num_scanlines)
+	{
+	    vcounter = 0;
+	}
+    }
+
+    // Clock every instance for a full frame
+    template<typename Variant>
+    void TMS99xxABatch<Variant>::runFrame()
+    {
+	for (int line = 0; line < numScanlines(); line++)
+	{
+	    chipClock();
+	}
+    }
+
+    template class TMS99xxABatch<TMS9918AVariant>;
+    template class TMS99xxABatch<TMS9928AVariant>;
+    template class TMS99xxABatch<TMS9929AVariant>;
+    template class TMS99xxABatch<TMS9118Variant>;
+    template class TMS99xxABatch<TMS9128Variant>;
+    template class TMS99xxABatch<TMS9129Variant>;
+}
@@ -0,0 +1,181 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BEEVDP_BATCH_H
+#define BEEVDP_BATCH_H
+
+#include <vector>
+#include "beevdp.h"
+
+namespace beevdp
+{
+    // Observation formats produced by the batch renderer
+    enum BeeVDPObservation : int
+    {
+	// Palette numbers (one byte per pixel)
+	ObservePalette = 0,
+	// Luma of each pixel (one byte per pixel)
+	ObserveGrayscale,
+    };
+
+    // Lockstep batch of identically configured TMS99xxA instances
+    //
+    // Registers and VRAM are stored in structure-of-arrays form
+    // (i.e. the same VRAM byte of every instance is stored contiguously),
+    // so each scanline is rendered for all instances at once,
+    // with the innermost loops running across instances.
+    // Instead of RGB framebuffers, the batch produces a compact observation
+    // for each instance (palette numbers or grayscale, optionally downsampled).
+    template<typename Variant>
+    class TMS99xxABatch
+    {
+	public:
+	    TMS99xxABatch(size_t num_instances);
+
+	    TMS99xxABatch(const TMS99xxABatch&) = delete;
+	    TMS99xxABatch &operator=(const TMS99xxABatch&) = delete;
+
+	    size_t size() const
+	    {
+		return num_instances;
+	    }
+
+	    // Select the observation format
+	    // ('scale' downsamples each axis by 1, 2, 4 or 8)
+	    void setObservation(BeeVDPObservation format, int scale);
+	    int observationWidth() const;
+	    int observationHeight() const;
+
+	    // Observations of all instances, laid out as [instance][line][pixel]
+	    const uint8_t *getObservations() const;
+	    const uint8_t *getObservation(size_t index) const;
+
+	    // Reset every instance (VRAM is cleared)
+	    void init();
+
+	    // Honor the 4K/16K bit in register 1 (off by default, see TMS99xxA)
+	    void set4KModeEnabled(bool is_enabled);
+
+	    // Port accesses on a single instance
+	    void writeControl(size_t index, uint8_t data);
+	    void writeData(size_t index, uint8_t data);
+	    bool isInterrupt(size_t index);
+	    uint8_t readStatus(size_t index);
+	    uint8_t readData(size_t index);
+
+	    // Bulk accesses
+	    void writeRegister(size_t index, int reg, uint8_t data);
+	    void writeRegisterAll(int reg, uint8_t data);
+	    void writeVRAM(size_t index, uint16_t addr, const uint8_t *data, size_t length);
+	    void readVRAM(size_t index, uint16_t addr, uint8_t *data, size_t length) const;
+
+	    constexpr int numScanlines() const
+	    {
+		return Variant::num_scanlines;
+	    }
+
+	    // Clock every instance once (i.e. advance all of them by one scanline)
+	    void chipClock();
+	    // Clock every instance for a full frame
+	    void runFrame();
+
+	private:
+	    size_t num_instances = 0;
+	    // Number of instances rounded up to a whole number of vectors
+	    size_t num_lanes = 0;
+
+	    uint16_t vcounter = 0;
+
+	    // VRAM, laid out as [address][lane]
+	    std::vector<uint8_t> vram;
+	    // Registers, laid out as [register][lane]
+	    std::array<std::vector<uint8_t>, 8> regs;
+
+	    // Port state of each instance
+	    std::vector<uint16_t> command_word;
+	    std::vector<uint16_t> addr_register;
+	    std::vector<uint8_t> read_buffer;
+	    std::vector<uint8_t> is_second_control_write;
+	    std::vector<uint8_t> is_vblank;
+	    std::vector<uint8_t> is_irq_gen;
+
+	    // Per-line parameters of each instance, derived from its registers
+	    std::vector<uint32_t> name_base;
+	    std::vector<uint32_t> name_offs;
+	    std::vector<uint32_t> pattern_base;
+	    std::vector<uint32_t> pattern_mask;
+	    std::vector<uint32_t> color_base;
+	    std::vector<uint32_t> color_mask;
+	    std::vector<uint32_t> color_shift_left;
+	    std::vector<uint32_t> color_shift_right;
+	    std::vector<uint32_t> vram_mask;
+	    std::vector<uint8_t> is_multicolor;
+	    std::vector<uint8_t> backdrop_color;
+
+	    // Per-tile values of each instance
+	    std::vector<uint8_t> tile_pattern;
+	    std::vector<uint8_t> tile_fg_color;
+	    std::vector<uint8_t> tile_bg_color;
+
+	    // Palette numbers of the current scanline, laid out as [pixel][lane]
+	    std::vector<uint8_t> linebuffer;
+
+	    bool is_4k_mode_enabled = false;
+
+	    BeeVDPObservation observation_format = ObservePalette;
+	    int observation_scale = 1;
+	    std::vector<uint8_t> observations;
+	    // Running sums for downsampled grayscale, laid out as [pixel][lane]
+	    std::vector<uint16_t> luma_sums;
+	    std::array<uint8_t, 16> luma_table;
+
+	    uint8_t &vram_at(uint32_t addr, size_t lane)
+	    {
+		return vram[((addr & 0x3FFF) * num_lanes) + lane];
+	    }
+
+	    uint8_t fetch_vram(size_t lane, uint32_t addr) const
+	    {
+		return vram[(((addr & vram_mask[lane]) * num_lanes) + lane)];
+	    }
+
+	    void increment_addr(size_t index);
+	    void update_lane_params(int line);
+	    bool is_vector_mode(size_t lane) const;
+	    void render_line(int line);
+	    void render_special(size_t lane, int line);
+	    void update_observations(int line);
+	    void write_observations(const uint8_t *pixels, size_t stride, size_t obs_line);
+
+	    template<typename T>
+	    bool testbit(T reg, int bit) const
+	    {
+		return ((reg >> bit) & 1) ? true : false;
+	    }
+    };
+
+    using TMS9918ABatch = TMS99xxABatch<TMS9918AVariant>;
+    using TMS9928ABatch = TMS99xxABatch<TMS9928AVariant>;
+    using TMS9929ABatch = TMS99xxABatch<TMS9929AVariant>;
+    using TMS9118Batch = TMS99xxABatch<TMS9118Variant>;
+    using TMS9128Batch = TMS99xxABatch<TMS9128Variant>;
+    using TMS9129Batch = TMS99xxABatch<TMS9129Variant>;
+};
+
+#endif // BEEVDP_BATCH_H
@@ -0,0 +1,502 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Frame throughput benchmark for the TMS9918A core
+//
+// Usage: beevdp-bench [frames]
+//
+// Runs the same GRAPHIC 2 screen with every frame rendered,
+// with only some frames rendered, with rendering skipped entirely,
+// with only a small region of interest rendered, in headless mode,
+// and with every frame skipped but two frames run ahead after it,
+// and reports the frame rate of each configuration.
+// The rendered run is repeated with the scanline kernels of each
+// instruction set level the CPU supports.
+// The same screen is then run on a lockstep batch of 256 instances at each level,
+// reporting the frame rate per instance, and its speedup over a single instance.
+// Finally, the NTSC filter is run on a rendered frame of the same screen,
+// on one thread and on several threads.
+// Frames with a few VRAM writes in between are then recorded with
+// the capture codec, with the usual keyframe interval and with keyframes only,
+// reporting the encoding rate (not counting rendering) and the size per frame.
+// In builds with BEEVDP_ENABLE_STATS, every mode is then run with
+// the hardware performance counters attached, reporting the events
+// per scanline in each render path, and per frame in all of chipClock().
+// The number of IRQs generated is also checked against the fully rendered run,
+// since skipping frames must not change the VDP's timing.
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <sstream>
+#include "beevdp.h"
+#include "beevdp-batch.h"
+#include "beevdp-ntsc.h"
+#include "beevdp-capture.h"
+#include "beevdp-perf.h"
+#include "beevdp-simd.h"
+using namespace beevdp;
+using namespace std;
+
+struct BenchConfig
+{
+    const char *name;
+    int render_interval;
+    bool is_headless;
+    BeeVDPRect region;
+    int run_ahead;
+};
+
+struct BenchResult
+{
+    double frames_per_sec;
+    uint64_t num_irqs;
+};
+
+void write_reg(TMS9918A &vdp, int reg, uint8_t data)
+{
+    vdp.writeControl(data);
+    vdp.writeControl((0x80 | reg));
+}
+
+BenchResult run_bench(const BenchConfig &config, uint64_t num_frames)
+{
+    TMS9918A vdp;
+    vdp.setHeadless(config.is_headless);
+    vdp.init();
+    vdp.setRenderInterval(config.render_interval);
+    vdp.setRegionOfInterest(config.region);
+
+    // Set up GRAPHIC 2 with IRQs enabled
+    const uint8_t regs[8] = {0x02, 0xE0, 0x0E, 0xFF, 0x03, 0x76, 0x03, 0x0F};
+
+    for (int reg = 0; reg < 8; reg++)
+    {
+	write_reg(vdp, reg, regs[reg]);
+    }
+
+    // Fill VRAM with the same pseudo-random screen every time
+    mt19937 rng(1);
+    vdp.writeControl(0x00);
+    vdp.writeControl(0x40);
+
+    for (int i = 0; i < 0x4000; i++)
+    {
+	vdp.writeData((rng() & 0xFF));
+    }
+
+    BenchResult result = {0.0, 0};
+    auto start_time = chrono::steady_clock::now();
+
+    for (uint64_t frame = 0; frame < num_frames; frame++)
+    {
+	for (int line = 0; line < vdp.numScanlines(); line++)
+	{
+	    vdp.chipClock();
+
+	    if (vdp.isInterrupt())
+	    {
+		result.num_irqs += 1;
+		vdp.readStatus();
+	    }
+	}
+
+	// The frames run ahead leave the real frames' timing untouched
+	if (config.run_ahead != 0)
+	{
+	    vdp.runAhead(config.run_ahead);
+	}
+    }
+
+    chrono::duration<double> elapsed = (chrono::steady_clock::now() - start_time);
+    result.frames_per_sec = (num_frames / elapsed.count());
+    vdp.shutdown();
+    return result;
+}
+
+BenchResult run_batch_bench(size_t num_instances, uint64_t num_frames)
+{
+    TMS9918ABatch batch(num_instances);
+    const uint8_t regs[8] = {0x02, 0xE0, 0x0E, 0xFF, 0x03, 0x76, 0x03, 0x0F};
+
+    mt19937 rng(1);
+    vector<uint8_t> vram(0x4000);
+
+    for (auto &data : vram)
+    {
+	data = (rng() & 0xFF);
+    }
+
+    for (size_t index = 0; index < num_instances; index++)
+    {
+	batch.writeVRAM(index, 0, vram.data(), vram.size());
+
+	for (int reg = 0; reg < 8; reg++)
+	{
+	    batch.writeRegister(index, reg, regs[reg]);
+	}
+    }
+
+    BenchResult result = {0.0, 0};
+    auto start_time = chrono::steady_clock::now();
+
+    for (uint64_t frame = 0; frame < num_frames; frame++)
+    {
+	for (int line = 0; line < batch.numScanlines(); line++)
+	{
+	    batch.chipClock();
+
+	    for (size_t index = 0; index < num_instances; index++)
+	    {
+		if (batch.isInterrupt(index))
+		{
+		    result.num_irqs += (index == 0);
+		    batch.readStatus(index);
+		}
+	    }
+	}
+    }
+
+    chrono::duration<double> elapsed = (chrono::steady_clock::now() - start_time);
+    result.frames_per_sec = ((num_frames * num_instances) / elapsed.count());
+    return result;
+}
+
+double run_ntsc_bench(uint64_t num_frames, int num_threads)
+{
+    TMS9918A vdp;
+    vdp.init();
+
+    const uint8_t regs[8] = {0x02, 0xE0, 0x0E, 0xFF, 0x03, 0x76, 0x03, 0x0F};
+
+    for (int reg = 0; reg < 8; reg++)
+    {
+	write_reg(vdp, reg, regs[reg]);
+    }
+
+    mt19937 rng(1);
+    vdp.writeControl(0x00);
+    vdp.writeControl(0x40);
+
+    for (int i = 0; i < 0x4000; i++)
+    {
+	vdp.writeData((rng() & 0xFF));
+    }
+
+    // Render two frames, so that the whole screen is up to date
+    for (int line = 0; line < (vdp.numScanlines() * 2); line++)
+    {
+	vdp.chipClock();
+    }
+
+    const BeeVDPFrame *frame = vdp.acquireFrame();
+    BeeVDPNTSCFilter filter(BeeVDPNTSCSetup(), tms99xx_palette, num_threads);
+    vector<BeeVDPRGB> pixels((BeeVDPNTSCFilter::output_width * 192));
+
+    auto start_time = chrono::steady_clock::now();
+
+    for (uint64_t i = 0; i < num_frames; i++)
+    {
+	filter.filter(frame->indices.data(), pixels.data(), 192);
+    }
+
+    chrono::duration<double> elapsed = (chrono::steady_clock::now() - start_time);
+    vdp.shutdown();
+    return (num_frames / elapsed.count());
+}
+
+BenchResult run_capture_bench(uint64_t num_frames, int keyframe_interval, uint64_t &bytes_per_frame)
+{
+    TMS9918A vdp;
+    vdp.init();
+
+    const uint8_t regs[8] = {0x02, 0xE0, 0x0E, 0xFF, 0x03, 0x76, 0x03, 0x0F};
+
+    for (int reg = 0; reg < 8; reg++)
+    {
+	write_reg(vdp, reg, regs[reg]);
+    }
+
+    mt19937 rng(1);
+    vdp.writeControl(0x00);
+    vdp.writeControl(0x40);
+
+    for (int i = 0; i < 0x4000; i++)
+    {
+	vdp.writeData((rng() & 0xFF));
+    }
+
+    stringstream stream;
+    BeeVDPCaptureWriter writer;
+    writer.open(stream, keyframe_interval);
+    chrono::duration<double> elapsed(0.0);
+
+    for (uint64_t frame = 0; frame < num_frames; frame++)
+    {
+	// Change a few bytes of the pattern and name tables
+	for (int i = 0; i < 16; i++)
+	{
+	    uint16_t addr = (rng() & 0x3BFF);
+	    vdp.writeControl(uint8_t(addr));
+	    vdp.writeControl(uint8_t(0x40 | (addr >> 8)));
+	    vdp.writeData((rng() & 0xFF));
+	}
+
+	for (int line = 0; line < vdp.numScanlines(); line++)
+	{
+	    vdp.chipClock();
+	}
+
+	const BeeVDPFrame *current = vdp.acquireFrame();
+	auto start_time = chrono::steady_clock::now();
+	writer.writeFrame(*current);
+	elapsed += (chrono::steady_clock::now() - start_time);
+    }
+
+    writer.close();
+    vdp.shutdown();
+    bytes_per_frame = (stream.str().size() / num_frames);
+    return {(num_frames / elapsed.count()), 0};
+}
+
+#ifdef BEEVDP_ENABLE_STATS
+void print_perf_row(const string &name, const BeeVDPPerfCounters &counters, const BeeVDPPerfSample &sample, uint64_t count)
+{
+    cout << left << setw(16) << name << right << fixed << setprecision(1);
+
+    for (int event = 0; event < NumPerfEvents; event++)
+    {
+	if (counters.hasEvent(BeeVDPPerfEvent(event)))
+	{
+	    cout << setw(14) << (double(sample.counts[event]) / count);
+	}
+	else
+	{
+	    cout << setw(14) << "-";
+	}
+    }
+
+    double cycles = double(sample.counts[PerfCycles]);
+    cout << setw(8) << setprecision(2) << ((cycles != 0.0) ? (sample.counts[PerfInstructions] / cycles) : 0.0) << endl;
+}
+
+// Run every mode with hardware counters attached
+bool run_perf_bench(uint64_t num_frames)
+{
+    BeeVDPPerfCounters counters;
+
+    if (!counters.open())
+    {
+	cout << "Hardware performance counters are unavailable (see perf_event_paranoid)" << endl;
+	return false;
+    }
+
+    TMS9918A vdp;
+    vdp.init();
+    vdp.setPerfCounters(&counters);
+
+    mt19937 rng(1);
+    vdp.writeControl(0x00);
+    vdp.writeControl(0x40);
+
+    for (int i = 0; i < 0x4000; i++)
+    {
+	vdp.writeData((rng() & 0xFF));
+    }
+
+    BeeVDPStats totals;
+    uint64_t frames_per_mode = max<uint64_t>((num_frames / 8), 1);
+
+    for (int mode = 0; mode < 8; mode++)
+    {
+	// Same tables as the GRAPHIC 2 screen, with the mode bits swapped in
+	write_reg(vdp, 0, ((mode & 2) ? 0x02 : 0x00));
+	write_reg(vdp, 1, (0xC0 | ((mode & 1) ? 0x10 : 0x00) | ((mode & 4) ? 0x08 : 0x00)));
+	const uint8_t regs[6] = {0x0E, 0xFF, 0x03, 0x76, 0x03, 0x0F};
+
+	for (int reg = 2; reg < 8; reg++)
+	{
+	    write_reg(vdp, reg, regs[(reg - 2)]);
+	}
+
+	for (uint64_t frame = 0; frame < frames_per_mode; frame++)
+	{
+	    for (int line = 0; line < vdp.numScanlines(); line++)
+	    {
+		vdp.chipClock();
+	    }
+
+	    const BeeVDPStats &stats = vdp.getFrameStats();
+
+	    for (int path = 0; path < NumRenderPaths; path++)
+	    {
+		totals.render_counters[path] += stats.render_counters[path];
+	    }
+
+	    for (int mode_index = 0; mode_index < 8; mode_index++)
+	    {
+		totals.lines_per_mode[mode_index] += stats.lines_per_mode[mode_index];
+	    }
+
+	    totals.clock_counters += stats.clock_counters;
+	}
+    }
+
+    vdp.shutdown();
+
+    const char *path_names[NumRenderPaths] = {"backdrop", "disabled", "graphics I", "text", "graphics II", "multicolor", "bogus"};
+    array<uint64_t, NumRenderPaths> path_lines = {};
+
+    for (int mode = 0; mode < 8; mode++)
+    {
+	path_lines[tms99xx_modes[mode].render_path] += totals.lines_per_mode[mode];
+    }
+
+    cout << left << setw(16) << "per line" << right;
+
+    for (int event = 0; event < NumPerfEvents; event++)
+    {
+	cout << setw(14) << BeeVDPPerfCounters::eventName(BeeVDPPerfEvent(event));
+    }
+
+    cout << setw(8) << "IPC" << endl;
+
+    for (int path = 0; path < NumRenderPaths; path++)
+    {
+	if (path_lines[path] != 0)
+	{
+	    print_perf_row(path_names[path], counters, totals.render_counters[path], path_lines[path]);
+	}
+    }
+
+    print_perf_row("chipClock/frame", counters, totals.clock_counters, (frames_per_mode * 8));
+    return true;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    uint64_t num_frames = 2000;
+
+    if (argc > 1)
+    {
+	num_frames = strtoull(argv[1], NULL, 0);
+    }
+
+    const BenchConfig configs[] =
+    {
+	{"rendered", 1, false, {0, 0, 256, 192}, 0},
+	{"every 4th frame", 4, false, {0, 0, 256, 192}, 0},
+	{"skipped", 0, false, {0, 0, 256, 192}, 0},
+	{"region 32x32", 1, false, {112, 80, 32, 32}, 0},
+	{"headless", 1, true, {0, 0, 256, 192}, 0},
+	{"run-ahead 2", 0, false, {0, 0, 256, 192}, 2},
+    };
+
+    BenchResult baseline = {0.0, 0};
+    bool is_mismatch = false;
+
+    for (const BenchConfig &config : configs)
+    {
+	BenchResult result = run_bench(config, num_frames);
+
+	// The fully rendered run comes first, and is the baseline
+	if (&config == &configs[0])
+	{
+	    baseline = result;
+	}
+
+	cout << left << setw(16) << config.name << right << fixed << setprecision(1);
+	cout << setw(12) << result.frames_per_sec << " frames/s";
+	cout << setw(8) << (result.frames_per_sec / baseline.frames_per_sec) << "x";
+	cout << setw(10) << result.num_irqs << " IRQs" << endl;
+
+	if (result.num_irqs != baseline.num_irqs)
+	{
+	    cout << "IRQ count differs from the rendered run!" << endl;
+	    is_mismatch = true;
+	}
+    }
+
+    // Compare the scanline kernels of each level on the fully rendered run
+    BeeVDPISALevel prev_level = getISALevel();
+    array<double, NumISALevels> level_frames_per_sec = {};
+
+    for (int level = ISAScalar; level <= detectISALevel(); level++)
+    {
+	setISALevel(BeeVDPISALevel(level));
+	BenchResult result = run_bench(configs[0], num_frames);
+	string name = (string("rendered ") + isaLevelName(BeeVDPISALevel(level)));
+	level_frames_per_sec[level] = result.frames_per_sec;
+
+	cout << left << setw(16) << name << right << fixed << setprecision(1);
+	cout << setw(12) << result.frames_per_sec << " frames/s";
+	cout << setw(8) << (result.frames_per_sec / baseline.frames_per_sec) << "x" << endl;
+    }
+
+    // The batch reports frames per second per instance at each level,
+    // along with its speedup over a single instance at the same level
+    const size_t batch_size = 256;
+
+    for (int level = ISAScalar; level <= detectISALevel(); level++)
+    {
+	setISALevel(BeeVDPISALevel(level));
+	BenchResult result = run_batch_bench(batch_size, max<uint64_t>((num_frames / batch_size), 1));
+	string name = (string("batch ") + isaLevelName(BeeVDPISALevel(level)));
+
+	cout << left << setw(16) << name << right << fixed << setprecision(1);
+	cout << setw(12) << result.frames_per_sec << " frames/s";
+	cout << setw(8) << (result.frames_per_sec / baseline.frames_per_sec) << "x";
+	cout << setw(8) << (result.frames_per_sec / level_frames_per_sec[level]) << "x per instance" << endl;
+    }
+
+    setISALevel(prev_level);
+
+    // The NTSC filter reports its own frame rate, on one thread and on
+    // (at least two) worker threads
+    int num_threads = max<int>(thread::hardware_concurrency(), 2);
+    for (int threads : {1, num_threads})
+    {
+	double frames_per_sec = run_ntsc_bench(num_frames, threads);
+	string name = ("NTSC x" + to_string(threads));
+	cout << left << setw(16) << name << right;
+	cout << setw(12) << frames_per_sec << " frames/s" << endl;
+    }
+
+    // The capture codec reports its encoding rate and the size of each frame
+    for (int keyframe_interval : {60, 1})
+    {
+	uint64_t bytes_per_frame = 0;
+	BenchResult result = run_capture_bench(num_frames, keyframe_interval, bytes_per_frame);
+	string name = ("capture key/" + to_string(keyframe_interval));
+	cout << left << setw(16) << name << right;
+	cout << setw(12) << result.frames_per_sec << " frames/s";
+	cout << setw(10) << bytes_per_frame << " bytes/frame" << endl;
+    }
+
+    // Hardware counters are only collected along with the other per-frame stats
+#ifdef BEEVDP_ENABLE_STATS
+    run_perf_bench(num_frames);
+#endif
+
+    return (is_mismatch) ? 1 : 0;
+}
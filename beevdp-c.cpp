@@ -0,0 +1,594 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include "beevdp-c.h"
+#include "beevdp.h"
+using namespace beevdp;
+using namespace std;
+
+static_assert(sizeof(beevdp_rgb) == sizeof(BeeVDPRGB), "beevdp_rgb must match BeeVDPRGB");
+static_assert(is_trivially_copyable<BeeVDPState>::value, "BeeVDPState must be copyable as bytes");
+
+// Each handle wraps a core specialized for one variant,
+// so only one virtual call is paid per port access or batch
+struct beevdp_vdp
+{
+    virtual ~beevdp_vdp() {}
+
+    virtual void writeControl(uint8_t data) = 0;
+    virtual void writeData(uint8_t data) = 0;
+    virtual uint8_t readStatus() = 0;
+    virtual uint8_t readData() = 0;
+    virtual bool isInterrupt() = 0;
+    virtual void chipClock() = 0;
+
+    virtual void writeRegisters(const uint8_t *regs, size_t num_regs) = 0;
+    virtual void writeVRAM(uint16_t addr, const uint8_t *data, size_t length) = 0;
+    virtual void readVRAM(uint16_t addr, uint8_t *data, size_t length) = 0;
+    virtual uint32_t runFrames(uint32_t num_frames, uint32_t flags) = 0;
+    virtual uint64_t getFramebuffer(beevdp_rgb *pixels, size_t num_pixels) = 0;
+    virtual void setRenderInterval(int interval) = 0;
+    virtual void setRegionOfInterest(int x, int y, int width, int height) = 0;
+    virtual uint8_t peekPixel(int x, int y) = 0;
+    virtual bool saveState(BeeVDPState &state) = 0;
+    virtual bool loadState(const BeeVDPState &state) = 0;
+    virtual bool runAhead(int num_frames, beevdp_frame_runner runner, void *user_data) = 0;
+    virtual void setLineCallback(beevdp_line_callback callback, void *user_data) = 0;
+    virtual void setVBlankCallback(beevdp_vblank_callback callback, void *user_data) = 0;
+    virtual void setExternalVideo(const beevdp_rgb *frame) = 0;
+    virtual void setExternalVDP(const beevdp_vdp *background) = 0;
+    virtual const beevdp_rgb *getScanline(int line) const = 0;
+
+    virtual int getWidth() const = 0;
+    virtual int getHeight() const = 0;
+    virtual int numScanlines() const = 0;
+};
+
+template<typename Core>
+struct beevdp_vdp_impl : beevdp_vdp
+{
+    Core core;
+
+    beevdp_vdp_impl(const beevdp_config &config)
+    {
+	core.setVRAMSize(BeeVDPVRAMSize(config.vram_size));
+	core.setHeadless(config.is_headless != 0);
+	core.init();
+	core.set4KModeEnabled(config.is_4k_mode_enabled != 0);
+    }
+
+    ~beevdp_vdp_impl()
+    {
+	core.shutdown();
+    }
+
+    void writeControl(uint8_t data) override
+    {
+	core.writeControl(data);
+    }
+
+    void writeData(uint8_t data) override
+    {
+	core.writeData(data);
+    }
+
+    uint8_t readStatus() override
+    {
+	return core.readStatus();
+    }
+
+    uint8_t readData() override
+    {
+	return core.readData();
+    }
+
+    bool isInterrupt() override
+    {
+	return core.isInterrupt();
+    }
+
+    void chipClock() override
+    {
+	core.chipClock();
+    }
+
+    void writeRegisters(const uint8_t *regs, size_t num_regs) override
+    {
+	for (size_t reg = 0; reg < num_regs; reg++)
+	{
+	    core.writeControl(regs[reg]);
+	    core.writeControl(0x80 | (reg & 0x3F));
+	}
+    }
+
+    void writeVRAM(uint16_t addr, const uint8_t *data, size_t length) override
+    {
+	// Set up the address register for VRAM writes...
+	core.writeControl(addr & 0xFF);
+	core.writeControl(((addr >> 8) & 0x3F) | 0x40);
+
+	// ...and stream the data through the data port
+	for (size_t i = 0; i < length; i++)
+	{
+	    core.writeData(data[i]);
+	}
+    }
+
+    void readVRAM(uint16_t addr, uint8_t *data, size_t length) override
+    {
+	// Set up the address register for VRAM reads
+	// (which also prefetches the first byte into the read buffer)...
+	core.writeControl(addr & 0xFF);
+	core.writeControl((addr >> 8) & 0x3F);
+
+	// ...and stream the data through the data port
+	for (size_t i = 0; i < length; i++)
+	{
+	    data[i] = core.readData();
+	}
+    }
+
+    uint32_t runFrames(uint32_t num_frames, uint32_t flags) override
+    {
+	uint32_t num_irqs = 0;
+
+	for (uint32_t frame = 0; frame < num_frames; frame++)
+	{
+	    for (int line = 0; line < core.numScanlines(); line++)
+	    {
+		core.chipClock();
+
+		if (core.isInterrupt())
+		{
+		    num_irqs += 1;
+
+		    if (flags & BEEVDP_RUN_ACK_IRQ)
+		    {
+			core.readStatus();
+		    }
+		}
+	    }
+	}
+
+	return num_irqs;
+    }
+
+    uint64_t getFramebuffer(beevdp_rgb *pixels, size_t num_pixels) override
+    {
+	const BeeVDPFrame *frame = core.acquireFrame();
+
+	if (frame == nullptr)
+	{
+	    return 0;
+	}
+
+	size_t copy_pixels = min(num_pixels, frame->pixels.size());
+	memcpy(pixels, frame->pixels.data(), (copy_pixels * sizeof(beevdp_rgb)));
+	return frame->sequence;
+    }
+
+    void setRenderInterval(int interval) override
+    {
+	core.setRenderInterval(interval);
+    }
+
+    void setRegionOfInterest(int x, int y, int width, int height) override
+    {
+	core.setRegionOfInterest({x, y, width, height});
+    }
+
+    uint8_t peekPixel(int x, int y) override
+    {
+	return core.peekPixel(x, y);
+    }
+
+    bool saveState(BeeVDPState &state) override
+    {
+	return core.saveState(state);
+    }
+
+    bool loadState(const BeeVDPState &state) override
+    {
+	return core.loadState(state);
+    }
+
+    bool runAhead(int num_frames, beevdp_frame_runner runner, void *user_data) override
+    {
+	if (runner == nullptr)
+	{
+	    return core.runAhead(num_frames);
+	}
+
+	return core.runAhead(num_frames, [runner, user_data](int frame_index)
+	{
+	    runner(user_data, frame_index);
+	});
+    }
+
+    void setLineCallback(beevdp_line_callback callback, void *user_data) override
+    {
+	if (callback == nullptr)
+	{
+	    core.setLineCallback(nullptr);
+	    return;
+	}
+
+	core.setLineCallback([callback, user_data](int line, const BeeVDPRGB *pixels)
+	{
+	    callback(user_data, line, reinterpret_cast<const beevdp_rgb*>(pixels));
+	});
+    }
+
+    void setVBlankCallback(beevdp_vblank_callback callback, void *user_data) override
+    {
+	if (callback == nullptr)
+	{
+	    core.setVBlankCallback(nullptr);
+	    return;
+	}
+
+	core.setVBlankCallback([callback, user_data](uint64_t frame_number)
+	{
+	    callback(user_data, frame_number);
+	});
+    }
+
+    void setExternalVideo(const beevdp_rgb *frame) override
+    {
+	core.setExternalVideo(reinterpret_cast<const BeeVDPRGB*>(frame));
+    }
+
+    void setExternalVDP(const beevdp_vdp *background) override
+    {
+	if (background == nullptr)
+	{
+	    core.setExternalVideo(BeeVDPVideoSource());
+	    return;
+	}
+
+	core.setExternalVideo([background](int line)
+	{
+	    return reinterpret_cast<const BeeVDPRGB*>(background->getScanline(line));
+	});
+    }
+
+    const beevdp_rgb *getScanline(int line) const override
+    {
+	return reinterpret_cast<const beevdp_rgb*>(core.getScanline(line));
+    }
+
+    int getWidth() const override
+    {
+	return core.getWidth();
+    }
+
+    int getHeight() const override
+    {
+	return core.getHeight();
+    }
+
+    int numScanlines() const override
+    {
+	return core.numScanlines();
+    }
+};
+
+uint32_t beevdp_abi_version(void)
+{
+    return BEEVDP_ABI_VERSION;
+}
+
+beevdp_vdp *beevdp_create(const beevdp_config *config)
+{
+    beevdp_config vdp_config = {sizeof(beevdp_config), VRAM16K, 0, BEEVDP_VARIANT_TMS9918A, 0};
+
+    // Only copy the fields the caller knows about
+    if (config != nullptr)
+    {
+	memcpy(&vdp_config, config, min<size_t>(config->struct_size, sizeof(beevdp_config)));
+    }
+
+    if ((vdp_config.vram_size != VRAM4K) && (vdp_config.vram_size != VRAM16K))
+    {
+	return nullptr;
+    }
+
+    try
+    {
+	switch (vdp_config.variant)
+	{
+	    case BEEVDP_VARIANT_TMS9918A: return new beevdp_vdp_impl<TMS9918A>(vdp_config);
+	    case BEEVDP_VARIANT_TMS9928A: return new beevdp_vdp_impl<TMS9928A>(vdp_config);
+	    case BEEVDP_VARIANT_TMS9929A: return new beevdp_vdp_impl<TMS9929A>(vdp_config);
+	    case BEEVDP_VARIANT_TMS9118: return new beevdp_vdp_impl<TMS9118>(vdp_config);
+	    case BEEVDP_VARIANT_TMS9128: return new beevdp_vdp_impl<TMS9128>(vdp_config);
+	    case BEEVDP_VARIANT_TMS9129: return new beevdp_vdp_impl<TMS9129>(vdp_config);
+	    default: return nullptr;
+	}
+    }
+    catch (...)
+    {
+	return nullptr;
+    }
+}
+
+void beevdp_destroy(beevdp_vdp *vdp)
+{
+    delete vdp;
+}
+
+void beevdp_write_control(beevdp_vdp *vdp, uint8_t data)
+{
+    if (vdp == nullptr)
+    {
+	return;
+    }
+
+    vdp->writeControl(data);
+}
+
+void beevdp_write_data(beevdp_vdp *vdp, uint8_t data)
+{
+    if (vdp == nullptr)
+    {
+	return;
+    }
+
+    vdp->writeData(data);
+}
+
+uint8_t beevdp_read_status(beevdp_vdp *vdp)
+{
+    if (vdp == nullptr)
+    {
+	return 0;
+    }
+
+    return vdp->readStatus();
+}
+
+uint8_t beevdp_read_data(beevdp_vdp *vdp)
+{
+    if (vdp == nullptr)
+    {
+	return 0;
+    }
+
+    return vdp->readData();
+}
+
+int beevdp_is_interrupt(beevdp_vdp *vdp)
+{
+    if (vdp == nullptr)
+    {
+	return 0;
+    }
+
+    return vdp->isInterrupt() ? 1 : 0;
+}
+
+void beevdp_chip_clock(beevdp_vdp *vdp)
+{
+    if (vdp == nullptr)
+    {
+	return;
+    }
+
+    vdp->chipClock();
+}
+
+void beevdp_write_registers(beevdp_vdp *vdp, const uint8_t *regs, size_t num_regs)
+{
+    if ((vdp == nullptr) || (regs == nullptr))
+    {
+	return;
+    }
+
+    vdp->writeRegisters(regs, num_regs);
+}
+
+void beevdp_write_vram(beevdp_vdp *vdp, uint16_t addr, const uint8_t *data, size_t length)
+{
+    if ((vdp == nullptr) || (data == nullptr))
+    {
+	return;
+    }
+
+    vdp->writeVRAM(addr, data, length);
+}
+
+void beevdp_read_vram(beevdp_vdp *vdp, uint16_t addr, uint8_t *data, size_t length)
+{
+    if ((vdp == nullptr) || (data == nullptr))
+    {
+	return;
+    }
+
+    vdp->readVRAM(addr, data, length);
+}
+
+uint32_t beevdp_run_frames(beevdp_vdp *vdp, uint32_t num_frames, uint32_t flags)
+{
+    if (vdp == nullptr)
+    {
+	return 0;
+    }
+
+    return vdp->runFrames(num_frames, flags);
+}
+
+uint64_t beevdp_get_framebuffer(beevdp_vdp *vdp, beevdp_rgb *pixels, size_t num_pixels)
+{
+    if ((vdp == nullptr) || (pixels == nullptr))
+    {
+	return 0;
+    }
+
+    return vdp->getFramebuffer(pixels, num_pixels);
+}
+
+void beevdp_set_render_interval(beevdp_vdp *vdp, uint32_t interval)
+{
+    if (vdp == nullptr)
+    {
+	return;
+    }
+
+    vdp->setRenderInterval(int(min<uint32_t>(interval, INT32_MAX)));
+}
+
+void beevdp_set_region_of_interest(beevdp_vdp *vdp, int x, int y, int width, int height)
+{
+    if (vdp == nullptr)
+    {
+	return;
+    }
+
+    vdp->setRegionOfInterest(x, y, width, height);
+}
+
+uint8_t beevdp_peek_pixel(beevdp_vdp *vdp, int x, int y)
+{
+    if (vdp == nullptr)
+    {
+	return 0;
+    }
+
+    return vdp->peekPixel(x, y);
+}
+
+size_t beevdp_save_state(beevdp_vdp *vdp, void *buffer, size_t size)
+{
+    if (vdp == nullptr)
+    {
+	return 0;
+    }
+
+    if ((buffer != nullptr) && (size >= sizeof(BeeVDPState)))
+    {
+	BeeVDPState state;
+
+	if (vdp->saveState(state))
+	{
+	    memcpy(buffer, &state, sizeof(BeeVDPState));
+	}
+    }
+
+    return sizeof(BeeVDPState);
+}
+
+int beevdp_load_state(beevdp_vdp *vdp, const void *buffer, size_t size)
+{
+    if (vdp == nullptr)
+    {
+	return 0;
+    }
+
+    if ((buffer == nullptr) || (size < sizeof(BeeVDPState)))
+    {
+	return 0;
+    }
+
+    BeeVDPState state;
+    memcpy(&state, buffer, sizeof(BeeVDPState));
+    return vdp->loadState(state) ? 1 : 0;
+}
+
+int beevdp_run_ahead(beevdp_vdp *vdp, int num_frames, beevdp_frame_runner runner, void *user_data)
+{
+    if (vdp == nullptr)
+    {
+	return 0;
+    }
+
+    return vdp->runAhead(num_frames, runner, user_data) ? 1 : 0;
+}
+
+void beevdp_set_line_callback(beevdp_vdp *vdp, beevdp_line_callback callback, void *user_data)
+{
+    if (vdp == nullptr)
+    {
+	return;
+    }
+
+    vdp->setLineCallback(callback, user_data);
+}
+
+void beevdp_set_vblank_callback(beevdp_vdp *vdp, beevdp_vblank_callback callback, void *user_data)
+{
+    if (vdp == nullptr)
+    {
+	return;
+    }
+
+    vdp->setVBlankCallback(callback, user_data);
+}
+
+void beevdp_set_external_video(beevdp_vdp *vdp, const beevdp_rgb *frame)
+{
+    if (vdp == nullptr)
+    {
+	return;
+    }
+
+    vdp->setExternalVideo(frame);
+}
+
+void beevdp_set_external_vdp(beevdp_vdp *vdp, const beevdp_vdp *background)
+{
+    if (vdp == nullptr)
+    {
+	return;
+    }
+
+    vdp->setExternalVDP(background);
+}
+
+int beevdp_get_width(const beevdp_vdp *vdp)
+{
+    if (vdp == nullptr)
+    {
+	return 0;
+    }
+
+    return vdp->getWidth();
+}
+
+int beevdp_get_height(const beevdp_vdp *vdp)
+{
+    if (vdp == nullptr)
+    {
+	return 0;
+    }
+
+    return vdp->getHeight();
+}
+
+int beevdp_num_scanlines(const beevdp_vdp *vdp)
+{
+    if (vdp == nullptr)
+    {
+	return 0;
+    }
+
+    return vdp->numScanlines();
+}
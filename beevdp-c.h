@@ -0,0 +1,189 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Stable C interface to the BeeVDP engine
+//
+// All VDPs are accessed through opaque handles, and the batched calls
+// (i.e. beevdp_write_vram(), beevdp_read_vram(), beevdp_run_frames()
+// and beevdp_get_framebuffer()) each do the work of many port accesses,
+// so that callers from other runtimes only pay the FFI overhead once per batch.
+//
+// Compatibility rules:
+// Functions are only ever added to this interface, never changed or removed.
+// Structs passed in by the caller start with a 'struct_size' field,
+// so that new fields can be appended without breaking older callers.
+//
+// Every function that takes a handle does nothing if the handle is NULL
+// (and returns 0), and so do the batched calls if their buffer is NULL.
+
+#ifndef BEEVDP_C_H
+#define BEEVDP_C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#if defined(BEEVDP_C_BUILD)
+#define BEEVDP_API __declspec(dllexport)
+#else
+#define BEEVDP_API __declspec(dllimport)
+#endif
+#else
+#define BEEVDP_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BEEVDP_ABI_VERSION 1
+
+// Opaque handle to a VDP instance
+typedef struct beevdp_vdp beevdp_vdp;
+
+// Format of each framebuffer pixel
+typedef struct beevdp_rgb
+{
+    uint8_t red;
+    uint8_t green;
+    uint8_t blue;
+} beevdp_rgb;
+
+// VDP configuration
+// (Note: 'struct_size' must be set to sizeof(beevdp_config))
+typedef struct beevdp_config
+{
+    uint32_t struct_size;
+    // VRAM size in bytes (0x1000 or 0x4000)
+    uint32_t vram_size;
+    // Run without any framebuffers if nonzero
+    uint32_t is_headless;
+    // Emulated chip (one of the BEEVDP_VARIANT_* values)
+    uint32_t variant;
+    // Honor the 4K/16K bit in register 1 if nonzero
+    // (VRAM is always addressed as 16K otherwise)
+    uint32_t is_4k_mode_enabled;
+} beevdp_config;
+
+// Supported chips
+#define BEEVDP_VARIANT_TMS9918A 0
+#define BEEVDP_VARIANT_TMS9928A 1
+#define BEEVDP_VARIANT_TMS9929A 2
+#define BEEVDP_VARIANT_TMS9118 3
+#define BEEVDP_VARIANT_TMS9128 4
+#define BEEVDP_VARIANT_TMS9129 5
+
+// Called with each scanline as soon as it's finished
+// ('pixels' holds beevdp_get_width() pixels, and is only valid during the call)
+typedef void (*beevdp_line_callback)(void *user_data, int line, const beevdp_rgb *pixels);
+
+// Called at the start of VBlank, after the completed frame has been published
+typedef void (*beevdp_vblank_callback)(void *user_data, uint64_t frame_number);
+
+// Runs one frame of the host machine during beevdp_run_ahead()
+// (i.e. the host's CPU, along with beevdp_num_scanlines() calls to beevdp_chip_clock())
+typedef void (*beevdp_frame_runner)(void *user_data, int frame_index);
+
+// Flags for beevdp_run_frames()
+// Acknowledge each IRQ by reading the status register,
+// like an interrupt handler on the host CPU would
+#define BEEVDP_RUN_ACK_IRQ 0x1
+
+// Fetch the ABI version the library was built with
+BEEVDP_API uint32_t beevdp_abi_version(void);
+
+// Create and initialize a VDP
+// (Note: 'config' may be NULL for the default configuration,
+// and this returns NULL on failure)
+BEEVDP_API beevdp_vdp *beevdp_create(const beevdp_config *config);
+BEEVDP_API void beevdp_destroy(beevdp_vdp *vdp);
+
+// Single port accesses
+BEEVDP_API void beevdp_write_control(beevdp_vdp *vdp, uint8_t data);
+BEEVDP_API void beevdp_write_data(beevdp_vdp *vdp, uint8_t data);
+BEEVDP_API uint8_t beevdp_read_status(beevdp_vdp *vdp);
+BEEVDP_API uint8_t beevdp_read_data(beevdp_vdp *vdp);
+BEEVDP_API int beevdp_is_interrupt(beevdp_vdp *vdp);
+BEEVDP_API void beevdp_chip_clock(beevdp_vdp *vdp);
+
+// Batched calls
+// Write 'num_regs' registers, starting at register 0
+BEEVDP_API void beevdp_write_registers(beevdp_vdp *vdp, const uint8_t *regs, size_t num_regs);
+// Write 'length' bytes to VRAM, starting at 'addr'
+BEEVDP_API void beevdp_write_vram(beevdp_vdp *vdp, uint16_t addr, const uint8_t *data, size_t length);
+// Read 'length' bytes from VRAM, starting at 'addr'
+BEEVDP_API void beevdp_read_vram(beevdp_vdp *vdp, uint16_t addr, uint8_t *data, size_t length);
+// Run 'num_frames' full frames, and return the number of IRQs generated
+BEEVDP_API uint32_t beevdp_run_frames(beevdp_vdp *vdp, uint32_t num_frames, uint32_t flags);
+// Copy the most recently completed frame into 'pixels',
+// which must hold at least 'num_pixels' pixels (i.e. width * height)
+// (Note: returns the frame's sequence number, or 0 if no frame is available)
+BEEVDP_API uint64_t beevdp_get_framebuffer(beevdp_vdp *vdp, beevdp_rgb *pixels, size_t num_pixels);
+
+// Render only every 'interval'th frame (or none at all if 'interval' is 0),
+// e.g. for fast-forwarding (timing, status flags and IRQs are unaffected)
+// (Note: the new interval takes effect at the next frame boundary)
+BEEVDP_API void beevdp_set_render_interval(beevdp_vdp *vdp, uint32_t interval);
+
+// Only render the 'width' x 'height' pixels starting at ('x', 'y'),
+// e.g. for agents that only look at part of the screen
+// (pixels outside the region are kept from the last frame; IRQs are unaffected)
+BEEVDP_API void beevdp_set_region_of_interest(beevdp_vdp *vdp, int x, int y, int width, int height);
+
+// Evaluate the palette number of the pixel at ('x', 'y') straight from
+// the current VRAM and registers (this also works for headless VDPs)
+BEEVDP_API uint8_t beevdp_peek_pixel(beevdp_vdp *vdp, int x, int y);
+
+// Save the VDP state into 'buffer', which must hold 'size' bytes
+// (Note: returns the size a state needs, and only saves if 'size' is at least that;
+// states can only be loaded by the same build of the library)
+BEEVDP_API size_t beevdp_save_state(beevdp_vdp *vdp, void *buffer, size_t size);
+// Restore a state saved by beevdp_save_state() (returns 0 on failure)
+BEEVDP_API int beevdp_load_state(beevdp_vdp *vdp, const void *buffer, size_t size);
+
+// Run 'num_frames' frames ahead with only the last one rendered, then go back
+// to the current state, e.g. to hide input latency (returns 0 if nothing was rendered)
+// 'runner' runs each frame of the host machine, or if it's NULL,
+// the VDP is clocked through each frame on its own
+// (Note: the host saves and restores its own state around this call,
+// and should set the render interval to 0 so that only these frames get rendered.
+// This may only be called between frames, and returns 0 in the middle of one.)
+BEEVDP_API int beevdp_run_ahead(beevdp_vdp *vdp, int num_frames, beevdp_frame_runner runner, void *user_data);
+
+// Low latency output (pass a NULL callback to remove it)
+BEEVDP_API void beevdp_set_line_callback(beevdp_vdp *vdp, beevdp_line_callback callback, void *user_data);
+BEEVDP_API void beevdp_set_vblank_callback(beevdp_vdp *vdp, beevdp_vblank_callback callback, void *user_data);
+
+// Overlay compositing, active while register 0 bit 0 (external video) is set:
+// pixels of color 0 show either a caller-provided frame of width * height pixels,
+// or the scanline 'background' is rendering
+// (Note: clock 'background' before 'vdp' on each scanline; pass NULL to remove)
+BEEVDP_API void beevdp_set_external_video(beevdp_vdp *vdp, const beevdp_rgb *frame);
+BEEVDP_API void beevdp_set_external_vdp(beevdp_vdp *vdp, const beevdp_vdp *background);
+
+// Display information
+BEEVDP_API int beevdp_get_width(const beevdp_vdp *vdp);
+BEEVDP_API int beevdp_get_height(const beevdp_vdp *vdp);
+BEEVDP_API int beevdp_num_scanlines(const beevdp_vdp *vdp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BEEVDP_C_H
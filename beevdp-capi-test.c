@@ -0,0 +1,217 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Tests for the C interface, written in C and linked against the shared library
+// (i.e. the way callers from other runtimes see it)
+//
+// Usage: beevdp-capi-test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "beevdp-c.h"
+
+static int num_failures = 0;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(int cond, const char *text, int line)
+{
+    if (!cond)
+    {
+	printf("Check failed on line %d: %s\n", line, text);
+	num_failures += 1;
+    }
+}
+
+// Counts what the callbacks were called with
+typedef struct callback_log
+{
+    int num_lines;
+    int last_line;
+    int is_out_of_order;
+    int num_vblanks;
+    uint64_t last_frame_number;
+} callback_log;
+
+static void log_line(void *user_data, int line, const beevdp_rgb *pixels)
+{
+    callback_log *log = (callback_log*)user_data;
+
+    if ((pixels == NULL) || (line != (log->last_line + 1)))
+    {
+	log->is_out_of_order = 1;
+    }
+
+    log->last_line = line;
+    log->num_lines += 1;
+}
+
+static void log_vblank(void *user_data, uint64_t frame_number)
+{
+    callback_log *log = (callback_log*)user_data;
+    log->last_line = -1;
+    log->num_vblanks += 1;
+    log->last_frame_number = frame_number;
+}
+
+// Every call has to survive a NULL handle
+static void test_null_handle(void)
+{
+    uint8_t data[4] = {0};
+    beevdp_rgb pixels[4];
+
+    beevdp_destroy(NULL);
+    beevdp_write_control(NULL, 0x00);
+    beevdp_write_data(NULL, 0x00);
+    CHECK(beevdp_read_status(NULL) == 0);
+    CHECK(beevdp_read_data(NULL) == 0);
+    CHECK(beevdp_is_interrupt(NULL) == 0);
+    beevdp_chip_clock(NULL);
+    beevdp_write_registers(NULL, data, 4);
+    beevdp_write_vram(NULL, 0, data, 4);
+    beevdp_read_vram(NULL, 0, data, 4);
+    CHECK(beevdp_run_frames(NULL, 1, BEEVDP_RUN_ACK_IRQ) == 0);
+    CHECK(beevdp_get_framebuffer(NULL, pixels, 4) == 0);
+    beevdp_set_render_interval(NULL, 1);
+    beevdp_set_region_of_interest(NULL, 0, 0, 1, 1);
+    CHECK(beevdp_peek_pixel(NULL, 0, 0) == 0);
+    CHECK(beevdp_save_state(NULL, data, 4) == 0);
+    CHECK(beevdp_load_state(NULL, data, 4) == 0);
+    CHECK(beevdp_run_ahead(NULL, 1, NULL, NULL) == 0);
+    beevdp_set_line_callback(NULL, log_line, NULL);
+    beevdp_set_vblank_callback(NULL, log_vblank, NULL);
+    beevdp_set_external_video(NULL, pixels);
+    beevdp_set_external_vdp(NULL, NULL);
+    CHECK(beevdp_get_width(NULL) == 0);
+    CHECK(beevdp_get_height(NULL) == 0);
+    CHECK(beevdp_num_scanlines(NULL) == 0);
+}
+
+static void test_create(void)
+{
+    beevdp_config config = {sizeof(beevdp_config), 0x4000, 1, BEEVDP_VARIANT_TMS9929A, 0};
+    beevdp_vdp *vdp = beevdp_create(&config);
+    CHECK(vdp != NULL);
+    CHECK(beevdp_num_scanlines(vdp) == 313);
+    beevdp_destroy(vdp);
+
+    // Unsupported configurations are rejected
+    config.vram_size = 0x2000;
+    CHECK(beevdp_create(&config) == NULL);
+    config.vram_size = 0x4000;
+    config.variant = 6;
+    CHECK(beevdp_create(&config) == NULL);
+
+    // Older callers don't know about the fields at the end
+    config.struct_size = (uint32_t)offsetof(beevdp_config, variant);
+    config.is_headless = 0;
+    vdp = beevdp_create(&config);
+    CHECK(vdp != NULL);
+    CHECK(beevdp_num_scanlines(vdp) == 262);
+    beevdp_destroy(vdp);
+}
+
+// Drive a default VDP through the batched calls
+static void test_frames(void)
+{
+    const uint8_t regs[8] = {0x00, 0xE0, 0x0E, 0xFF, 0x03, 0x76, 0x03, 0x1F};
+    uint8_t pattern[256];
+    uint8_t readback[256];
+    beevdp_vdp *vdp = beevdp_create(NULL);
+    CHECK(vdp != NULL);
+
+    if (vdp == NULL)
+    {
+	return;
+    }
+
+    int width = beevdp_get_width(vdp);
+    int height = beevdp_get_height(vdp);
+    CHECK((width == 256) && (height == 192));
+
+    for (int i = 0; i < 256; i++)
+    {
+	pattern[i] = (uint8_t)((i * 37) + 11);
+    }
+
+    beevdp_write_vram(vdp, 0x3F00, pattern, sizeof(pattern));
+    beevdp_read_vram(vdp, 0x3F00, readback, sizeof(readback));
+    CHECK(memcmp(pattern, readback, sizeof(pattern)) == 0);
+
+    // NULL buffers are ignored
+    beevdp_write_vram(vdp, 0x3F00, NULL, sizeof(pattern));
+    beevdp_read_vram(vdp, 0x3F00, readback, sizeof(readback));
+    CHECK(memcmp(pattern, readback, sizeof(pattern)) == 0);
+
+    // With IRQs enabled, every frame raises exactly one
+    // (Note: enabling them can raise one right away, which is cleared first)
+    beevdp_write_registers(vdp, regs, 8);
+    beevdp_read_status(vdp);
+    beevdp_is_interrupt(vdp);
+    CHECK(beevdp_run_frames(vdp, 3, BEEVDP_RUN_ACK_IRQ) == 3);
+
+    size_t num_pixels = ((size_t)width * height);
+    beevdp_rgb *pixels = (beevdp_rgb*)calloc(num_pixels, sizeof(beevdp_rgb));
+    CHECK(beevdp_get_framebuffer(vdp, pixels, num_pixels) != 0);
+    CHECK(beevdp_get_framebuffer(vdp, NULL, num_pixels) == 0);
+
+    // Line callbacks come in order, with one VBlank per frame
+    callback_log log = {0, -1, 0, 0, 0};
+    beevdp_set_line_callback(vdp, log_line, &log);
+    beevdp_set_vblank_callback(vdp, log_vblank, &log);
+    beevdp_run_frames(vdp, 2, BEEVDP_RUN_ACK_IRQ);
+    CHECK(log.num_vblanks == 2);
+    CHECK(log.num_lines == (2 * height));
+    CHECK(!log.is_out_of_order);
+    CHECK(log.last_frame_number != 0);
+    beevdp_set_line_callback(vdp, NULL, NULL);
+    beevdp_set_vblank_callback(vdp, NULL, NULL);
+
+    // A saved state brings back the VRAM it was saved with
+    size_t state_size = beevdp_save_state(vdp, NULL, 0);
+    void *state = malloc(state_size);
+    CHECK(beevdp_save_state(vdp, state, state_size) == state_size);
+    memset(readback, 0, sizeof(readback));
+    beevdp_write_vram(vdp, 0x3F00, readback, sizeof(readback));
+    CHECK(beevdp_load_state(vdp, state, (state_size - 1)) == 0);
+    CHECK(beevdp_load_state(vdp, state, state_size) == 1);
+    beevdp_read_vram(vdp, 0x3F00, readback, sizeof(readback));
+    CHECK(memcmp(pattern, readback, sizeof(pattern)) == 0);
+
+    free(state);
+    free(pixels);
+    beevdp_destroy(vdp);
+}
+
+int main(void)
+{
+    CHECK(beevdp_abi_version() == BEEVDP_ABI_VERSION);
+    test_null_handle();
+    test_create();
+    test_frames();
+
+    if (num_failures != 0)
+    {
+	printf("FAILED: %d checks failed\n", num_failures);
+	return 1;
+    }
+
+    printf("All C interface checks passed\n");
+    return 0;
+}
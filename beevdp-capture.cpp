@@ -0,0 +1,555 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Notes on the capture codec:
+// Palette numbers only take 4 bits, so every row of 256 pixels packs into 128 bytes,
+// with the even pixel in the low nibble.
+// Rows are XORed against a reference row (the row above in keyframes,
+// or the same row of the previous frame in deltas), which turns unchanged
+// bytes into zeros, and the result is run-length coded with these control bytes:
+// 0x00-0x3F: 1 to 64 zero bytes
+// 0x40-0x7F: the next byte, repeated 1 to 64 times
+// 0x80-0xFF: 1 to 128 literal bytes follow
+// The encoder never needs more than one frame of history, so both sides
+// run in constant memory (apart from the reader's list of keyframe positions).
+
+#include <cstring>
+#include <algorithm>
+#include "beevdp-capture.h"
+using namespace beevdp;
+using namespace std;
+
+namespace beevdp
+{
+    static constexpr uint32_t capture_magic = 0x43445642; // 'BVDC'
+    static constexpr uint16_t capture_version = 1;
+
+    static constexpr int row_bytes = 128;
+    static constexpr int num_rows = 192;
+    static constexpr int frame_bytes = (row_bytes * num_rows);
+    // Bitmap of the changed rows at the start of a delta
+    static constexpr int row_map_bytes = (num_rows / 8);
+    // Largest payload the writer can produce, with room to spare
+    // (Note: anything bigger is a corrupt record, and is rejected before it's allocated)
+    static constexpr uint32_t max_payload_size = (row_map_bytes + (num_rows * (row_bytes + 2)));
+
+    static constexpr size_t file_header_size = 12;
+    static constexpr size_t record_header_size = 21;
+
+    enum : uint8_t
+    {
+	RecordKeyframe = 0,
+	RecordDelta = 1,
+    };
+
+    static const uint8_t zero_row[row_bytes] = {};
+
+    static void put_value(uint8_t *data, uint64_t value, int num_bytes)
+    {
+	for (int i = 0; i < num_bytes; i++)
+	{
+	    data[i] = uint8_t(value >> (i * 8));
+	}
+    }
+
+    static uint64_t get_value(const uint8_t *data, int num_bytes)
+    {
+	uint64_t value = 0;
+
+	for (int i = 0; i < num_bytes; i++)
+	{
+	    value |= (uint64_t(data[i]) << (i * 8));
+	}
+
+	return value;
+    }
+
+    // Run-length code the XOR of 'row' and 'ref_row' onto the end of 'out'
+    static void encode_row(const uint8_t *row, const uint8_t *ref_row, vector<uint8_t> &out)
+    {
+	uint8_t delta[row_bytes];
+
+	for (int pos = 0; pos < row_bytes; pos++)
+	{
+	    delta[pos] = (row[pos] ^ ref_row[pos]);
+	}
+
+	int literal_start = 0;
+
+	auto flush_literal = [&](int end)
+	{
+	    while (literal_start < end)
+	    {
+		int length = min((end - literal_start), 128);
+		out.push_back(uint8_t(0x80 | (length - 1)));
+		out.insert(out.end(), &delta[literal_start], &delta[(literal_start + length)]);
+		literal_start += length;
+	    }
+	};
+
+	int pos = 0;
+
+	while (pos < row_bytes)
+	{
+	    int run = 1;
+
+	    while (((pos + run) < row_bytes) && (delta[(pos + run)] == delta[pos]) && (run < 64))
+	    {
+		run += 1;
+	    }
+
+	    // Short runs are cheaper as part of a literal
+	    bool is_zero = (delta[pos] == 0);
+
+	    if ((is_zero && (run >= 2)) || (run >= 3))
+	    {
+		flush_literal(pos);
+
+		if (is_zero)
+		{
+		    out.push_back(uint8_t(run - 1));
+		}
+		else
+		{
+		    out.push_back(uint8_t(0x40 | (run - 1)));
+		    out.push_back(delta[pos]);
+		}
+
+		literal_start = (pos + run);
+	    }
+
+	    pos += run;
+	}
+
+	flush_literal(row_bytes);
+    }
+
+    // Decode a row coded by encode_row() from 'data'
+    // (Note: 'row' and 'ref_row' may be the same buffer)
+    static bool decode_row(const uint8_t *&data, const uint8_t *end, uint8_t *row, const uint8_t *ref_row)
+    {
+	int pos = 0;
+
+	while (pos < row_bytes)
+	{
+	    if (data >= end)
+	    {
+		return false;
+	    }
+
+	    uint8_t control = *data++;
+	    int length = 0;
+
+	    if (control < 0x40)
+	    {
+		length = (control + 1);
+
+		if ((pos + length) > row_bytes)
+		{
+		    return false;
+		}
+
+		memmove(&row[pos], &ref_row[pos], length);
+	    }
+	    else if (control < 0x80)
+	    {
+		length = ((control & 0x3F) + 1);
+
+		if ((data >= end) || ((pos + length) > row_bytes))
+		{
+		    return false;
+		}
+
+		uint8_t value = *data++;
+
+		for (int i = 0; i < length; i++)
+		{
+		    row[(pos + i)] = (ref_row[(pos + i)] ^ value);
+		}
+	    }
+	    else
+	    {
+		length = ((control & 0x7F) + 1);
+
+		if (((end - data) < length) || ((pos + length) > row_bytes))
+		{
+		    return false;
+		}
+
+		for (int i = 0; i < length; i++)
+		{
+		    row[(pos + i)] = (ref_row[(pos + i)] ^ data[i]);
+		}
+
+		data += length;
+	    }
+
+	    pos += length;
+	}
+
+	return true;
+    }
+
+    BeeVDPCaptureWriter::BeeVDPCaptureWriter()
+    {
+
+    }
+
+    BeeVDPCaptureWriter::~BeeVDPCaptureWriter()
+    {
+	close();
+    }
+
+    bool BeeVDPCaptureWriter::open(ostream &stream, int interval)
+    {
+	if ((interval < 1) || (interval > 0xFFFF))
+	{
+	    return false;
+	}
+
+	output = &stream;
+	keyframe_interval = interval;
+	num_frames = 0;
+	rows.assign(frame_bytes, 0);
+	prev_rows.assign(frame_bytes, 0);
+	payload.reserve((row_map_bytes + (num_rows * (row_bytes + 1))));
+
+	uint8_t header[file_header_size];
+	put_value(&header[0], capture_magic, 4);
+	put_value(&header[4], capture_version, 2);
+	put_value(&header[6], keyframe_interval, 2);
+	put_value(&header[8], 256, 2);
+	put_value(&header[10], 192, 2);
+	output->write(reinterpret_cast<const char*>(header), sizeof(header));
+	return output->good();
+    }
+
+    bool BeeVDPCaptureWriter::writeFrame(const BeeVDPFrame &frame)
+    {
+	if (output == nullptr)
+	{
+	    return false;
+	}
+
+	// Pack two palette numbers into each byte
+	const uint8_t *indices = frame.indices.data();
+
+	for (int pos = 0; pos < frame_bytes; pos++)
+	{
+	    rows[pos] = ((indices[(pos * 2)] & 0xF) | ((indices[((pos * 2) + 1)] & 0xF) << 4));
+	}
+
+	bool is_keyframe = ((num_frames % keyframe_interval) == 0);
+	payload.clear();
+
+	if (is_keyframe)
+	{
+	    for (int row = 0; row < num_rows; row++)
+	    {
+		const uint8_t *ref_row = (row == 0) ? zero_row : &rows[((row - 1) * row_bytes)];
+		encode_row(&rows[(row * row_bytes)], ref_row, payload);
+	    }
+	}
+	else
+	{
+	    // Unchanged rows are skipped entirely
+	    payload.resize(row_map_bytes, 0);
+
+	    for (int row = 0; row < num_rows; row++)
+	    {
+		int offset = (row * row_bytes);
+
+		if (memcmp(&rows[offset], &prev_rows[offset], row_bytes) == 0)
+		{
+		    continue;
+		}
+
+		payload[(row >> 3)] |= (1 << (row & 7));
+		encode_row(&rows[offset], &prev_rows[offset], payload);
+	    }
+	}
+
+	uint8_t header[record_header_size];
+	header[0] = is_keyframe ? RecordKeyframe : RecordDelta;
+	put_value(&header[1], frame.sequence, 8);
+	put_value(&header[9], uint64_t(frame.timestamp), 8);
+	put_value(&header[17], payload.size(), 4);
+	output->write(reinterpret_cast<const char*>(header), sizeof(header));
+	output->write(reinterpret_cast<const char*>(payload.data()), payload.size());
+
+	rows.swap(prev_rows);
+	num_frames += 1;
+	return output->good();
+    }
+
+    void BeeVDPCaptureWriter::close()
+    {
+	if (output != nullptr)
+	{
+	    output->flush();
+	    output = nullptr;
+	}
+    }
+
+    uint64_t BeeVDPCaptureWriter::numFrames() const
+    {
+	return num_frames;
+    }
+
+    BeeVDPCaptureReader::BeeVDPCaptureReader()
+    {
+
+    }
+
+    BeeVDPCaptureReader::~BeeVDPCaptureReader()
+    {
+	close();
+    }
+
+    bool BeeVDPCaptureReader::open(istream &stream)
+    {
+	close();
+
+	uint8_t header[file_header_size];
+
+	if (!stream.read(reinterpret_cast<char*>(header), sizeof(header)))
+	{
+	    return false;
+	}
+
+	bool is_valid = (get_value(&header[0], 4) == capture_magic) &&
+	    (get_value(&header[4], 2) == capture_version) &&
+	    (get_value(&header[6], 2) != 0) &&
+	    (get_value(&header[8], 2) == 256) &&
+	    (get_value(&header[10], 2) == 192);
+
+	if (!is_valid)
+	{
+	    return false;
+	}
+
+	input = &stream;
+	keyframe_interval = int(get_value(&header[6], 2));
+	next_frame = 0;
+	rows.assign(frame_bytes, 0);
+
+	// The first frame is always a keyframe
+	keyframe_offsets.push_back(stream.tellg());
+	return true;
+    }
+
+    void BeeVDPCaptureReader::close()
+    {
+	input = nullptr;
+	keyframe_interval = 0;
+	next_frame = 0;
+	keyframe_offsets.clear();
+    }
+
+    bool BeeVDPCaptureReader::read_header(RecordHeader &header)
+    {
+	uint8_t data[record_header_size];
+
+	if (!input->read(reinterpret_cast<char*>(data), sizeof(data)))
+	{
+	    return false;
+	}
+
+	header.type = data[0];
+	header.sequence = get_value(&data[1], 8);
+	header.timestamp = int64_t(get_value(&data[9], 8));
+	header.payload_size = uint32_t(get_value(&data[17], 4));
+	return true;
+    }
+
+    // Decode the next frame into the packed rows
+    bool BeeVDPCaptureReader::decode_frame()
+    {
+	streamoff offset = input->tellg();
+	RecordHeader header;
+
+	if (!read_header(header))
+	{
+	    return false;
+	}
+
+	bool is_keyframe = ((next_frame % keyframe_interval) == 0);
+
+	if ((header.type != (is_keyframe ? RecordKeyframe : RecordDelta)) || (header.payload_size > max_payload_size))
+	{
+	    return false;
+	}
+
+	payload.resize(header.payload_size);
+
+	if (!input->read(reinterpret_cast<char*>(payload.data()), payload.size()))
+	{
+	    return false;
+	}
+
+	const uint8_t *data = payload.data();
+	const uint8_t *end = (data + payload.size());
+
+	if (is_keyframe)
+	{
+	    for (int row = 0; row < num_rows; row++)
+	    {
+		const uint8_t *ref_row = (row == 0) ? zero_row : &rows[((row - 1) * row_bytes)];
+
+		if (!decode_row(data, end, &rows[(row * row_bytes)], ref_row))
+		{
+		    return false;
+		}
+	    }
+
+	    if ((next_frame / keyframe_interval) == keyframe_offsets.size())
+	    {
+		keyframe_offsets.push_back(offset);
+	    }
+	}
+	else
+	{
+	    if (payload.size() < row_map_bytes)
+	    {
+		return false;
+	    }
+
+	    const uint8_t *row_map = data;
+	    data += row_map_bytes;
+
+	    for (int row = 0; row < num_rows; row++)
+	    {
+		uint8_t *row_data = &rows[(row * row_bytes)];
+
+		if (((row_map[(row >> 3)] >> (row & 7)) & 1) && !decode_row(data, end, row_data, row_data))
+		{
+		    return false;
+		}
+	    }
+	}
+
+	last_header = header;
+	next_frame += 1;
+	return true;
+    }
+
+    bool BeeVDPCaptureReader::readFrame(BeeVDPFrame &frame, const array<BeeVDPRGB, 16> &palette)
+    {
+	if ((input == nullptr) || !decode_frame())
+	{
+	    return false;
+	}
+
+	for (int pos = 0; pos < frame_bytes; pos++)
+	{
+	    uint8_t even_color = (rows[pos] & 0xF);
+	    uint8_t odd_color = (rows[pos] >> 4);
+	    frame.indices[(pos * 2)] = even_color;
+	    frame.indices[((pos * 2) + 1)] = odd_color;
+	    frame.pixels[(pos * 2)] = palette[even_color];
+	    frame.pixels[((pos * 2) + 1)] = palette[odd_color];
+	}
+
+	frame.sequence = last_header.sequence;
+	frame.timestamp = last_header.timestamp;
+	frame.dirty_base = 0;
+	frame.dirty_columns.fill(0xFFFFFFFF);
+	return true;
+    }
+
+    bool BeeVDPCaptureReader::seekFrame(uint64_t frame_number)
+    {
+	if (input == nullptr)
+	{
+	    return false;
+	}
+
+	// A failed seek leaves the reader where it was
+	input->clear();
+	streamoff position = input->tellg();
+	uint64_t position_frame = next_frame;
+	vector<uint8_t> position_rows = rows;
+	RecordHeader position_header = last_header;
+
+	auto restore_position = [&]()
+	{
+	    input->clear();
+	    input->seekg(position);
+	    next_frame = position_frame;
+	    rows.swap(position_rows);
+	    last_header = position_header;
+	};
+
+	uint64_t keyframe = (frame_number / keyframe_interval);
+
+	// Find any keyframes not seen yet, by skipping over whole frames
+	// from the last keyframe found
+	while (keyframe_offsets.size() <= keyframe)
+	{
+	    input->seekg(keyframe_offsets.back());
+
+	    for (int frame = 0; frame < keyframe_interval; frame++)
+	    {
+		RecordHeader header;
+
+		if (!read_header(header) || (header.payload_size > max_payload_size) || !input->seekg(header.payload_size, ios::cur))
+		{
+		    restore_position();
+		    return false;
+		}
+	    }
+
+	    streamoff offset = input->tellg();
+	    RecordHeader header;
+
+	    if (!read_header(header) || (header.type != RecordKeyframe))
+	    {
+		restore_position();
+		return false;
+	    }
+
+	    keyframe_offsets.push_back(offset);
+	}
+
+	// Decode forward from the keyframe
+	input->seekg(keyframe_offsets[keyframe]);
+	next_frame = (keyframe * keyframe_interval);
+
+	while (next_frame < frame_number)
+	{
+	    if (!decode_frame())
+	    {
+		restore_position();
+		return false;
+	    }
+	}
+
+	return true;
+    }
+
+    uint64_t BeeVDPCaptureReader::getPosition() const
+    {
+	return next_frame;
+    }
+
+    int BeeVDPCaptureReader::getKeyframeInterval() const
+    {
+	return keyframe_interval;
+    }
+};
@@ -0,0 +1,119 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BEEVDP_CAPTURE_H
+#define BEEVDP_CAPTURE_H
+
+#include <vector>
+#include <istream>
+#include <ostream>
+#include "beevdp.h"
+
+namespace beevdp
+{
+    // Lossless capture format for long recordings of TMS99xxA output
+    //
+    // Frames are stored as palette numbers (4 bits per pixel, 128 bytes per row),
+    // so the pixels of external video are not recorded.
+    // Every 'keyframe_interval'th frame is a keyframe, which codes each row
+    // as the XOR against the row above it.
+    // All other frames carry a bitmap of the rows that changed since
+    // the previous frame, and code only those rows, as the XOR against
+    // the same row of the previous frame.
+    // Both kinds of rows are then run-length coded (see beevdp-capture.cpp).
+    //
+    // Layout (all values are little-endian):
+    // File header: 'BVDC', version (16-bit), keyframe interval (16-bit),
+    // width (16-bit), height (16-bit)
+    // Each frame: type (8-bit, 0 for keyframes and 1 for deltas),
+    // sequence number (64-bit), timestamp (64-bit), payload size (32-bit), payload
+    class BeeVDPCaptureWriter
+    {
+	public:
+	    BeeVDPCaptureWriter();
+	    ~BeeVDPCaptureWriter();
+
+	    // Start a new capture on 'stream'
+	    bool open(std::ostream &stream, int keyframe_interval = 60);
+	    // Append a frame (only its sequence number, timestamp and palette numbers are kept)
+	    bool writeFrame(const BeeVDPFrame &frame);
+	    void close();
+
+	    uint64_t numFrames() const;
+
+	private:
+	    std::ostream *output = nullptr;
+	    int keyframe_interval = 60;
+	    uint64_t num_frames = 0;
+
+	    std::vector<uint8_t> rows;
+	    std::vector<uint8_t> prev_rows;
+	    std::vector<uint8_t> payload;
+    };
+
+    class BeeVDPCaptureReader
+    {
+	public:
+	    BeeVDPCaptureReader();
+	    ~BeeVDPCaptureReader();
+
+	    // Start reading a capture from 'stream'
+	    // (Note: the stream must be seekable for seekFrame())
+	    bool open(std::istream &stream);
+	    void close();
+
+	    // Decode the next frame into 'frame', using 'palette' for its pixels
+	    // (Note: returns false at the end of the capture, or on a corrupt record)
+	    bool readFrame(BeeVDPFrame &frame, const std::array<BeeVDPRGB, 16> &palette = tms99xx_palette);
+
+	    // Make 'frame_number' (counting from 0) the next frame to be read,
+	    // by decoding forward from the closest keyframe before it
+	    // (Note: on failure, the position and the previous frame are left unchanged)
+	    bool seekFrame(uint64_t frame_number);
+
+	    // Number of the next frame to be read
+	    uint64_t getPosition() const;
+	    int getKeyframeInterval() const;
+
+	private:
+	    struct RecordHeader
+	    {
+		uint8_t type = 0;
+		uint64_t sequence = 0;
+		int64_t timestamp = 0;
+		uint32_t payload_size = 0;
+	    };
+
+	    std::istream *input = nullptr;
+	    int keyframe_interval = 0;
+	    uint64_t next_frame = 0;
+
+	    // Stream position of every keyframe found so far
+	    std::vector<std::streamoff> keyframe_offsets;
+
+	    std::vector<uint8_t> rows;
+	    std::vector<uint8_t> payload;
+	    RecordHeader last_header;
+
+	    bool read_header(RecordHeader &header);
+	    bool decode_frame();
+    };
+};
+
+#endif // BEEVDP_CAPTURE_H
@@ -0,0 +1,470 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+// Notes on the debug views:
+// Every view is a grid of 8x8 tiles (6x8 in the name map of text mode),
+// and each tile only depends on a handful of VRAM bytes
+// (i.e. its name, its 8 pattern bytes and its color byte(s)).
+// Patterns and colors are stored in 8-byte aligned blocks,
+// so a single byte of the dirty bitmap tells if a block has been written.
+// Scanning the tiles for writes is therefore far cheaper than redrawing them,
+// and the views can be updated every frame.
+
+#include <algorithm>
+#include <cstring>
+#include <tuple>
+#include "beevdp-debug.h"
+#include "beevdp.h"
+using namespace beevdp;
+using namespace std;
+
+namespace beevdp
+{
+    bool BeeVDPTableState::operator==(const BeeVDPTableState &other) const
+    {
+	auto fields = [](const BeeVDPTableState &state)
+	{
+	    return tie(state.mode_val, state.pattern_name, state.color_table, state.pattern_gen,
+		state.sprite_attrib, state.sprite_gen, state.text_color, state.backdrop_color, state.vram_mask);
+	};
+
+	return (fields(*this) == fields(other));
+    }
+
+    BeeVDPDebugViews::BeeVDPDebugViews()
+    {
+	for (auto *view : {&pattern_sheet, &name_map, &color_swatches, &vram_map})
+	{
+	    view->pixels.resize((256 * 192), 0);
+	}
+    }
+
+    BeeVDPDebugViews::~BeeVDPDebugViews()
+    {
+
+    }
+
+    void BeeVDPDebugViews::invalidate()
+    {
+	is_full_redraw = true;
+    }
+
+    const BeeVDPDebugView &BeeVDPDebugViews::getPatternSheet() const
+    {
+	return pattern_sheet;
+    }
+
+    const BeeVDPDebugView &BeeVDPDebugViews::getNameMap() const
+    {
+	return name_map;
+    }
+
+    const BeeVDPDebugView &BeeVDPDebugViews::getColorSwatches() const
+    {
+	return color_swatches;
+    }
+
+    const BeeVDPDebugView &BeeVDPDebugViews::getVRAMMap() const
+    {
+	return vram_map;
+    }
+
+    int BeeVDPDebugViews::numRedrawnTiles() const
+    {
+	return redrawn_tiles;
+    }
+
+    // Graphics II mode (i.e. mode 2)
+    bool BeeVDPDebugViews::is_graphics2() const
+    {
+	const BeeVDPModeDesc &desc = tms99xx_modes[(table.mode_val & 0x7)];
+	return (desc.has_color_table && desc.is_bank_split);
+    }
+
+    // Text mode (i.e. mode 1, and the undocumented mode 1+2)
+    bool BeeVDPDebugViews::is_text() const
+    {
+	const BeeVDPModeDesc &desc = tms99xx_modes[(table.mode_val & 0x7)];
+	return ((desc.source == CellPattern) && !desc.has_color_table);
+    }
+
+    // Multicolor mode (i.e. mode 3, and the undocumented mode 2+3)
+    bool BeeVDPDebugViews::is_multicolor() const
+    {
+	return (tms99xx_modes[(table.mode_val & 0x7)].source == CellMulticolor);
+    }
+
+    // Graphics II addressing (i.e. mode 2, and the undocumented modes 1+2 and 2+3)
+    bool BeeVDPDebugViews::is_bank_split() const
+    {
+	return tms99xx_modes[(table.mode_val & 0x7)].is_bank_split;
+    }
+
+    bool BeeVDPDebugViews::is_byte_dirty(uint32_t addr) const
+    {
+	addr &= table.vram_mask;
+	return ((dirty[(addr >> 6)] >> (addr & 0x3F)) & 1);
+    }
+
+    bool BeeVDPDebugViews::is_block_dirty(uint32_t addr) const
+    {
+	addr &= table.vram_mask;
+	return ((dirty[(addr >> 6)] >> (addr & 0x38)) & 0xFF);
+    }
+
+    // Bring all views up to date with the writes since the previous update
+    void BeeVDPDebugViews::update(const uint8_t *vram_data, const BeeVDPTableState &state)
+    {
+	bool is_full = (is_full_redraw || (state != last_state));
+	redrawn_tiles = 0;
+
+	// Nothing to do if nothing has been written
+	// (apart from clearing the write marks of the previous update)
+	if (!is_full && !is_dirty && !is_marked)
+	{
+	    return;
+	}
+
+	vram = vram_data;
+	table = state;
+
+	update_pattern_sheet(is_full);
+	update_name_map(is_full);
+	update_color_swatches(is_full);
+	update_vram_map(is_full);
+
+	last_state = state;
+	dirty.fill(0);
+	is_dirty = false;
+	is_full_redraw = false;
+	vram = nullptr;
+    }
+
+    // Draw a tile of 'width' x 8 pixels of a pattern
+    // (Note: color 0 shows the backdrop color, like it does on the screen)
+    void BeeVDPDebugViews::draw_pattern(BeeVDPDebugView &view, int xpos, int ypos, int width, uint32_t pattern_addr, uint32_t color_addr)
+    {
+	for (int row = 0; row < 8; row++)
+	{
+	    uint8_t pattern_byte = fetch_vram(pattern_addr + row);
+	    uint8_t fg_color = table.text_color;
+	    uint8_t bg_color = table.backdrop_color;
+
+	    if (!is_text())
+	    {
+		uint8_t color_byte = fetch_vram(is_graphics2() ? (color_addr + row) : color_addr);
+		fg_color = (color_byte >> 4);
+		bg_color = (color_byte & 0xF);
+	    }
+
+	    fg_color = (fg_color != 0) ? fg_color : table.backdrop_color;
+	    bg_color = (bg_color != 0) ? bg_color : table.backdrop_color;
+	    uint8_t *pixels = &view.pixels[((ypos + row) * view.width) + xpos];
+
+	    for (int pixel = 0; pixel < width; pixel++)
+	    {
+		pixels[pixel] = ((pattern_byte >> (7 - pixel)) & 1) ? fg_color : bg_color;
+	    }
+	}
+    }
+
+    // Draw a multicolor tile, starting from the given row of color pairs
+    // (Note: each row of color pairs is 4 pixels high on the screen)
+    void BeeVDPDebugViews::draw_multicolor(BeeVDPDebugView &view, int xpos, int ypos, uint32_t pattern_addr, int first_row)
+    {
+	for (int row = 0; row < 8; row++)
+	{
+	    int pair_row = (first_row < 0) ? row : ((first_row + (row >> 2)) & 0x7);
+	    uint8_t color_byte = fetch_vram(pattern_addr + pair_row);
+	    uint8_t left_color = (color_byte >> 4);
+	    uint8_t right_color = (color_byte & 0xF);
+	    uint8_t *pixels = &view.pixels[((ypos + row) * view.width) + xpos];
+	    memset(pixels, (left_color != 0) ? left_color : table.backdrop_color, 4);
+	    memset(&pixels[4], (right_color != 0) ? right_color : table.backdrop_color, 4);
+	}
+    }
+
+    // Draw a color table entry as is, with the foreground color on the left
+    // and the background color on the right
+    void BeeVDPDebugViews::draw_swatch(BeeVDPDebugView &view, int xpos, int ypos, uint32_t color_addr, int color_step)
+    {
+	for (int row = 0; row < 8; row++)
+	{
+	    uint8_t color_byte = fetch_vram(color_addr + (row * color_step));
+	    uint8_t *pixels = &view.pixels[((ypos + row) * view.width) + xpos];
+	    memset(pixels, (color_byte >> 4), 4);
+	    memset(&pixels[4], (color_byte & 0xF), 4);
+	}
+    }
+
+    // Every pattern as stored in the pattern table, 32 per row
+    // (Note: the modes with graphics II addressing show all three banks,
+    // and graphics II mode shows the colors of each pattern as well)
+    void BeeVDPDebugViews::update_pattern_sheet(bool is_full)
+    {
+	int num_patterns = is_bank_split() ? 768 : 256;
+	uint32_t pattern_base = is_bank_split() ? ((table.pattern_gen & 0x4) << 11) : (table.pattern_gen << 11);
+	uint32_t color_base = is_graphics2() ? ((table.color_table & 0x80) << 6) : (table.color_table << 6);
+	bool is_colored = !is_text() && !is_multicolor();
+
+	pattern_sheet.width = 256;
+	pattern_sheet.height = ((num_patterns / 32) * 8);
+
+	for (int pattern = 0; pattern < num_patterns; pattern++)
+	{
+	    uint32_t pattern_addr = (pattern_base + (pattern << 3));
+	    uint32_t color_addr = is_graphics2() ? (color_base + (pattern << 3)) : (color_base + (pattern >> 3));
+	    bool is_changed = is_full || is_block_dirty(pattern_addr);
+
+	    if (is_colored)
+	    {
+		is_changed |= is_graphics2() ? is_block_dirty(color_addr) : is_byte_dirty(color_addr);
+	    }
+
+	    if (!is_changed)
+	    {
+		continue;
+	    }
+
+	    int xpos = ((pattern & 0x1F) << 3);
+	    int ypos = ((pattern >> 5) << 3);
+
+	    if (is_multicolor())
+	    {
+		draw_multicolor(pattern_sheet, xpos, ypos, pattern_addr, -1);
+	    }
+	    else
+	    {
+		draw_pattern(pattern_sheet, xpos, ypos, 8, pattern_addr, color_addr);
+	    }
+
+	    redrawn_tiles += 1;
+	}
+    }
+
+    // The name table drawn as a tile map, using the same table lookups as the screen
+    void BeeVDPDebugViews::update_name_map(bool is_full)
+    {
+	const BeeVDPModeDesc &desc = tms99xx_modes[(table.mode_val & 0x7)];
+	bool is_bogus = (desc.source == CellBars);
+	int num_cols = desc.num_cols;
+	int tile_width = desc.cell_width;
+	uint32_t name_base = (table.pattern_name << 10);
+	uint32_t pattern_base = (table.pattern_gen << 11);
+	uint32_t color_base = (table.color_table << 6);
+	uint16_t pattern_mask = 0xFF;
+	uint16_t color_mask = 0xFF;
+
+	if (is_bank_split())
+	{
+	    pattern_base = ((table.pattern_gen & 0x4) << 11);
+	    pattern_mask = (((table.pattern_gen & 0x3) << 8) | 0xFF);
+	    color_base = ((table.color_table & 0x80) << 6);
+	    color_mask = (((table.color_table & 0x7F) << 3) | 0x7);
+	}
+
+	name_map.width = (num_cols * tile_width);
+	name_map.height = 192;
+
+	for (int tile_row = 0; tile_row < 24; tile_row++)
+	{
+	    for (int tile_col = 0; tile_col < num_cols; tile_col++)
+	    {
+		int xpos = (tile_col * tile_width);
+		int ypos = (tile_row << 3);
+
+		// The bogus modes don't fetch anything from VRAM
+		if (is_bogus)
+		{
+		    if (is_full)
+		    {
+			uint8_t fg_color = (table.text_color != 0) ? table.text_color : table.backdrop_color;
+
+			for (int row = 0; row < 8; row++)
+			{
+			    uint8_t *pixels = &name_map.pixels[((ypos + row) * name_map.width) + xpos];
+			    memset(pixels, fg_color, 4);
+			    memset(&pixels[4], table.backdrop_color, 2);
+			}
+
+			redrawn_tiles += 1;
+		    }
+
+		    continue;
+		}
+
+		uint32_t name_addr = (name_base + (tile_row * num_cols) + tile_col);
+		uint16_t name_word = fetch_vram(name_addr);
+
+		if (is_bank_split())
+		{
+		    name_word += ((tile_row >> 3) << 8);
+		}
+
+		uint32_t pattern_addr = (pattern_base + ((name_word & pattern_mask) << 3));
+		uint32_t color_addr = is_graphics2() ? (color_base + ((name_word & color_mask) << 3)) : (color_base + (name_word >> 3));
+		bool is_changed = (is_full || is_byte_dirty(name_addr) || is_block_dirty(pattern_addr));
+
+		if (!is_text() && !is_multicolor())
+		{
+		    is_changed |= is_graphics2() ? is_block_dirty(color_addr) : is_byte_dirty(color_addr);
+		}
+
+		if (!is_changed)
+		{
+		    continue;
+		}
+
+		if (is_multicolor())
+		{
+		    draw_multicolor(name_map, xpos, ypos, pattern_addr, (tile_row << 1));
+		}
+		else
+		{
+		    draw_pattern(name_map, xpos, ypos, tile_width, pattern_addr, color_addr);
+		}
+
+		redrawn_tiles += 1;
+	    }
+	}
+    }
+
+    // Every entry of the color table, 32 per row
+    // (Note: only the graphics modes have a color table)
+    void BeeVDPDebugViews::update_color_swatches(bool is_full)
+    {
+	int num_entries = 0;
+
+	if (is_graphics2())
+	{
+	    num_entries = 768;
+	}
+	else if (table.mode_val == 0)
+	{
+	    num_entries = 32;
+	}
+
+	uint32_t color_base = is_graphics2() ? ((table.color_table & 0x80) << 6) : (table.color_table << 6);
+	color_swatches.width = 256;
+	color_swatches.height = (((num_entries + 31) / 32) * 8);
+
+	for (int entry = 0; entry < num_entries; entry++)
+	{
+	    uint32_t color_addr = is_graphics2() ? (color_base + (entry << 3)) : (color_base + entry);
+	    bool is_changed = is_full || (is_graphics2() ? is_block_dirty(color_addr) : is_byte_dirty(color_addr));
+
+	    if (!is_changed)
+	    {
+		continue;
+	    }
+
+	    draw_swatch(color_swatches, ((entry & 0x1F) << 3), ((entry >> 5) << 3), color_addr, is_graphics2() ? 1 : 0);
+	    redrawn_tiles += 1;
+	}
+    }
+
+    // Flag every byte of a table in the VRAM map
+    void BeeVDPDebugViews::mark_table(uint32_t addr, uint32_t length, uint8_t flag)
+    {
+	for (uint32_t offs = 0; offs < length; offs++)
+	{
+	    vram_map.pixels[((addr + offs) & table.vram_mask)] |= flag;
+	}
+    }
+
+    // Which table(s) each byte of VRAM belongs to,
+    // along with the bytes written since the previous update
+    void BeeVDPDebugViews::update_vram_map(bool is_full)
+    {
+	vram_map.width = 128;
+	vram_map.height = ((table.vram_mask + 1) / 128);
+
+	if (is_full)
+	{
+	    fill(vram_map.pixels.begin(), vram_map.pixels.end(), 0);
+	    mark_table((table.pattern_name << 10), (is_text() ? 960 : 768), UsageName);
+
+	    if (is_bank_split())
+	    {
+		uint32_t pattern_base = ((table.pattern_gen & 0x4) << 11);
+		uint16_t pattern_mask = (((table.pattern_gen & 0x3) << 8) | 0xFF);
+		uint32_t color_base = ((table.color_table & 0x80) << 6);
+		uint16_t color_mask = (((table.color_table & 0x7F) << 3) | 0x7);
+
+		// Only the patterns and colors the masks let through are ever fetched
+		for (int pattern = 0; pattern < 768; pattern++)
+		{
+		    mark_table((pattern_base + ((pattern & pattern_mask) << 3)), 8, UsagePattern);
+
+		    if (is_graphics2())
+		    {
+			mark_table((color_base + ((pattern & color_mask) << 3)), 8, UsageColor);
+		    }
+		}
+	    }
+	    else
+	    {
+		mark_table((table.pattern_gen << 11), 2048, UsagePattern);
+
+		if (table.mode_val == 0)
+		{
+		    mark_table((table.color_table << 6), 32, UsageColor);
+		}
+	    }
+
+	    // Sprites are displayed in all modes apart from the text modes
+	    if (!is_text())
+	    {
+		mark_table(((table.sprite_attrib & 0x7F) << 7), 128, UsageSpriteAttrib);
+		mark_table(((table.sprite_gen & 0x7) << 11), 2048, UsageSpritePattern);
+	    }
+
+	    marked.fill(0);
+	}
+
+	// Clear the previous write marks and set the new ones
+	for (size_t word = 0; word < dirty.size(); word++)
+	{
+	    uint64_t changed_bits = (marked[word] | dirty[word]);
+
+	    for (int bit = 0; changed_bits != 0; bit++, changed_bits >>= 1)
+	    {
+		if ((changed_bits & 1) == 0)
+		{
+		    continue;
+		}
+
+		uint32_t addr = ((word << 6) + bit);
+
+		if (addr > table.vram_mask)
+		{
+		    break;
+		}
+
+		uint8_t &cell = vram_map.pixels[addr];
+		cell = ((dirty[word] >> bit) & 1) ? (cell | UsageWritten) : (cell & ~UsageWritten);
+	    }
+
+	    marked[word] = dirty[word];
+	}
+
+	is_marked = is_dirty;
+    }
+};
@@ -0,0 +1,152 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BEEVDP_DEBUG_H
+#define BEEVDP_DEBUG_H
+
+#include <array>
+#include <vector>
+#include <cstdint>
+
+namespace beevdp
+{
+    // Table layout of the VDP, as seen by the debug views
+    struct BeeVDPTableState
+    {
+	uint8_t mode_val = 0;
+	uint8_t pattern_name = 0;
+	uint8_t color_table = 0;
+	uint8_t pattern_gen = 0;
+	uint8_t sprite_attrib = 0;
+	uint8_t sprite_gen = 0;
+	uint8_t text_color = 0;
+	uint8_t backdrop_color = 0;
+	uint16_t vram_mask = 0x3FFF;
+
+	bool operator==(const BeeVDPTableState &other) const;
+	bool operator!=(const BeeVDPTableState &other) const
+	{
+	    return !(*this == other);
+	}
+    };
+
+    // Flags of each byte in the VRAM map
+    enum BeeVDPVRAMUsage : uint8_t
+    {
+	UsageName = 0x01,
+	UsagePattern = 0x02,
+	UsageColor = 0x04,
+	UsageSpriteAttrib = 0x08,
+	UsageSpritePattern = 0x10,
+	// Written since the previous update
+	UsageWritten = 0x80,
+    };
+
+    // A debug surface of 'width' x 'height' palette numbers
+    // (or BeeVDPVRAMUsage flags in the case of the VRAM map)
+    struct BeeVDPDebugView
+    {
+	int width = 0;
+	int height = 0;
+	std::vector<uint8_t> pixels;
+    };
+
+    // Debug surfaces for inspecting VRAM while the guest is running:
+    // - the pattern sheet (256 patterns, or 768 with graphics II addressing, 32 per row)
+    // - the name map (the name table drawn as a tile map)
+    // - the color swatches (foreground on the left, background on the right)
+    // - the VRAM map (one cell per byte of VRAM, 128 per row)
+    //
+    // The VDP marks every VRAM write, and each update only redraws
+    // the tiles that depend on bytes written since the previous update
+    // (unless the table layout has changed, which redraws everything)
+    class BeeVDPDebugViews
+    {
+	public:
+	    BeeVDPDebugViews();
+	    ~BeeVDPDebugViews();
+
+	    // Redraw everything on the next update
+	    // (e.g. after VRAM has been changed behind the VDP's back)
+	    void invalidate();
+
+	    // Called by the VDP on every VRAM write
+	    void markWrite(uint32_t addr)
+	    {
+		dirty[((addr >> 6) & 0xFF)] |= (1ULL << (addr & 0x3F));
+		is_dirty = true;
+	    }
+
+	    // Called by the VDP to bring the views up to date
+	    void update(const uint8_t *vram, const BeeVDPTableState &state);
+
+	    const BeeVDPDebugView &getPatternSheet() const;
+	    const BeeVDPDebugView &getNameMap() const;
+	    const BeeVDPDebugView &getColorSwatches() const;
+	    const BeeVDPDebugView &getVRAMMap() const;
+
+	    // Number of tiles redrawn by the last update
+	    int numRedrawnTiles() const;
+
+	private:
+	    BeeVDPDebugView pattern_sheet;
+	    BeeVDPDebugView name_map;
+	    BeeVDPDebugView color_swatches;
+	    BeeVDPDebugView vram_map;
+
+	    // One bit per byte of VRAM written since the previous update
+	    std::array<uint64_t, 256> dirty = {};
+	    // Writes marked in the VRAM map by the previous update
+	    std::array<uint64_t, 256> marked = {};
+	    bool is_dirty = false;
+	    bool is_marked = false;
+	    bool is_full_redraw = true;
+
+	    BeeVDPTableState last_state;
+	    const uint8_t *vram = nullptr;
+	    BeeVDPTableState table;
+	    int redrawn_tiles = 0;
+
+	    bool is_graphics2() const;
+	    bool is_text() const;
+	    bool is_multicolor() const;
+	    bool is_bank_split() const;
+
+	    uint8_t fetch_vram(uint32_t addr) const
+	    {
+		return vram[(addr & table.vram_mask)];
+	    }
+
+	    // Dirty bits of the byte at 'addr', or the 8-byte block containing it
+	    bool is_byte_dirty(uint32_t addr) const;
+	    bool is_block_dirty(uint32_t addr) const;
+
+	    void draw_pattern(BeeVDPDebugView &view, int xpos, int ypos, int width, uint32_t pattern_addr, uint32_t color_addr);
+	    void draw_multicolor(BeeVDPDebugView &view, int xpos, int ypos, uint32_t pattern_addr, int first_row);
+	    void draw_swatch(BeeVDPDebugView &view, int xpos, int ypos, uint32_t color_addr, int color_step);
+
+	    void update_pattern_sheet(bool is_full);
+	    void update_name_map(bool is_full);
+	    void update_color_swatches(bool is_full);
+	    void update_vram_map(bool is_full);
+	    void mark_table(uint32_t addr, uint32_t length, uint8_t flag);
+    };
+};
+
+#endif // BEEVDP_DEBUG_H
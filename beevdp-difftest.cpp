@@ -0,0 +1,2608 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Randomized differential tests for the BeeVDP cores
+//
+// Usage: beevdp-difftest [iterations] [seed]
+//
+// Every test feeds random VRAM, register values and port accesses
+// into the code under test, and compares what comes out against
+// a straightforward way of getting the same result (usually the
+// reference renderer, or a VDP running without the feature being tested).
+// The tests are listed in 'diff_tests' below, each with the number of
+// iterations per round, and all of them draw from the same seeded generator,
+// so a failing run can be repeated by passing the seed it printed.
+
+#include <iostream>
+#include <cstdlib>
+#include <random>
+#include <algorithm>
+#include <thread>
+#include <sstream>
+#include <string>
+#include <memory>
+#include "beevdp.h"
+#include "beevdp-batch.h"
+#include "beevdp-debug.h"
+#include "beevdp-profiler.h"
+#include "beevdp-shm.h"
+#include "beevdp-capture.h"
+#include "beevdp-sms.h"
+#include "beevdp-v9938.h"
+#include "beevdp-simd.h"
+#include "beevdp-ntsc.h"
+using namespace beevdp;
+using namespace std;
+
+// What a test reports after all of its rounds matched
+struct DiffResult
+{
+    // Number of things compared (scanlines, frames, rounds...)
+    uint64_t num_matched = 0;
+    // Extra details for the summary line (if any)
+    string details;
+};
+
+// A test runs 'num_rounds' rounds, and prints what went wrong before returning false
+using DiffTestFunc = bool (*)(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result);
+
+struct DiffTest
+{
+    const char *name;
+    DiffTestFunc run;
+    // One round for every 'iterations_per_round' iterations,
+    // but never fewer than 'min_rounds'
+    uint64_t iterations_per_round;
+    uint64_t min_rounds;
+};
+
+const char *renderer_names[NumRenderers] = {"reference", "fast"};
+
+template<typename VDP>
+void write_reg(VDP &vdp, int reg, uint8_t data)
+{
+    vdp.writeControl(data);
+    vdp.writeControl((0x80 | reg));
+}
+
+template<typename VDP>
+void write_regs(VDP &vdp, const array<uint8_t, 8> &regs)
+{
+    for (int reg = 0; reg < 8; reg++)
+    {
+	write_reg(vdp, reg, regs[reg]);
+    }
+}
+
+// Write a single VRAM byte through the data port
+template<typename VDP>
+void write_vram(VDP &vdp, uint16_t addr, uint8_t data)
+{
+    vdp.writeControl(uint8_t(addr));
+    vdp.writeControl(uint8_t(0x40 | ((addr >> 8) & 0x3F)));
+    vdp.writeData(data);
+}
+
+// Read a single VRAM byte through the data port
+template<typename VDP>
+uint8_t read_vram(VDP &vdp, uint16_t addr)
+{
+    vdp.writeControl(uint8_t(addr));
+    vdp.writeControl(uint8_t((addr >> 8) & 0x3F));
+    return vdp.readData();
+}
+
+// Pick random register values for the given mode
+array<uint8_t, 8> random_regs(mt19937_64 &rng, int mode_val, bool is_enabled)
+{
+    array<uint8_t, 8> regs;
+
+    for (auto &reg : regs)
+    {
+	reg = uint8_t(rng());
+    }
+
+    regs[0] = ((regs[0] & ~0x02) | (((mode_val >> 1) & 1) << 1));
+    regs[1] = ((regs[1] & ~0x58) | ((mode_val & 1) << 4) | ((mode_val >> 2) << 3) | (is_enabled << 6));
+    return regs;
+}
+
+// Fill VRAM with random data through the data port
+template<typename VDP>
+void random_vram(VDP &vdp, mt19937_64 &rng)
+{
+    vdp.writeControl(0x00);
+    vdp.writeControl(0x40);
+
+    for (int i = 0; i < 0x4000; i++)
+    {
+	vdp.writeData(uint8_t(rng()));
+    }
+}
+
+// Run one full frame, acknowledging each IRQ like an interrupt handler would
+// (Note: returns the number of IRQs generated)
+int run_frame(TMS9918A &vdp)
+{
+    int num_irqs = 0;
+
+    for (int line = 0; line < vdp.numScanlines(); line++)
+    {
+	vdp.chipClock();
+
+	if (vdp.isInterrupt())
+	{
+	    num_irqs += 1;
+	    vdp.readStatus();
+	}
+    }
+
+    return num_irqs;
+}
+
+bool is_same_rgb(const BeeVDPRGB &a, const BeeVDPRGB &b)
+{
+    return (a.red == b.red) && (a.green == b.green) && (a.blue == b.blue);
+}
+
+bool is_same_pixels(const BeeVDPRGB *pixels, const BeeVDPRGB *ref_pixels, size_t num_pixels)
+{
+    return equal(pixels, (pixels + num_pixels), ref_pixels, is_same_rgb);
+}
+
+// Copy the dirty regions of 'frame' (relative to frame 'prev_sequence') onto 'patched'
+// (Note: returns the number of pixels copied)
+uint64_t patch_dirty_rects(const BeeVDPFrame &frame, uint64_t prev_sequence, vector<BeeVDPRGB> &patched)
+{
+    vector<BeeVDPRect> rects;
+    frame.getDirtyRects(prev_sequence, rects);
+    uint64_t num_dirty = 0;
+
+    for (auto &rect : rects)
+    {
+	for (int ypos = rect.y; ypos < (rect.y + rect.height); ypos++)
+	{
+	    int pos = ((ypos * 256) + rect.x);
+	    copy_n(&frame.pixels[pos], rect.width, &patched[pos]);
+	    num_dirty += rect.width;
+	}
+    }
+
+    return num_dirty;
+}
+
+// Render random scanlines with every renderer, and compare them
+// against the reference renderer (along with point queries)
+// (Note: VRAM is refilled with random data every 64 rounds)
+bool test_scanlines(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    array<uint8_t, 0x4000> vram;
+
+    TMS9918A vdp;
+    vdp.setHeadless(true);
+    vdp.setVRAMBuffer(vram.data(), VRAM16K);
+    vdp.init();
+
+    array<uint8_t, 256> ref_line;
+    array<uint8_t, 256> test_line;
+    array<uint64_t, 8> mode_count = {};
+
+    for (uint64_t round = 0; round < num_rounds; round++)
+    {
+	if ((round & 63) == 0)
+	{
+	    for (size_t i = 0; i < vram.size(); i += 8)
+	    {
+		uint64_t data = rng();
+
+		for (int byte = 0; byte < 8; byte++)
+		{
+		    vram[(i + byte)] = uint8_t(data >> (byte * 8));
+		}
+	    }
+	}
+
+	// Pick a random mode and random register values
+	uint64_t rand_val = rng();
+	int mode_val = (rand_val & 0x7);
+	bool is_enabled = ((rand_val >> 3) & 0x7) != 0;
+	array<uint8_t, 8> regs = random_regs(rng, mode_val, is_enabled);
+	write_regs(vdp, regs);
+
+	int line = ((rand_val >> 8) % vdp.getHeight());
+
+	if (!vdp.renderLine(line, RendererReference, ref_line))
+	{
+	    // No reference implementation for this mode
+	    continue;
+	}
+
+	mode_count[mode_val] += 1;
+
+	// Point queries must agree with the reference renderer
+	for (int i = 0; i < 4; i++)
+	{
+	    int xpos = int(rng() & 0xFF);
+	    uint8_t color_val = vdp.peekPixel(xpos, line);
+
+	    if (color_val != ref_line[xpos])
+	    {
+		cout << "Point query mismatch at round " << round << endl;
+		cout << "Mode: " << mode_val << ", pixel: (" << xpos << "," << line << ")" << endl;
+		cout << "Expected color " << int(ref_line[xpos]) << ", got color " << int(color_val) << endl;
+		return false;
+	    }
+	}
+
+	for (int renderer = 1; renderer < NumRenderers; renderer++)
+	{
+	    if (!vdp.renderLine(line, BeeVDPRenderer(renderer), test_line))
+	    {
+		cout << "Renderer '" << renderer_names[renderer] << "' doesn't support mode " << mode_val << endl;
+		return false;
+	    }
+
+	    result.num_matched += 1;
+
+	    for (int xpos = 0; xpos < 256; xpos++)
+	    {
+		if (test_line[xpos] == ref_line[xpos])
+		{
+		    continue;
+		}
+
+		cout << "Mismatch in renderer '" << renderer_names[renderer] << "' at round " << round << endl;
+		cout << "Mode: " << mode_val << ", pixel: (" << xpos << "," << line << ")" << endl;
+		cout << "Expected color " << int(ref_line[xpos]) << ", got color " << int(test_line[xpos]) << endl;
+		cout << "Registers:";
+
+		for (int reg = 0; reg < 8; reg++)
+		{
+		    cout << " " << hex << int(regs[reg]) << dec;
+		}
+
+		cout << endl;
+		return false;
+	    }
+	}
+    }
+
+    stringstream details;
+    details << " (per mode:";
+
+    for (int mode = 0; mode < 8; mode++)
+    {
+	details << " " << mode_count[mode];
+    }
+
+    details << ")";
+    result.details = details.str();
+    return true;
+}
+
+// Compare every line of a batch of random instances against the reference renderer
+bool test_batch(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    // An odd batch size also covers the padding lanes
+    const size_t num_instances = 37;
+    TMS9918ABatch batch(num_instances);
+    vector<array<uint8_t, 8>> batch_regs(num_instances);
+    array<uint8_t, 0x4000> vram;
+
+    TMS9918A vdp;
+    vdp.setHeadless(true);
+    vdp.setVRAMBuffer(vram.data(), VRAM16K);
+    vdp.init();
+
+    array<uint8_t, 256> ref_line;
+
+    for (uint64_t round = 0; round < num_rounds; round++)
+    {
+	bool is_4k_mode_enabled = ((rng() & 1) != 0);
+	batch.set4KModeEnabled(is_4k_mode_enabled);
+	vdp.set4KModeEnabled(is_4k_mode_enabled);
+
+	for (size_t index = 0; index < num_instances; index++)
+	{
+	    for (auto &data : vram)
+	    {
+		data = uint8_t(rng());
+	    }
+
+	    uint64_t rand_val = rng();
+	    batch_regs[index] = random_regs(rng, (rand_val & 0x7), (((rand_val >> 3) & 0x7) != 0));
+	    batch.writeVRAM(index, 0, vram.data(), vram.size());
+
+	    for (int reg = 0; reg < 8; reg++)
+	    {
+		batch.writeRegister(index, reg, batch_regs[index][reg]);
+	    }
+	}
+
+	batch.runFrame();
+
+	for (size_t index = 0; index < num_instances; index++)
+	{
+	    batch.readVRAM(index, 0, vram.data(), vram.size());
+	    write_regs(vdp, batch_regs[index]);
+	    const uint8_t *obs = batch.getObservation(index);
+
+	    for (int line = 0; line < vdp.getHeight(); line++)
+	    {
+		if (!vdp.renderLine(line, RendererReference, ref_line))
+		{
+		    // No reference implementation for this mode
+		    break;
+		}
+
+		result.num_matched += 1;
+
+		for (int xpos = 0; xpos < 256; xpos++)
+		{
+		    if (obs[((line * 256) + xpos)] == ref_line[xpos])
+		    {
+			continue;
+		    }
+
+		    cout << "Mismatch in batch instance " << index << " at round " << round << endl;
+		    cout << "Pixel: (" << xpos << "," << line << ")" << endl;
+		    cout << "Expected color " << int(ref_line[xpos]) << ", got color " << int(obs[((line * 256) + xpos)]) << endl;
+		    cout << "Registers:";
+
+		    for (int reg = 0; reg < 8; reg++)
+		    {
+			cout << " " << hex << int(batch_regs[index][reg]) << dec;
+		    }
+
+		    cout << endl;
+		    return false;
+		}
+	    }
+	}
+    }
+
+    return true;
+}
+
+// Make random VRAM accesses on every scanline, and check each frame's heatmap
+// against counts kept by hand
+// (Note: the access slot budget is 7 in graphics I/II modes, 18 in multicolor mode
+// and 31 in text mode, and only applies to active display while the display is enabled)
+bool test_profiler(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    const int mode_vals[4] = {0, 1, 2, 4};
+    array<uint8_t, 0x4000> vram;
+
+    for (uint64_t round = 0; round < num_rounds; round++)
+    {
+	int block_shift = int(rng() % 9);
+	int mode_val = mode_vals[(rng() & 3)];
+	bool is_enabled = ((rng() & 3) != 0);
+	int slots = !is_enabled ? -1 : (mode_val & 1) ? 31 : (mode_val & 4) ? 18 : 7;
+
+	TMS9918A vdp;
+	vdp.setHeadless(true);
+	vdp.init();
+	random_vram(vdp, rng);
+
+	for (int addr = 0; addr < 0x4000; addr++)
+	{
+	    vram[addr] = read_vram(vdp, addr);
+	}
+
+	write_regs(vdp, random_regs(rng, mode_val, is_enabled));
+
+	BeeVDPVRAMProfiler profiler(block_shift);
+	BeeVDPHeatmap ref_map = profiler.getFrameHeatmap();
+	vdp.setVRAMProfiler(&profiler);
+
+	uint64_t frame_number = 0;
+	int num_frames = 0;
+	int line = 0;
+
+	while (num_frames < 2)
+	{
+	    uint16_t addr = uint16_t(rng() & 0x3FFF);
+	    vdp.writeControl(uint8_t(addr));
+	    vdp.writeControl(uint8_t(0x40 | (addr >> 8)));
+
+	    int num_accesses = int(rng() % 40);
+	    int line_slots = (line < vdp.getHeight()) ? slots : -1;
+
+	    for (int access = 0; access < num_accesses; access++)
+	    {
+		size_t block = (size_t(addr >> block_shift) % ref_map.numBlocks());
+
+		if (rng() & 1)
+		{
+		    uint8_t data = (rng() & 1) ? vram[addr] : uint8_t(rng());
+		    ref_map.redundant_writes[block] += (vram[addr] == data);
+		    ref_map.writes[block] += 1;
+		    vram[addr] = data;
+		    vdp.writeData(data);
+		}
+		else
+		{
+		    ref_map.reads[block] += 1;
+		    vdp.readData();
+		}
+
+		ref_map.dropped_accesses[block] += ((line_slots >= 0) && (access >= line_slots));
+		addr = ((addr + 1) & 0x3FFF);
+	    }
+
+	    vdp.chipClock();
+	    line = ((line + 1) % vdp.numScanlines());
+
+	    const BeeVDPHeatmap &map = profiler.getFrameHeatmap();
+
+	    if (map.frame_number == frame_number)
+	    {
+		continue;
+	    }
+
+	    if ((map.reads != ref_map.reads) || (map.writes != ref_map.writes) || (map.redundant_writes != ref_map.redundant_writes) || (map.dropped_accesses != ref_map.dropped_accesses))
+	    {
+		cout << "Heatmap of frame " << map.frame_number << " doesn't match in mode " << mode_val;
+		cout << " (block shift " << block_shift << ", display " << (is_enabled ? "enabled" : "disabled") << ")" << endl;
+		return false;
+	    }
+
+	    frame_number = map.frame_number;
+	    ref_map = BeeVDPVRAMProfiler(block_shift).getFrameHeatmap();
+	    num_frames += 1;
+	    result.num_matched += 1;
+	}
+
+	vdp.shutdown();
+    }
+
+    return true;
+}
+
+// Write random bytes with 4K mode enabled or not, and with either amount of VRAM,
+// and check where each one lands in VRAM
+// (Note: addresses are only masked to 4K in 4K mode, on variants that have it,
+// while the 4K/16K bit in register 1 is clear)
+template<typename Variant>
+bool test_vram_modes(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    using VDP = TMS99xxA<Variant>;
+    array<uint8_t, 0x4000> vram_16k;
+    array<uint8_t, 0x1000> vram_4k;
+    VDP vdp_16k;
+    VDP vdp_4k;
+    vdp_16k.setHeadless(true);
+    vdp_4k.setHeadless(true);
+    vdp_16k.setVRAMBuffer(vram_16k.data(), VRAM16K);
+    vdp_4k.setVRAMBuffer(vram_4k.data(), VRAM4K);
+    vdp_16k.init();
+    vdp_4k.init();
+
+    for (uint64_t round = 0; round < num_rounds; round++)
+    {
+	bool is_small = ((rng() & 3) == 0);
+	VDP &vdp = is_small ? vdp_4k : vdp_16k;
+	uint8_t *vram = is_small ? vram_4k.data() : vram_16k.data();
+
+	bool is_4k_mode_enabled = ((rng() & 1) != 0);
+	bool is_16k_bit = ((rng() & 1) != 0);
+	vdp.set4KModeEnabled(is_4k_mode_enabled);
+	write_reg(vdp, 1, (is_16k_bit ? 0x80 : 0x00));
+
+	uint16_t mask = (Variant::has_4k_mode && is_4k_mode_enabled && !is_16k_bit) ? 0x0FFF : 0x3FFF;
+	mask &= is_small ? 0x0FFF : 0x3FFF;
+
+	for (int i = 0; i < 16; i++)
+	{
+	    uint16_t addr = uint16_t(rng() & 0x3FFF);
+	    uint8_t data = uint8_t(rng());
+	    write_vram(vdp, addr, data);
+
+	    if ((vram[(addr & mask)] != data) || (read_vram(vdp, addr) != data))
+	    {
+		cout << "VRAM write to " << hex << addr << dec << " landed in the wrong place";
+		cout << " (4K mode " << (is_4k_mode_enabled ? "enabled" : "disabled") << ", R1 = " << (is_16k_bit ? "0x80" : "0x00") << ")" << endl;
+		return false;
+	    }
+
+	    result.num_matched += 1;
+	}
+    }
+
+    vdp_16k.shutdown();
+    vdp_4k.shutdown();
+    return true;
+}
+
+// Run random frames on the given variant, and check that its frame IRQs come
+// 'num_scanlines' scanlines apart, and that each published frame matches
+// the variant's palette colors for the palette numbers peekPixel() returns
+template<typename Variant>
+bool test_variant(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    TMS99xxA<Variant> vdp;
+    vdp.init();
+    random_vram(vdp, rng);
+
+    for (uint64_t round = 0; round < num_rounds; round++)
+    {
+	// Always enable the frame IRQ
+	array<uint8_t, 8> regs = random_regs(rng, int(rng() & 7), ((rng() & 3) != 0));
+	// (Note: enabling it can raise one right away, which is cleared first)
+	regs[1] |= 0x20;
+	write_regs(vdp, regs);
+	vdp.readStatus();
+	vdp.isInterrupt();
+
+	// Sync up with the next frame IRQ...
+	int num_lines = 0;
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+	    num_lines = 0;
+
+	    do
+	    {
+		vdp.chipClock();
+		num_lines += 1;
+	    } while (!vdp.isInterrupt() && (num_lines <= Variant::num_scanlines));
+
+	    if ((vdp.readStatus() & 0x80) == 0)
+	    {
+		cout << Variant::name << " raised an IRQ without setting the VBlank flag" << endl;
+		return false;
+	    }
+	}
+
+	// ...and time the frame that follows it
+	if (num_lines != Variant::num_scanlines)
+	{
+	    cout << Variant::name << " raised its frame IRQs " << num_lines << " scanlines apart";
+	    cout << " (expected " << Variant::num_scanlines << ")" << endl;
+	    return false;
+	}
+
+	auto framebuffer = vdp.getFramebuffer();
+
+	for (int ypos = 0; ypos < vdp.getHeight(); ypos++)
+	{
+	    for (int xpos = 0; xpos < vdp.getWidth(); xpos++)
+	    {
+		const BeeVDPRGB &color = Variant::palette[vdp.peekPixel(xpos, ypos)];
+
+		if (!is_same_rgb(framebuffer[((ypos * vdp.getWidth()) + xpos)], color))
+		{
+		    cout << Variant::name << " pixel (" << xpos << "," << ypos << ") doesn't match its palette color" << endl;
+		    return false;
+		}
+	    }
+	}
+
+	result.num_matched += 1;
+    }
+
+    vdp.shutdown();
+    return true;
+}
+
+// Compare overlay compositing against a per-pixel merge of the same frame
+bool test_overlay(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    TMS9918A background;
+    TMS9918A overlay;
+    background.init();
+    overlay.init();
+
+    vector<BeeVDPRGB> external_frame((256 * 192));
+
+    for (uint64_t round = 0; round < num_rounds; round++)
+    {
+	random_vram(background, rng);
+	random_vram(overlay, rng);
+
+	array<uint8_t, 8> background_regs = random_regs(rng, (rng() & 7), true);
+	// (Note: every mode is overlaid with both renderers, on both kinds of external video,
+	// every 32 rounds)
+	array<uint8_t, 8> overlay_regs = random_regs(rng, int((round >> 2) & 7), ((rng() & 7) != 0));
+	overlay_regs[0] |= 0x01;
+
+	// Color 0 is drawn with the backdrop color,
+	// so the external video mostly shows through a transparent backdrop
+	if ((rng() & 3) != 0)
+	{
+	    overlay_regs[7] &= 0xF0;
+	}
+
+	write_regs(background, background_regs);
+	write_regs(overlay, overlay_regs);
+
+	// Both renderers flag the transparent pixels as they draw them
+	overlay.setRenderer(((round & 2) != 0) ? RendererReference : RendererFast);
+
+	// Alternate between stacking on another VDP and a caller-provided frame
+	bool is_stacked = ((round & 1) == 0);
+
+	if (is_stacked)
+	{
+	    overlay.setExternalVideo([&background](int line)
+	    {
+		return background.getScanline(line);
+	    });
+	}
+	else
+	{
+	    for (auto &pixel : external_frame)
+	    {
+		uint64_t rand_val = rng();
+		pixel = {uint8_t(rand_val), uint8_t(rand_val >> 8), uint8_t(rand_val >> 16)};
+	    }
+
+	    overlay.setExternalVideo(external_frame.data());
+	}
+
+	// Render one whole frame with the background VDP a scanline ahead
+	for (int line = 0; line < overlay.numScanlines(); line++)
+	{
+	    background.chipClock();
+	    overlay.chipClock();
+	}
+
+	const BeeVDPFrame *background_frame = background.acquireFrame();
+	const BeeVDPFrame *overlay_frame = overlay.acquireFrame();
+	const BeeVDPRGB *source = is_stacked ? background_frame->pixels.data() : external_frame.data();
+
+	for (int pos = 0; pos < (256 * 192); pos++)
+	{
+	    uint8_t color = overlay_frame->indices[pos];
+	    BeeVDPRGB expected = (color == 0) ? source[pos] : tms99xx_palette[color];
+	    result.num_matched += 1;
+
+	    if (is_same_rgb(overlay_frame->pixels[pos], expected))
+	    {
+		continue;
+	    }
+
+	    cout << "Overlay mismatch at round " << round << (is_stacked ? " (stacked VDP)" : " (external frame)") << endl;
+	    cout << "Pixel: (" << (pos % 256) << "," << (pos / 256) << "), color " << int(color) << endl;
+	    return false;
+	}
+    }
+
+    overlay.shutdown();
+    background.shutdown();
+    return true;
+}
+
+// Compare two debug views pixel by pixel
+bool is_same_view(const BeeVDPDebugView &view, const BeeVDPDebugView &ref_view)
+{
+    if ((view.width != ref_view.width) || (view.height != ref_view.height))
+    {
+	return false;
+    }
+
+    size_t num_pixels = (view.width * view.height);
+    return equal(view.pixels.begin(), (view.pixels.begin() + num_pixels), ref_view.pixels.begin());
+}
+
+// Compare incrementally updated debug views against views drawn from scratch
+bool test_debug_views(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    array<uint8_t, 0x4000> vram;
+
+    // Both VDPs share the same VRAM, and only the first one is written to
+    TMS9918A vdp;
+    TMS9918A ref_vdp;
+
+    for (auto *core : {&vdp, &ref_vdp})
+    {
+	core->setHeadless(true);
+	core->setVRAMBuffer(vram.data(), VRAM16K);
+	core->init();
+    }
+
+    BeeVDPDebugViews views;
+    vdp.setDebugViews(&views);
+    uint64_t redrawn_tiles = 0;
+
+    for (uint64_t round = 0; round < num_rounds; round++)
+    {
+	// Change the table layout every few rounds
+	if ((round & 7) == 0)
+	{
+	    array<uint8_t, 8> regs = random_regs(rng, (rng() & 0x7), true);
+	    write_regs(vdp, regs);
+	    write_regs(ref_vdp, regs);
+	}
+
+	// Write a few random bursts of data
+	int num_bursts = (rng() % 8);
+
+	for (int burst = 0; burst < num_bursts; burst++)
+	{
+	    uint16_t addr = (rng() & 0x3FFF);
+	    int length = (rng() % 16);
+	    vdp.writeControl(addr & 0xFF);
+	    vdp.writeControl(((addr >> 8) & 0x3F) | 0x40);
+
+	    for (int i = 0; i < length; i++)
+	    {
+		vdp.writeData(uint8_t(rng()));
+	    }
+	}
+
+	vdp.updateDebugViews();
+	redrawn_tiles += views.numRedrawnTiles();
+
+	BeeVDPDebugViews ref_views;
+	ref_vdp.setDebugViews(&ref_views);
+	ref_vdp.updateDebugViews();
+	ref_vdp.setDebugViews(nullptr);
+
+	const char *names[4] = {"pattern sheet", "name map", "color swatches", "VRAM map"};
+	const BeeVDPDebugView *test_list[4] = {&views.getPatternSheet(), &views.getNameMap(), &views.getColorSwatches(), &views.getVRAMMap()};
+	const BeeVDPDebugView *ref_list[4] = {&ref_views.getPatternSheet(), &ref_views.getNameMap(), &ref_views.getColorSwatches(), &ref_views.getVRAMMap()};
+
+	for (int view = 0; view < 4; view++)
+	{
+	    // The reference VRAM map has no write marks
+	    BeeVDPDebugView test_view = *test_list[view];
+
+	    if (view == 3)
+	    {
+		for (auto &cell : test_view.pixels)
+		{
+		    cell &= ~UsageWritten;
+		}
+	    }
+
+	    if (!is_same_view(test_view, *ref_list[view]))
+	    {
+		cout << "Debug view mismatch in the " << names[view] << " at round " << round << endl;
+		return false;
+	    }
+	}
+
+	result.num_matched += 1;
+    }
+
+    vdp.shutdown();
+    ref_vdp.shutdown();
+    result.details = (" (" + to_string(redrawn_tiles) + " tiles redrawn)");
+    return true;
+}
+
+// Run frames with line and VBlank callbacks attached, and check that:
+// - each rendered frame hands over scanlines 0 to 191 in order, each one
+// while the VDP is clocked on that scanline, with the pixels peekPixel() expects
+// - skipped frames don't hand over any scanlines
+// - the VBlank callback comes once per frame, on the VBlank line,
+// after all of the frame's scanlines, and after the frame was published
+bool test_callbacks(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    TMS9918A vdp;
+    vdp.init();
+    random_vram(vdp, rng);
+
+    int clock_line = 0;
+    int next_line = 0;
+    uint64_t frame_number = 0;
+    uint64_t last_sequence = 0;
+    bool is_rendered = true;
+    string error;
+
+    vdp.setLineCallback([&](int line, const BeeVDPRGB *pixels)
+    {
+	if (!error.empty())
+	{
+	    return;
+	}
+
+	if (!is_rendered || (line != next_line) || (line != clock_line))
+	{
+	    error = ("Scanline " + to_string(line) + " handed over on scanline " + to_string(clock_line));
+	    return;
+	}
+
+	for (int xpos = 0; xpos < vdp.getWidth(); xpos++)
+	{
+	    if (!is_same_rgb(pixels[xpos], tms99xx_palette[vdp.peekPixel(xpos, line)]))
+	    {
+		error = ("Scanline " + to_string(line) + " handed over with the wrong pixels");
+		return;
+	    }
+	}
+
+	next_line += 1;
+    });
+
+    vdp.setVBlankCallback([&](uint64_t number)
+    {
+	if (!error.empty())
+	{
+	    return;
+	}
+
+	const BeeVDPFrame *frame = vdp.acquireFrame();
+	int expected_lines = is_rendered ? vdp.getHeight() : 0;
+
+	if ((clock_line != TMS9918AVariant::vblank_line) || (next_line != expected_lines) || ((frame_number != 0) && (number != (frame_number + 1))))
+	{
+	    error = ("VBlank of frame " + to_string(number) + " came on scanline " + to_string(clock_line));
+	    error += (" after " + to_string(next_line) + " scanlines");
+	}
+	else if (is_rendered && ((frame == nullptr) || (frame->sequence != (last_sequence + 1))))
+	{
+	    error = ("Frame " + to_string(number) + " wasn't published before its VBlank");
+	}
+	else if (!is_rendered && (frame != nullptr) && (frame->sequence != last_sequence))
+	{
+	    error = ("Skipped frame " + to_string(number) + " was published");
+	}
+
+	frame_number = number;
+	last_sequence = (frame != nullptr) ? frame->sequence : 0;
+    });
+
+    for (uint64_t round = 0; round < num_rounds; round++)
+    {
+	// The render interval only changes at the end of a frame,
+	// so frames are skipped as of the next one
+	array<uint8_t, 8> regs = random_regs(rng, (rng() & 7), ((rng() & 3) != 0));
+	write_regs(vdp, regs);
+	int interval = int(rng() % 3);
+	vdp.setRenderInterval(interval);
+
+	for (int line = 0; line < vdp.numScanlines(); line++)
+	{
+	    clock_line = line;
+
+	    if (line == 0)
+	    {
+		next_line = 0;
+	    }
+
+	    vdp.chipClock();
+
+	    if (line == TMS9918AVariant::vblank_line)
+	    {
+		is_rendered = (interval != 0) && ((frame_number % interval) == 0);
+	    }
+	}
+
+	if (!error.empty())
+	{
+	    cout << error << " (round " << round << ")" << endl;
+	    return false;
+	}
+
+	result.num_matched += 1;
+    }
+
+    vdp.setLineCallback(nullptr);
+    vdp.setVBlankCallback(nullptr);
+    vdp.shutdown();
+    return true;
+}
+
+// Change the render interval at a random scanline of each frame, and check
+// that every frame that gets published matches a VDP rendering all frames
+// (Note: VRAM changes between frames, so a frame that was only
+// partially rendered would still show parts of an older frame)
+bool test_render_interval(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    TMS9918A vdp;
+    TMS9918A ref_vdp;
+    vdp.init();
+    ref_vdp.init();
+
+    mt19937_64 vram_rng = rng;
+    random_vram(vdp, rng);
+    random_vram(ref_vdp, vram_rng);
+
+    array<uint8_t, 8> regs = random_regs(rng, (rng() & 7), true);
+    write_regs(vdp, regs);
+    write_regs(ref_vdp, regs);
+
+    uint64_t last_sequence = 0;
+    uint64_t num_skipped = 0;
+
+    for (uint64_t round = 0; round < num_rounds; round++)
+    {
+	int split_line = int(rng() % vdp.numScanlines());
+
+	for (int line = 0; line < vdp.numScanlines(); line++)
+	{
+	    if (line == split_line)
+	    {
+		vdp.setRenderInterval(int(rng() % 4));
+	    }
+
+	    vdp.chipClock();
+	    ref_vdp.chipClock();
+	}
+
+	const BeeVDPFrame *frame = vdp.acquireFrame();
+	const BeeVDPFrame *ref_frame = ref_vdp.acquireFrame();
+
+	if ((frame == nullptr) || (frame->sequence == last_sequence))
+	{
+	    num_skipped += 1;
+	}
+	else if (!is_same_pixels(frame->pixels.data(), ref_frame->pixels.data(), frame->pixels.size()))
+	{
+	    cout << "Frame " << frame->sequence << " was published without being rendered in full";
+	    cout << " (render interval changed on scanline " << split_line << ")" << endl;
+	    return false;
+	}
+	else
+	{
+	    last_sequence = frame->sequence;
+	    result.num_matched += 1;
+	}
+
+	// Change some VRAM before the next frame
+	for (int i = 0; i < 64; i++)
+	{
+	    uint16_t addr = uint16_t(rng() & 0x3FFF);
+	    uint8_t data = uint8_t(rng());
+	    write_vram(vdp, addr, data);
+	    write_vram(ref_vdp, addr, data);
+	}
+    }
+
+    vdp.shutdown();
+    ref_vdp.shutdown();
+    result.details = (" (" + to_string(num_skipped) + " frames skipped)");
+    return true;
+}
+
+// Publish frames from one thread while another one acquires them,
+// and check that the presenter only ever sees whole frames, in order
+// (Note: every pixel of a frame is stamped with its sequence number),
+// then check that getFramebuffer() never takes frames away from the presenter
+bool test_triple_buffer(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    auto ring = make_unique<BeeVDPFrameRing>();
+    ring->clear();
+
+    atomic<bool> is_done = false;
+    uint64_t num_acquired = 0;
+    uint64_t num_torn = 0;
+    uint64_t num_reordered = 0;
+
+    thread presenter([&]()
+    {
+	uint64_t last_sequence = 0;
+
+	while (!is_done.load())
+	{
+	    const BeeVDPFrame *frame = ring->acquire();
+
+	    if ((frame == nullptr) || (frame->sequence == last_sequence))
+	    {
+		this_thread::yield();
+		continue;
+	    }
+
+	    if (frame->sequence < last_sequence)
+	    {
+		num_reordered += 1;
+	    }
+
+	    uint8_t stamp = uint8_t(frame->sequence);
+	    bool is_whole = all_of(frame->indices.begin(), frame->indices.end(), [stamp](uint8_t data) { return (data == stamp); });
+	    is_whole &= all_of(frame->pixels.begin(), frame->pixels.end(), [stamp](const BeeVDPRGB &pixel) { return (pixel.red == stamp); });
+
+	    if (!is_whole)
+	    {
+		num_torn += 1;
+	    }
+
+	    last_sequence = frame->sequence;
+	    num_acquired += 1;
+	}
+    });
+
+    for (uint64_t sequence = 1; sequence <= num_rounds; sequence++)
+    {
+	BeeVDPFrame &frame = ring->backFrame();
+	frame.indices.fill(uint8_t(sequence));
+	frame.pixels.fill({uint8_t(sequence), 0, 0});
+	frame.sequence = sequence;
+	ring->publish();
+    }
+
+    is_done.store(true);
+    presenter.join();
+
+    if ((num_torn != 0) || (num_reordered != 0))
+    {
+	cout << num_torn << " torn and " << num_reordered << " reordered frames out of " << num_acquired << endl;
+	return false;
+    }
+
+    // The final frame is still waiting for the presenter
+    const BeeVDPFrame *last = ring->acquire();
+
+    if ((last == nullptr) || (last->sequence != num_rounds))
+    {
+	cout << "The last published frame was lost" << endl;
+	return false;
+    }
+
+    TMS9918A vdp;
+    TMS9918A ref_vdp;
+    vdp.init();
+    ref_vdp.init();
+
+    mt19937_64 vram_rng = rng;
+    random_vram(vdp, rng);
+    random_vram(ref_vdp, vram_rng);
+
+    array<uint8_t, 8> regs = random_regs(rng, (rng() & 7), true);
+    write_regs(vdp, regs);
+    write_regs(ref_vdp, regs);
+    run_frame(ref_vdp);
+
+    // Before the first frame is published, the frame being drawn is returned
+    for (int line = 0; line < 100; line++)
+    {
+	vdp.chipClock();
+    }
+
+    array<BeeVDPRGB, (256 * 192)> pixels = vdp.getFramebuffer();
+
+    if (!is_same_pixels(pixels.data(), ref_vdp.acquireFrame()->pixels.data(), (256 * 100)))
+    {
+	cout << "The frame being drawn didn't match before the first frame" << endl;
+	return false;
+    }
+
+    for (int frame = 0; frame < 4; frame++)
+    {
+	run_frame(vdp);
+	pixels = vdp.getFramebuffer();
+	const BeeVDPFrame *current = vdp.acquireFrame();
+
+	if ((current == nullptr) || (current->sequence != uint64_t(frame + 1)))
+	{
+	    cout << "getFramebuffer() took frame " << (frame + 1) << " away from the presenter" << endl;
+	    return false;
+	}
+
+	if (!is_same_pixels(pixels.data(), current->pixels.data(), pixels.size()))
+	{
+	    cout << "getFramebuffer() didn't return the last published frame" << endl;
+	    return false;
+	}
+    }
+
+    vdp.shutdown();
+    ref_vdp.shutdown();
+    result.num_matched = num_acquired;
+    return true;
+}
+
+// Take snapshots from another thread while the VDP is being rewritten
+// (Note: every rewrite fills all of VRAM and register 7 with the same value,
+// so a consistent snapshot has a single value throughout)
+bool test_snapshots(mt19937_64 &, uint64_t num_rounds, DiffResult &result)
+{
+    TMS9918A vdp;
+    vdp.setHeadless(true);
+    vdp.setSnapshotsEnabled(true);
+    vdp.init();
+
+    atomic<bool> is_done = false;
+    uint64_t num_snapshots = 0;
+    uint64_t num_inconsistent = 0;
+
+    thread observer([&]()
+    {
+	uint64_t last_sequence = 0;
+
+	while (!is_done.load())
+	{
+	    vdp.requestSnapshot();
+	    const BeeVDPSnapshot *snapshot = vdp.acquireSnapshot();
+
+	    if ((snapshot == nullptr) || (snapshot->sequence == last_sequence))
+	    {
+		this_thread::yield();
+		continue;
+	    }
+
+	    last_sequence = snapshot->sequence;
+	    num_snapshots += 1;
+	    uint8_t value = snapshot->regs[7];
+
+	    if (!all_of(snapshot->vram.begin(), (snapshot->vram.begin() + snapshot->vram_size), [value](uint8_t data) { return (data == value); }))
+	    {
+		num_inconsistent += 1;
+	    }
+	}
+    });
+
+    for (uint64_t rewrite = 0; rewrite < num_rounds; rewrite++)
+    {
+	uint8_t value = uint8_t(rewrite);
+	vdp.writeControl(0x00);
+	vdp.writeControl(0x40);
+
+	for (int i = 0; i < 0x4000; i++)
+	{
+	    vdp.writeData(value);
+	}
+
+	write_reg(vdp, 7, value);
+	vdp.chipClock();
+    }
+
+    is_done.store(true);
+    observer.join();
+    vdp.shutdown();
+
+    if (num_inconsistent != 0)
+    {
+	cout << num_inconsistent << " of " << num_snapshots << " snapshots were inconsistent" << endl;
+	return false;
+    }
+
+    result.num_matched = num_snapshots;
+    return true;
+}
+
+// Render into a shared frame ring, and read the frames back
+// through a second mapping (as a presenter in another process would)
+bool test_shared_frames(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    BeeVDPSharedFrames producer;
+
+    if (!producer.create())
+    {
+	result.details = " (skipped, not supported on this platform)";
+	return true;
+    }
+
+    BeeVDPSharedFrames consumer;
+
+    if (!consumer.openFd(producer.getFd()))
+    {
+	cout << "Could not map the shared frames" << endl;
+	return false;
+    }
+
+    // (Note: the shared ring has to stay attached
+    // while the other storage options are changed)
+    TMS9918A vdp;
+    TMS9918A ref_vdp;
+    vdp.setFrameRing(producer.getRing());
+    vdp.setSnapshotsEnabled((rng() & 1) != 0);
+    vdp.setVRAMSize(VRAM16K);
+    vdp.setMemoryResource(pmr::get_default_resource());
+    vdp.init();
+    ref_vdp.init();
+
+    const BeeVDPSharedHeader *header = consumer.getHeader();
+    const uint8_t *base = reinterpret_cast<const uint8_t*>(header);
+
+    for (uint64_t frame = 0; frame < num_rounds; frame++)
+    {
+	mt19937_64 vram_rng = rng;
+	random_vram(vdp, rng);
+	random_vram(ref_vdp, vram_rng);
+
+	array<uint8_t, 8> regs = random_regs(rng, (rng() & 7), true);
+	write_regs(vdp, regs);
+	write_regs(ref_vdp, regs);
+
+	for (int line = 0; line < vdp.numScanlines(); line++)
+	{
+	    vdp.chipClock();
+	    ref_vdp.chipClock();
+	}
+
+	const BeeVDPFrame *shared_frame = consumer.acquireFrame();
+	const BeeVDPFrame *ref_frame = ref_vdp.acquireFrame();
+
+	if (shared_frame == nullptr)
+	{
+	    cout << "No frames reached the shared ring" << endl;
+	    return false;
+	}
+
+	// The header alone must be enough to find the frame
+	const uint8_t *frame_data = reinterpret_cast<const uint8_t*>(shared_frame);
+	ptrdiff_t frame_offset = (frame_data - (base + header->frames_offset));
+	bool is_layout_valid = (frame_offset >= 0) && ((frame_offset % header->frame_size) == 0) && ((frame_offset / header->frame_size) < 3);
+	is_layout_valid = is_layout_valid && (*reinterpret_cast<const uint64_t*>(frame_data + header->sequence_offset) == shared_frame->sequence);
+	is_layout_valid = is_layout_valid && ((frame_data + header->pixels_offset) == reinterpret_cast<const uint8_t*>(shared_frame->pixels.data()));
+
+	if (!is_layout_valid)
+	{
+	    cout << "Shared frame layout mismatch at frame " << frame << endl;
+	    return false;
+	}
+
+	bool is_same = (shared_frame->sequence == ref_frame->sequence) && (shared_frame->indices == ref_frame->indices);
+	is_same = is_same && is_same_pixels(shared_frame->pixels.data(), ref_frame->pixels.data(), shared_frame->pixels.size());
+
+	if (!is_same)
+	{
+	    cout << "Shared frame mismatch at frame " << frame << endl;
+	    return false;
+	}
+
+	result.num_matched += 1;
+    }
+
+    vdp.shutdown();
+    ref_vdp.shutdown();
+    return true;
+}
+
+// Patch the dirty regions of every frame onto the previous frame,
+// after a few random VRAM writes (or none at all)
+bool test_dirty_rects(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    TMS9918A vdp;
+    vdp.init();
+    random_vram(vdp, rng);
+    write_regs(vdp, random_regs(rng, (rng() & 7), true));
+
+    vector<BeeVDPRGB> patched((256 * 192));
+    vector<BeeVDPRect> rects;
+    uint64_t prev_sequence = 0;
+    uint64_t num_dirty = 0;
+
+    for (uint64_t frame = 0; frame < num_rounds; frame++)
+    {
+	int num_writes = ((rng() & 3) == 0) ? 0 : int(rng() % 16);
+
+	for (int i = 0; i < num_writes; i++)
+	{
+	    write_vram(vdp, (rng() & 0x3FFF), uint8_t(rng()));
+	}
+
+	run_frame(vdp);
+
+	const BeeVDPFrame *current = vdp.acquireFrame();
+	num_dirty += patch_dirty_rects(*current, prev_sequence, patched);
+	current->getDirtyRects(prev_sequence, rects);
+
+	bool is_same = is_same_pixels(patched.data(), current->pixels.data(), patched.size());
+
+	if (!is_same || ((num_writes == 0) && (prev_sequence != 0) && !rects.empty()))
+	{
+	    cout << "Dirty region mismatch at frame " << frame << " (" << num_writes << " VRAM writes)" << endl;
+	    return false;
+	}
+
+	prev_sequence = current->sequence;
+	result.num_matched += 1;
+    }
+
+    vdp.shutdown();
+    result.details = (" (" + to_string(num_dirty) + " dirty pixels patched)");
+    return true;
+}
+
+// Record frames with a few random VRAM writes in between,
+// and check that every frame decodes back exactly
+bool test_capture(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    TMS9918A vdp;
+    vdp.init();
+    random_vram(vdp, rng);
+    write_regs(vdp, random_regs(rng, (rng() & 7), true));
+
+    stringstream stream;
+    BeeVDPCaptureWriter writer;
+    writer.open(stream, int((rng() % 16) + 1));
+
+    vector<array<uint8_t, (256 * 192)>> recorded;
+    vector<uint64_t> sequences;
+
+    for (uint64_t frame = 0; frame < num_rounds; frame++)
+    {
+	int num_writes = int(rng() % 64);
+
+	for (int i = 0; i < num_writes; i++)
+	{
+	    write_vram(vdp, (rng() & 0x3FFF), uint8_t(rng()));
+	}
+
+	run_frame(vdp);
+	const BeeVDPFrame *current = vdp.acquireFrame();
+
+	if (!writer.writeFrame(*current))
+	{
+	    cout << "Could not record frame " << frame << endl;
+	    return false;
+	}
+
+	recorded.push_back(current->indices);
+	sequences.push_back(current->sequence);
+    }
+
+    writer.close();
+    vdp.shutdown();
+
+    uint64_t capture_size = stream.str().size();
+    BeeVDPCaptureReader reader;
+
+    if (!reader.open(stream))
+    {
+	cout << "Could not open the capture" << endl;
+	return false;
+    }
+
+    for (uint64_t frame = 0; frame < num_rounds; frame++)
+    {
+	BeeVDPFrame decoded;
+
+	if (!reader.readFrame(decoded) || (decoded.sequence != sequences[frame]) || (decoded.indices != recorded[frame]))
+	{
+	    cout << "Capture mismatch at frame " << frame << " (in order)" << endl;
+	    return false;
+	}
+
+	result.num_matched += 1;
+    }
+
+    BeeVDPFrame extra;
+
+    if (reader.readFrame(extra))
+    {
+	cout << "Capture has more frames than were recorded" << endl;
+	return false;
+    }
+
+    // Fresh readers find keyframes by skipping ahead,
+    // while this one already knows where they are
+    for (int seek = 0; seek < 32; seek++)
+    {
+	uint64_t frame = (rng() % num_rounds);
+	BeeVDPCaptureReader fresh_reader;
+	stream.clear();
+	stream.seekg(0);
+	fresh_reader.open(stream);
+
+	BeeVDPCaptureReader &seek_reader = ((seek & 1) != 0) ? fresh_reader : reader;
+
+	if (!seek_reader.seekFrame(frame))
+	{
+	    cout << "Could not seek to frame " << frame << endl;
+	    return false;
+	}
+
+	BeeVDPFrame decoded;
+
+	if (!seek_reader.readFrame(decoded) || (decoded.indices != recorded[frame]))
+	{
+	    cout << "Capture mismatch at frame " << frame << " (after seeking)" << endl;
+	    return false;
+	}
+    }
+
+    // A failed seek must leave the reader where it was
+    uint64_t frame = (rng() % num_rounds);
+    reader.seekFrame(frame);
+
+    if (reader.seekFrame((num_rounds + 16 * 65536)))
+    {
+	cout << "Seeking past the end of the capture succeeded" << endl;
+	return false;
+    }
+
+    BeeVDPFrame after_seek;
+
+    if ((reader.getPosition() != frame) || !reader.readFrame(after_seek) || (after_seek.indices != recorded[frame]))
+    {
+	cout << "Failed seek moved the reader from frame " << frame << endl;
+	return false;
+    }
+
+    // A payload bigger than any frame can need is corrupt,
+    // even when the stream has the bytes for it
+    string corrupt = stream.str();
+    corrupt.append((256 * 192), '\0');
+    uint32_t payload_size = ((192 / 8) + (192 * 130) + 1);
+
+    for (int i = 0; i < 4; i++)
+    {
+	corrupt[(12 + 17 + i)] = char(payload_size >> (i * 8));
+    }
+
+    stringstream corrupt_stream(corrupt);
+    BeeVDPCaptureReader corrupt_reader;
+
+    if (!corrupt_reader.open(corrupt_stream) || corrupt_reader.readFrame(extra))
+    {
+	cout << "Capture with an oversized payload was not rejected" << endl;
+	return false;
+    }
+
+    result.details = (" (" + to_string(capture_size / num_rounds) + " bytes per frame)");
+    return true;
+}
+
+// Share one VRAM image between several VDPs, and check that
+// each one only ever sees its own writes
+bool test_vram_image(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    vector<uint8_t> base_vram(0x4000);
+
+    for (auto &data : base_vram)
+    {
+	data = uint8_t(rng());
+    }
+
+    BeeVDPVRAMImage image;
+
+    if (!image.create(base_vram.data(), VRAM16K))
+    {
+	cout << "Could not create the VRAM image" << endl;
+	return false;
+    }
+
+    const int num_vdps = 4;
+    array<TMS9918A, num_vdps> vdps;
+    array<TMS9918A, num_vdps> ref_vdps;
+    array<vector<uint8_t>, num_vdps> ref_vram;
+
+    for (int index = 0; index < num_vdps; index++)
+    {
+	ref_vram[index] = base_vram;
+	vdps[index].setVRAMImage(&image);
+	ref_vdps[index].setVRAMBuffer(ref_vram[index].data(), VRAM16K);
+	vdps[index].init();
+	ref_vdps[index].init();
+    }
+
+    for (uint64_t round = 0; round < num_rounds; round++)
+    {
+	array<uint8_t, 8> regs = random_regs(rng, (rng() & 7), true);
+
+	for (int index = 0; index < num_vdps; index++)
+	{
+	    TMS9918A &vdp = vdps[index];
+	    TMS9918A &ref_vdp = ref_vdps[index];
+
+	    // Each VDP only writes to some of its pages
+	    int num_writes = int(rng() % 32);
+	    uint16_t page = ((rng() & 3) << 12);
+
+	    for (int i = 0; i < num_writes; i++)
+	    {
+		uint16_t addr = (page | (rng() & 0xFFF));
+		uint8_t data = uint8_t(rng());
+		write_vram(vdp, addr, data);
+		write_vram(ref_vdp, addr, data);
+	    }
+
+	    write_regs(vdp, regs);
+	    write_regs(ref_vdp, regs);
+
+	    for (int line = 0; line < vdp.numScanlines(); line++)
+	    {
+		vdp.chipClock();
+		ref_vdp.chipClock();
+	    }
+
+	    if (vdp.acquireFrame()->indices != ref_vdp.acquireFrame()->indices)
+	    {
+		cout << "VRAM image mismatch at round " << round << " (VDP " << index << ")" << endl;
+		return false;
+	    }
+	}
+
+	result.num_matched += 1;
+    }
+
+    for (int index = 0; index < num_vdps; index++)
+    {
+	vdps[index].shutdown();
+	ref_vdps[index].shutdown();
+    }
+
+    if (!equal(base_vram.begin(), base_vram.end(), image.getData()))
+    {
+	cout << "The shared VRAM image was modified" << endl;
+	return false;
+    }
+
+    return true;
+}
+
+// Render random regions of interest, and compare them against fully rendered frames
+// (Note: the dirty regions are patched onto a copy of the previous frame,
+// which must then match the fully rendered frame inside the region,
+// and still hold the last published pixels outside it.
+// The line callback must also see every scanline of the frame, in or out of the region)
+bool test_region(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    TMS9918A vdp;
+    TMS9918A ref_vdp;
+    vdp.init();
+    ref_vdp.init();
+
+    mt19937_64 vram_rng = rng;
+    random_vram(vdp, rng);
+    random_vram(ref_vdp, vram_rng);
+
+    vector<BeeVDPRGB> line_pixels((256 * 192));
+    int next_line = 0;
+
+    vdp.setLineCallback([&](int line, const BeeVDPRGB *pixels)
+    {
+	if (line == next_line)
+	{
+	    copy_n(pixels, 256, &line_pixels[(line * 256)]);
+	}
+
+	next_line = (line == next_line) ? (line + 1) : -1;
+    });
+
+    vector<BeeVDPRGB> patched((256 * 192));
+    vector<BeeVDPRGB> expected((256 * 192));
+    vector<uint8_t> expected_indices((256 * 192));
+    uint64_t prev_sequence = 0;
+    BeeVDPRect region = {0, 0, 256, 192};
+
+    for (uint64_t frame = 0; frame < num_rounds; frame++)
+    {
+	array<uint8_t, 8> regs = random_regs(rng, (rng() & 7), ((rng() & 7) != 0));
+	regs[1] |= 0x20;
+	write_regs(vdp, regs);
+	write_regs(ref_vdp, regs);
+
+	// Keep the same region for a few frames at a time
+	// (Note: regions sticking out of the screen are clipped)
+	if ((rng() & 3) == 0)
+	{
+	    int xpos = (int(rng() % 288) - 16);
+	    int ypos = (int(rng() % 224) - 16);
+	    vdp.setRegionOfInterest({xpos, ypos, int(rng() % 257), int(rng() % 193)});
+	    region = vdp.getRegionOfInterest();
+	}
+
+	next_line = 0;
+	int num_irqs = run_frame(vdp);
+	int num_ref_irqs = run_frame(ref_vdp);
+
+	const BeeVDPFrame *current = vdp.acquireFrame();
+	const BeeVDPFrame *ref_frame = ref_vdp.acquireFrame();
+	patch_dirty_rects(*current, prev_sequence, patched);
+
+	if ((next_line != 192) || !is_same_pixels(line_pixels.data(), current->pixels.data(), line_pixels.size()))
+	{
+	    cout << "Line callback mismatch with a region of interest at frame " << frame << endl;
+	    return false;
+	}
+
+	// (Note: the first frame has nothing to keep, so it's rendered in full)
+	BeeVDPRect rendered = (frame == 0) ? BeeVDPRect{0, 0, 256, 192} : region;
+
+	for (int ypos = rendered.y; ypos < (rendered.y + rendered.height); ypos++)
+	{
+	    int pos = ((ypos * 256) + rendered.x);
+	    copy_n(&ref_frame->pixels[pos], rendered.width, &expected[pos]);
+	    copy_n(&ref_frame->indices[pos], rendered.width, &expected_indices[pos]);
+	}
+
+	for (int pos = 0; pos < (256 * 192); pos++)
+	{
+	    bool is_same = (current->indices[pos] == expected_indices[pos]);
+	    is_same &= is_same_rgb(current->pixels[pos], expected[pos]);
+	    is_same &= is_same_rgb(patched[pos], expected[pos]);
+
+	    if (!is_same)
+	    {
+		cout << "Region of interest mismatch at frame " << frame << ", pixel (" << (pos % 256) << "," << (pos / 256) << ")" << endl;
+		return false;
+	    }
+	}
+
+	if (num_irqs != num_ref_irqs)
+	{
+	    cout << "IRQ count mismatch with a region of interest at frame " << frame << endl;
+	    return false;
+	}
+
+	prev_sequence = current->sequence;
+	result.num_matched += 1;
+    }
+
+    vdp.shutdown();
+    ref_vdp.shutdown();
+    return true;
+}
+
+// Compare the kernels of every supported instruction set level against the scalar kernels
+bool test_kernels(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    BeeVDPISALevel prev_level = getISALevel();
+    BeeVDPISALevel max_level = detectISALevel();
+
+    // Leave some room past the end of each scanline, to catch stray stores
+    const int guard_size = 64;
+    vector<uint8_t> indices(256);
+    vector<uint8_t> palette(48);
+    vector<uint8_t> ref_pixels(((256 * 3) + guard_size));
+    vector<uint8_t> test_pixels(((256 * 3) + guard_size));
+    vector<uint8_t> line(256 * 3);
+    vector<uint8_t> last_line(256 * 3);
+    vector<uint8_t> blend_source(256 * 3);
+
+    // Batch fetches read up to 96 lanes of VRAM, which is only filled once,
+    // and take 9 parameter arrays and 2 flag arrays, with one entry per lane
+    const size_t max_lanes = 96;
+    vector<uint8_t> batch_vram(((0x4000 * max_lanes) + 3));
+    vector<uint32_t> fetch_params((9 * max_lanes));
+    vector<uint8_t> fetch_flags((2 * max_lanes));
+    vector<uint8_t> ref_tiles((3 * max_lanes));
+    vector<uint8_t> test_tiles((3 * max_lanes));
+
+    for (auto &data : batch_vram)
+    {
+	data = uint8_t(rng());
+    }
+
+    // Transposes are checked on a block in the middle of a larger buffer
+    vector<uint8_t> transpose_src(1024);
+    vector<uint8_t> ref_transposed(1024);
+    vector<uint8_t> test_transposed(1024);
+
+    for (int level = ISAScalar; level <= max_level; level++)
+    {
+	setISALevel(BeeVDPISALevel(level));
+	const BeeVDPKernels &kernels = getKernels();
+
+	for (uint64_t round = 0; round < num_rounds; round++)
+	{
+	    // Palette numbers above 15 must be masked by every kernel
+	    int count = ((rng() & 1) ? 256 : int(rng() % 257));
+
+	    for (auto &data : indices)
+	    {
+		data = uint8_t(rng());
+	    }
+
+	    for (auto &data : palette)
+	    {
+		data = uint8_t(rng());
+	    }
+
+	    fill(ref_pixels.begin(), ref_pixels.end(), 0xA5);
+	    fill(test_pixels.begin(), test_pixels.end(), 0xA5);
+	    simd::convert_line_scalar(ref_pixels.data(), indices.data(), palette.data(), count);
+	    kernels.convert_line(test_pixels.data(), indices.data(), palette.data(), count);
+
+	    if (test_pixels != ref_pixels)
+	    {
+		cout << "Palette conversion mismatch at level " << isaLevelName(BeeVDPISALevel(level)) << " (" << count << " pixels)" << endl;
+		return false;
+	    }
+
+	    // Change a few random bytes (or none at all) between the two scanlines
+	    for (auto &data : line)
+	    {
+		data = uint8_t(rng());
+	    }
+
+	    last_line = line;
+	    int num_changes = int(rng() % 4);
+
+	    for (int i = 0; i < num_changes; i++)
+	    {
+		last_line[(rng() % last_line.size())] ^= uint8_t((rng() % 255) + 1);
+	    }
+
+	    int first_column = int(rng() % 33);
+	    int end_column = (first_column + int(rng() % (33 - first_column)));
+	    uint32_t ref_columns = simd::diff_columns_scalar(line.data(), last_line.data(), first_column, end_column);
+	    uint32_t test_columns = kernels.diff_columns(line.data(), last_line.data(), first_column, end_column);
+
+	    if (test_columns != ref_columns)
+	    {
+		cout << "Scanline comparison mismatch at level " << isaLevelName(BeeVDPISALevel(level)) << endl;
+		return false;
+	    }
+
+	    // Blend random pixels into a copy of the scanline,
+	    // with sparse, dense, empty and full masks
+	    array<uint64_t, 4> blend_mask;
+	    int density = int(rng() % 4);
+
+	    for (auto &word : blend_mask)
+	    {
+		uint64_t bits = rng();
+		word = (density == 0) ? (bits & rng() & rng()) : (density == 1) ? (bits | rng()) : (density == 2) ? 0 : ~0ULL;
+	    }
+
+	    if ((rng() & 3) == 0)
+	    {
+		blend_mask[(rng() & 3)] = rng();
+	    }
+
+	    for (auto &data : blend_source)
+	    {
+		data = uint8_t(rng());
+	    }
+
+	    copy(line.begin(), line.end(), ref_pixels.begin());
+	    copy(line.begin(), line.end(), test_pixels.begin());
+	    simd::blend_line_scalar(ref_pixels.data(), blend_source.data(), blend_mask.data());
+	    kernels.blend_line(test_pixels.data(), blend_source.data(), blend_mask.data());
+
+	    if (test_pixels != ref_pixels)
+	    {
+		cout << "Scanline blend mismatch at level " << isaLevelName(BeeVDPISALevel(level)) << endl;
+		return false;
+	    }
+
+	    // Fetch a random tile column with random parameters
+	    // in graphics I/II or multicolor layout for every lane
+	    size_t num_lanes = (32 * ((rng() % 3) + 1));
+	    uint32_t *params = fetch_params.data();
+
+	    for (size_t lane = 0; lane < num_lanes; lane++)
+	    {
+		bool is_graphics2 = ((rng() & 1) != 0);
+		params[lane] = uint32_t(rng() & 0x3C00);
+		params[(max_lanes + lane)] = is_graphics2 ? uint32_t((rng() % 3) << 8) : 0;
+		params[((2 * max_lanes) + lane)] = uint32_t(rng() & 0x3800);
+		params[((3 * max_lanes) + lane)] = is_graphics2 ? uint32_t(rng() & 0x3FF) : 0xFF;
+		params[((4 * max_lanes) + lane)] = uint32_t(rng() & 0x3FC0);
+		params[((5 * max_lanes) + lane)] = is_graphics2 ? uint32_t(rng() & 0x3FF) : 0xFF;
+		params[((6 * max_lanes) + lane)] = is_graphics2 ? 3 : 0;
+		params[((7 * max_lanes) + lane)] = is_graphics2 ? 0 : 3;
+		params[((8 * max_lanes) + lane)] = ((rng() & 1) ? 0x3FFF : 0x0FFF);
+		fetch_flags[lane] = uint8_t((rng() & 3) == 0);
+		fetch_flags[(max_lanes + lane)] = uint8_t(rng() & 0xF);
+	    }
+
+	    int tile_col = int(rng() % 32);
+	    BeeVDPBatchFetch ref_fetch =
+	    {
+		num_lanes, batch_vram.data(),
+		&params[0], &params[max_lanes],
+		&params[(2 * max_lanes)], &params[(3 * max_lanes)],
+		&params[(4 * max_lanes)], &params[(5 * max_lanes)],
+		&params[(6 * max_lanes)], &params[(7 * max_lanes)],
+		&params[(8 * max_lanes)], &fetch_flags[0], &fetch_flags[max_lanes],
+		&ref_tiles[0], &ref_tiles[max_lanes], &ref_tiles[(2 * max_lanes)]
+	    };
+
+	    BeeVDPBatchFetch test_fetch = ref_fetch;
+	    test_fetch.tile_pattern = &test_tiles[0];
+	    test_fetch.tile_fg_color = &test_tiles[max_lanes];
+	    test_fetch.tile_bg_color = &test_tiles[(2 * max_lanes)];
+
+	    fill(ref_tiles.begin(), ref_tiles.end(), 0xA5);
+	    fill(test_tiles.begin(), test_tiles.end(), 0xA5);
+	    simd::batch_fetch_scalar(ref_fetch, tile_col);
+	    kernels.batch_fetch(test_fetch, tile_col);
+
+	    if (test_tiles != ref_tiles)
+	    {
+		cout << "Batch fetch mismatch at level " << isaLevelName(BeeVDPISALevel(level)) << " (" << num_lanes << " lanes)" << endl;
+		return false;
+	    }
+
+	    // Transpose a block between rows of random lengths,
+	    // and compare it against a plain byte loop
+	    // (Note: the scalar kernel is checked this way as well)
+	    size_t src_stride = ((rng() % 33) + 16);
+	    size_t dst_stride = ((rng() % 33) + 16);
+
+	    for (auto &data : transpose_src)
+	    {
+		data = uint8_t(rng());
+	    }
+
+	    fill(ref_transposed.begin(), ref_transposed.end(), 0xA5);
+	    fill(test_transposed.begin(), test_transposed.end(), 0xA5);
+
+	    for (size_t row = 0; row < 16; row++)
+	    {
+		for (size_t col = 0; col < 16; col++)
+		{
+		    ref_transposed[((col * dst_stride) + row + 1)] = transpose_src[((row * src_stride) + col + 1)];
+		}
+	    }
+
+	    kernels.transpose_block(&test_transposed[1], dst_stride, &transpose_src[1], src_stride);
+
+	    if (test_transposed != ref_transposed)
+	    {
+		cout << "Block transpose mismatch at level " << isaLevelName(BeeVDPISALevel(level)) << endl;
+		return false;
+	    }
+
+	    result.num_matched += 1;
+	}
+    }
+
+    setISALevel(prev_level);
+    result.details = (string(" (every level up to ") + isaLevelName(max_level) + ")");
+    return true;
+}
+
+// Run one frame of a host machine that pokes at the VDP at random
+// (Note: the same seed always runs the same frame)
+int run_host_frame(TMS9918A &vdp, uint64_t seed)
+{
+    mt19937_64 frame_rng(seed);
+    int num_irqs = 0;
+
+    for (int line = 0; line < vdp.numScanlines(); line++)
+    {
+	if ((frame_rng() & 15) == 0)
+	{
+	    uint16_t addr = uint16_t(frame_rng() & 0x3FFF);
+	    write_vram(vdp, addr, uint8_t(frame_rng()));
+	}
+
+	if ((frame_rng() & 127) == 0)
+	{
+	    write_reg(vdp, int(2 + (frame_rng() % 6)), uint8_t(frame_rng()));
+	}
+
+	if ((frame_rng() & 63) == 0)
+	{
+	    vdp.readData();
+	}
+
+	vdp.chipClock();
+
+	if (vdp.isInterrupt())
+	{
+	    num_irqs += 1;
+	    vdp.readStatus();
+	}
+    }
+
+    return num_irqs;
+}
+
+bool is_same_state(const BeeVDPState &state, const BeeVDPState &ref_state)
+{
+    bool is_same = (state.regs == ref_state.regs) && (state.vcounter == ref_state.vcounter);
+    is_same &= (state.command_word == ref_state.command_word) && (state.addr_register == ref_state.addr_register);
+    is_same &= (state.code_register == ref_state.code_register) && (state.read_buffer == ref_state.read_buffer);
+    is_same &= (state.is_second_control_write == ref_state.is_second_control_write);
+    is_same &= (state.is_vblank == ref_state.is_vblank) && (state.is_irq_pending == ref_state.is_irq_pending);
+    is_same &= (state.frame_count == ref_state.frame_count) && (state.vram_size == ref_state.vram_size);
+    return is_same && equal(state.vram.begin(), (state.vram.begin() + state.vram_size), ref_state.vram.begin());
+}
+
+// Run ahead a few frames at a time, and compare the result against a VDP
+// running the same frames normally, which then goes back with loadState()
+// (Note: the VDP running ahead must be left exactly where it was)
+bool test_run_ahead(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    TMS9918A vdp;
+    TMS9918A ref_vdp;
+    vdp.init();
+    ref_vdp.init();
+    vdp.setRenderInterval(0);
+
+    mt19937_64 vram_rng = rng;
+    random_vram(vdp, rng);
+    random_vram(ref_vdp, vram_rng);
+
+    array<uint8_t, 8> regs = random_regs(rng, (rng() & 7), true);
+    regs[1] |= 0x20;
+    write_regs(vdp, regs);
+    write_regs(ref_vdp, regs);
+
+    BeeVDPState state;
+    BeeVDPState ref_state;
+    BeeVDPState ahead_state;
+
+    for (uint64_t round = 0; round < num_rounds; round++)
+    {
+	int num_frames = int(1 + (rng() % 4));
+	vector<uint64_t> seeds(num_frames);
+
+	for (auto &seed : seeds)
+	{
+	    seed = rng();
+	}
+
+	ref_vdp.saveState(ref_state);
+
+	for (int frame = 0; frame < num_frames; frame++)
+	{
+	    run_host_frame(ref_vdp, seeds[frame]);
+	}
+
+	ref_vdp.saveState(ahead_state);
+
+	if (!ref_vdp.loadState(ref_state))
+	{
+	    cout << "Saved state was rejected at round " << round << endl;
+	    return false;
+	}
+
+	bool is_rendered = vdp.runAhead(num_frames, [&](int frame)
+	{
+	    run_host_frame(vdp, seeds[frame]);
+	});
+
+	const BeeVDPFrame *current = vdp.acquireFrame();
+	const BeeVDPFrame *ref_frame = ref_vdp.acquireFrame();
+
+	// (Note: only the frames run ahead are published)
+	if (!is_rendered || (current->sequence != (round + 1)) || (current->indices != ref_frame->indices))
+	{
+	    cout << "Run-ahead frame mismatch at round " << round << " (" << num_frames << " frames ahead)" << endl;
+	    return false;
+	}
+
+	vdp.saveState(state);
+
+	if (!is_same_state(state, ref_state))
+	{
+	    cout << "State changed by running ahead at round " << round << endl;
+	    return false;
+	}
+
+	ref_vdp.saveState(state);
+
+	if (!is_same_state(state, ref_state))
+	{
+	    cout << "State mismatch after loadState() at round " << round << endl;
+	    return false;
+	}
+
+	// Both VDPs then carry on with the real frame
+	uint64_t seed = rng();
+	int num_irqs = run_host_frame(vdp, seed);
+	int num_ref_irqs = run_host_frame(ref_vdp, seed);
+	vdp.saveState(state);
+	ref_vdp.saveState(ref_state);
+
+	if ((num_irqs != num_ref_irqs) || !is_same_state(state, ref_state))
+	{
+	    cout << "Real frame mismatch after running ahead at round " << round << endl;
+	    return false;
+	}
+
+	result.num_matched += 1;
+    }
+
+    // Running ahead from the middle of a frame is rejected
+    // (Note: the first frame rendered would be torn otherwise)
+    uint64_t sequence = vdp.acquireFrame()->sequence;
+
+    for (int line = 1; line < vdp.getHeight(); line++)
+    {
+	vdp.chipClock();
+	vdp.saveState(ref_state);
+
+	if (vdp.runAhead(int(1 + (rng() % 4))) || (vdp.acquireFrame()->sequence != sequence))
+	{
+	    cout << "Frame run ahead from scanline " << line << endl;
+	    return false;
+	}
+
+	vdp.saveState(state);
+
+	if (!is_same_state(state, ref_state))
+	{
+	    cout << "State changed by running ahead from scanline " << line << endl;
+	    return false;
+	}
+    }
+
+    // States only load into VDPs with the same amount of VRAM
+    TMS9918A small_vdp;
+    small_vdp.setVRAMSize(VRAM4K);
+    small_vdp.init();
+
+    if (small_vdp.loadState(ahead_state))
+    {
+	cout << "A 16K state was loaded into a 4K VDP" << endl;
+	return false;
+    }
+
+    vdp.shutdown();
+    ref_vdp.shutdown();
+    small_vdp.shutdown();
+    return true;
+}
+
+// Publish real frames and frames run ahead in between, with a presenter
+// that patches the dirty regions of whichever frames it happens to pick up,
+// and check that:
+// - sequence numbers go up with every frame published, and are never reused
+// - the patched copy always matches the frame it was patched from
+// - the real frames match a VDP that never runs ahead
+bool test_mixed_run_ahead(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    TMS9918A vdp;
+    TMS9918A ref_vdp;
+    vdp.init();
+    ref_vdp.init();
+
+    mt19937_64 vram_rng = rng;
+    random_vram(vdp, rng);
+    random_vram(ref_vdp, vram_rng);
+
+    array<uint8_t, 8> regs = random_regs(rng, (rng() & 7), true);
+    regs[1] |= 0x20;
+    write_regs(vdp, regs);
+    write_regs(ref_vdp, regs);
+
+    vector<BeeVDPRGB> patched((256 * 192));
+    uint64_t prev_sequence = 0;
+    uint64_t num_ahead = 0;
+
+    // Patch the latest frame onto the presenter's copy
+    auto present_frame = [&](const BeeVDPFrame *frame, uint64_t round)
+    {
+	if ((frame == nullptr) || (frame->sequence <= prev_sequence))
+	{
+	    cout << "Sequence number reused at round " << round << endl;
+	    return false;
+	}
+
+	patch_dirty_rects(*frame, prev_sequence, patched);
+	prev_sequence = frame->sequence;
+
+	if (!is_same_pixels(patched.data(), frame->pixels.data(), patched.size()))
+	{
+	    cout << "Dirty region mismatch with frames run ahead at round " << round << endl;
+	    return false;
+	}
+
+	return true;
+    };
+
+    for (uint64_t round = 0; round < num_rounds; round++)
+    {
+	uint64_t seed = rng();
+	run_host_frame(vdp, seed);
+	run_host_frame(ref_vdp, seed);
+
+	// The presenter doesn't pick up every frame
+	if ((rng() & 3) != 0)
+	{
+	    const BeeVDPFrame *current = vdp.acquireFrame();
+
+	    if (!present_frame(current, round))
+	    {
+		return false;
+	    }
+
+	    if (current->indices != ref_vdp.acquireFrame()->indices)
+	    {
+		cout << "Real frame mismatch between frames run ahead at round " << round << endl;
+		return false;
+	    }
+	}
+
+	if ((rng() & 1) != 0)
+	{
+	    int num_frames = int(1 + (rng() % 4));
+	    vector<uint64_t> seeds(num_frames);
+
+	    for (auto &frame_seed : seeds)
+	    {
+		frame_seed = rng();
+	    }
+
+	    vdp.runAhead(num_frames, [&](int frame)
+	    {
+		run_host_frame(vdp, seeds[frame]);
+	    });
+
+	    if (((rng() & 3) != 0) && !present_frame(vdp.acquireFrame(), round))
+	    {
+		return false;
+	    }
+
+	    num_ahead += 1;
+	}
+
+	result.num_matched += 1;
+    }
+
+    vdp.shutdown();
+    ref_vdp.shutdown();
+    result.details = (" (" + to_string(num_ahead) + " run ahead)");
+    return true;
+}
+
+// Set up the address register of a Sega VDP with the given code
+template<typename VDP>
+void sega_set_addr(VDP &vdp, uint16_t addr, int code)
+{
+    vdp.writeControl(uint8_t(addr));
+    vdp.writeControl(uint8_t((code << 6) | ((addr >> 8) & 0x3F)));
+}
+
+// Compare the Mode 4 renderers of a Sega VDP against each other
+// after random bursts of VRAM, CRAM and register writes,
+// along with the sprite flags raised by rendered and headless VDPs
+template<typename VDP>
+bool test_sega(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    // The reference VDP renders every frame with the reference renderer,
+    // while the headless VDP only evaluates sprites (with the fast renderer)
+    VDP vdp;
+    VDP ref_vdp;
+    ref_vdp.setRenderer(RendererReference);
+    vdp.setHeadless(true);
+    vdp.init();
+    ref_vdp.init();
+
+    array<uint8_t, 256> ref_line;
+    array<uint8_t, 256> test_line;
+
+    for (uint64_t round = 0; round < num_rounds; round++)
+    {
+	// Refill VRAM every 16 rounds, and write random bursts in between
+	// (Note: all writes go through the data port, so that the tile cache is updated)
+	bool is_refill = ((round & 15) == 0);
+	int num_writes = is_refill ? 0x4000 : int(rng() % 512);
+	uint16_t addr = is_refill ? 0 : (rng() & 0x3FFF);
+
+	for (VDP *target : {&vdp, &ref_vdp})
+	{
+	    sega_set_addr(*target, addr, 1);
+	}
+
+	for (int i = 0; i < num_writes; i++)
+	{
+	    uint8_t data = uint8_t(rng());
+	    vdp.writeData(data);
+	    ref_vdp.writeData(data);
+	}
+
+	for (VDP *target : {&vdp, &ref_vdp})
+	{
+	    sega_set_addr(*target, 0, 3);
+	}
+
+	for (int i = 0; i < 64; i++)
+	{
+	    uint8_t data = uint8_t(rng());
+	    vdp.writeData(data);
+	    ref_vdp.writeData(data);
+	}
+
+	// Pick random register values, with Mode 4 enabled
+	// and the display enabled most of the time
+	array<uint8_t, 11> regs;
+
+	for (int reg = 0; reg <= 10; reg++)
+	{
+	    uint8_t data = uint8_t(rng());
+	    regs[reg] = data;
+
+	    if (reg == 0)
+	    {
+		data |= 0x04;
+	    }
+	    else if ((reg == 1) && ((rng() & 7) != 0))
+	    {
+		data |= 0x40;
+	    }
+
+	    for (VDP *target : {&vdp, &ref_vdp})
+	    {
+		sega_set_addr(*target, ((reg << 8) | data), 2);
+	    }
+	}
+
+	// Keep most sprites on screen, so that lines often have more than 8 of them,
+	// and end the sprite list early now and then
+	for (VDP *target : {&vdp, &ref_vdp})
+	{
+	    sega_set_addr(*target, ((regs[5] & 0x7E) << 7), 1);
+	}
+
+	int list_end = ((rng() & 3) == 0) ? int(rng() % 64) : 64;
+
+	for (int sprite = 0; sprite < 64; sprite++)
+	{
+	    uint8_t ypos = (sprite == list_end) ? 0xD0 : uint8_t(rng() % 0xC0);
+	    vdp.writeData(ypos);
+	    ref_vdp.writeData(ypos);
+	}
+
+	for (int i = 0; i < 8; i++)
+	{
+	    int line = int(rng() % 192);
+	    ref_vdp.renderLine(line, RendererReference, ref_line);
+	    vdp.renderLine(line, RendererFast, test_line);
+
+	    if (test_line != ref_line)
+	    {
+		cout << "Mode 4 mismatch at round " << round << " (line " << line << ")" << endl;
+		return false;
+	    }
+
+	    result.num_matched += 1;
+	}
+
+	// Run a full frame on both VDPs, and check that both raised the same sprite flags
+	for (int line = 0; line < vdp.numScanlines(); line++)
+	{
+	    vdp.chipClock();
+	    ref_vdp.chipClock();
+	}
+
+	if (vdp.readStatus() != ref_vdp.readStatus())
+	{
+	    cout << "Status mismatch at round " << round << endl;
+	    return false;
+	}
+    }
+
+    vdp.shutdown();
+    ref_vdp.shutdown();
+    return true;
+}
+
+// Filter random frames with a pool of worker threads, and compare
+// the result against the same frames filtered on the calling thread alone
+// (Note: each pool filters several frames, with a random number of rows each time)
+bool test_ntsc(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    BeeVDPNTSCFilter ref_filter;
+    vector<uint8_t> indices((BeeVDPNTSCFilter::input_width * 192));
+    vector<BeeVDPRGB> pixels((BeeVDPNTSCFilter::output_width * 192));
+    vector<BeeVDPRGB> ref_pixels(pixels.size());
+
+    for (uint64_t round = 0; round < num_rounds; round++)
+    {
+	BeeVDPNTSCFilter filter(BeeVDPNTSCSetup(), tms99xx_palette, int(2 + (rng() % 7)));
+
+	for (int frame = 0; frame < 8; frame++)
+	{
+	    for (auto &index : indices)
+	    {
+		index = uint8_t(rng() & 0xF);
+	    }
+
+	    int num_rows = int(rng() % 193);
+	    fill(pixels.begin(), pixels.end(), BeeVDPRGB{0, 0, 0});
+	    fill(ref_pixels.begin(), ref_pixels.end(), BeeVDPRGB{0, 0, 0});
+	    filter.filter(indices.data(), pixels.data(), num_rows);
+	    ref_filter.filter(indices.data(), ref_pixels.data(), num_rows);
+
+	    if (!is_same_pixels(pixels.data(), ref_pixels.data(), pixels.size()))
+	    {
+		cout << "NTSC filter with " << filter.numThreads() << " threads doesn't match on " << num_rows << " rows" << endl;
+		return false;
+	    }
+
+	    result.num_matched += 1;
+	}
+    }
+
+    return true;
+}
+
+// Point the V9938's address register at 'addr' (in all 128K of VRAM)
+void v9938_set_addr(V9938 &vdp, uint32_t addr, bool is_write)
+{
+    write_reg(vdp, 14, uint8_t(addr >> 14));
+    vdp.writeControl(uint8_t(addr));
+    vdp.writeControl(uint8_t(((addr >> 8) & 0x3F) | (is_write ? 0x40 : 0x00)));
+}
+
+// Run random HMMV, HMMM and YMMM commands in each bitmap mode,
+// and compare all of VRAM against the same commands done one byte at a time
+// (Note: DX and SX often point past the edge of 256-pixel wide screens,
+// and the run of bytes stops as soon as it leaves the screen)
+bool test_v9938_commands(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    // R#0, pixels per byte and lines that fit in VRAM for GRAPHIC 4-7
+    const int mode_regs[4] = {0x06, 0x08, 0x0A, 0x0E};
+    const int mode_ppb[4] = {2, 4, 2, 1};
+    const int mode_lines[4] = {1024, 1024, 512, 512};
+    const char *cmd_names[3] = {"HMMV", "HMMM", "YMMM"};
+
+    vector<uint8_t> vram(0x20000);
+    vector<uint8_t> test_vram(0x20000);
+
+    V9938 vdp;
+    vdp.setHeadless(true);
+    vdp.init();
+    write_reg(vdp, 1, 0x40);
+
+    for (uint64_t round = 0; round < num_rounds; round++)
+    {
+	int mode = int(rng() & 3);
+	write_reg(vdp, 0, uint8_t(mode_regs[mode]));
+
+	int ppb = mode_ppb[mode];
+	int num_lines = mode_lines[mode];
+	int bytes_per_line = (0x20000 / num_lines);
+
+	if ((round & 15) == 0)
+	{
+	    v9938_set_addr(vdp, 0, true);
+
+	    for (auto &data : vram)
+	    {
+		data = uint8_t(rng());
+		vdp.writeData(data);
+	    }
+	}
+
+	int opcode = int(rng() % 3);
+	int sx = int(rng() & 0x1FF);
+	int sy = int(rng() & 0x3FF);
+	int dx = int(rng() & 0x1FF);
+	int dy = int(rng() & 0x3FF);
+	int nx = int(rng() & 0x1FF);
+	int ny = int(rng() & 0x3F);
+	uint8_t clr = uint8_t(rng());
+	uint8_t arg = uint8_t(rng() & 0x0C);
+
+	const uint8_t cmd_regs[15] =
+	{
+	    uint8_t(sx), uint8_t(sx >> 8), uint8_t(sy), uint8_t(sy >> 8),
+	    uint8_t(dx), uint8_t(dx >> 8), uint8_t(dy), uint8_t(dy >> 8),
+	    uint8_t(nx), uint8_t(nx >> 8), uint8_t(ny), uint8_t(ny >> 8),
+	    clr, arg, uint8_t((0xC0 + (opcode << 4)))
+	};
+
+	for (int reg = 0; reg < 15; reg++)
+	{
+	    write_reg(vdp, (32 + reg), cmd_regs[reg]);
+	}
+
+	// Do the same, one byte at a time
+	int dix = (arg & 0x04) ? -1 : 1;
+	int diy = (arg & 0x08) ? -1 : 1;
+	int num_bytes = (((nx != 0) ? nx : 512) / ppb);
+	int num_rows = (ny != 0) ? ny : 1024;
+
+	auto line_addr = [&](int ypos)
+	{
+	    return ((ypos & (num_lines - 1)) * bytes_per_line);
+	};
+
+	auto is_on_screen = [&](int xpos)
+	{
+	    return ((xpos >= 0) && (xpos < bytes_per_line));
+	};
+
+	for (int row = 0; row < num_rows; row++)
+	{
+	    int src_line = line_addr((sy + (row * diy)));
+	    int dst_line = line_addr((dy + (row * diy)));
+
+	    for (int col = 0; (opcode == 2) || (col < num_bytes); col++)
+	    {
+		int src_x = ((sx / ppb) + (col * dix));
+		int dst_x = ((dx / ppb) + (col * dix));
+
+		if (!is_on_screen(dst_x) || ((opcode == 1) && !is_on_screen(src_x)))
+		{
+		    break;
+		}
+
+		// (YMMM copies from SY to DY in the same columns)
+		switch (opcode)
+		{
+		    case 0: vram[(dst_line + dst_x)] = clr; break;
+		    case 1: vram[(dst_line + dst_x)] = vram[(src_line + src_x)]; break;
+		    default: vram[(dst_line + dst_x)] = vram[(src_line + dst_x)]; break;
+		}
+	    }
+	}
+
+	v9938_set_addr(vdp, 0, false);
+
+	for (auto &data : test_vram)
+	{
+	    data = vdp.readData();
+	}
+
+	if (test_vram != vram)
+	{
+	    size_t addr = (mismatch(test_vram.begin(), test_vram.end(), vram.begin()).first - test_vram.begin());
+	    cout << cmd_names[opcode] << " mismatch in GRAPHIC " << (4 + mode) << " at VRAM address " << hex << addr << dec << endl;
+	    cout << "SX: " << sx << ", SY: " << sy << ", DX: " << dx << ", DY: " << dy;
+	    cout << ", NX: " << nx << ", NY: " << ny << ", DIX: " << dix << ", DIY: " << diy << endl;
+	    return false;
+	}
+
+	result.num_matched += 1;
+    }
+
+    vdp.shutdown();
+    return true;
+}
+
+// Render random GRAPHIC 4 frames, and compare every pixel against the palette
+// set up by the MSX2 BIOS, with a few entries rewritten through the palette port
+// (Note: the first frame is drawn entirely with the default palette)
+bool test_v9938_palette(mt19937_64 &rng, uint64_t num_rounds, DiffResult &result)
+{
+    // Red, green and blue levels (0-7) of each color
+    const uint8_t bios_palette[16][3] =
+    {
+	{0, 0, 0}, {0, 0, 0}, {1, 6, 1}, {3, 7, 3}, {1, 1, 7}, {2, 3, 7}, {5, 1, 1}, {2, 6, 7},
+	{7, 1, 1}, {7, 3, 3}, {6, 6, 1}, {6, 6, 4}, {1, 4, 1}, {6, 2, 5}, {5, 5, 5}, {7, 7, 7},
+    };
+
+    auto level_rgb = [](int red, int green, int blue)
+    {
+	return BeeVDPRGB{uint8_t((red * 255) / 7), uint8_t((green * 255) / 7), uint8_t((blue * 255) / 7)};
+    };
+
+    array<BeeVDPRGB, 16> palette;
+
+    for (int color = 0; color < 16; color++)
+    {
+	palette[color] = level_rgb(bios_palette[color][0], bios_palette[color][1], bios_palette[color][2]);
+    }
+
+    // GRAPHIC 4 on page 0, with color 0 taken from the palette rather than the backdrop
+    V9938 vdp;
+    vdp.init();
+    write_reg(vdp, 0, 0x06);
+    write_reg(vdp, 1, 0x40);
+    write_reg(vdp, 2, 0x1F);
+    write_reg(vdp, 8, 0x20);
+
+    vector<uint8_t> vram((128 * 256));
+
+    for (uint64_t round = 0; round < num_rounds; round++)
+    {
+	if ((round != 0) && ((rng() & 1) != 0))
+	{
+	    // Format of palette data is 0RRR0BBB, then 00000GGG
+	    int color = int(rng() & 15);
+	    int red = int(rng() & 7);
+	    int green = int(rng() & 7);
+	    int blue = int(rng() & 7);
+	    write_reg(vdp, 16, uint8_t(color));
+	    vdp.writePalette(uint8_t((red << 4) | blue));
+	    vdp.writePalette(uint8_t(green));
+	    palette[color] = level_rgb(red, green, blue);
+	}
+
+	v9938_set_addr(vdp, 0, true);
+
+	for (auto &data : vram)
+	{
+	    data = uint8_t(rng());
+	    vdp.writeData(data);
+	}
+
+	for (int line = 0; line < vdp.numScanlines(); line++)
+	{
+	    vdp.chipClock();
+	}
+
+	const V9938Frame *frame = vdp.acquireFrame();
+
+	if (frame == nullptr)
+	{
+	    cout << "No V9938 frame was published at round " << round << endl;
+	    return false;
+	}
+
+	// Each byte holds two pixels, and each pixel is doubled horizontally
+	for (int ypos = 0; ypos < frame->height; ypos++)
+	{
+	    for (int xpos = 0; xpos < 512; xpos++)
+	    {
+		uint8_t data = vram[((ypos * 128) + (xpos >> 2))];
+		int color = ((xpos & 2) != 0) ? (data & 0xF) : (data >> 4);
+
+		if (!is_same_rgb(frame->pixels[((ypos * 512) + xpos)], palette[color]))
+		{
+		    cout << "V9938 color " << color << " mismatch at round " << round << ", pixel (" << xpos << "," << ypos << ")" << endl;
+		    return false;
+		}
+	    }
+	}
+
+	result.num_matched += 1;
+    }
+
+    vdp.shutdown();
+    return true;
+}
+
+const DiffTest diff_tests[] =
+{
+    {"renderer scanlines", test_scanlines, 1, 1},
+    {"batch scanlines", test_batch, 20000, 1},
+    {"profiled frames", test_profiler, 10000, 8},
+    {"TMS9918A VRAM writes", test_vram_modes<TMS9918AVariant>, 1000, 16},
+    {"TMS9928A VRAM writes", test_vram_modes<TMS9928AVariant>, 1000, 16},
+    {"TMS9929A VRAM writes", test_vram_modes<TMS9929AVariant>, 1000, 16},
+    {"TMS9118 VRAM writes", test_vram_modes<TMS9118Variant>, 1000, 16},
+    {"TMS9128 VRAM writes", test_vram_modes<TMS9128Variant>, 1000, 16},
+    {"TMS9129 VRAM writes", test_vram_modes<TMS9129Variant>, 1000, 16},
+    {"TMS9918A frames", test_variant<TMS9918AVariant>, 1000, 4},
+    {"TMS9928A frames", test_variant<TMS9928AVariant>, 1000, 4},
+    {"TMS9929A frames", test_variant<TMS9929AVariant>, 1000, 4},
+    {"TMS9118 frames", test_variant<TMS9118Variant>, 1000, 4},
+    {"TMS9128 frames", test_variant<TMS9128Variant>, 1000, 4},
+    {"TMS9129 frames", test_variant<TMS9129Variant>, 1000, 4},
+    {"overlay pixels", test_overlay, 10000, 32},
+    {"debug view updates", test_debug_views, 1000, 8},
+    {"frames with callbacks", test_callbacks, 1000, 16},
+    {"render interval frames", test_render_interval, 100, 64},
+    {"triple buffered frames", test_triple_buffer, 10, 64},
+    {"snapshots", test_snapshots, 100, 16},
+    {"shared frames", test_shared_frames, 10000, 4},
+    {"patched frames", test_dirty_rects, 1000, 16},
+    {"captured frames", test_capture, 1000, 16},
+    {"shared VRAM image rounds", test_vram_image, 2000, 8},
+    {"region of interest frames", test_region, 1000, 16},
+    {"kernel rounds", test_kernels, 100, 64},
+    {"run-ahead rounds", test_run_ahead, 2000, 16},
+    {"mixed run-ahead rounds", test_mixed_run_ahead, 2000, 16},
+    {"SMS Mode 4 scanlines", test_sega<SMSVDP>, 2000, 16},
+    {"Game Gear Mode 4 scanlines", test_sega<GameGearVDP>, 2000, 16},
+    {"V9938 commands", test_v9938_commands, 1000, 32},
+    {"V9938 GRAPHIC 4 frames", test_v9938_palette, 2000, 16},
+    {"NTSC filtered frames", test_ntsc, 2000, 16},
+};
+
+int main(int argc, char *argv[])
+{
+    uint64_t iterations = 1000000;
+    uint64_t seed = random_device{}();
+
+    if (argc > 1)
+    {
+	iterations = strtoull(argv[1], NULL, 0);
+    }
+
+    if (argc > 2)
+    {
+	seed = strtoull(argv[2], NULL, 0);
+    }
+
+    cout << "Running " << dec << iterations << " iterations with seed " << seed << "..." << endl;
+    mt19937_64 rng(seed);
+
+    for (const DiffTest &test : diff_tests)
+    {
+	uint64_t num_rounds = max<uint64_t>((iterations / test.iterations_per_round), test.min_rounds);
+	DiffResult result;
+
+	if (!test.run(rng, num_rounds, result))
+	{
+	    cout << "FAILED: " << test.name << " (seed " << seed << ")" << endl;
+	    return 1;
+	}
+
+	cout << "All " << result.num_matched << " " << test.name << " matched" << result.details << endl;
+    }
+
+    return 0;
+}
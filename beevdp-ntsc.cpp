@@ -0,0 +1,320 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// NTSC composite video filter, in the style of blargg's NTSC filters
+//
+// Model of the signal chain:
+// Each pixel is encoded as YIQ, and modulated onto the color subcarrier
+// at two samples per pixel (i.e. three samples per subcarrier cycle).
+// The decoder then low-pass filters the composite signal to recover the luma,
+// and demodulates and low-pass filters it to recover I and Q.
+// Luma edges leak into the chroma (giving the familiar color fringes),
+// the chroma is smeared across several pixels, and with some sharpness
+// the subcarrier leaks into the luma as well.
+//
+// Since the whole chain is linear, the output for a row is just the sum
+// of the responses to each pixel on its own. Those responses are precomputed
+// for each palette color on each of the three phases, as fixed point RGBA,
+// so that filtering a row is nothing more than adding up short runs of integers
+// (which the compiler turns into vector additions).
+// The TMS9918A's 342 pixel clocks per line cover exactly 228 subcarrier cycles,
+// so every row starts on the same phase, and the artifacts don't crawl.
+
+#include <cmath>
+#include <algorithm>
+#include "beevdp-ntsc.h"
+using namespace beevdp;
+using namespace std;
+
+namespace beevdp
+{
+    BeeVDPNTSCFilter::BeeVDPNTSCFilter(const BeeVDPNTSCSetup &setup, const array<BeeVDPRGB, 16> &palette, int num_threads)
+    {
+	init_kernels(setup, palette);
+
+	// The calling thread takes the first band itself,
+	// so one worker is started for each of the other bands
+	for (int band = 1; band < num_threads; band++)
+	{
+	    workers.emplace_back(&BeeVDPNTSCFilter::run_worker, this, band);
+	}
+    }
+
+    BeeVDPNTSCFilter::~BeeVDPNTSCFilter()
+    {
+	{
+	    lock_guard<mutex> lock(job_mutex);
+	    is_stopping = true;
+	}
+
+	job_ready.notify_all();
+
+	for (auto &worker : workers)
+	{
+	    worker.join();
+	}
+    }
+
+    // Precompute the response to each palette color on each phase
+    void BeeVDPNTSCFilter::init_kernels(const BeeVDPNTSCSetup &setup, const array<BeeVDPRGB, 16> &palette)
+    {
+	const double pi = 3.14159265358979323846;
+	const int filter_size = ((kernel_margin * 2) + 1);
+	using Filter = array<double, filter_size>;
+
+	// Convolve two filters (centered at index 'kernel_margin')
+	auto convolve = [&](const Filter &lhs, const Filter &rhs) -> Filter
+	{
+	    Filter result = {};
+
+	    for (int i = 0; i < filter_size; i++)
+	    {
+		for (int j = 0; j < filter_size; j++)
+		{
+		    int pos = (i + j - kernel_margin);
+
+		    if ((pos >= 0) && (pos < filter_size))
+		    {
+			result[pos] += (lhs[i] * rhs[j]);
+		    }
+		}
+	    }
+
+	    return result;
+	};
+
+	// Averaging three samples covers a whole subcarrier cycle,
+	// which cancels out the subcarrier entirely
+	Filter delta = {};
+	delta[kernel_margin] = 1.0;
+	Filter box = {};
+	box[(kernel_margin - 1)] = box[kernel_margin] = box[(kernel_margin + 1)] = (1.0 / 3.0);
+
+	// Luma filter (with some of the unfiltered signal blended in for sharpness)
+	double sharpness = (0.25 * (1.0 + setup.sharpness));
+	Filter luma_filter = {};
+
+	for (int i = 0; i < filter_size; i++)
+	{
+	    luma_filter[i] = (((1.0 - sharpness) * box[i]) + (sharpness * delta[i]));
+	}
+
+	// Chroma filter (two or three passes of the box filter)
+	double bleed = (0.5 * (1.0 + setup.bleed));
+	Filter chroma_narrow = convolve(box, box);
+	Filter chroma_wide = convolve(chroma_narrow, box);
+	Filter chroma_filter = {};
+
+	for (int i = 0; i < filter_size; i++)
+	{
+	    chroma_filter[i] = (((1.0 - bleed) * chroma_narrow[i]) + (bleed * chroma_wide[i]));
+	}
+
+	double hue = (setup.hue * pi);
+	double saturation = (1.0 + setup.saturation);
+	double hue_cos = (cos(hue) * saturation);
+	double hue_sin = (sin(hue) * saturation);
+
+	kernels.assign((16 * num_phases * kernel_length * 4), 0);
+
+	for (int color = 0; color < 16; color++)
+	{
+	    double red = palette[color].red;
+	    double green = palette[color].green;
+	    double blue = palette[color].blue;
+
+	    // Encode the color as YIQ
+	    double luma = ((0.299 * red) + (0.587 * green) + (0.114 * blue));
+	    double chroma_i = ((0.596 * red) - (0.274 * green) - (0.322 * blue));
+	    double chroma_q = ((0.211 * red) - (0.523 * green) + (0.312 * blue));
+
+	    for (int phase = 0; phase < num_phases; phase++)
+	    {
+		// Composite signal of the pixel's two samples
+		array<double, 2> signal;
+		array<double, 2> signal_i;
+		array<double, 2> signal_q;
+
+		for (int sample = 0; sample < 2; sample++)
+		{
+		    double angle = ((2.0 * pi * (phase + sample)) / num_phases);
+		    signal[sample] = (luma + (chroma_i * cos(angle)) + (chroma_q * sin(angle)));
+		    // Demodulated chroma (before low-pass filtering)
+		    signal_i[sample] = (signal[sample] * 2.0 * cos(angle));
+		    signal_q[sample] = (signal[sample] * 2.0 * sin(angle));
+		}
+
+		int32_t *kernel = &kernels[(((color * num_phases) + phase) * kernel_length * 4)];
+
+		for (int tap = 0; tap < kernel_length; tap++)
+		{
+		    int out_sample = (tap - kernel_margin);
+		    double out_y = 0.0;
+		    double out_i = 0.0;
+		    double out_q = 0.0;
+
+		    for (int sample = 0; sample < 2; sample++)
+		    {
+			int offset = ((sample - out_sample) + kernel_margin);
+
+			if ((offset < 0) || (offset >= filter_size))
+			{
+			    continue;
+			}
+
+			out_y += (luma_filter[offset] * signal[sample]);
+			out_i += (chroma_filter[offset] * signal_i[sample]);
+			out_q += (chroma_filter[offset] * signal_q[sample]);
+		    }
+
+		    // Apply the hue and saturation controls
+		    double adj_i = ((out_i * hue_cos) - (out_q * hue_sin));
+		    double adj_q = ((out_i * hue_sin) + (out_q * hue_cos));
+
+		    // Decode YIQ back to RGB
+		    double out_red = (out_y + (0.956 * adj_i) + (0.621 * adj_q));
+		    double out_green = (out_y - (0.272 * adj_i) - (0.647 * adj_q));
+		    double out_blue = (out_y - (1.106 * adj_i) + (1.703 * adj_q));
+
+		    int32_t *lanes = &kernel[(tap * 4)];
+		    lanes[0] = int32_t(lround(out_red * (1 << kernel_shift)));
+		    lanes[1] = int32_t(lround(out_green * (1 << kernel_shift)));
+		    lanes[2] = int32_t(lround(out_blue * (1 << kernel_shift)));
+		    lanes[3] = 0;
+		}
+	    }
+	}
+    }
+
+    // Filter a band of rows
+    void BeeVDPNTSCFilter::filterRows(const uint8_t *indices, BeeVDPRGB *pixels, int first_row, int num_rows) const
+    {
+	const int padded_width = (input_width + (row_padding * 2));
+	// Offset of the first visible output sample in the accumulator
+	const int accum_start = ((row_padding * 2) + kernel_margin);
+	const int32_t rounding = (1 << (kernel_shift - 1));
+
+	// (Note: the accumulator has a fixed size, so it lives on the stack
+	// of whichever thread is filtering, and nothing is allocated per call)
+	array<int32_t, (accum_width * 4)> accum;
+
+	for (int row = first_row; row < (first_row + num_rows); row++)
+	{
+	    const uint8_t *row_in = &indices[(row * input_width)];
+	    BeeVDPRGB *row_out = &pixels[(row * output_width)];
+	    fill(accum.begin(), accum.end(), 0);
+
+	    // Sum up the response to each pixel (repeating the edge pixels past each side)
+	    for (int pos = 0; pos < padded_width; pos++)
+	    {
+		int xpos = clamp((pos - row_padding), 0, (input_width - 1));
+		int color = (row_in[xpos] & 0xF);
+		int first_sample = (2 * (pos - row_padding));
+		int phase = (((first_sample % num_phases) + num_phases) % num_phases);
+
+		const int32_t *kernel = &kernels[(((color * num_phases) + phase) * kernel_length * 4)];
+		int32_t *dst = &accum[((pos * 2) * 4)];
+
+		for (int lane = 0; lane < (kernel_length * 4); lane++)
+		{
+		    dst[lane] += kernel[lane];
+		}
+	    }
+
+	    // Convert the visible part back to 8-bit RGB
+	    const int32_t *src = &accum[(accum_start * 4)];
+
+	    for (int xpos = 0; xpos < output_width; xpos++)
+	    {
+		const int32_t *lanes = &src[(xpos * 4)];
+		row_out[xpos].red = uint8_t(clamp(((lanes[0] + rounding) >> kernel_shift), 0, 255));
+		row_out[xpos].green = uint8_t(clamp(((lanes[1] + rounding) >> kernel_shift), 0, 255));
+		row_out[xpos].blue = uint8_t(clamp(((lanes[2] + rounding) >> kernel_shift), 0, 255));
+	    }
+	}
+    }
+
+    // Filter a whole frame, split into bands across the filter's threads
+    void BeeVDPNTSCFilter::filter(const uint8_t *indices, BeeVDPRGB *pixels, int num_rows)
+    {
+	int num_bands = clamp(numThreads(), 1, max(num_rows, 1));
+
+	if (num_bands == 1)
+	{
+	    filterRows(indices, pixels, 0, num_rows);
+	    return;
+	}
+
+	int band_size = ((num_rows + num_bands - 1) / num_bands);
+
+	// Hand the frame over to the workers...
+	{
+	    lock_guard<mutex> lock(job_mutex);
+	    current_job = {indices, pixels, num_rows, band_size};
+	    pending_bands = int(workers.size());
+	    job_number += 1;
+	}
+
+	job_ready.notify_all();
+
+	// ...filter the first band here...
+	filterRows(indices, pixels, 0, min(band_size, num_rows));
+
+	// ...and wait for the other bands to be done
+	unique_lock<mutex> lock(job_mutex);
+	job_done.wait(lock, [this]() { return (pending_bands == 0); });
+    }
+
+    // Filter band number 'band' of every frame handed over by filter()
+    // (Note: bands past the end of a frame are simply skipped)
+    void BeeVDPNTSCFilter::run_worker(int band)
+    {
+	uint64_t last_job = 0;
+	unique_lock<mutex> lock(job_mutex);
+
+	while (true)
+	{
+	    job_ready.wait(lock, [&]() { return (is_stopping || (job_number != last_job)); });
+
+	    if (is_stopping)
+	    {
+		return;
+	    }
+
+	    last_job = job_number;
+	    NTSCJob job = current_job;
+	    lock.unlock();
+
+	    int first_row = (band * job.band_size);
+
+	    if (first_row < job.num_rows)
+	    {
+		filterRows(job.indices, job.pixels, first_row, min(job.band_size, (job.num_rows - first_row)));
+	    }
+
+	    lock.lock();
+	    pending_bands -= 1;
+
+	    if (pending_bands == 0)
+	    {
+		job_done.notify_one();
+	    }
+	}
+    }
+}
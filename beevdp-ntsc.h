@@ -0,0 +1,125 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BEEVDP_NTSC_H
+#define BEEVDP_NTSC_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "beevdp.h"
+
+namespace beevdp
+{
+    // Adjustable parameters of the NTSC filter
+    // (each value ranges from -1 to 1, with 0 being the default)
+    struct BeeVDPNTSCSetup
+    {
+	// Hue rotation (1 is +180 degrees)
+	double hue = 0.0;
+	// Color saturation
+	double saturation = 0.0;
+	// Luma sharpness (higher values let more of the color subcarrier
+	// into the luma, giving stronger dot patterns on saturated colors)
+	double sharpness = 0.0;
+	// Color bleed (higher values smear the chroma across more pixels)
+	double bleed = 0.0;
+    };
+
+    // Composite video filter for TMS99xxA output
+    //
+    // The TMS9918A pixel clock is 1.5 times the NTSC color subcarrier,
+    // so every pixel starts on one of three subcarrier phases.
+    // The filter precomputes the (linear) response of the whole
+    // encode -> composite -> decode chain to each palette color on each phase,
+    // and then simply sums up those responses for each row of palette numbers.
+    // Each input pixel produces two output pixels.
+    class BeeVDPNTSCFilter
+    {
+	public:
+	    static constexpr int input_width = 256;
+	    static constexpr int output_width = (input_width * 2);
+
+	    // 'num_threads' is the number of threads each frame is split across
+	    // (Note: the extra threads are started here, and wait for frames
+	    // until the filter is destroyed)
+	    BeeVDPNTSCFilter(const BeeVDPNTSCSetup &setup = BeeVDPNTSCSetup(), const std::array<BeeVDPRGB, 16> &palette = tms99xx_palette, int num_threads = 1);
+	    ~BeeVDPNTSCFilter();
+
+	    BeeVDPNTSCFilter(const BeeVDPNTSCFilter&) = delete;
+	    BeeVDPNTSCFilter &operator=(const BeeVDPNTSCFilter&) = delete;
+
+	    int numThreads() const
+	    {
+		return (int(workers.size()) + 1);
+	    }
+
+	    // Filter 'num_rows' rows of palette numbers (256 per row), starting at 'first_row',
+	    // into the same rows of 'pixels' (512 per row)
+	    // (Note: this only reads the filter's tables, so separate bands of rows
+	    // can be filtered on separate threads at the same time)
+	    void filterRows(const uint8_t *indices, BeeVDPRGB *pixels, int first_row, int num_rows) const;
+
+	    // Filter 'num_rows' rows, split into bands across the filter's threads
+	    // (Note: the calling thread filters the first band itself)
+	    void filter(const uint8_t *indices, BeeVDPRGB *pixels, int num_rows);
+
+	private:
+	    // Output samples affected on each side of a pixel
+	    static constexpr int kernel_margin = 3;
+	    static constexpr int kernel_length = (2 + (kernel_margin * 2));
+	    // Input pixels repeated past each edge of a row
+	    static constexpr int row_padding = 2;
+	    static constexpr int num_phases = 3;
+	    // Kernels are stored as fixed point with this many fraction bits
+	    static constexpr int kernel_shift = 10;
+	    // Output samples summed up for each row (including the padding)
+	    static constexpr int accum_width = ((((input_width + (row_padding * 2)) * 2) + kernel_length) - 2);
+
+	    // Response to each palette color on each phase, as RGBA lanes
+	    // (laid out as [color][phase][tap][lane])
+	    std::vector<int32_t> kernels;
+
+	    void init_kernels(const BeeVDPNTSCSetup &setup, const std::array<BeeVDPRGB, 16> &palette);
+
+	    // Frame being filtered by the worker threads
+	    struct NTSCJob
+	    {
+		const uint8_t *indices = nullptr;
+		BeeVDPRGB *pixels = nullptr;
+		int num_rows = 0;
+		int band_size = 0;
+	    };
+
+	    std::vector<std::thread> workers;
+	    std::mutex job_mutex;
+	    std::condition_variable job_ready;
+	    std::condition_variable job_done;
+	    NTSCJob current_job;
+	    // Bumped for every new job, so that each worker takes it exactly once
+	    uint64_t job_number = 0;
+	    int pending_bands = 0;
+	    bool is_stopping = false;
+
+	    void run_worker(int band);
+    };
+};
+
+#endif // BEEVDP_NTSC_H
@@ -0,0 +1,194 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Notes on the hardware performance counters:
+// All events are opened as one perf_event group (with user space counting only,
+// which is allowed at the default perf_event_paranoid level of 2),
+// so a single read() returns all counts, taken at the same moment.
+// Events the CPU doesn't support (e.g. LLC misses in many virtual machines)
+// are simply left out of the group.
+
+#include "beevdp-perf.h"
+
+#ifdef __linux__
+#include <cstring>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#endif
+
+using namespace beevdp;
+using namespace std;
+
+namespace beevdp
+{
+#ifdef __linux__
+    struct PerfEventConfig
+    {
+	uint32_t type;
+	uint64_t config;
+    };
+
+    // Indexed by BeeVDPPerfEvent
+    static constexpr PerfEventConfig perf_event_configs[NumPerfEvents] =
+    {
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+	{PERF_TYPE_HW_CACHE, (PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    };
+#endif
+
+    BeeVDPPerfCounters::BeeVDPPerfCounters()
+    {
+	event_fds.fill(-1);
+    }
+
+    BeeVDPPerfCounters::~BeeVDPPerfCounters()
+    {
+	close();
+    }
+
+    bool BeeVDPPerfCounters::open()
+    {
+	close();
+
+#ifdef __linux__
+	for (int event = 0; event < NumPerfEvents; event++)
+	{
+	    perf_event_attr attr;
+	    memset(&attr, 0, sizeof(attr));
+	    attr.size = sizeof(attr);
+	    attr.type = perf_event_configs[event].type;
+	    attr.config = perf_event_configs[event].config;
+	    attr.read_format = PERF_FORMAT_GROUP;
+	    attr.disabled = (group_fd < 0) ? 1 : 0;
+	    attr.exclude_kernel = 1;
+	    attr.exclude_hv = 1;
+
+	    int fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0));
+
+	    if (fd < 0)
+	    {
+		continue;
+	    }
+
+	    if (group_fd < 0)
+	    {
+		group_fd = fd;
+	    }
+
+	    event_fds[event] = fd;
+	    num_open += 1;
+	}
+
+	if (group_fd < 0)
+	{
+	    return false;
+	}
+
+	ioctl(group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	return true;
+#else
+	return false;
+#endif
+    }
+
+    void BeeVDPPerfCounters::close()
+    {
+#ifdef __linux__
+	// Close the group leader last
+	for (int event = (NumPerfEvents - 1); event >= 0; event--)
+	{
+	    if ((event_fds[event] >= 0) && (event_fds[event] != group_fd))
+	    {
+		::close(event_fds[event]);
+	    }
+	}
+
+	if (group_fd >= 0)
+	{
+	    ::close(group_fd);
+	}
+#endif
+
+	event_fds.fill(-1);
+	group_fd = -1;
+	num_open = 0;
+    }
+
+    bool BeeVDPPerfCounters::isOpen() const
+    {
+	return (group_fd >= 0);
+    }
+
+    bool BeeVDPPerfCounters::hasEvent(BeeVDPPerfEvent event) const
+    {
+	return (event >= 0) && (event < NumPerfEvents) && (event_fds[event] >= 0);
+    }
+
+    BeeVDPPerfSample BeeVDPPerfCounters::read() const
+    {
+	BeeVDPPerfSample sample;
+
+#ifdef __linux__
+	if (group_fd < 0)
+	{
+	    return sample;
+	}
+
+	// The group is read as {number of events, value of each event},
+	// with the values in the order the events were opened
+	array<uint64_t, (NumPerfEvents + 1)> values = {};
+
+	if (::read(group_fd, values.data(), (sizeof(uint64_t) * (num_open + 1))) <= 0)
+	{
+	    return sample;
+	}
+
+	int value_index = 1;
+
+	for (int event = 0; event < NumPerfEvents; event++)
+	{
+	    if (event_fds[event] >= 0)
+	    {
+		sample.counts[event] = values[value_index++];
+	    }
+	}
+#endif
+
+	return sample;
+    }
+
+    const char *BeeVDPPerfCounters::eventName(BeeVDPPerfEvent event)
+    {
+	switch (event)
+	{
+	    case PerfCycles: return "cycles";
+	    case PerfInstructions: return "instructions";
+	    case PerfBranchMisses: return "branch misses";
+	    case PerfL1DMisses: return "L1D misses";
+	    case PerfLLCMisses: return "LLC misses";
+	    default: return "unknown";
+	}
+    }
+};
@@ -0,0 +1,70 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BEEVDP_PERF_H
+#define BEEVDP_PERF_H
+
+#include "beevdp.h"
+
+namespace beevdp
+{
+    // Hardware performance counters of the calling thread
+    // (cycles, instructions, branch misses, L1D and LLC misses),
+    // read through Linux's perf_event_open() without any external profiler
+    //
+    // Attach the counters with TMS99xxA::setPerfCounters(), and the VDP
+    // adds the events in each render path and in chipClock() to its
+    // per-frame BeeVDPStats (which requires BEEVDP_ENABLE_STATS).
+    // (Note: the counters only count the thread that opened them,
+    // so open them on the thread that calls chipClock().
+    // Each read is a system call, so expect the timings to grow while attached.)
+    class BeeVDPPerfCounters
+    {
+	public:
+	    BeeVDPPerfCounters();
+	    ~BeeVDPPerfCounters();
+
+	    BeeVDPPerfCounters(const BeeVDPPerfCounters&) = delete;
+	    BeeVDPPerfCounters &operator=(const BeeVDPPerfCounters&) = delete;
+
+	    // Start counting all events the CPU (and kernel) support
+	    // (Note: returns false if none of them could be opened,
+	    // e.g. on other platforms, or if perf_event_paranoid is too strict)
+	    bool open();
+	    void close();
+
+	    bool isOpen() const;
+	    // Whether 'event' is being counted (it reads as 0 otherwise)
+	    bool hasEvent(BeeVDPPerfEvent event) const;
+
+	    // Current totals of all events
+	    BeeVDPPerfSample read() const;
+
+	    static const char *eventName(BeeVDPPerfEvent event);
+
+	private:
+	    // The first event opened leads the group,
+	    // so all events are read with a single system call
+	    int group_fd = -1;
+	    std::array<int, NumPerfEvents> event_fds;
+	    int num_open = 0;
+    };
+};
+
+#endif // BEEVDP_PERF_H
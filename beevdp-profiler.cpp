@@ -0,0 +1,202 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Notes on the access slot model:
+// BeeVDP clocks the VDP once per scanline, so the exact timing of CPU accesses
+// within a scanline isn't known.
+// Instead, each scanline of active display is given a budget of CPU access slots,
+// based on the worst-case access delays listed in the TMS9918A datasheet
+// (i.e. 2us in text mode, 3.5us in multicolor mode and 8us in graphics I/II modes),
+// and every access beyond that budget is counted as one that the real hardware would drop.
+
+#include <algorithm>
+#include "beevdp-profiler.h"
+using namespace beevdp;
+using namespace std;
+
+namespace beevdp
+{
+    BeeVDPVRAMProfiler::BeeVDPVRAMProfiler(int block_shift, int vram_size)
+    {
+	int num_blocks = max((vram_size >> block_shift), 1);
+	current_map.block_shift = block_shift;
+	current_map.reads.resize(num_blocks, 0);
+	current_map.writes.resize(num_blocks, 0);
+	current_map.redundant_writes.resize(num_blocks, 0);
+	current_map.dropped_accesses.resize(num_blocks, 0);
+	frame_map = current_map;
+    }
+
+    BeeVDPVRAMProfiler::~BeeVDPVRAMProfiler()
+    {
+
+    }
+
+    // Clear all counters
+    void BeeVDPVRAMProfiler::reset()
+    {
+	for (auto *map : {&current_map, &frame_map})
+	{
+	    map->frame_number = 0;
+	    fill(map->reads.begin(), map->reads.end(), 0);
+	    fill(map->writes.begin(), map->writes.end(), 0);
+	    fill(map->redundant_writes.begin(), map->redundant_writes.end(), 0);
+	    fill(map->dropped_accesses.begin(), map->dropped_accesses.end(), 0);
+	}
+
+	access_line = -1;
+	line_accesses = 0;
+    }
+
+    // Check if an access on the given scanline exceeds the CPU access slot budget
+    bool BeeVDPVRAMProfiler::is_dropped(int line, int slots)
+    {
+	if (line != access_line)
+	{
+	    access_line = line;
+	    line_accesses = 0;
+	}
+
+	line_accesses += 1;
+	return ((slots >= 0) && (line_accesses > slots));
+    }
+
+    // Record a VRAM read
+    void BeeVDPVRAMProfiler::recordRead(uint32_t addr, int line, int slots)
+    {
+	size_t block = ((addr >> current_map.block_shift) % current_map.numBlocks());
+	current_map.reads[block] += 1;
+
+	if (is_dropped(line, slots))
+	{
+	    current_map.dropped_accesses[block] += 1;
+	}
+    }
+
+    // Record a VRAM write
+    void BeeVDPVRAMProfiler::recordWrite(uint32_t addr, bool is_redundant, int line, int slots)
+    {
+	size_t block = ((addr >> current_map.block_shift) % current_map.numBlocks());
+	current_map.writes[block] += 1;
+
+	if (is_redundant)
+	{
+	    current_map.redundant_writes[block] += 1;
+	}
+
+	if (is_dropped(line, slots))
+	{
+	    current_map.dropped_accesses[block] += 1;
+	}
+    }
+
+    // Snapshot the heatmap of the completed frame and start a new one
+    void BeeVDPVRAMProfiler::endFrame(uint64_t frame_number)
+    {
+	current_map.frame_number = frame_number;
+	swap(current_map, frame_map);
+
+	current_map.frame_number = 0;
+	fill(current_map.reads.begin(), current_map.reads.end(), 0);
+	fill(current_map.writes.begin(), current_map.writes.end(), 0);
+	fill(current_map.redundant_writes.begin(), current_map.redundant_writes.end(), 0);
+	fill(current_map.dropped_accesses.begin(), current_map.dropped_accesses.end(), 0);
+
+	access_line = -1;
+	line_accesses = 0;
+    }
+
+    const BeeVDPHeatmap &BeeVDPVRAMProfiler::getFrameHeatmap() const
+    {
+	return frame_map;
+    }
+
+    // Export the last frame's heatmap as CSV
+    // (Note: blocks without any accesses are omitted)
+    bool BeeVDPVRAMProfiler::writeCSV(ostream &stream) const
+    {
+	stream << "frame,address,reads,writes,redundant_writes,dropped_accesses" << "\n";
+
+	for (size_t block = 0; block < frame_map.numBlocks(); block++)
+	{
+	    if ((frame_map.reads[block] == 0) && (frame_map.writes[block] == 0))
+	    {
+		continue;
+	    }
+
+	    stream << dec << frame_map.frame_number << ",";
+	    stream << (block << frame_map.block_shift) << ",";
+	    stream << frame_map.reads[block] << ",";
+	    stream << frame_map.writes[block] << ",";
+	    stream << frame_map.redundant_writes[block] << ",";
+	    stream << frame_map.dropped_accesses[block] << "\n";
+	}
+
+	return stream.good();
+    }
+
+    // Export the last frame's heatmap in a compact binary format
+    // (all values are little-endian):
+    // "BVHM" | version (u8) | block shift (u8) | number of entries (u32) | frame number (u64)
+    // followed by each entry:
+    // block number (u32) | reads (u32) | writes (u32) | redundant writes (u32) | dropped accesses (u32)
+    // (Note: blocks without any accesses are omitted)
+    bool BeeVDPVRAMProfiler::writeBinary(ostream &stream) const
+    {
+	auto write_le = [&](uint64_t value, int num_bytes)
+	{
+	    for (int i = 0; i < num_bytes; i++)
+	    {
+		stream.put(char((value >> (i * 8)) & 0xFF));
+	    }
+	};
+
+	uint32_t num_entries = 0;
+
+	for (size_t block = 0; block < frame_map.numBlocks(); block++)
+	{
+	    if ((frame_map.reads[block] != 0) || (frame_map.writes[block] != 0))
+	    {
+		num_entries += 1;
+	    }
+	}
+
+	stream.write("BVHM", 4);
+	write_le(1, 1);
+	write_le(frame_map.block_shift, 1);
+	write_le(num_entries, 4);
+	write_le(frame_map.frame_number, 8);
+
+	for (size_t block = 0; block < frame_map.numBlocks(); block++)
+	{
+	    if ((frame_map.reads[block] == 0) && (frame_map.writes[block] == 0))
+	    {
+		continue;
+	    }
+
+	    write_le(block, 4);
+	    write_le(frame_map.reads[block], 4);
+	    write_le(frame_map.writes[block], 4);
+	    write_le(frame_map.redundant_writes[block], 4);
+	    write_le(frame_map.dropped_accesses[block], 4);
+	}
+
+	return stream.good();
+    }
+}
@@ -0,0 +1,86 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef BEEVDP_PROFILER_H
+#define BEEVDP_PROFILER_H
+
+#include <vector>
+#include <string>
+#include "beevdp.h"
+
+namespace beevdp
+{
+    // VRAM access counters for a single frame,
+    // with one entry per VRAM block
+    struct BeeVDPHeatmap
+    {
+	uint64_t frame_number = 0;
+	// Size of each block (in bytes) is (1 << block_shift)
+	int block_shift = 0;
+	std::vector<uint32_t> reads;
+	std::vector<uint32_t> writes;
+	// Writes that stored the value already present in VRAM
+	std::vector<uint32_t> redundant_writes;
+	// Accesses during active display beyond the number of
+	// CPU access slots the real hardware provides on that scanline
+	std::vector<uint32_t> dropped_accesses;
+
+	size_t numBlocks() const
+	{
+	    return reads.size();
+	}
+    };
+
+    // Records guest VRAM traffic in the form of per-frame heatmaps
+    class BeeVDPVRAMProfiler
+    {
+	public:
+	    // 'block_shift' selects the granularity of the heatmap
+	    // (i.e. 0 for per-address counts, or 6 for 64-byte blocks)
+	    BeeVDPVRAMProfiler(int block_shift = 0, int vram_size = 0x4000);
+	    ~BeeVDPVRAMProfiler();
+
+	    void reset();
+
+	    // Called by the VDP on every VRAM access
+	    // ('slots' is the number of CPU access slots available
+	    // on scanline 'line', or -1 if accesses are unrestricted)
+	    void recordRead(uint32_t addr, int line, int slots);
+	    void recordWrite(uint32_t addr, bool is_redundant, int line, int slots);
+
+	    // Called by the VDP at VBlank
+	    void endFrame(uint64_t frame_number);
+
+	    // Heatmap of the last completed frame
+	    const BeeVDPHeatmap &getFrameHeatmap() const;
+
+	    bool writeCSV(std::ostream &stream) const;
+	    bool writeBinary(std::ostream &stream) const;
+
+	private:
+	    BeeVDPHeatmap current_map;
+	    BeeVDPHeatmap frame_map;
+
+	    int access_line = -1;
+	    int line_accesses = 0;
+
+	    bool is_dropped(int line, int slots);
+    };
+};
+
+#endif // BEEVDP_PROFILER_H
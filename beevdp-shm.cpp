@@ -0,0 +1,400 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+
+// Notes on the shared frame ring:
+// The mapping holds a BeeVDPSharedHeader, followed by a BeeVDPFrameRing
+// (at a 64-byte aligned offset).
+// The ring's shared index is a lock-free std::atomic<int>,
+// which works across processes just like it does across threads.
+// The header describes the layout with plain offsets, so that
+// presenters which don't use this class (or even C++) can find the frames.
+//
+// Notes on the shared VRAM images:
+// The image lives in a memfd (or an unlinked POSIX shared memory object),
+// and every VDP maps it with MAP_PRIVATE, which leaves the copy-on-write
+// to the operating system. This keeps VRAM a flat array, so no VRAM access
+// (and especially no renderer fetch) goes through a page table of its own.
+
+#include <cstring>
+#include <cstddef>
+#include <new>
+#include <atomic>
+#include "beevdp-shm.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define BEEVDP_HAS_SHM
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace beevdp;
+using namespace std;
+
+namespace beevdp
+{
+    static constexpr uint32_t shared_magic = 0x50445642; // 'BVDP'
+    static constexpr uint32_t shared_version = 2;
+
+    static_assert(std::atomic<int>::is_always_lock_free, "The shared index must be lock-free to work across processes");
+
+    // Offset of the frame ring within the mapping
+    static constexpr size_t ring_offset = (((sizeof(BeeVDPSharedHeader) + 63) / 64) * 64);
+    static constexpr size_t shared_size = (ring_offset + sizeof(BeeVDPFrameRing));
+
+    BeeVDPSharedFrames::BeeVDPSharedFrames()
+    {
+
+    }
+
+    BeeVDPSharedFrames::~BeeVDPSharedFrames()
+    {
+	close();
+    }
+
+    // Create a new shared frame ring
+    bool BeeVDPSharedFrames::create(const string &name)
+    {
+#ifdef BEEVDP_HAS_SHM
+	close();
+
+	if (name.empty())
+	{
+#ifdef __linux__
+	    shm_fd = memfd_create("beevdp-frames", MFD_CLOEXEC);
+#endif
+	}
+	else
+	{
+	    shm_fd = shm_open(name.c_str(), (O_CREAT | O_EXCL | O_RDWR), 0600);
+	    shm_name = name;
+	}
+
+	if (shm_fd < 0)
+	{
+	    shm_name.clear();
+	    return false;
+	}
+
+	is_owner = true;
+
+	if ((ftruncate(shm_fd, shared_size) != 0) || !map_fd(shared_size))
+	{
+	    close();
+	    return false;
+	}
+
+	// Construct the ring in place, and describe it in the header
+	auto *base = static_cast<uint8_t*>(mapping);
+	auto *ring = new (base + ring_offset) BeeVDPFrameRing();
+	ring->clear();
+
+	const BeeVDPFrame *frames = ring->frameData();
+	auto *header = new (base) BeeVDPSharedHeader();
+	header->version = shared_version;
+	header->pixel_format = PixelFormatRGB24;
+	header->width = 256;
+	header->height = 192;
+	header->mapping_size = shared_size;
+	header->index_offset = (reinterpret_cast<const uint8_t*>(ring->sharedIndex()) - base);
+	header->frames_offset = (reinterpret_cast<const uint8_t*>(frames) - base);
+	header->frame_size = sizeof(BeeVDPFrame);
+	header->sequence_offset = offsetof(BeeVDPFrame, sequence);
+	header->timestamp_offset = offsetof(BeeVDPFrame, timestamp);
+	header->pixels_offset = offsetof(BeeVDPFrame, pixels);
+	header->indices_offset = offsetof(BeeVDPFrame, indices);
+	header->dirty_base_offset = offsetof(BeeVDPFrame, dirty_base);
+	header->dirty_columns_offset = offsetof(BeeVDPFrame, dirty_columns);
+
+	// The magic number goes in last, so that a consumer
+	// never sees a half-written header
+	atomic_thread_fence(memory_order_release);
+	header->magic = shared_magic;
+	return true;
+#else
+	(void)name;
+	return false;
+#endif
+    }
+
+    // Map an existing shared frame ring by name
+    bool BeeVDPSharedFrames::open(const string &name)
+    {
+#ifdef BEEVDP_HAS_SHM
+	close();
+	int fd = shm_open(name.c_str(), O_RDWR, 0);
+
+	if (fd < 0)
+	{
+	    return false;
+	}
+
+	bool is_opened = openFd(fd);
+	::close(fd);
+	return is_opened;
+#else
+	(void)name;
+	return false;
+#endif
+    }
+
+    // Map an existing shared frame ring by file descriptor
+    // (Note: the descriptor is duplicated, so the caller keeps ownership of 'fd')
+    bool BeeVDPSharedFrames::openFd(int fd)
+    {
+#ifdef BEEVDP_HAS_SHM
+	close();
+	struct stat info;
+
+	if ((fstat(fd, &info) != 0) || (size_t(info.st_size) < shared_size))
+	{
+	    return false;
+	}
+
+	shm_fd = dup(fd);
+
+	if ((shm_fd < 0) || !map_fd(shared_size) || !check_header())
+	{
+	    close();
+	    return false;
+	}
+
+	return true;
+#else
+	(void)fd;
+	return false;
+#endif
+    }
+
+    void BeeVDPSharedFrames::close()
+    {
+#ifdef BEEVDP_HAS_SHM
+	if (mapping != nullptr)
+	{
+	    munmap(mapping, mapping_size);
+	    mapping = nullptr;
+	    mapping_size = 0;
+	}
+
+	if (shm_fd >= 0)
+	{
+	    ::close(shm_fd);
+	    shm_fd = -1;
+	}
+
+	if (is_owner && !shm_name.empty())
+	{
+	    shm_unlink(shm_name.c_str());
+	}
+#endif
+
+	shm_name.clear();
+	is_owner = false;
+    }
+
+    bool BeeVDPSharedFrames::map_fd(size_t size)
+    {
+#ifdef BEEVDP_HAS_SHM
+	void *addr = mmap(nullptr, size, (PROT_READ | PROT_WRITE), MAP_SHARED, shm_fd, 0);
+
+	if (addr == MAP_FAILED)
+	{
+	    return false;
+	}
+
+	mapping = addr;
+	mapping_size = size;
+	return true;
+#else
+	(void)size;
+	return false;
+#endif
+    }
+
+    // Check that the mapping was created by a compatible build of BeeVDP
+    bool BeeVDPSharedFrames::check_header() const
+    {
+	const BeeVDPSharedHeader *header = getHeader();
+	bool is_valid = (header->magic == shared_magic);
+	atomic_thread_fence(memory_order_acquire);
+
+	return is_valid && (header->version == shared_version) &&
+	    (header->mapping_size == shared_size) &&
+	    (header->frame_size == sizeof(BeeVDPFrame));
+    }
+
+    bool BeeVDPSharedFrames::isOpen() const
+    {
+	return (mapping != nullptr);
+    }
+
+    int BeeVDPSharedFrames::getFd() const
+    {
+	return shm_fd;
+    }
+
+    const BeeVDPSharedHeader *BeeVDPSharedFrames::getHeader() const
+    {
+	return static_cast<const BeeVDPSharedHeader*>(mapping);
+    }
+
+    BeeVDPFrameRing *BeeVDPSharedFrames::getRing()
+    {
+	if (mapping == nullptr)
+	{
+	    return nullptr;
+	}
+
+	return reinterpret_cast<BeeVDPFrameRing*>(static_cast<uint8_t*>(mapping) + ring_offset);
+    }
+
+    const BeeVDPFrame *BeeVDPSharedFrames::acquireFrame()
+    {
+	BeeVDPFrameRing *ring = getRing();
+	return (ring != nullptr) ? ring->acquire() : nullptr;
+    }
+
+    BeeVDPVRAMImage::BeeVDPVRAMImage()
+    {
+
+    }
+
+    BeeVDPVRAMImage::~BeeVDPVRAMImage()
+    {
+	close();
+    }
+
+    bool BeeVDPVRAMImage::create(const uint8_t *data, BeeVDPVRAMSize size)
+    {
+	close();
+	image_size = size;
+
+#ifdef BEEVDP_HAS_SHM
+	size_t page_size = size_t(sysconf(_SC_PAGESIZE));
+	mapping_size = (((size + page_size - 1) / page_size) * page_size);
+
+#ifdef __linux__
+	image_fd = memfd_create("beevdp-vram", MFD_CLOEXEC);
+#else
+	// Nobody else needs to find the object, so it's unlinked straight away
+	static atomic<int> image_count = 0;
+	string name = ("/beevdp-vram-" + to_string(getpid()) + "-" + to_string(image_count++));
+	image_fd = shm_open(name.c_str(), (O_CREAT | O_EXCL | O_RDWR), 0600);
+
+	if (image_fd >= 0)
+	{
+	    shm_unlink(name.c_str());
+	}
+#endif
+
+	if ((image_fd < 0) || (ftruncate(image_fd, mapping_size) != 0))
+	{
+	    close();
+	    return false;
+	}
+
+	void *addr = mmap(nullptr, mapping_size, (PROT_READ | PROT_WRITE), MAP_SHARED, image_fd, 0);
+
+	if (addr == MAP_FAILED)
+	{
+	    close();
+	    return false;
+	}
+
+	memcpy(addr, data, size);
+	mprotect(addr, mapping_size, PROT_READ);
+	image_data = static_cast<uint8_t*>(addr);
+#else
+	mapping_size = size;
+	image_data = new uint8_t[size];
+	memcpy(image_data, data, size);
+#endif
+
+	return true;
+    }
+
+    void BeeVDPVRAMImage::close()
+    {
+#ifdef BEEVDP_HAS_SHM
+	if (image_data != nullptr)
+	{
+	    munmap(image_data, mapping_size);
+	}
+
+	if (image_fd >= 0)
+	{
+	    ::close(image_fd);
+	    image_fd = -1;
+	}
+#else
+	delete[] image_data;
+#endif
+
+	image_data = nullptr;
+	mapping_size = 0;
+    }
+
+    bool BeeVDPVRAMImage::isOpen() const
+    {
+	return (image_data != nullptr);
+    }
+
+    BeeVDPVRAMSize BeeVDPVRAMImage::getSize() const
+    {
+	return image_size;
+    }
+
+    const uint8_t *BeeVDPVRAMImage::getData() const
+    {
+	return image_data;
+    }
+
+    uint8_t *BeeVDPVRAMImage::mapCopy() const
+    {
+	if (image_data == nullptr)
+	{
+	    return nullptr;
+	}
+
+#ifdef BEEVDP_HAS_SHM
+	void *addr = mmap(nullptr, mapping_size, (PROT_READ | PROT_WRITE), MAP_PRIVATE, image_fd, 0);
+	return (addr != MAP_FAILED) ? static_cast<uint8_t*>(addr) : nullptr;
+#else
+	uint8_t *copy = new uint8_t[mapping_size];
+	memcpy(copy, image_data, mapping_size);
+	return copy;
+#endif
+    }
+
+    void BeeVDPVRAMImage::unmapCopy(uint8_t *copy) const
+    {
+	if (copy == nullptr)
+	{
+	    return;
+	}
+
+#ifdef BEEVDP_HAS_SHM
+	munmap(copy, mapping_size);
+#else
+	delete[] copy;
+#endif
+    }
+};
@@ -0,0 +1,160 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BEEVDP_SHM_H
+#define BEEVDP_SHM_H
+
+#include <string>
+#include "beevdp.h"
+
+namespace beevdp
+{
+    // Pixel formats of a shared frame ring
+    enum BeeVDPPixelFormat : uint32_t
+    {
+	// 3 bytes per pixel, in the order {red, green, blue}
+	PixelFormatRGB24 = 0,
+    };
+
+    // Header at the start of a shared frame ring
+    // (Note: all offsets are in bytes, from the start of the mapping.
+    // A presenter in another process that doesn't use BeeVDPSharedFrames
+    // picks up frames the way BeeVDPTripleBuffer::acquire() does:
+    // if bit 2 of the 32-bit index at 'index_offset' is set, it atomically
+    // swaps in the index of the frame it holds (initially 1), and then reads
+    // frame number (swapped out index & 3) until the next swap)
+    struct BeeVDPSharedHeader
+    {
+	// 'BVDP'
+	uint32_t magic = 0;
+	uint32_t version = 0;
+	uint32_t pixel_format = PixelFormatRGB24;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	// Size of the whole mapping
+	uint64_t mapping_size = 0;
+	// Shared index of the triple buffer
+	uint64_t index_offset = 0;
+	// Frame N starts at (frames_offset + (N * frame_size))
+	uint64_t frames_offset = 0;
+	uint64_t frame_size = 0;
+	// Offsets within each frame of its sequence number (uint64_t, 0 while unused),
+	// timestamp (int64_t), pixels and palette numbers (one byte per pixel)
+	uint64_t sequence_offset = 0;
+	uint64_t timestamp_offset = 0;
+	uint64_t pixels_offset = 0;
+	uint64_t indices_offset = 0;
+	// Offsets within each frame of the dirty regions
+	// (see BeeVDPFrame::dirty_base and BeeVDPFrame::dirty_columns)
+	uint64_t dirty_base_offset = 0;
+	uint64_t dirty_columns_offset = 0;
+    };
+
+    // Frame ring in POSIX shared memory (or a memfd), for presenters
+    // in other processes
+    // (Note: the VDP renders straight into the shared frames, so handing
+    // frames over never copies them. Only one presenter at a time,
+    // in this process or another one, may acquire frames.)
+    class BeeVDPSharedFrames
+    {
+	public:
+	    BeeVDPSharedFrames();
+	    ~BeeVDPSharedFrames();
+
+	    BeeVDPSharedFrames(const BeeVDPSharedFrames&) = delete;
+	    BeeVDPSharedFrames &operator=(const BeeVDPSharedFrames&) = delete;
+
+	    // Producer side
+	    // Create a named shared memory object (e.g. "/beevdp-frames"),
+	    // or an anonymous memfd if 'name' is empty
+	    // (Note: pass getRing() to TMS99xxA::setFrameRing() before init())
+	    bool create(const std::string &name = "");
+
+	    // Consumer side
+	    // Map an existing shared memory object by name,
+	    // or by a file descriptor (e.g. a memfd inherited from the producer)
+	    bool open(const std::string &name);
+	    bool openFd(int fd);
+
+	    // Unmap the frame ring (and remove the shared memory object,
+	    // if this is the producer that created it)
+	    void close();
+
+	    bool isOpen() const;
+	    int getFd() const;
+	    const BeeVDPSharedHeader *getHeader() const;
+	    BeeVDPFrameRing *getRing();
+
+	    // Fetch the most recently completed frame
+	    // (see BeeVDPTripleBuffer::acquire())
+	    const BeeVDPFrame *acquireFrame();
+
+	private:
+	    int shm_fd = -1;
+	    void *mapping = nullptr;
+	    size_t mapping_size = 0;
+	    std::string shm_name;
+	    bool is_owner = false;
+
+	    bool map_fd(size_t size);
+	    bool check_header() const;
+    };
+
+    // Read-only VRAM image shared by many VDPs, with copy-on-write pages
+    // (e.g. the font and pattern tables uploaded by a common boot sequence)
+    //
+    // Each VDP attached with TMS99xxA::setVRAMImage() maps the image privately,
+    // so the operating system copies a page only when a VDP first writes to it,
+    // and memory per VDP grows with the pages it actually modifies.
+    // (Note: pages are the operating system's pages (usually 4 KB).
+    // Where memory mapping isn't available, each VDP gets a plain copy instead.)
+    class BeeVDPVRAMImage
+    {
+	public:
+	    BeeVDPVRAMImage();
+	    ~BeeVDPVRAMImage();
+
+	    BeeVDPVRAMImage(const BeeVDPVRAMImage&) = delete;
+	    BeeVDPVRAMImage &operator=(const BeeVDPVRAMImage&) = delete;
+
+	    // Capture 'size' bytes of VRAM contents
+	    // (Note: the image must outlive every VDP using it)
+	    bool create(const uint8_t *data, BeeVDPVRAMSize size);
+	    void close();
+
+	    bool isOpen() const;
+	    BeeVDPVRAMSize getSize() const;
+	    const uint8_t *getData() const;
+
+	    // Map a private, writable view of the image
+	    // (Note: returns a null pointer if the image isn't open)
+	    uint8_t *mapCopy() const;
+	    void unmapCopy(uint8_t *copy) const;
+
+	private:
+	    int image_fd = -1;
+	    BeeVDPVRAMSize image_size = VRAM16K;
+	    // Page-rounded size of the shared object
+	    size_t mapping_size = 0;
+	    // Read-only view of the image itself
+	    uint8_t *image_data = nullptr;
+    };
+};
+
+#endif // BEEVDP_SHM_H
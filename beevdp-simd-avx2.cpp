@@ -0,0 +1,224 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// AVX2 kernels (see beevdp-simd.cpp for the dispatch)
+// (Note: this file is compiled with AVX2 enabled,
+// and must only include headers without inline functions)
+
+#ifdef BEEVDP_SIMD_X86
+#include <immintrin.h>
+#include <climits>
+#include "beevdp-simd.h"
+
+namespace beevdp
+{
+    namespace simd
+    {
+	// Same as the SSE4.1 version, with 16 pixels in each 128-bit lane
+	// (Note: the byte shuffles stay within each lane, so the three
+	// interleaved vectors of each lane are put back in order before storing)
+	void convert_line_avx2(uint8_t *pixels, const uint8_t *indices, const uint8_t *palette, int count)
+	{
+	    alignas(16) uint8_t planes[3][16];
+
+	    for (int color = 0; color < 16; color++)
+	    {
+		planes[0][color] = palette[(color * 3)];
+		planes[1][color] = palette[((color * 3) + 1)];
+		planes[2][color] = palette[((color * 3) + 2)];
+	    }
+
+	    __m256i channels[3];
+	    __m256i masks[3][3];
+
+	    for (int channel = 0; channel < 3; channel++)
+	    {
+		channels[channel] = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(planes[channel])));
+
+		for (int part = 0; part < 3; part++)
+		{
+		    masks[part][channel] = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb_interleave[part][channel])));
+		}
+	    }
+
+	    const __m256i index_mask = _mm256_set1_epi8(0x0F);
+	    int xpos = 0;
+
+	    for (; (xpos + 32) <= count; xpos += 32)
+	    {
+		__m256i index_vals = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(&indices[xpos])), index_mask);
+		__m256i red = _mm256_shuffle_epi8(channels[0], index_vals);
+		__m256i green = _mm256_shuffle_epi8(channels[1], index_vals);
+		__m256i blue = _mm256_shuffle_epi8(channels[2], index_vals);
+		__m256i rgb[3];
+
+		for (int part = 0; part < 3; part++)
+		{
+		    rgb[part] = _mm256_or_si256(_mm256_shuffle_epi8(red, masks[part][0]), _mm256_shuffle_epi8(green, masks[part][1]));
+		    rgb[part] = _mm256_or_si256(rgb[part], _mm256_shuffle_epi8(blue, masks[part][2]));
+		}
+
+		__m256i *dst = reinterpret_cast<__m256i*>(&pixels[(xpos * 3)]);
+		_mm256_storeu_si256(&dst[0], _mm256_permute2x128_si256(rgb[0], rgb[1], 0x20));
+		_mm256_storeu_si256(&dst[1], _mm256_permute2x128_si256(rgb[2], rgb[0], 0x30));
+		_mm256_storeu_si256(&dst[2], _mm256_permute2x128_si256(rgb[1], rgb[2], 0x31));
+	    }
+
+	    convert_line_scalar(&pixels[(xpos * 3)], &indices[xpos], palette, (count - xpos));
+	}
+
+	// Same as the SSE4.1 version, with 32 pixels at a time
+	// (Note: every 32-bit group of the broadcast mask holds all 32 bits,
+	// so the in-lane byte shuffles can pick any of them)
+	void blend_line_avx2(uint8_t *pixels, const uint8_t *source, const uint64_t *mask)
+	{
+	    __m256i mask_bytes[3];
+	    __m256i mask_bits[3];
+
+	    for (int part = 0; part < 3; part++)
+	    {
+		mask_bytes[part] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&blend_mask_bytes[(part * 32)]));
+		mask_bits[part] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&blend_mask_bits[(part * 32)]));
+	    }
+
+	    for (int xpos = 0; xpos < 256; xpos += 32)
+	    {
+		uint32_t pixel_bits = uint32_t(mask[(xpos >> 6)] >> (xpos & 63));
+
+		if (pixel_bits == 0)
+		{
+		    continue;
+		}
+
+		__m256i mask_vals = _mm256_set1_epi32(int(pixel_bits));
+
+		for (int part = 0; part < 3; part++)
+		{
+		    int offs = ((xpos * 3) + (part * 32));
+		    __m256i byte_mask = _mm256_and_si256(_mm256_shuffle_epi8(mask_vals, mask_bytes[part]), mask_bits[part]);
+		    byte_mask = _mm256_cmpeq_epi8(byte_mask, mask_bits[part]);
+		    __m256i dst = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&pixels[offs]));
+		    __m256i src = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&source[offs]));
+		    _mm256_storeu_si256(reinterpret_cast<__m256i*>(&pixels[offs]), _mm256_blendv_epi8(dst, src, byte_mask));
+		}
+	    }
+	}
+
+	// Narrow 8 32-bit values (each below 256) to 8 bytes
+	static inline void store_bytes(uint8_t *dst, __m256i vals)
+	{
+	    __m256i bytes = _mm256_packus_epi16(_mm256_packus_epi32(vals, vals), _mm256_setzero_si256());
+	    __m256i order = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+	    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(bytes, order)));
+	}
+
+	// Same as the scalar version, with 8 lanes at a time and the VRAM loads done as gathers
+	// (Note: each gather loads 4 bytes from the byte offset of the lane's VRAM byte,
+	// and keeps the lowest one, hence the padding past the end of VRAM.
+	// The offsets are signed 32-bit values, so huge batches use the scalar version.)
+	void batch_fetch_avx2(const BeeVDPBatchFetch &fetch, int tile_col)
+	{
+	    if (fetch.num_lanes > size_t(INT32_MAX / 0x4000))
+	    {
+		batch_fetch_scalar(fetch, tile_col);
+		return;
+	    }
+
+	    const int *vram = reinterpret_cast<const int*>(fetch.vram);
+	    const __m256i lanes = _mm256_set1_epi32(int(fetch.num_lanes));
+	    const __m256i lane_steps = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	    const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+	    const __m256i nibble_mask = _mm256_set1_epi32(0xF);
+	    const __m256i zero = _mm256_setzero_si256();
+	    const __m256i column = _mm256_set1_epi32(tile_col);
+
+	    auto load_params = [](const uint32_t *params, size_t lane)
+	    {
+		return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&params[lane]));
+	    };
+
+	    auto load_flags = [](const uint8_t *flags, size_t lane)
+	    {
+		return _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&flags[lane])));
+	    };
+
+	    for (size_t lane = 0; lane < fetch.num_lanes; lane += 8)
+	    {
+		__m256i lane_index = _mm256_add_epi32(_mm256_set1_epi32(int(lane)), lane_steps);
+		__m256i mask = load_params(fetch.vram_mask, lane);
+
+		// Offset of each lane's byte at 'addr' (i.e. addr * lanes + lane)
+		auto vram_offset = [&](__m256i addr)
+		{
+		    return _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(addr, mask), lanes), lane_index);
+		};
+
+		__m256i name_addr = _mm256_add_epi32(load_params(fetch.name_base, lane), column);
+		__m256i name_word = _mm256_and_si256(_mm256_i32gather_epi32(vram, vram_offset(name_addr), 1), byte_mask);
+		name_word = _mm256_add_epi32(name_word, load_params(fetch.name_offs, lane));
+
+		__m256i pattern_addr = _mm256_slli_epi32(_mm256_and_si256(name_word, load_params(fetch.pattern_mask, lane)), 3);
+		pattern_addr = _mm256_add_epi32(load_params(fetch.pattern_base, lane), pattern_addr);
+		__m256i color_addr = _mm256_sllv_epi32(_mm256_and_si256(name_word, load_params(fetch.color_mask, lane)), load_params(fetch.color_shift_left, lane));
+		color_addr = _mm256_add_epi32(load_params(fetch.color_base, lane), _mm256_srlv_epi32(color_addr, load_params(fetch.color_shift_right, lane)));
+
+		__m256i pattern_byte = _mm256_and_si256(_mm256_i32gather_epi32(vram, vram_offset(pattern_addr), 1), byte_mask);
+		__m256i color_byte = _mm256_and_si256(_mm256_i32gather_epi32(vram, vram_offset(color_addr), 1), byte_mask);
+
+		// Multicolor blocks take their colors from the pattern byte
+		__m256i is_mc = _mm256_cmpgt_epi32(load_flags(fetch.is_multicolor, lane), zero);
+		__m256i colors = _mm256_blendv_epi8(color_byte, pattern_byte, is_mc);
+		__m256i backdrop = load_flags(fetch.backdrop_color, lane);
+		__m256i fg_color = _mm256_srli_epi32(colors, 4);
+		__m256i bg_color = _mm256_and_si256(colors, nibble_mask);
+		fg_color = _mm256_blendv_epi8(fg_color, backdrop, _mm256_cmpeq_epi32(fg_color, zero));
+		bg_color = _mm256_blendv_epi8(bg_color, backdrop, _mm256_cmpeq_epi32(bg_color, zero));
+
+		store_bytes(&fetch.tile_pattern[lane], _mm256_blendv_epi8(pattern_byte, _mm256_set1_epi32(0xF0), is_mc));
+		store_bytes(&fetch.tile_fg_color[lane], fg_color);
+		store_bytes(&fetch.tile_bg_color[lane], bg_color);
+	    }
+	}
+
+	// Compare 32 bytes at a time, and gather the byte masks into columns
+	uint32_t diff_columns_avx2(const uint8_t *line, const uint8_t *last_line, int first_column, int end_column)
+	{
+	    uint64_t byte_mask[12];
+
+	    for (int word = 0; word < 12; word++)
+	    {
+		uint64_t mask = 0;
+
+		for (int part = 0; part < 2; part++)
+		{
+		    int offs = ((word * 64) + (part * 32));
+		    __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&line[offs]));
+		    __m256i last_pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&last_line[offs]));
+		    uint32_t equal_bits = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(pixels, last_pixels)));
+		    mask |= (uint64_t(~equal_bits) << (part * 32));
+		}
+
+		byte_mask[word] = mask;
+	    }
+
+	    return columns_from_mask(byte_mask, first_column, end_column);
+	}
+    };
+};
+#endif // BEEVDP_SIMD_X86
@@ -0,0 +1,48 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// AVX-512 kernels (see beevdp-simd.cpp for the dispatch)
+// (Note: this file is compiled with AVX-512 F and BW enabled,
+// and must only include headers without inline functions)
+
+#ifdef BEEVDP_SIMD_X86
+#include <immintrin.h>
+#include "beevdp-simd.h"
+
+namespace beevdp
+{
+    namespace simd
+    {
+	// Compare 64 bytes at a time, which gives each word of the byte mask directly
+	uint32_t diff_columns_avx512(const uint8_t *line, const uint8_t *last_line, int first_column, int end_column)
+	{
+	    uint64_t byte_mask[12];
+
+	    for (int word = 0; word < 12; word++)
+	    {
+		__m512i pixels = _mm512_loadu_si512(&line[(word * 64)]);
+		__m512i last_pixels = _mm512_loadu_si512(&last_line[(word * 64)]);
+		byte_mask[word] = uint64_t(_mm512_cmpneq_epi8_mask(pixels, last_pixels));
+	    }
+
+	    return columns_from_mask(byte_mask, first_column, end_column);
+	}
+    };
+};
+#endif // BEEVDP_SIMD_X86
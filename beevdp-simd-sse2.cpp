@@ -0,0 +1,90 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// SSE2 kernels (see beevdp-simd.cpp for the dispatch)
+// (Note: this file is compiled with SSE2 enabled,
+// and must only include headers without inline functions)
+
+#ifdef BEEVDP_SIMD_X86
+#include <emmintrin.h>
+#include "beevdp-simd.h"
+
+namespace beevdp
+{
+    namespace simd
+    {
+	// Compare 16 bytes at a time, and gather the byte masks into columns
+	uint32_t diff_columns_sse2(const uint8_t *line, const uint8_t *last_line, int first_column, int end_column)
+	{
+	    uint64_t byte_mask[12];
+
+	    for (int word = 0; word < 12; word++)
+	    {
+		uint64_t mask = 0;
+
+		for (int part = 0; part < 4; part++)
+		{
+		    int offs = ((word * 64) + (part * 16));
+		    __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&line[offs]));
+		    __m128i last_pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&last_line[offs]));
+		    uint32_t equal_bits = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(pixels, last_pixels)));
+		    mask |= (uint64_t(equal_bits ^ 0xFFFF) << (part * 16));
+		}
+
+		byte_mask[word] = mask;
+	    }
+
+	    return columns_from_mask(byte_mask, first_column, end_column);
+	}
+
+	// Interleave the bytes of rows N and N + 8 four times over,
+	// which moves byte N of row M to byte M of row N
+	void transpose_block_sse2(uint8_t *dst, size_t dst_stride, const uint8_t *src, size_t src_stride)
+	{
+	    __m128i rows[16];
+
+	    for (int row = 0; row < 16; row++)
+	    {
+		rows[row] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&src[(row * src_stride)]));
+	    }
+
+	    for (int pass = 0; pass < 4; pass++)
+	    {
+		__m128i interleaved[16];
+
+		for (int row = 0; row < 8; row++)
+		{
+		    interleaved[(row * 2)] = _mm_unpacklo_epi8(rows[row], rows[(row + 8)]);
+		    interleaved[((row * 2) + 1)] = _mm_unpackhi_epi8(rows[row], rows[(row + 8)]);
+		}
+
+		for (int row = 0; row < 16; row++)
+		{
+		    rows[row] = interleaved[row];
+		}
+	    }
+
+	    for (int row = 0; row < 16; row++)
+	    {
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&dst[(row * dst_stride)]), rows[row]);
+	    }
+	}
+    };
+};
+#endif // BEEVDP_SIMD_X86
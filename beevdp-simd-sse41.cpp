@@ -0,0 +1,117 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// SSE4.1 kernels (see beevdp-simd.cpp for the dispatch)
+// (Note: this file is compiled with SSE4.1 enabled,
+// and must only include headers without inline functions)
+
+#ifdef BEEVDP_SIMD_X86
+#include <smmintrin.h>
+#include "beevdp-simd.h"
+
+namespace beevdp
+{
+    namespace simd
+    {
+	// Look up 16 pixels at a time in the palette's red, green and blue planes,
+	// then interleave the planes into 48 bytes of RGB
+	void convert_line_sse41(uint8_t *pixels, const uint8_t *indices, const uint8_t *palette, int count)
+	{
+	    alignas(16) uint8_t planes[3][16];
+
+	    for (int color = 0; color < 16; color++)
+	    {
+		planes[0][color] = palette[(color * 3)];
+		planes[1][color] = palette[((color * 3) + 1)];
+		planes[2][color] = palette[((color * 3) + 2)];
+	    }
+
+	    __m128i channels[3];
+	    __m128i masks[3][3];
+
+	    for (int channel = 0; channel < 3; channel++)
+	    {
+		channels[channel] = _mm_load_si128(reinterpret_cast<const __m128i*>(planes[channel]));
+
+		for (int part = 0; part < 3; part++)
+		{
+		    masks[part][channel] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rgb_interleave[part][channel]));
+		}
+	    }
+
+	    const __m128i index_mask = _mm_set1_epi8(0x0F);
+	    int xpos = 0;
+
+	    for (; (xpos + 16) <= count; xpos += 16)
+	    {
+		__m128i index_vals = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&indices[xpos])), index_mask);
+		__m128i red = _mm_shuffle_epi8(channels[0], index_vals);
+		__m128i green = _mm_shuffle_epi8(channels[1], index_vals);
+		__m128i blue = _mm_shuffle_epi8(channels[2], index_vals);
+
+		for (int part = 0; part < 3; part++)
+		{
+		    __m128i rgb = _mm_or_si128(_mm_shuffle_epi8(red, masks[part][0]), _mm_shuffle_epi8(green, masks[part][1]));
+		    rgb = _mm_or_si128(rgb, _mm_shuffle_epi8(blue, masks[part][2]));
+		    _mm_storeu_si128(reinterpret_cast<__m128i*>(&pixels[((xpos * 3) + (part * 16))]), rgb);
+		}
+	    }
+
+	    convert_line_scalar(&pixels[(xpos * 3)], &indices[xpos], palette, (count - xpos));
+	}
+
+	// Spread the mask bits of 16 pixels over their 48 bytes with byte shuffles,
+	// then blend the source into those bytes
+	// (Note: runs of 16 pixels that keep their colors are skipped)
+	void blend_line_sse41(uint8_t *pixels, const uint8_t *source, const uint64_t *mask)
+	{
+	    __m128i mask_bytes[3];
+	    __m128i mask_bits[3];
+
+	    for (int part = 0; part < 3; part++)
+	    {
+		mask_bytes[part] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&blend_mask_bytes[(part * 16)]));
+		mask_bits[part] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&blend_mask_bits[(part * 16)]));
+	    }
+
+	    for (int xpos = 0; xpos < 256; xpos += 16)
+	    {
+		uint32_t pixel_bits = uint32_t((mask[(xpos >> 6)] >> (xpos & 63)) & 0xFFFF);
+
+		if (pixel_bits == 0)
+		{
+		    continue;
+		}
+
+		__m128i mask_vals = _mm_set1_epi32(int(pixel_bits));
+
+		for (int part = 0; part < 3; part++)
+		{
+		    int offs = ((xpos * 3) + (part * 16));
+		    __m128i byte_mask = _mm_and_si128(_mm_shuffle_epi8(mask_vals, mask_bytes[part]), mask_bits[part]);
+		    byte_mask = _mm_cmpeq_epi8(byte_mask, mask_bits[part]);
+		    __m128i dst = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&pixels[offs]));
+		    __m128i src = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&source[offs]));
+		    _mm_storeu_si128(reinterpret_cast<__m128i*>(&pixels[offs]), _mm_blendv_epi8(dst, src, byte_mask));
+		}
+	    }
+	}
+    };
+};
+#endif // BEEVDP_SIMD_X86
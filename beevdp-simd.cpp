@@ -0,0 +1,455 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Runtime instruction set dispatch for the per-scanline kernels
+//
+// Every kernel has a scalar version (below), and x86 builds also include
+// vectorized versions in separate translation units, each compiled
+// for its own instruction set (see beevdp-simd-*.cpp).
+// The highest level the CPU supports is picked once, on first use,
+// so a single binary runs on anything from a baseline x86-64 CPU upwards.
+// Levels without a better kernel of their own use the one from the level below
+// (e.g. palette conversion needs SSSE3's byte shuffles, so the SSE2 level
+// converts pixels with the scalar kernel).
+
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include "beevdp-simd.h"
+
+#ifdef BEEVDP_SIMD_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+using namespace beevdp;
+using namespace std;
+
+namespace beevdp
+{
+    namespace simd
+    {
+	void convert_line_scalar(uint8_t *pixels, const uint8_t *indices, const uint8_t *palette, int count)
+	{
+	    for (int xpos = 0; xpos < count; xpos++)
+	    {
+		memcpy(&pixels[(xpos * 3)], &palette[((indices[xpos] & 0xF) * 3)], 3);
+	    }
+	}
+
+	uint32_t diff_columns_scalar(const uint8_t *line, const uint8_t *last_line, int first_column, int end_column)
+	{
+	    uint32_t columns = 0;
+
+	    for (int column = first_column; column < end_column; column++)
+	    {
+		uint64_t words[3];
+		uint64_t last_words[3];
+		memcpy(words, &line[(column * 24)], 24);
+		memcpy(last_words, &last_line[(column * 24)], 24);
+
+		if (((words[0] ^ last_words[0]) | (words[1] ^ last_words[1]) | (words[2] ^ last_words[2])) != 0)
+		{
+		    columns |= (1u << column);
+		}
+	    }
+
+	    return columns;
+	}
+
+	void blend_line_scalar(uint8_t *pixels, const uint8_t *source, const uint64_t *mask)
+	{
+	    for (int word = 0; word < 4; word++)
+	    {
+		// (Note: runs of 64 pixels that keep their colors are skipped)
+		if (mask[word] == 0)
+		{
+		    continue;
+		}
+
+		for (int xpos = (word * 64); xpos < ((word + 1) * 64); xpos++)
+		{
+		    // Every bit of the byte mask is set for pixels taken from 'source'
+		    uint8_t byte_mask = uint8_t(0 - ((mask[word] >> (xpos & 63)) & 1));
+
+		    for (int offs = (xpos * 3); offs < ((xpos * 3) + 3); offs++)
+		    {
+			pixels[offs] = uint8_t((pixels[offs] & ~byte_mask) | (source[offs] & byte_mask));
+		    }
+		}
+	    }
+	}
+
+	void batch_fetch_scalar(const BeeVDPBatchFetch &fetch, int tile_col)
+	{
+	    const size_t lanes = fetch.num_lanes;
+
+	    for (size_t lane = 0; lane < lanes; lane++)
+	    {
+		uint32_t mask = fetch.vram_mask[lane];
+		uint32_t name_word = (fetch.vram[((((fetch.name_base[lane] + tile_col) & mask) * lanes) + lane)] + fetch.name_offs[lane]);
+		uint32_t pattern_addr = ((fetch.pattern_base[lane] + ((name_word & fetch.pattern_mask[lane]) << 3)) & mask);
+		uint32_t color_addr = ((fetch.color_base[lane] + (((name_word & fetch.color_mask[lane]) << fetch.color_shift_left[lane]) >> fetch.color_shift_right[lane])) & mask);
+		uint8_t pattern_byte = fetch.vram[((pattern_addr * lanes) + lane)];
+		uint8_t color_byte = fetch.vram[((color_addr * lanes) + lane)];
+
+		// Multicolor blocks are expressed as a fixed 4+4 pixel pattern,
+		// with the colors taken from the pattern byte
+		bool is_mc = (fetch.is_multicolor[lane] != 0);
+		uint8_t colors = (is_mc) ? pattern_byte : color_byte;
+		uint8_t fg_color = (colors >> 4);
+		uint8_t bg_color = (colors & 0xF);
+		uint8_t backdrop = fetch.backdrop_color[lane];
+
+		fetch.tile_pattern[lane] = (is_mc) ? 0xF0 : pattern_byte;
+		fetch.tile_fg_color[lane] = (fg_color != 0) ? fg_color : backdrop;
+		fetch.tile_bg_color[lane] = (bg_color != 0) ? bg_color : backdrop;
+	    }
+	}
+
+	// Load 8 bytes as a 64-bit word (with the first byte in the lowest bits)
+	static inline uint64_t load_word(const uint8_t *src)
+	{
+	    uint64_t word = 0;
+
+	    for (int byte = 0; byte < 8; byte++)
+	    {
+		word |= (uint64_t(src[byte]) << (byte * 8));
+	    }
+
+	    return word;
+	}
+
+	// Store a 64-bit word as 8 bytes (with the lowest bits in the first byte)
+	static inline void store_word(uint8_t *dst, uint64_t word)
+	{
+	    for (int byte = 0; byte < 8; byte++)
+	    {
+		dst[byte] = uint8_t(word >> (byte * 8));
+	    }
+	}
+
+	// Transpose each 8x8 quadrant with 64-bit words (swapping 1x1, then 2x2,
+	// then 4x4 sub-blocks across the diagonal), and swap the off-diagonal quadrants
+	void transpose_block_scalar(uint8_t *dst, size_t dst_stride, const uint8_t *src, size_t src_stride)
+	{
+	    for (int quadrant = 0; quadrant < 4; quadrant++)
+	    {
+		int src_row = ((quadrant >> 1) * 8);
+		int src_col = ((quadrant & 1) * 8);
+		uint64_t rows[8];
+
+		for (int row = 0; row < 8; row++)
+		{
+		    rows[row] = load_word(&src[(((src_row + row) * src_stride) + src_col)]);
+		}
+
+		for (int row = 0; row < 8; row += 2)
+		{
+		    uint64_t swap = (((rows[row] >> 8) ^ rows[(row + 1)]) & 0x00FF00FF00FF00FFULL);
+		    rows[(row + 1)] ^= swap;
+		    rows[row] ^= (swap << 8);
+		}
+
+		for (int row : {0, 1, 4, 5})
+		{
+		    uint64_t swap = (((rows[row] >> 16) ^ rows[(row + 2)]) & 0x0000FFFF0000FFFFULL);
+		    rows[(row + 2)] ^= swap;
+		    rows[row] ^= (swap << 16);
+		}
+
+		for (int row = 0; row < 4; row++)
+		{
+		    uint64_t swap = (((rows[row] >> 32) ^ rows[(row + 4)]) & 0x00000000FFFFFFFFULL);
+		    rows[(row + 4)] ^= swap;
+		    rows[row] ^= (swap << 32);
+		}
+
+		for (int row = 0; row < 8; row++)
+		{
+		    store_word(&dst[(((src_col + row) * dst_stride) + src_row)], rows[row]);
+		}
+	    }
+	}
+
+	// Shuffle controls that interleave 16 red, green and blue bytes into 48 bytes of RGB,
+	// indexed by [output vector][channel] (0x80 leaves the byte clear)
+	const uint8_t rgb_interleave[3][3][16] =
+	{
+	    {
+		{0x00, 0x80, 0x80, 0x01, 0x80, 0x80, 0x02, 0x80, 0x80, 0x03, 0x80, 0x80, 0x04, 0x80, 0x80, 0x05},
+		{0x80, 0x00, 0x80, 0x80, 0x01, 0x80, 0x80, 0x02, 0x80, 0x80, 0x03, 0x80, 0x80, 0x04, 0x80, 0x80},
+		{0x80, 0x80, 0x00, 0x80, 0x80, 0x01, 0x80, 0x80, 0x02, 0x80, 0x80, 0x03, 0x80, 0x80, 0x04, 0x80},
+	    },
+	    {
+		{0x80, 0x80, 0x06, 0x80, 0x80, 0x07, 0x80, 0x80, 0x08, 0x80, 0x80, 0x09, 0x80, 0x80, 0x0A, 0x80},
+		{0x05, 0x80, 0x80, 0x06, 0x80, 0x80, 0x07, 0x80, 0x80, 0x08, 0x80, 0x80, 0x09, 0x80, 0x80, 0x0A},
+		{0x80, 0x05, 0x80, 0x80, 0x06, 0x80, 0x80, 0x07, 0x80, 0x80, 0x08, 0x80, 0x80, 0x09, 0x80, 0x80},
+	    },
+	    {
+		{0x80, 0x0B, 0x80, 0x80, 0x0C, 0x80, 0x80, 0x0D, 0x80, 0x80, 0x0E, 0x80, 0x80, 0x0F, 0x80, 0x80},
+		{0x80, 0x80, 0x0B, 0x80, 0x80, 0x0C, 0x80, 0x80, 0x0D, 0x80, 0x80, 0x0E, 0x80, 0x80, 0x0F, 0x80},
+		{0x0A, 0x80, 0x80, 0x0B, 0x80, 0x80, 0x0C, 0x80, 0x80, 0x0D, 0x80, 0x80, 0x0E, 0x80, 0x80, 0x0F},
+	    },
+	};
+
+	const uint8_t blend_mask_bytes[96] =
+	{
+	    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	    0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	    0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+	    0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+	    0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	    0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	};
+
+	const uint8_t blend_mask_bits[96] =
+	{
+	    0x01, 0x01, 0x01, 0x02, 0x02, 0x02, 0x04, 0x04, 0x04, 0x08, 0x08, 0x08,
+	    0x10, 0x10, 0x10, 0x20, 0x20, 0x20, 0x40, 0x40, 0x40, 0x80, 0x80, 0x80,
+	    0x01, 0x01, 0x01, 0x02, 0x02, 0x02, 0x04, 0x04, 0x04, 0x08, 0x08, 0x08,
+	    0x10, 0x10, 0x10, 0x20, 0x20, 0x20, 0x40, 0x40, 0x40, 0x80, 0x80, 0x80,
+	    0x01, 0x01, 0x01, 0x02, 0x02, 0x02, 0x04, 0x04, 0x04, 0x08, 0x08, 0x08,
+	    0x10, 0x10, 0x10, 0x20, 0x20, 0x20, 0x40, 0x40, 0x40, 0x80, 0x80, 0x80,
+	    0x01, 0x01, 0x01, 0x02, 0x02, 0x02, 0x04, 0x04, 0x04, 0x08, 0x08, 0x08,
+	    0x10, 0x10, 0x10, 0x20, 0x20, 0x20, 0x40, 0x40, 0x40, 0x80, 0x80, 0x80,
+	};
+
+	uint32_t columns_from_mask(const uint64_t *byte_mask, int first_column, int end_column)
+	{
+	    uint32_t columns = 0;
+
+	    for (int column = first_column; column < end_column; column++)
+	    {
+		// Each column covers 24 bits of the mask, which may straddle two words
+		int bit = (column * 24);
+		int word = (bit >> 6);
+		int shift = (bit & 63);
+		uint64_t bits = (byte_mask[word] >> shift);
+
+		if (shift > 40)
+		{
+		    bits |= (byte_mask[(word + 1)] << (64 - shift));
+		}
+
+		if ((bits & 0xFFFFFF) != 0)
+		{
+		    columns |= (1u << column);
+		}
+	    }
+
+	    return columns;
+	}
+    };
+
+#ifdef BEEVDP_SIMD_X86
+    static void read_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+    {
+#if defined(_MSC_VER)
+	int values[4];
+	__cpuidex(values, int(leaf), int(subleaf));
+
+	for (int index = 0; index < 4; index++)
+	{
+	    regs[index] = uint32_t(values[index]);
+	}
+#else
+	if (!__get_cpuid_count(leaf, subleaf, &regs[0], &regs[1], &regs[2], &regs[3]))
+	{
+	    regs[0] = regs[1] = regs[2] = regs[3] = 0;
+	}
+#endif
+    }
+
+    // Fetch the register states the OS saves on context switches (XCR0)
+    static uint64_t read_xcr0()
+    {
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	uint32_t low = 0;
+	uint32_t high = 0;
+	__asm__ volatile ("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+	return ((uint64_t(high) << 32) | low);
+#endif
+    }
+#endif
+
+    BeeVDPISALevel detectISALevel()
+    {
+#ifdef BEEVDP_SIMD_X86
+	uint32_t leaf1[4];
+	uint32_t leaf7[4];
+	read_cpuid(1, 0, leaf1);
+	read_cpuid(7, 0, leaf7);
+
+	bool is_sse2 = ((leaf1[3] >> 26) & 1);
+	bool is_ssse3 = ((leaf1[2] >> 9) & 1);
+	bool is_sse41 = ((leaf1[2] >> 19) & 1);
+	bool is_osxsave = ((leaf1[2] >> 27) & 1);
+	bool is_avx = ((leaf1[2] >> 28) & 1);
+
+	if (!is_sse2)
+	{
+	    return ISAScalar;
+	}
+
+	if (!is_ssse3 || !is_sse41)
+	{
+	    return ISASSE2;
+	}
+
+	// The AVX registers are only usable if the OS saves them
+	// (i.e. the XMM and YMM state bits of XCR0 are set)
+	uint64_t xcr0 = (is_osxsave) ? read_xcr0() : 0;
+	bool is_avx2 = (is_avx && ((xcr0 & 0x6) == 0x6) && ((leaf7[1] >> 5) & 1));
+
+	if (!is_avx2)
+	{
+	    return ISASSE41;
+	}
+
+	// AVX-512 also needs the opmask and upper ZMM state bits
+	bool is_avx512f = ((leaf7[1] >> 16) & 1);
+	bool is_avx512bw = ((leaf7[1] >> 30) & 1);
+
+	if (!is_avx512f || !is_avx512bw || ((xcr0 & 0xE6) != 0xE6))
+	{
+	    return ISAAVX2;
+	}
+
+	return ISAAVX512;
+#else
+	return ISAScalar;
+#endif
+    }
+
+    const char *isaLevelName(BeeVDPISALevel level)
+    {
+	switch (level)
+	{
+	    case ISAScalar: return "scalar";
+	    case ISASSE2: return "sse2";
+	    case ISASSE41: return "sse4.1";
+	    case ISAAVX2: return "avx2";
+	    case ISAAVX512: return "avx512";
+	    default: return "unknown";
+	}
+    }
+
+    // Build the kernel table for the given level
+    static BeeVDPKernels make_kernels(BeeVDPISALevel level)
+    {
+	BeeVDPKernels kernels = {simd::convert_line_scalar, simd::diff_columns_scalar, simd::blend_line_scalar, simd::batch_fetch_scalar, simd::transpose_block_scalar};
+
+#ifdef BEEVDP_SIMD_X86
+	if (level >= ISASSE2)
+	{
+	    kernels.diff_columns = simd::diff_columns_sse2;
+	    kernels.transpose_block = simd::transpose_block_sse2;
+	}
+
+	if (level >= ISASSE41)
+	{
+	    kernels.convert_line = simd::convert_line_sse41;
+	    kernels.blend_line = simd::blend_line_sse41;
+	}
+
+	if (level >= ISAAVX2)
+	{
+	    kernels.convert_line = simd::convert_line_avx2;
+	    kernels.diff_columns = simd::diff_columns_avx2;
+	    kernels.blend_line = simd::blend_line_avx2;
+	    kernels.batch_fetch = simd::batch_fetch_avx2;
+	}
+
+	// (Note: the AVX2 palette conversion and blends are already limited by the stores,
+	// so only the comparison gets an AVX-512 version)
+	if (level >= ISAAVX512)
+	{
+	    kernels.diff_columns = simd::diff_columns_avx512;
+	}
+#else
+	(void)level;
+#endif
+
+	return kernels;
+    }
+
+    struct BeeVDPDispatch
+    {
+	BeeVDPISALevel level;
+	BeeVDPKernels kernels;
+    };
+
+    // Pick the starting level, honoring the BEEVDP_ISA environment variable
+    static BeeVDPISALevel initial_level()
+    {
+	BeeVDPISALevel level = detectISALevel();
+	const char *name = getenv("BEEVDP_ISA");
+
+	if (name == nullptr)
+	{
+	    return level;
+	}
+
+	for (int index = 0; index < NumISALevels; index++)
+	{
+	    if (strcmp(name, isaLevelName(BeeVDPISALevel(index))) == 0)
+	    {
+		return min(level, BeeVDPISALevel(index));
+	    }
+	}
+
+	return level;
+    }
+
+    static BeeVDPDispatch make_dispatch(BeeVDPISALevel level)
+    {
+	return {level, make_kernels(level)};
+    }
+
+    static BeeVDPDispatch &get_dispatch()
+    {
+	static BeeVDPDispatch dispatch = make_dispatch(initial_level());
+	return dispatch;
+    }
+
+    BeeVDPISALevel setISALevel(BeeVDPISALevel level)
+    {
+	BeeVDPISALevel new_level = clamp(level, ISAScalar, detectISALevel());
+	get_dispatch() = make_dispatch(new_level);
+	return new_level;
+    }
+
+    BeeVDPISALevel getISALevel()
+    {
+	return get_dispatch().level;
+    }
+
+    const BeeVDPKernels &getKernels()
+    {
+	return get_dispatch().kernels;
+    }
+};
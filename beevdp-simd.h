@@ -0,0 +1,145 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BEEVDP_SIMD_H
+#define BEEVDP_SIMD_H
+
+#include <cstdint>
+#include <cstddef>
+
+// (Note: this header is included by the translation units
+// built for each instruction set, so it deliberately doesn't pull in
+// beevdp.h or any other header with inline functions, which the linker
+// could otherwise pick from a translation unit built for a newer instruction set)
+
+namespace beevdp
+{
+    // Instruction set levels the vectorized kernels are built for
+    // (each level includes all of the levels below it)
+    enum BeeVDPISALevel : int
+    {
+	ISAScalar = 0,
+	ISASSE2,
+	// SSE4.1 (and SSSE3)
+	ISASSE41,
+	ISAAVX2,
+	// AVX-512 F and BW
+	ISAAVX512,
+	NumISALevels,
+    };
+
+    // Per-lane parameters of a batch renderer tile fetch (see beevdp-batch.cpp)
+    // (Note: every array holds one entry per lane, and VRAM is laid out
+    // as [address][lane], with at least 3 bytes of padding past the end)
+    struct BeeVDPBatchFetch
+    {
+	size_t num_lanes;
+	const uint8_t *vram;
+	const uint32_t *name_base;
+	const uint32_t *name_offs;
+	const uint32_t *pattern_base;
+	const uint32_t *pattern_mask;
+	const uint32_t *color_base;
+	const uint32_t *color_mask;
+	const uint32_t *color_shift_left;
+	const uint32_t *color_shift_right;
+	const uint32_t *vram_mask;
+	const uint8_t *is_multicolor;
+	const uint8_t *backdrop_color;
+	// Pattern byte and colors of the tile, for every lane
+	uint8_t *tile_pattern;
+	uint8_t *tile_fg_color;
+	uint8_t *tile_bg_color;
+    };
+
+    // Per-scanline kernels, picked once for the instruction set level in use
+    // (Note: RGB pixels are passed as bytes, 3 bytes per pixel)
+    struct BeeVDPKernels
+    {
+	// Convert 'count' palette numbers (masked to 4 bits) to RGB pixels
+	// with a 16-color palette
+	void (*convert_line)(uint8_t *pixels, const uint8_t *indices, const uint8_t *palette, int count);
+	// Compare two 256-pixel scanlines, and set bit N of the result
+	// if any pixel in column N (i.e. pixels 8N to 8N + 7) differs,
+	// for columns 'first_column' to 'end_column' - 1
+	uint32_t (*diff_columns)(const uint8_t *line, const uint8_t *last_line, int first_column, int end_column);
+	// Copy the pixels of a 256-pixel scanline selected by 'mask' from 'source'
+	// (i.e. bit N of word W selects pixel (W * 64) + N)
+	void (*blend_line)(uint8_t *pixels, const uint8_t *source, const uint64_t *mask);
+	// Fetch the pattern byte and colors of tile column 'tile_col' for every lane of a batch
+	// (Note: 'num_lanes' must be a multiple of 32)
+	void (*batch_fetch)(const BeeVDPBatchFetch &fetch, int tile_col);
+	// Transpose a 16x16 block of bytes (i.e. byte N of source row M
+	// becomes byte M of destination row N), with rows 'stride' bytes apart
+	void (*transpose_block)(uint8_t *dst, size_t dst_stride, const uint8_t *src, size_t src_stride);
+    };
+
+    // Fetch the highest level supported by both the CPU (according to CPUID)
+    // and the build (x86 builds include every level, other builds only the scalar one)
+    BeeVDPISALevel detectISALevel();
+
+    // Force the kernels of a specific level (e.g. for testing),
+    // and return the level actually in use (which never exceeds detectISALevel())
+    // (Note: the BEEVDP_ISA environment variable, set to one of the level names,
+    // does the same when the kernels are first used.
+    // This should not be called while any VDP is being clocked.)
+    BeeVDPISALevel setISALevel(BeeVDPISALevel level);
+    BeeVDPISALevel getISALevel();
+    const char *isaLevelName(BeeVDPISALevel level);
+
+    // Fetch the kernels for the level in use
+    const BeeVDPKernels &getKernels();
+
+    // Kernels for each instruction set level
+    // (Note: the scalar kernels are always available, and the others
+    // only exist in x86 builds, where they're compiled with the matching flags)
+    namespace simd
+    {
+	void convert_line_scalar(uint8_t *pixels, const uint8_t *indices, const uint8_t *palette, int count);
+	uint32_t diff_columns_scalar(const uint8_t *line, const uint8_t *last_line, int first_column, int end_column);
+	void blend_line_scalar(uint8_t *pixels, const uint8_t *source, const uint64_t *mask);
+	void batch_fetch_scalar(const BeeVDPBatchFetch &fetch, int tile_col);
+	void transpose_block_scalar(uint8_t *dst, size_t dst_stride, const uint8_t *src, size_t src_stride);
+
+	extern const uint8_t rgb_interleave[3][3][16];
+
+	// Byte of a 32-bit pixel mask, and the bit within that byte,
+	// that select each of the 96 bytes of 32 RGB pixels
+	extern const uint8_t blend_mask_bytes[96];
+	extern const uint8_t blend_mask_bits[96];
+
+	// Gather a mask with one bit per differing byte of a 768-byte scanline
+	// into one bit per 24-byte column
+	uint32_t columns_from_mask(const uint64_t *byte_mask, int first_column, int end_column);
+
+#ifdef BEEVDP_SIMD_X86
+	uint32_t diff_columns_sse2(const uint8_t *line, const uint8_t *last_line, int first_column, int end_column);
+	void transpose_block_sse2(uint8_t *dst, size_t dst_stride, const uint8_t *src, size_t src_stride);
+	void convert_line_sse41(uint8_t *pixels, const uint8_t *indices, const uint8_t *palette, int count);
+	void blend_line_sse41(uint8_t *pixels, const uint8_t *source, const uint64_t *mask);
+	void convert_line_avx2(uint8_t *pixels, const uint8_t *indices, const uint8_t *palette, int count);
+	void blend_line_avx2(uint8_t *pixels, const uint8_t *source, const uint64_t *mask);
+	void batch_fetch_avx2(const BeeVDPBatchFetch &fetch, int tile_col);
+	uint32_t diff_columns_avx2(const uint8_t *line, const uint8_t *last_line, int first_column, int end_column);
+	uint32_t diff_columns_avx512(const uint8_t *line, const uint8_t *last_line, int first_column, int end_column);
+#endif
+    };
+};
+
+#endif // BEEVDP_SIMD_H
@@ -0,0 +1,865 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Notes on the Sega VDP implementation:
+// This core provides Mode 4 of the Master System and Game Gear VDPs,
+// on top of the same control/data port protocol as the TMS99xxA cores
+// (with code 2 selecting a register write and code 3 selecting CRAM).
+//
+// The 4bpp planar tiles are kept in a decoded tile cache,
+// which holds one row of 8 chunky pixels for each VRAM longword.
+// Every data port write to VRAM updates the affected row,
+// so the fast renderer never has to de-interleave bitplanes.
+// The reference renderer reads the bitplanes straight from VRAM,
+// and is used to verify the tile cache.
+//
+// The VDP is clocked once per scanline, so register writes
+// (including the scroll registers) take effect on the next scanline.
+//
+// TODO list:
+// Implement the legacy TMS9918A modes (i.e. Mode 4 disabled)
+// Implement the 224 and 240-line modes, and PAL timing
+// Implement the Game Gear's SMS compatibility mode
+
+#include <algorithm>
+#include "beevdp-sms.h"
+using namespace beevdp;
+using namespace std;
+
+namespace beevdp
+{
+    // Spread the bits of a single bitplane byte into the low bit of each byte,
+    // with the leftmost pixel (i.e. bit 7) in the lowest byte
+    static array<uint64_t, 256> make_plane_expand()
+    {
+	array<uint64_t, 256> table;
+
+	for (int value = 0; value < 256; value++)
+	{
+	    uint64_t row = 0;
+
+	    for (int pixel = 0; pixel < 8; pixel++)
+	    {
+		if ((value >> (7 - pixel)) & 1)
+		{
+		    row |= (uint64_t(1) << (pixel * 8));
+		}
+	    }
+
+	    table[value] = row;
+	}
+
+	return table;
+    }
+
+    static const array<uint64_t, 256> plane_expand = make_plane_expand();
+
+    // Reverse the order of the pixels in a decoded tile row
+    // (used for horizontally flipped tiles)
+    static uint64_t flip_row(uint64_t row)
+    {
+	row = (((row >> 8) & 0x00FF00FF00FF00FFULL) | ((row & 0x00FF00FF00FF00FFULL) << 8));
+	row = (((row >> 16) & 0x0000FFFF0000FFFFULL) | ((row & 0x0000FFFF0000FFFFULL) << 16));
+	return ((row >> 32) | (row << 32));
+    }
+
+    template<typename Variant>
+    SegaVDP<Variant>::SegaVDP()
+    {
+	memory_resource = pmr::get_default_resource();
+    }
+
+    template<typename Variant>
+    SegaVDP<Variant>::~SegaVDP()
+    {
+	free_storage();
+    }
+
+    // Set the memory resource used to allocate VRAM and the framebuffers
+    template<typename Variant>
+    void SegaVDP<Variant>::setMemoryResource(pmr::memory_resource *resource)
+    {
+	free_storage();
+	memory_resource = (resource != nullptr) ? resource : pmr::get_default_resource();
+    }
+
+    // Run without any framebuffers
+    template<typename Variant>
+    void SegaVDP<Variant>::setHeadless(bool is_enabled)
+    {
+	free_storage();
+	is_headless = is_enabled;
+    }
+
+    // Set how often frames are rendered
+    // (Note: timing, status flags and IRQs are unaffected by skipped frames)
+    template<typename Variant>
+    void SegaVDP<Variant>::setRenderInterval(int interval)
+    {
+	// (Note: the frame in progress keeps its current setting,
+	// and publish_frame() applies the new interval from the next frame on)
+	render_interval = max(interval, 0);
+    }
+
+    // Set the callback for finished scanlines
+    template<typename Variant>
+    void SegaVDP<Variant>::setLineCallback(BeeVDPLineCallback callback)
+    {
+	line_callback = move(callback);
+    }
+
+    // Set the callback for the start of VBlank
+    template<typename Variant>
+    void SegaVDP<Variant>::setVBlankCallback(BeeVDPVBlankCallback callback)
+    {
+	vblank_callback = move(callback);
+    }
+
+    // Allocate VRAM and the framebuffers (if needed)
+    template<typename Variant>
+    void SegaVDP<Variant>::allocate_storage()
+    {
+	if (vram == nullptr)
+	{
+	    vram = static_cast<uint8_t*>(memory_resource->allocate(vram_size, alignof(uint64_t)));
+	}
+
+	if (!is_headless && (frame_ring == nullptr))
+	{
+	    using FrameRing = BeeVDPTripleBuffer<SegaVDPFrame>;
+	    void *ring_mem = memory_resource->allocate(sizeof(FrameRing), alignof(FrameRing));
+	    frame_ring = new (ring_mem) FrameRing();
+	}
+    }
+
+    // Release any storage owned by the VDP
+    template<typename Variant>
+    void SegaVDP<Variant>::free_storage()
+    {
+	using FrameRing = BeeVDPTripleBuffer<SegaVDPFrame>;
+
+	if (frame_ring != nullptr)
+	{
+	    frame_ring->~FrameRing();
+	    memory_resource->deallocate(frame_ring, sizeof(FrameRing), alignof(FrameRing));
+	    frame_ring = nullptr;
+	}
+
+	if (vram != nullptr)
+	{
+	    memory_resource->deallocate(vram, vram_size, alignof(uint64_t));
+	    vram = nullptr;
+	}
+    }
+
+    // Initialize the VDP
+    template<typename Variant>
+    void SegaVDP<Variant>::init()
+    {
+	allocate_storage();
+
+	// Fill VRAM with random data to simulate
+	// the real hardware
+	srand(time(NULL));
+	for (uint32_t i = 0; i < vram_size; i++)
+	{
+	    vram[i] = (rand() & 0xFF);
+	}
+
+	for (uint32_t addr = 0; addr < vram_size; addr += 4)
+	{
+	    update_tile_row(addr);
+	}
+
+	regs.fill(0);
+	cram.fill(0);
+	cram_latch = 0;
+
+	for (int index = 0; index < 32; index++)
+	{
+	    update_cram_rgb(index);
+	}
+
+	if (frame_ring != nullptr)
+	{
+	    frame_ring->clear();
+	}
+
+	is_second_control_write = false;
+	command_word = 0;
+	addr_register = 0;
+	code_register = 0;
+	read_buffer = 0;
+	is_frame_flag = false;
+	is_overflow_flag = false;
+	is_collision_flag = false;
+	line_counter = 0;
+	is_line_irq_pending = false;
+	frame_count = 0;
+	is_frame_rendered = (render_interval != 0);
+	vcounter = 0;
+	cout << Variant::name << "::Initialized" << endl;
+    }
+
+    // Power off the VDP
+    template<typename Variant>
+    void SegaVDP<Variant>::shutdown()
+    {
+	cout << Variant::name << "::Shutting down..." << endl;
+    }
+
+    // Check if Mode 4 is enabled (R0 bit 2)
+    template<typename Variant>
+    bool SegaVDP<Variant>::is_mode4() const
+    {
+	return testbit(regs[0], 2);
+    }
+
+    // Check if the display is enabled (R1 bit 6)
+    template<typename Variant>
+    bool SegaVDP<Variant>::is_display_enabled() const
+    {
+	return testbit(regs[1], 6);
+    }
+
+    // Fetch the base address of the name table
+    template<typename Variant>
+    uint32_t SegaVDP<Variant>::name_table() const
+    {
+	return ((regs[2] & 0x0E) << 10);
+    }
+
+    // Fetch the base address of the sprite attribute table
+    template<typename Variant>
+    uint32_t SegaVDP<Variant>::sprite_table() const
+    {
+	return ((regs[5] & 0x7E) << 7);
+    }
+
+    // Fetch the backdrop color
+    // (Note: this is always taken from the sprite palette)
+    template<typename Variant>
+    uint8_t SegaVDP<Variant>::backdrop_color() const
+    {
+	return (16 + (regs[7] & 0xF));
+    }
+
+    // Convert a CRAM entry to 24-bit RGB
+    template<typename Variant>
+    void SegaVDP<Variant>::update_cram_rgb(int index)
+    {
+	if constexpr (Variant::is_game_gear)
+	{
+	    // Format of CRAM data is GGGGRRRR, then ----BBBB
+	    uint8_t low = cram[(index * 2)];
+	    uint8_t high = cram[(index * 2) + 1];
+	    int red = (low & 0xF);
+	    int green = (low >> 4);
+	    int blue = (high & 0xF);
+	    cram_rgb[index] = {uint8_t(red * 17), uint8_t(green * 17), uint8_t(blue * 17)};
+	}
+	else
+	{
+	    // Format of CRAM data is --BBGGRR
+	    uint8_t color = cram[index];
+	    int red = (color & 0x3);
+	    int green = ((color >> 2) & 0x3);
+	    int blue = ((color >> 4) & 0x3);
+	    cram_rgb[index] = {uint8_t(red * 85), uint8_t(green * 85), uint8_t(blue * 85)};
+	}
+    }
+
+    // Decode the tile row containing VRAM address 'addr' into the tile cache
+    template<typename Variant>
+    void SegaVDP<Variant>::update_tile_row(uint32_t addr)
+    {
+	uint32_t row_addr = (addr & vram_mask & ~3);
+	uint64_t row = plane_expand[vram[row_addr]];
+	row |= (plane_expand[vram[row_addr + 1]] << 1);
+	row |= (plane_expand[vram[row_addr + 2]] << 2);
+	row |= (plane_expand[vram[row_addr + 3]] << 3);
+	tile_rows[(row_addr >> 2)] = row;
+    }
+
+    // Write to a VDP register
+    template<typename Variant>
+    void SegaVDP<Variant>::write_reg(int reg, uint8_t data)
+    {
+	// Ignore writes to invalid registers
+	// (i.e. not registers 0-10)
+	if (reg > 10)
+	{
+	    return;
+	}
+
+	regs[reg] = data;
+    }
+
+    // Write to CRAM
+    template<typename Variant>
+    void SegaVDP<Variant>::write_cram(uint8_t data)
+    {
+	if constexpr (Variant::is_game_gear)
+	{
+	    // The Game Gear latches even bytes,
+	    // and writes both bytes of the color at once on odd bytes
+	    int addr = (addr_register & 0x3F);
+
+	    if ((addr & 1) == 0)
+	    {
+		cram_latch = data;
+		return;
+	    }
+
+	    cram[addr - 1] = cram_latch;
+	    cram[addr] = (data & 0x0F);
+	    update_cram_rgb((addr >> 1));
+	}
+	else
+	{
+	    int addr = (addr_register & 0x1F);
+	    cram[addr] = (data & 0x3F);
+	    update_cram_rgb(addr);
+	}
+    }
+
+    // Write to a VDP register through the control port
+    // (Note: code 3 only selects CRAM for the data port)
+    template<typename Variant>
+    void SegaVDP<Variant>::port_register()
+    {
+	if (code_register == 2)
+	{
+	    write_reg(((command_word >> 8) & 0x0F), (command_word & 0xFF));
+	}
+    }
+
+    // Write data port bytes to VRAM, or to CRAM with code 3
+    template<typename Variant>
+    void SegaVDP<Variant>::port_write(uint16_t addr, uint8_t data)
+    {
+	if (code_register == 3)
+	{
+	    write_cram(data);
+	}
+	else
+	{
+	    vram[addr] = data;
+	    update_tile_row(addr);
+	}
+    }
+
+    // Fetch VRAM bytes for the data port's read buffer
+    template<typename Variant>
+    uint8_t SegaVDP<Variant>::port_read(uint16_t addr)
+    {
+	return vram[addr];
+    }
+
+    // Read from Sega VDP status port
+    // (Format of status byte is F | OVR | COL | -----)
+    template<typename Variant>
+    uint8_t SegaVDP<Variant>::readStatus()
+    {
+	reset_latch();
+	uint8_t status_byte = ((is_frame_flag << 7) | (is_overflow_flag << 6) | (is_collision_flag << 5));
+	is_frame_flag = false;
+	is_overflow_flag = false;
+	is_collision_flag = false;
+	is_line_irq_pending = false;
+	return status_byte;
+    }
+
+    // Read from Sega VDP V counter port
+    // (Note: on NTSC, the V counter jumps from 0xDA back to 0xD5)
+    template<typename Variant>
+    uint8_t SegaVDP<Variant>::readVCounter() const
+    {
+	return (vcounter <= 0xDA) ? vcounter : (vcounter - 6);
+    }
+
+    // Check if an interrupt is pending (frame or line interrupt)
+    template<typename Variant>
+    bool SegaVDP<Variant>::isInterrupt()
+    {
+	bool is_frame_irq = (is_frame_flag && testbit(regs[1], 5));
+	bool is_line_irq = (is_line_irq_pending && testbit(regs[0], 4));
+	return (is_frame_irq || is_line_irq);
+    }
+
+    // Fetch the most recently completed frame without copying it
+    template<typename Variant>
+    const SegaVDPFrame *SegaVDP<Variant>::acquireFrame()
+    {
+	if (frame_ring == nullptr)
+	{
+	    return nullptr;
+	}
+
+	return frame_ring->acquire();
+    }
+
+    // Fetch the visible part of the framebuffer
+    template<typename Variant>
+    BeeVDPRect SegaVDP<Variant>::getViewport() const
+    {
+	if constexpr (Variant::is_game_gear)
+	{
+	    return {48, 24, 160, 144};
+	}
+	else
+	{
+	    return {0, 0, 256, 192};
+	}
+    }
+
+    // Fetch width of the visible viewport
+    template<typename Variant>
+    int SegaVDP<Variant>::getWidth() const
+    {
+	return getViewport().width;
+    }
+
+    // Fetch height of the visible viewport
+    template<typename Variant>
+    int SegaVDP<Variant>::getHeight() const
+    {
+	return getViewport().height;
+    }
+
+    // Hand the finished frame over to the presenter
+    template<typename Variant>
+    void SegaVDP<Variant>::publish_frame()
+    {
+	frame_count += 1;
+
+	// Skipped frames are never handed over to the presenter
+	bool is_published = is_frame_rendered;
+	is_frame_rendered = (render_interval != 0) && ((frame_count % render_interval) == 0);
+
+	if ((frame_ring == nullptr) || !is_published)
+	{
+	    return;
+	}
+
+	SegaVDPFrame &frame = frame_ring->backFrame();
+	frame.sequence = frame_count;
+	frame.timestamp = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+	frame.viewport = getViewport();
+	frame_ring->publish();
+    }
+
+    // Update the line interrupt counter
+    // (Note: the counter only counts down on lines 0-192,
+    // and is reloaded from R10 on every other line)
+    template<typename Variant>
+    void SegaVDP<Variant>::update_line_counter()
+    {
+	if (vcounter > 192)
+	{
+	    line_counter = regs[10];
+	    return;
+	}
+
+	if (line_counter == 0)
+	{
+	    line_counter = regs[10];
+	    is_line_irq_pending = true;
+	}
+	else
+	{
+	    line_counter -= 1;
+	}
+    }
+
+    template<typename Variant>
+    void SegaVDP<Variant>::chipClock()
+    {
+	// We've reached VBlank
+	if (vcounter == 192)
+	{
+	    publish_frame();
+
+	    if (vblank_callback)
+	    {
+		vblank_callback(frame_count);
+	    }
+	}
+
+	if (vcounter == Variant::vblank_line)
+	{
+	    is_frame_flag = true;
+	}
+
+	if (vcounter < 192)
+	{
+	    if ((frame_ring != nullptr) && is_frame_rendered)
+	    {
+		render_scanline();
+
+		// Hand the finished scanline over straight away
+		if (line_callback)
+		{
+		    line_callback(vcounter, &frame_ring->backFrame().pixels[(vcounter * 256)]);
+		}
+	    }
+	    else if (is_mode4() && is_display_enabled())
+	    {
+		// The sprite overflow and collision flags
+		// don't depend on whether the frame is rendered
+		render_sprites_fast(vcounter);
+	    }
+	}
+
+	update_line_counter();
+
+	vcounter += 1;
+
+	if (vcounter >= numScanlines())
+	{
+	    vcounter = 0;
+	}
+    }
+
+    // Render an individual scanline
+    template<typename Variant>
+    void SegaVDP<Variant>::render_scanline()
+    {
+	int ypos = vcounter;
+	BeeVDPRGB *line = &frame_ring->backFrame().pixels[(ypos * 256)];
+
+	render_linebuffer(current_renderer, ypos);
+
+	for (int xpos = 0; xpos < 256; xpos++)
+	{
+	    line[xpos] = cram_rgb[linebuffer[xpos]];
+	}
+    }
+
+    // Render scanline 'line' into the linebuffer (as CRAM indices)
+    template<typename Variant>
+    void SegaVDP<Variant>::render_linebuffer(BeeVDPRenderer renderer, int line)
+    {
+	// If the VDP is disabled (or Mode 4 is off), render just the backdrop
+	if (!is_mode4() || !is_display_enabled())
+	{
+	    linebuffer.fill(backdrop_color());
+	    return;
+	}
+
+	if (renderer == RendererReference)
+	{
+	    render_background_reference(line);
+	    render_sprites_reference(line);
+	}
+	else
+	{
+	    render_background_fast(line);
+	    render_sprites_fast(line);
+	}
+
+	merge_sprites();
+    }
+
+    // Fetch the color of a single tile pixel from the bitplanes in VRAM
+    template<typename Variant>
+    uint8_t SegaVDP<Variant>::planar_pixel(uint32_t tile, int row, int col) const
+    {
+	uint32_t addr = (((tile * 32) + (row * 4)) & vram_mask);
+	int bit = (7 - col);
+	uint8_t color = 0;
+
+	for (int plane = 0; plane < 4; plane++)
+	{
+	    color |= (((vram[addr + plane] >> bit) & 1) << plane);
+	}
+
+	return color;
+    }
+
+    // Render the background layer of scanline 'line' (reference version)
+    // (Note: each screen column fetches its own tile,
+    // which is then shifted right by the fine horizontal scroll)
+    template<typename Variant>
+    void SegaVDP<Variant>::render_background_reference(int line)
+    {
+	int hscroll = (testbit(regs[0], 6) && (line < 16)) ? 0 : regs[8];
+	int coarse_x = (hscroll >> 3);
+	int fine_x = (hscroll & 7);
+
+	for (int column = 0; column < 32; column++)
+	{
+	    int vscroll = (testbit(regs[0], 7) && (column >= 24)) ? 0 : regs[9];
+	    int ypos = ((line + vscroll) % 224);
+	    int tile_column = ((column - coarse_x) & 31);
+
+	    uint32_t entry_addr = (name_table() + ((((ypos >> 3) * 32) + tile_column) * 2));
+	    uint16_t entry = (vram[entry_addr] | (vram[entry_addr + 1] << 8));
+
+	    uint32_t tile = (entry & 0x1FF);
+	    bool is_hflip = testbit(entry, 9);
+	    bool is_vflip = testbit(entry, 10);
+	    uint8_t palette = testbit(entry, 11) ? 16 : 0;
+	    bool is_priority = testbit(entry, 12);
+	    int row = is_vflip ? (7 - (ypos & 7)) : (ypos & 7);
+
+	    for (int pixel = 0; pixel < 8; pixel++)
+	    {
+		int xpos = (((column * 8) + fine_x + pixel) & 0xFF);
+		uint8_t color = planar_pixel(tile, row, (is_hflip ? (7 - pixel) : pixel));
+		linebuffer[xpos] = (palette | color);
+		priority_line[xpos] = (is_priority && (color != 0));
+	    }
+	}
+    }
+
+    // Render the background layer of scanline 'line' (fast version)
+    template<typename Variant>
+    void SegaVDP<Variant>::render_background_fast(int line)
+    {
+	int hscroll = (testbit(regs[0], 6) && (line < 16)) ? 0 : regs[8];
+	int coarse_x = (hscroll >> 3);
+	int fine_x = (hscroll & 7);
+	uint32_t base_addr = name_table();
+
+	for (int column = 0; column < 32; column++)
+	{
+	    int vscroll = (testbit(regs[0], 7) && (column >= 24)) ? 0 : regs[9];
+	    int ypos = ((line + vscroll) % 224);
+
+	    uint32_t entry_addr = (base_addr + ((((ypos >> 3) * 32) + ((column - coarse_x) & 31)) * 2));
+	    uint16_t entry = (vram[entry_addr] | (vram[entry_addr + 1] << 8));
+
+	    int row = testbit(entry, 10) ? (7 - (ypos & 7)) : (ypos & 7);
+	    uint64_t pixels = tile_rows[(((entry & 0x1FF) << 3) | row)];
+
+	    if (testbit(entry, 9))
+	    {
+		pixels = flip_row(pixels);
+	    }
+
+	    uint8_t palette = testbit(entry, 11) ? 16 : 0;
+	    bool is_priority = testbit(entry, 12);
+	    int xpos = ((column * 8) + fine_x);
+
+	    for (int pixel = 0; pixel < 8; pixel++, pixels >>= 8)
+	    {
+		uint8_t color = (pixels & 0xF);
+		linebuffer[(xpos + pixel) & 0xFF] = (palette | color);
+		priority_line[(xpos + pixel) & 0xFF] = (is_priority && (color != 0));
+	    }
+	}
+    }
+
+    // Evaluate and render the sprites on scanline 'line' (reference version)
+    template<typename Variant>
+    void SegaVDP<Variant>::render_sprites_reference(int line)
+    {
+	sprite_line.fill(0);
+
+	uint32_t sat_addr = sprite_table();
+	int zoom = testbit(regs[1], 0) ? 2 : 1;
+	int sprite_height = (testbit(regs[1], 1) ? 16 : 8);
+	int x_offset = testbit(regs[0], 3) ? -8 : 0;
+	uint32_t pattern_base = testbit(regs[6], 2) ? 256 : 0;
+	int num_sprites = 0;
+
+	for (int sprite = 0; sprite < 64; sprite++)
+	{
+	    int ypos = vram[sat_addr + sprite];
+
+	    // A Y coordinate of 0xD0 terminates the sprite list
+	    if (ypos == 0xD0)
+	    {
+		break;
+	    }
+
+	    // Sprites start on the line after their Y coordinate
+	    int row = ((line - (ypos + 1)) & 0xFF);
+
+	    if (row >= (sprite_height * zoom))
+	    {
+		continue;
+	    }
+
+	    // Only the first 8 sprites on each line are displayed
+	    if (num_sprites == 8)
+	    {
+		is_overflow_flag = true;
+		break;
+	    }
+
+	    num_sprites += 1;
+
+	    int xpos = (vram[sat_addr + 0x80 + (sprite * 2)] + x_offset);
+	    uint32_t pattern = vram[sat_addr + 0x81 + (sprite * 2)];
+
+	    if (sprite_height == 16)
+	    {
+		pattern &= 0xFE;
+	    }
+
+	    row /= zoom;
+	    uint32_t tile = (pattern_base + pattern + (row >> 3));
+
+	    for (int pixel = 0; pixel < (8 * zoom); pixel++)
+	    {
+		int screen_x = (xpos + pixel);
+
+		if ((screen_x < 0) || (screen_x > 255))
+		{
+		    continue;
+		}
+
+		uint8_t color = planar_pixel(tile, (row & 7), (pixel / zoom));
+
+		if (color == 0)
+		{
+		    continue;
+		}
+
+		// Earlier sprites take priority over later ones
+		if (sprite_line[screen_x] != 0)
+		{
+		    is_collision_flag = true;
+		    continue;
+		}
+
+		sprite_line[screen_x] = (16 | color);
+	    }
+	}
+    }
+
+    // Evaluate and render the sprites on scanline 'line' (fast version)
+    template<typename Variant>
+    void SegaVDP<Variant>::render_sprites_fast(int line)
+    {
+	sprite_line.fill(0);
+
+	const uint8_t *sat = &vram[sprite_table()];
+	int zoom_shift = testbit(regs[1], 0) ? 1 : 0;
+	int sprite_height = (testbit(regs[1], 1) ? 16 : 8);
+	int x_offset = testbit(regs[0], 3) ? -8 : 0;
+	uint32_t pattern_base = testbit(regs[6], 2) ? 256 : 0;
+	uint32_t pattern_mask = (sprite_height == 16) ? 0xFE : 0xFF;
+	int num_sprites = 0;
+
+	for (int sprite = 0; sprite < 64; sprite++)
+	{
+	    if (sat[sprite] == 0xD0)
+	    {
+		break;
+	    }
+
+	    int row = ((line - (sat[sprite] + 1)) & 0xFF);
+
+	    if (row >= (sprite_height << zoom_shift))
+	    {
+		continue;
+	    }
+
+	    if (num_sprites == 8)
+	    {
+		is_overflow_flag = true;
+		break;
+	    }
+
+	    num_sprites += 1;
+	    row >>= zoom_shift;
+
+	    int xpos = (sat[0x80 + (sprite * 2)] + x_offset);
+	    uint32_t tile = (pattern_base + (sat[0x81 + (sprite * 2)] & pattern_mask) + (row >> 3));
+	    uint64_t pixels = tile_rows[(((tile << 3) | (row & 7)) & 0xFFF)];
+
+	    // Skip fully transparent rows
+	    if (pixels == 0)
+	    {
+		continue;
+	    }
+
+	    for (int pixel = 0; pixel < (8 << zoom_shift); pixel++)
+	    {
+		int screen_x = (xpos + pixel);
+		uint8_t color = ((pixels >> ((pixel >> zoom_shift) * 8)) & 0xF);
+
+		if ((color == 0) || (screen_x < 0) || (screen_x > 255))
+		{
+		    continue;
+		}
+
+		if (sprite_line[screen_x] != 0)
+		{
+		    is_collision_flag = true;
+		    continue;
+		}
+
+		sprite_line[screen_x] = (16 | color);
+	    }
+	}
+    }
+
+    // Combine the sprites with the background layer
+    // (Note: sprites are drawn over the background,
+    // except over non-zero background pixels with the priority bit set)
+    template<typename Variant>
+    void SegaVDP<Variant>::merge_sprites()
+    {
+	for (int xpos = 0; xpos < 256; xpos++)
+	{
+	    if ((sprite_line[xpos] != 0) && !priority_line[xpos])
+	    {
+		linebuffer[xpos] = sprite_line[xpos];
+	    }
+	}
+
+	// Mask the leftmost column with the backdrop color if R0 bit 5 is set
+	if (testbit(regs[0], 5))
+	{
+	    fill_n(linebuffer.begin(), 8, backdrop_color());
+	}
+    }
+
+    template<typename Variant>
+    void SegaVDP<Variant>::setRenderer(BeeVDPRenderer renderer)
+    {
+	current_renderer = renderer;
+    }
+
+    // Render scanline 'line' of the current VRAM and register state
+    // into 'line_out' (as CRAM indices) with the given renderer,
+    // without touching the framebuffer or the status flags
+    // (Note: this is meant for verifying renderers against each other,
+    // and returns false if Mode 4 is disabled)
+    template<typename Variant>
+    bool SegaVDP<Variant>::renderLine(int line, BeeVDPRenderer renderer, array<uint8_t, 256> &line_out)
+    {
+	bool prev_overflow_flag = is_overflow_flag;
+	bool prev_collision_flag = is_collision_flag;
+
+	render_linebuffer(renderer, line);
+	line_out = linebuffer;
+
+	is_overflow_flag = prev_overflow_flag;
+	is_collision_flag = prev_collision_flag;
+	return is_mode4();
+    }
+
+    template class SegaVDP<SMSVariant>;
+    template class SegaVDP<GameGearVariant>;
+};
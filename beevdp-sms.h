@@ -0,0 +1,236 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BEEVDP_SMS_H
+#define BEEVDP_SMS_H
+
+#include "beevdp.h"
+
+namespace beevdp
+{
+    // A completed Sega VDP frame
+    // (Note: the framebuffer always holds the full 256x192 raster,
+    // of which 'viewport' is the part visible on the console's screen)
+    struct SegaVDPFrame
+    {
+	// Frame sequence number (starts at 1)
+	uint64_t sequence = 0;
+	// Time at which the frame was completed
+	// (in nanoseconds, from std::chrono::steady_clock)
+	int64_t timestamp = 0;
+	BeeVDPRect viewport = {0, 0, 256, 192};
+	std::array<BeeVDPRGB, (256 * 192)> pixels;
+
+	void clear()
+	{
+	    sequence = 0;
+	    timestamp = 0;
+	    pixels.fill({0, 0, 0});
+	}
+    };
+
+    // Variant traits for the Sega VDPs
+    // Each variant provides:
+    // name - name of the chip
+    // num_scanlines - total number of scanlines per frame
+    // vblank_line - scanline on which the frame interrupt flag is raised
+    // is_game_gear - whether CRAM holds 12-bit colors (written in pairs of bytes),
+    // and only the 160x144 viewport is visible
+
+    // Master System VDP (aka. 315-5246)
+    struct SMSVariant
+    {
+	static constexpr const char *name = "315-5246";
+	static constexpr int num_scanlines = 262;
+	static constexpr int vblank_line = 193;
+	static constexpr bool is_game_gear = false;
+    };
+
+    // Game Gear VDP (aka. 315-5378)
+    struct GameGearVariant : SMSVariant
+    {
+	static constexpr const char *name = "315-5378";
+	static constexpr bool is_game_gear = true;
+    };
+
+    // Sega VDP core, which adds Mode 4 to the TMS9918A's port interface
+    // (i.e. 4bpp tiles, CRAM, line interrupts, scrolling and 8 sprites per line)
+    template<typename Variant>
+    class SegaVDP : public BeeVDPPorts<SegaVDP<Variant>>
+    {
+	public:
+	    SegaVDP();
+	    ~SegaVDP();
+
+	    SegaVDP(const SegaVDP&) = delete;
+	    SegaVDP &operator=(const SegaVDP&) = delete;
+
+	    // Storage configuration
+	    // (Note: these should be called before init())
+	    void setMemoryResource(std::pmr::memory_resource *resource);
+	    void setHeadless(bool is_enabled);
+
+	    // Render only every 'interval'th frame (or no frames at all if 'interval' is 0)
+	    // (Note: timing, status flags and IRQs are unaffected by skipped frames,
+	    // and a new interval only takes effect at the next frame boundary,
+	    // so the frame in progress is always rendered or skipped in full)
+	    void setRenderInterval(int interval);
+
+	    // Hand over each finished scanline (and the start of each VBlank)
+	    // without waiting for the frame to complete
+	    void setLineCallback(BeeVDPLineCallback callback);
+	    void setVBlankCallback(BeeVDPVBlankCallback callback);
+
+	    void init();
+	    void shutdown();
+
+	    // Data and control ports (provided by BeeVDPPorts)
+	    // (Note: code 3 selects CRAM for the data port, rather than the registers)
+	    uint8_t readStatus();
+
+	    // V counter port
+	    uint8_t readVCounter() const;
+
+	    bool isInterrupt();
+
+	    const SegaVDPFrame *acquireFrame();
+
+	    // Size of the visible viewport
+	    // (i.e. 256x192 on the Master System, or 160x144 on the Game Gear)
+	    int getWidth() const;
+	    int getHeight() const;
+	    BeeVDPRect getViewport() const;
+	    constexpr int numScanlines() const
+	    {
+		return Variant::num_scanlines;
+	    }
+
+	    void setRenderer(BeeVDPRenderer renderer);
+	    // Render a single scanline into 'line_out' (as CRAM indices)
+	    // without affecting the VDP's state
+	    bool renderLine(int line, BeeVDPRenderer renderer, std::array<uint8_t, 256> &line_out);
+
+	    void chipClock();
+
+	private:
+	    static constexpr uint32_t vram_size = 0x4000;
+	    static constexpr uint32_t vram_mask = (vram_size - 1);
+	    static constexpr int cram_size = (Variant::is_game_gear) ? 64 : 32;
+
+	    uint8_t *vram = nullptr;
+
+	    // Decoded tile cache, with one row of 8 pixels per VRAM longword
+	    // (Note: each byte holds the 4-bit color of one pixel,
+	    // with the leftmost pixel in the lowest byte)
+	    std::array<uint64_t, (vram_size / 4)> tile_rows;
+
+	    uint16_t vcounter = 0;
+
+	    std::array<uint8_t, 16> regs = {};
+
+	    // Port state (shared with the TMS99xxA cores)
+	    using Ports = BeeVDPPorts<SegaVDP>;
+	    friend Ports;
+	    using Ports::is_second_control_write;
+	    using Ports::command_word;
+	    using Ports::addr_register;
+	    using Ports::code_register;
+	    using Ports::read_buffer;
+	    using Ports::reset_latch;
+
+	    uint8_t port_read(uint16_t addr);
+	    void port_write(uint16_t addr, uint8_t data);
+	    void port_register();
+
+	    // Color RAM, and the same colors in 24-bit RGB
+	    std::array<uint8_t, cram_size> cram = {};
+	    uint8_t cram_latch = 0;
+	    std::array<BeeVDPRGB, 32> cram_rgb;
+
+	    // Status flags
+	    bool is_frame_flag = false;
+	    bool is_overflow_flag = false;
+	    bool is_collision_flag = false;
+
+	    // Line interrupt counter (reloaded from R10)
+	    uint8_t line_counter = 0;
+	    bool is_line_irq_pending = false;
+
+	    // CRAM indices of the scanline being rendered
+	    std::array<uint8_t, 256> linebuffer;
+	    // Background pixels with their priority bit set (and a color other than 0)
+	    std::array<bool, 256> priority_line;
+	    // Sprite pixels of the scanline being rendered (0 where there's no sprite)
+	    std::array<uint8_t, 256> sprite_line;
+
+	    std::pmr::memory_resource *memory_resource = nullptr;
+	    BeeVDPTripleBuffer<SegaVDPFrame> *frame_ring = nullptr;
+	    uint64_t frame_count = 0;
+	    bool is_headless = false;
+	    int render_interval = 1;
+	    bool is_frame_rendered = true;
+
+	    BeeVDPRenderer current_renderer = RendererFast;
+
+	    BeeVDPLineCallback line_callback;
+	    BeeVDPVBlankCallback vblank_callback;
+
+	    void allocate_storage();
+	    void free_storage();
+
+	    void write_reg(int reg, uint8_t data);
+	    void write_cram(uint8_t data);
+	    void update_cram_rgb(int index);
+	    void update_tile_row(uint32_t addr);
+
+	    bool is_mode4() const;
+	    bool is_display_enabled() const;
+	    uint32_t name_table() const;
+	    uint32_t sprite_table() const;
+	    uint8_t backdrop_color() const;
+
+	    void publish_frame();
+	    void update_line_counter();
+
+	    void render_scanline();
+	    void render_linebuffer(BeeVDPRenderer renderer, int line);
+
+	    // Reference renderer (reads the bitplanes straight from VRAM)
+	    uint8_t planar_pixel(uint32_t tile, int row, int col) const;
+	    void render_background_reference(int line);
+	    void render_sprites_reference(int line);
+
+	    // Fast renderer (reads pre-decoded rows from the tile cache)
+	    void render_background_fast(int line);
+	    void render_sprites_fast(int line);
+
+	    void merge_sprites();
+
+	    template<typename T>
+	    bool testbit(T reg, int bit) const
+	    {
+		return ((reg >> bit) & 1) ? true : false;
+	    }
+    };
+
+    using SMSVDP = SegaVDP<SMSVariant>;
+    using GameGearVDP = SegaVDP<GameGearVariant>;
+};
+
+#endif // BEEVDP_SMS_H
@@ -21,6 +21,7 @@
 #include <cassert>
 #include <SDL2/SDL.h>
 #include "beevdp.h"
+#include "beevdp-debug.h"
 #include "vdpfont.h" // VDP font file as C-array
 using namespace beevdp;
 using namespace std;
@@ -33,6 +34,15 @@ SDL_Window *window = NULL;
 SDL_Renderer *render = NULL;
 SDL_Texture *texture = NULL;
 
+// Debug view shown instead of the screen (0 for the screen itself)
+int debug_view = 0;
+BeeVDPDebugViews debug_views;
+array<BeeVDPRGB, (256 * 192)> debug_pixels;
+
+// Last frame uploaded to the texture, and the regions that changed since then
+uint64_t uploaded_sequence = 0;
+vector<BeeVDPRect> dirty_rects;
+
 int sdl_error(string message)
 {
     cout << message << " SDL_Error: " << SDL_GetError() << endl;
@@ -62,6 +72,48 @@ void shutdown()
     SDL_Quit();
 }
 
+// Draw the selected debug view in the top-left corner of the window
+void draw_debug_view(TMS9918A &vdp)
+{
+    vdp.updateDebugViews();
+
+    const BeeVDPDebugView *views[4] = {&debug_views.getPatternSheet(), &debug_views.getNameMap(), &debug_views.getColorSwatches(), &debug_views.getVRAMMap()};
+    const BeeVDPDebugView &view = *views[(debug_view - 1)];
+    bool is_vram_map = (debug_view == 4);
+    debug_pixels.fill({0x20, 0x20, 0x20});
+
+    for (int ypos = 0; ypos < view.height; ypos++)
+    {
+	for (int xpos = 0; xpos < view.width; xpos++)
+	{
+	    uint8_t value = view.pixels[((ypos * view.width) + xpos)];
+	    BeeVDPRGB &pixel = debug_pixels[((ypos * width) + xpos)];
+
+	    if (!is_vram_map)
+	    {
+		pixel = tms99xx_palette[(value & 0xF)];
+		continue;
+	    }
+
+	    // Names in red, patterns in green, colors in blue,
+	    // sprite tables in gray and fresh writes in white
+	    pixel.red = (value & UsageName) ? 0xC0 : 0;
+	    pixel.green = (value & UsagePattern) ? 0xC0 : 0;
+	    pixel.blue = (value & UsageColor) ? 0xC0 : 0;
+
+	    if (value & (UsageSpriteAttrib | UsageSpritePattern))
+	    {
+		pixel = {0x60, 0x60, 0x60};
+	    }
+
+	    if (value & UsageWritten)
+	    {
+		pixel = {0xFF, 0xFF, 0xFF};
+	    }
+	}
+    }
+}
+
 void updatevdp(TMS9918A &vdp)
 {
     for (int i = 0; i < vdp.numScanlines(); i++)
@@ -77,7 +129,29 @@ void updatevdp(TMS9918A &vdp)
     }
 
     assert(render && texture);
-    SDL_UpdateTexture(texture, NULL, vdp.getFramebuffer().data(), (width * sizeof(BeeVDPRGB)));
+    const BeeVDPFrame *frame = vdp.acquireFrame();
+
+    if (debug_view != 0)
+    {
+	draw_debug_view(vdp);
+	SDL_UpdateTexture(texture, NULL, debug_pixels.data(), (width * sizeof(BeeVDPRGB)));
+	uploaded_sequence = 0;
+    }
+    else if ((frame != NULL) && (frame->sequence != uploaded_sequence))
+    {
+	// Only upload the parts of the frame that changed
+	frame->getDirtyRects(uploaded_sequence, dirty_rects);
+
+	for (auto &rect : dirty_rects)
+	{
+	    SDL_Rect dst_rect = {rect.x, rect.y, rect.width, rect.height};
+	    const BeeVDPRGB *pixels = &frame->pixels[((rect.y * width) + rect.x)];
+	    SDL_UpdateTexture(texture, &dst_rect, pixels, (width * sizeof(BeeVDPRGB)));
+	}
+
+	uploaded_sequence = frame->sequence;
+    }
+
     SDL_RenderClear(render);
     SDL_RenderCopy(render, texture, NULL, NULL);
     SDL_RenderPresent(render);
@@ -463,6 +537,7 @@ int main(int argc, char *argv[])
 {
     TMS9918A vdp;
     vdp.init();
+    vdp.setDebugViews(&debug_views);
 
     if (SDL_Init(SDL_INIT_VIDEO) < 0)
     {
@@ -505,6 +580,7 @@ int main(int argc, char *argv[])
     cout << "5: Display example of bogus mode 1+3" << endl;
     cout << "7: Display example of bogus mode 1+2+3" << endl;
     cout << "D: Dump VRAM to file" << endl;
+    cout << "V: Cycle through the debug views (pattern sheet, name map, color swatches and VRAM map)" << endl;
     cout << endl;
 
     bool quit = false;
@@ -562,6 +638,11 @@ int main(int argc, char *argv[])
 			    dump_vram(vdp);
 			}
 			break;
+			case SDLK_v:
+			{
+			    debug_view = ((debug_view + 1) % 5);
+			}
+			break;
 		    }
 		}
 		break;
@@ -574,4 +655,4 @@ int main(int argc, char *argv[])
     vdp.shutdown();
     shutdown();
     return 0;
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -0,0 +1,1396 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Notes on the V9938 implementation:
+// This core provides the TEXT 1 and 2, MULTICOLOR and GRAPHIC 1-7 modes,
+// on top of the same port interface as the TMS99xxA cores
+// (with the addition of the palette and indirect register ports).
+//
+// The hardware command engine is implemented in terms of bulk memory operations
+// (i.e. the effects of each command are applied as soon as it's issued),
+// with an optional timing model that keeps the CE bit set for
+// roughly as long as the real command engine would take to execute it.
+// CPU transfer commands (LMMC, HMMC and LMCM) advance with each byte
+// transferred through R#44 or S#7, like on the real hardware.
+//
+// VRAM is stored in logical address order, so the interleaving the real chip
+// applies in GRAPHIC 6 and 7 is not visible when switching between modes.
+//
+// TODO list:
+// Implement sprite rendering (sprite modes 1 and 2)
+// Implement interlace and even/odd page flipping
+// Implement horizontal adjust (R#18) and the 16K/64K VRAM configurations
+
+#include <cstring>
+#include <algorithm>
+#include "beevdp-v9938.h"
+using namespace beevdp;
+using namespace std;
+
+namespace beevdp
+{
+    // Display modes (M5 | M4 | M3 | M2 | M1)
+    enum V9938Mode : int
+    {
+	ModeGraphic1 = 0x00,
+	ModeText1 = 0x01,
+	ModeMulticolor = 0x02,
+	ModeGraphic2 = 0x04,
+	ModeGraphic3 = 0x08,
+	ModeText2 = 0x09,
+	ModeGraphic4 = 0x0C,
+	ModeGraphic5 = 0x10,
+	ModeGraphic6 = 0x14,
+	ModeGraphic7 = 0x1C,
+    };
+
+    // Command engine opcodes (upper 4 bits of R#46)
+    enum V9938Opcode : int
+    {
+	CmdStop = 0x0,
+	CmdPoint = 0x4,
+	CmdPset = 0x5,
+	CmdSrch = 0x6,
+	CmdLine = 0x7,
+	CmdLmmv = 0x8,
+	CmdLmmm = 0x9,
+	CmdLmcm = 0xA,
+	CmdLmmc = 0xB,
+	CmdHmmv = 0xC,
+	CmdHmmm = 0xD,
+	CmdYmmm = 0xE,
+	CmdHmmc = 0xF,
+    };
+
+    // Master clock cycles per scanline
+    static constexpr int cycles_per_line = 1368;
+
+    // Default palette set up by the MSX2 BIOS
+    // (in the same layout as 'palette', i.e. 0GGG0RRR0BBB)
+    static constexpr array<uint16_t, 16> default_palette =
+    {
+	0x000, 0x000, 0x611, 0x733, 0x117, 0x327, 0x151, 0x627,
+	0x171, 0x373, 0x661, 0x664, 0x411, 0x265, 0x555, 0x777,
+    };
+
+    V9938::V9938()
+    {
+	memory_resource = pmr::get_default_resource();
+
+	// Precompute the direct colors used in GRAPHIC 7
+	// (Format of each byte is GGGRRRBB)
+	for (int color = 0; color < 256; color++)
+	{
+	    int green = ((color >> 5) & 0x7);
+	    int red = ((color >> 2) & 0x7);
+	    int blue = (((color & 0x3) << 1) | ((color & 0x3) >> 1));
+	    graphic7_rgb[color] = {uint8_t((red * 255) / 7), uint8_t((green * 255) / 7), uint8_t((blue * 255) / 7)};
+	}
+    }
+
+    V9938::~V9938()
+    {
+	free_storage();
+    }
+
+    // Set the memory resource used to allocate VRAM and the framebuffers
+    void V9938::setMemoryResource(pmr::memory_resource *resource)
+    {
+	free_storage();
+	memory_resource = (resource != nullptr) ? resource : pmr::get_default_resource();
+    }
+
+    // Run without any framebuffers
+    void V9938::setHeadless(bool is_enabled)
+    {
+	free_storage();
+	is_headless = is_enabled;
+    }
+
+    // Enable or disable the command engine's timing model
+    void V9938::setCommandTiming(bool is_enabled)
+    {
+	is_command_timing = is_enabled;
+    }
+
+    // Set how often frames are rendered
+    // (Note: timing, status flags and IRQs are unaffected by skipped frames)
+    void V9938::setRenderInterval(int interval)
+    {
+	// (Note: the frame in progress keeps its current setting,
+	// and publish_frame() applies the new interval from the next frame on)
+	render_interval = max(interval, 0);
+    }
+
+    // Set the callback for finished scanlines
+    void V9938::setLineCallback(BeeVDPLineCallback callback)
+    {
+	line_callback = move(callback);
+    }
+
+    // Set the callback for the start of VBlank
+    void V9938::setVBlankCallback(BeeVDPVBlankCallback callback)
+    {
+	vblank_callback = move(callback);
+    }
+
+    // Allocate VRAM and the framebuffers (if needed)
+    void V9938::allocate_storage()
+    {
+	if (vram == nullptr)
+	{
+	    vram = static_cast<uint8_t*>(memory_resource->allocate(vram_size, alignof(uint64_t)));
+	}
+
+	if (!is_headless && (frame_ring == nullptr))
+	{
+	    using FrameRing = BeeVDPTripleBuffer<V9938Frame>;
+	    void *ring_mem = memory_resource->allocate(sizeof(FrameRing), alignof(FrameRing));
+	    frame_ring = new (ring_mem) FrameRing();
+	}
+    }
+
+    // Release any storage owned by the VDP
+    void V9938::free_storage()
+    {
+	using FrameRing = BeeVDPTripleBuffer<V9938Frame>;
+
+	if (frame_ring != nullptr)
+	{
+	    frame_ring->~FrameRing();
+	    memory_resource->deallocate(frame_ring, sizeof(FrameRing), alignof(FrameRing));
+	    frame_ring = nullptr;
+	}
+
+	if (vram != nullptr)
+	{
+	    memory_resource->deallocate(vram, vram_size, alignof(uint64_t));
+	    vram = nullptr;
+	}
+    }
+
+    // Initialize the VDP
+    void V9938::init()
+    {
+	allocate_storage();
+
+	// Fill VRAM with random data to simulate
+	// the real hardware
+	srand(time(NULL));
+	for (uint32_t i = 0; i < vram_size; i++)
+	{
+	    vram[i] = (rand() & 0xFF);
+	}
+
+	regs.fill(0);
+	command = V9938Command();
+
+	for (int index = 0; index < 16; index++)
+	{
+	    palette[index] = default_palette[index];
+	    update_palette(index);
+	}
+
+	if (frame_ring != nullptr)
+	{
+	    frame_ring->clear();
+	}
+
+	frame_count = 0;
+	is_frame_rendered = (render_interval != 0);
+	vcounter = 0;
+	is_vblank_flag = true;
+	cout << "V9938::Initialized" << endl;
+    }
+
+    // Power off the VDP
+    void V9938::shutdown()
+    {
+	cout << "V9938::Shutting down..." << endl;
+    }
+
+    // Fetch the current display mode
+    int V9938::get_mode() const
+    {
+	int m1_bit = testbit(regs[1], 4);
+	int m2_bit = testbit(regs[1], 3);
+	int m345_bits = ((regs[0] >> 1) & 0x7);
+	return ((m345_bits << 2) | (m2_bit << 1) | m1_bit);
+    }
+
+    // Check if the current mode is one of the bitmap modes
+    // (i.e. GRAPHIC 4-7, which the command engine operates on)
+    bool V9938::is_bitmap_mode() const
+    {
+	switch (get_mode())
+	{
+	    case ModeGraphic4:
+	    case ModeGraphic5:
+	    case ModeGraphic6:
+	    case ModeGraphic7: return true;
+	    default: return false;
+	}
+    }
+
+    // Fetch the number of active display lines
+    int V9938::active_lines() const
+    {
+	return testbit(regs[9], 7) ? 212 : 192;
+    }
+
+    // Fetch the full 17-bit VRAM address
+    uint32_t V9938::vram_addr() const
+    {
+	return ((((regs[14] & 0x7) << 14) | addr_register) & vram_mask);
+    }
+
+    // Increment address register
+    void V9938::increment_addr()
+    {
+	addr_register = ((addr_register + 1) & 0x3FFF);
+
+	if (addr_register != 0)
+	{
+	    return;
+	}
+
+	// The address register carries over into R#14,
+	// except in the TMS9918A-compatible modes
+	switch (get_mode())
+	{
+	    case ModeGraphic1:
+	    case ModeGraphic2:
+	    case ModeMulticolor:
+	    case ModeText1: break;
+	    default: regs[14] = ((regs[14] + 1) & 0x7); break;
+	}
+    }
+
+    // Convert a palette entry from 9-bit RGB (0GGG0RRR0BBB) to 24-bit RGB
+    void V9938::update_palette(int index)
+    {
+	uint16_t color = palette[index];
+	int red = ((color >> 4) & 0x7);
+	int blue = (color & 0x7);
+	int green = ((color >> 8) & 0x7);
+	palette_rgb[index] = {uint8_t((red * 255) / 7), uint8_t((green * 255) / 7), uint8_t((blue * 255) / 7)};
+    }
+
+    // Write to a VDP register
+    void V9938::write_reg(int reg, uint8_t data)
+    {
+	// Ignore writes to invalid registers
+	// (i.e. not registers 0-23 or 32-46)
+	if (((reg >= 24) && (reg < 32)) || (reg > 46))
+	{
+	    return;
+	}
+
+	regs[reg] = data;
+
+	switch (reg)
+	{
+	    // Register 14 (VRAM address bits A16-A14)
+	    case 14: regs[14] &= 0x7; break;
+	    // Register 15 (status register pointer)
+	    case 15: regs[15] &= 0xF; break;
+	    // Register 16 (palette pointer)
+	    case 16:
+	    {
+		regs[16] &= 0xF;
+		is_second_palette_write = false;
+	    }
+	    break;
+	    // Register 44 (color register, also used for CPU transfers)
+	    case 44:
+	    {
+		command.clr = data;
+
+		if (command.is_executing && command.is_transfer_ready)
+		{
+		    int opcode = (command.cmd >> 4);
+
+		    if ((opcode == CmdLmmc) || (opcode == CmdHmmc))
+		    {
+			transfer_data(data);
+		    }
+		}
+	    }
+	    break;
+	    // Register 46 (command register)
+	    case 46: start_command(); break;
+	    default: break;
+	}
+    }
+
+    // Write to V9938 control port
+    void V9938::writeControl(uint8_t data)
+    {
+	if (!is_second_control_write)
+	{
+	    control_latch = data;
+	    is_second_control_write = true;
+	    return;
+	}
+
+	is_second_control_write = false;
+
+	if (testbit(data, 7))
+	{
+	    // Write to VDP register
+	    write_reg((data & 0x3F), control_latch);
+	}
+	else
+	{
+	    // Update address register
+	    addr_register = (((data & 0x3F) << 8) | control_latch);
+
+	    // Read VRAM (prefetch the first byte)
+	    if (!testbit(data, 6))
+	    {
+		read_buffer = vram[vram_addr()];
+		increment_addr();
+	    }
+	}
+    }
+
+    // Write to V9938 data port
+    void V9938::writeData(uint8_t data)
+    {
+	vram[vram_addr()] = data;
+	read_buffer = data;
+	increment_addr();
+	is_second_control_write = false;
+    }
+
+    // Read from V9938 data port
+    uint8_t V9938::readData()
+    {
+	is_second_control_write = false;
+	uint8_t result = read_buffer;
+	read_buffer = vram[vram_addr()];
+	increment_addr();
+	return result;
+    }
+
+    // Write to V9938 palette port
+    void V9938::writePalette(uint8_t data)
+    {
+	if (!is_second_palette_write)
+	{
+	    palette_latch = data;
+	    is_second_palette_write = true;
+	    return;
+	}
+
+	// Format of palette data is 0RRR0BBB, then 00000GGG
+	int index = (regs[16] & 0xF);
+	palette[index] = (((data & 0x7) << 8) | (palette_latch & 0x77));
+	update_palette(index);
+
+	regs[16] = ((index + 1) & 0xF);
+	is_second_palette_write = false;
+    }
+
+    // Write to V9938 indirect register port
+    void V9938::writeIndirect(uint8_t data)
+    {
+	int reg = (regs[17] & 0x3F);
+
+	// R#17 can't be written to indirectly
+	if (reg != 17)
+	{
+	    write_reg(reg, data);
+	}
+
+	// Auto-increment the register pointer (unless disabled)
+	if (!testbit(regs[17], 7))
+	{
+	    regs[17] = ((regs[17] & 0xC0) | ((reg + 1) & 0x3F));
+	}
+    }
+
+    // Read from V9938 status port
+    uint8_t V9938::readStatus()
+    {
+	is_second_control_write = false;
+	uint8_t status_byte = 0;
+
+	switch (regs[15] & 0xF)
+	{
+	    // S#0: F | 5S | C | fifth sprite number
+	    case 0:
+	    {
+		status_byte = (is_vblank_flag << 7);
+		is_vblank_flag = false;
+	    }
+	    break;
+	    // S#1: FL | LPS | ID (0 on the V9938) | FH
+	    case 1:
+	    {
+		status_byte = is_line_flag;
+		is_line_flag = false;
+	    }
+	    break;
+	    // S#2: TR | VR | HR | BD | 1 | 1 | EO | CE
+	    case 2:
+	    {
+		bool is_vretrace = (vcounter >= active_lines());
+		status_byte = ((command.is_transfer_ready << 7) | (is_vretrace << 6) | (is_hblank_toggle << 5));
+		status_byte |= ((is_border_detected << 4) | 0x0C | command.is_executing);
+
+		// The VDP is clocked once per scanline, so toggle HR on each read
+		// to keep software that polls it from stalling
+		is_hblank_toggle = !is_hblank_toggle;
+	    }
+	    break;
+	    // S#3-S#6: sprite collision coordinates
+	    case 3: status_byte = 0x00; break;
+	    case 4: status_byte = 0xFE; break;
+	    case 5: status_byte = 0x00; break;
+	    case 6: status_byte = 0xFC; break;
+	    // S#7: color register (used by POINT and LMCM)
+	    case 7: status_byte = transfer_status(); break;
+	    // S#8-S#9: border X coordinate (used by SRCH)
+	    case 8: status_byte = (border_x & 0xFF); break;
+	    case 9: status_byte = ((border_x >> 8) | 0xFE); break;
+	    default: status_byte = 0xFF; break;
+	}
+
+	return status_byte;
+    }
+
+    // Check if the INT line is asserted
+    // (Note: this is cleared by reading S#0 or S#1)
+    bool V9938::isInterrupt()
+    {
+	bool is_frame_irq = (is_vblank_flag && testbit(regs[1], 5));
+	bool is_line_irq = (is_line_flag && testbit(regs[0], 4));
+	return (is_frame_irq || is_line_irq);
+    }
+
+    // Fetch the most recently completed frame without copying it
+    const V9938Frame *V9938::acquireFrame()
+    {
+	if (frame_ring == nullptr)
+	{
+	    return nullptr;
+	}
+
+	return frame_ring->acquire();
+    }
+
+    // Fetch width of V9938 framebuffer
+    int V9938::getWidth() const
+    {
+	return 512;
+    }
+
+    // Fetch height of V9938 framebuffer
+    int V9938::getHeight() const
+    {
+	return active_lines();
+    }
+
+    // Fetch maximum number of scanlines in V9938
+    int V9938::numScanlines() const
+    {
+	// R#9 bit 1 selects between NTSC and PAL timing
+	return testbit(regs[9], 1) ? 313 : 262;
+    }
+
+    // Stamp the completed frame and hand it over to the presenter
+    void V9938::publish_frame()
+    {
+	frame_count += 1;
+
+	// Skipped frames are never handed over to the presenter
+	bool is_published = is_frame_rendered;
+	is_frame_rendered = (render_interval != 0) && ((frame_count % render_interval) == 0);
+
+	if ((frame_ring == nullptr) || !is_published)
+	{
+	    return;
+	}
+
+	V9938Frame &frame = frame_ring->backFrame();
+	frame.sequence = frame_count;
+	frame.timestamp = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+	frame.height = active_lines();
+	frame_ring->publish();
+    }
+
+    // Update the TEXT 2 blink phase
+    // (R#13 holds the on and off times, in units of 10 frames)
+    void V9938::update_blink()
+    {
+	int on_time = ((regs[13] >> 4) * 10);
+	int off_time = ((regs[13] & 0xF) * 10);
+
+	if (off_time == 0)
+	{
+	    is_blink_phase = false;
+	    blink_counter = 0;
+	    return;
+	}
+
+	if (on_time == 0)
+	{
+	    is_blink_phase = true;
+	    blink_counter = 0;
+	    return;
+	}
+
+	blink_counter += 1;
+
+	if (blink_counter >= (is_blink_phase ? on_time : off_time))
+	{
+	    is_blink_phase = !is_blink_phase;
+	    blink_counter = 0;
+	}
+    }
+
+    // Clock the emulated V9938 once
+    void V9938::chipClock()
+    {
+	int num_lines = active_lines();
+
+	// We've reached VBlank
+	if (vcounter == num_lines)
+	{
+	    is_vblank_flag = true;
+	    publish_frame();
+	    update_blink();
+
+	    if (vblank_callback)
+	    {
+		vblank_callback(frame_count);
+	    }
+	}
+
+	if (vcounter < num_lines)
+	{
+	    if ((frame_ring != nullptr) && is_frame_rendered)
+	    {
+		render_scanline();
+
+		// Hand the finished scanline over straight away
+		if (line_callback)
+		{
+		    line_callback(vcounter, &frame_ring->backFrame().pixels[(vcounter * 512)]);
+		}
+	    }
+
+	    // Line interrupts are affected by vertical scrolling
+	    if (((vcounter + regs[23]) & 0xFF) == regs[19])
+	    {
+		is_line_flag = true;
+	    }
+	}
+
+	// Advance the command engine's timing model
+	if (command.is_executing && !command.is_transfer_ready && (command.remaining_cycles > 0))
+	{
+	    command.remaining_cycles -= cycles_per_line;
+
+	    if (command.remaining_cycles <= 0)
+	    {
+		command.remaining_cycles = 0;
+		command.is_executing = false;
+	    }
+	}
+
+	vcounter += 1;
+
+	if (vcounter >= numScanlines())
+	{
+	    vcounter = 0;
+	}
+    }
+
+    // Fetch the color corresponding to the given palette number
+    // (Note: color 0 shows the backdrop, unless the TP bit in R#8 is set)
+    BeeVDPRGB V9938::get_color(int color_val) const
+    {
+	if ((color_val == 0) && !testbit(regs[8], 5))
+	{
+	    return backdrop_rgb();
+	}
+
+	return palette_rgb[(color_val & 0xF)];
+    }
+
+    // Fetch the backdrop color
+    BeeVDPRGB V9938::backdrop_rgb() const
+    {
+	if (get_mode() == ModeGraphic7)
+	{
+	    return graphic7_rgb[regs[7]];
+	}
+
+	return palette_rgb[(regs[7] & 0xF)];
+    }
+
+    // Render an individual scanline
+    void V9938::render_scanline()
+    {
+	int ypos = vcounter;
+	BeeVDPRGB *line = &frame_ring->backFrame().pixels[(ypos * 512)];
+
+	// If the VDP is disabled, render just the backdrop
+	if (!testbit(regs[1], 6))
+	{
+	    fill(line, (line + 512), backdrop_rgb());
+	    return;
+	}
+
+	// Apply vertical scrolling
+	int scroll_ypos = ((ypos + regs[23]) & 0xFF);
+	int mode = get_mode();
+
+	switch (mode)
+	{
+	    case ModeGraphic1: render_pattern(line, scroll_ypos, false); break;
+	    case ModeGraphic2:
+	    case ModeGraphic3: render_pattern(line, scroll_ypos, true); break;
+	    case ModeMulticolor: render_multicolor(line, scroll_ypos); break;
+	    case ModeText1: render_text(line, scroll_ypos, false); break;
+	    case ModeText2: render_text(line, scroll_ypos, true); break;
+	    case ModeGraphic4:
+	    case ModeGraphic5:
+	    case ModeGraphic6:
+	    case ModeGraphic7: render_bitmap(line, scroll_ypos, mode); break;
+	    // Undefined modes show just the backdrop
+	    default: fill(line, (line + 512), backdrop_rgb()); break;
+	}
+    }
+
+    // Render in TEXT 1 or TEXT 2 mode
+    void V9938::render_text(BeeVDPRGB *line, int ypos, bool is_text2)
+    {
+	int num_cols = (is_text2) ? 80 : 40;
+	int pixel_width = (is_text2) ? 1 : 2;
+	uint32_t name_mask = (is_text2) ? 0x7C : 0x7F;
+	uint32_t name_base = (((regs[2] & name_mask) << 10) + ((ypos >> 3) * num_cols));
+	uint32_t pattern_base = (((regs[4] & 0x3F) << 11) + (ypos & 0x7));
+	uint32_t blink_base = ((((regs[10] & 0x7) << 14) | ((regs[3] & 0xF8) << 6)) + ((ypos >> 3) * 10));
+
+	BeeVDPRGB fg_color = get_color(regs[7] >> 4);
+	BeeVDPRGB bg_color = get_color(regs[7] & 0xF);
+	BeeVDPRGB blink_fg_color = get_color(regs[12] >> 4);
+	BeeVDPRGB blink_bg_color = get_color(regs[12] & 0xF);
+
+	// The left and right borders are filled with the backdrop color
+	fill(line, (line + 512), backdrop_rgb());
+
+	for (int tile_col = 0; tile_col < num_cols; tile_col++)
+	{
+	    uint8_t name_byte = vram[((name_base + tile_col) & vram_mask)];
+	    uint8_t pattern_byte = vram[((pattern_base + (name_byte << 3)) & vram_mask)];
+
+	    bool is_blink = false;
+
+	    // TEXT 2 characters with their attribute bit set
+	    // use the alternate colors in R#12 during the blink phase
+	    if (is_text2 && is_blink_phase)
+	    {
+		uint8_t blink_byte = vram[((blink_base + (tile_col >> 3)) & vram_mask)];
+		is_blink = testbit(blink_byte, (7 - (tile_col & 0x7)));
+	    }
+
+	    BeeVDPRGB tile_fg = (is_blink) ? blink_fg_color : fg_color;
+	    BeeVDPRGB tile_bg = (is_blink) ? blink_bg_color : bg_color;
+	    BeeVDPRGB *pixels = &line[(16 + (tile_col * 6 * pixel_width))];
+
+	    for (int pixel = 0; pixel < 6; pixel++)
+	    {
+		BeeVDPRGB color = testbit(pattern_byte, (7 - pixel)) ? tile_fg : tile_bg;
+
+		for (int i = 0; i < pixel_width; i++)
+		{
+		    pixels[((pixel * pixel_width) + i)] = color;
+		}
+	    }
+	}
+    }
+
+    // Render in GRAPHIC 1, 2 or 3 mode
+    void V9938::render_pattern(BeeVDPRGB *line, int ypos, bool is_graphics2)
+    {
+	uint32_t name_base = (((regs[2] & 0x7F) << 10) + ((ypos >> 3) << 5));
+	uint32_t pattern_base = 0;
+	uint32_t color_base = 0;
+	uint16_t pattern_mask = 0xFF;
+	uint16_t color_mask = 0xFF;
+	uint16_t name_offs = 0;
+
+	if (is_graphics2)
+	{
+	    // The screen is split into three banks of 256 patterns
+	    pattern_base = (((regs[4] & 0x3C) << 11) + (ypos & 0x7));
+	    pattern_mask = (((regs[4] & 0x3) << 8) | 0xFF);
+	    color_base = ((((regs[10] & 0x7) << 14) | ((regs[3] & 0x80) << 6)) + (ypos & 0x7));
+	    color_mask = (((regs[3] & 0x7F) << 3) | 0x7);
+	    name_offs = ((ypos >> 6) << 8);
+	}
+	else
+	{
+	    pattern_base = (((regs[4] & 0x3F) << 11) + (ypos & 0x7));
+	    color_base = (((regs[10] & 0x7) << 14) | (regs[3] << 6));
+	}
+
+	for (int tile_col = 0; tile_col < 32; tile_col++)
+	{
+	    uint16_t name_word = (vram[((name_base + tile_col) & vram_mask)] + name_offs);
+	    uint8_t pattern_byte = vram[((pattern_base + ((name_word & pattern_mask) << 3)) & vram_mask)];
+	    uint8_t color_byte = 0;
+
+	    if (is_graphics2)
+	    {
+		color_byte = vram[((color_base + ((name_word & color_mask) << 3)) & vram_mask)];
+	    }
+	    else
+	    {
+		color_byte = vram[((color_base + (name_word >> 3)) & vram_mask)];
+	    }
+
+	    BeeVDPRGB fg_color = get_color(color_byte >> 4);
+	    BeeVDPRGB bg_color = get_color(color_byte & 0xF);
+	    BeeVDPRGB *pixels = &line[(tile_col << 4)];
+
+	    for (int pixel = 0; pixel < 8; pixel++)
+	    {
+		BeeVDPRGB color = testbit(pattern_byte, (7 - pixel)) ? fg_color : bg_color;
+		pixels[(pixel << 1)] = color;
+		pixels[((pixel << 1) + 1)] = color;
+	    }
+	}
+    }
+
+    // Render in MULTICOLOR mode
+    void V9938::render_multicolor(BeeVDPRGB *line, int ypos)
+    {
+	uint32_t name_base = (((regs[2] & 0x7F) << 10) + ((ypos >> 3) << 5));
+	uint32_t pattern_base = (((regs[4] & 0x3F) << 11) + ((ypos >> 2) & 0x7));
+
+	for (int tile_col = 0; tile_col < 32; tile_col++)
+	{
+	    uint8_t name_byte = vram[((name_base + tile_col) & vram_mask)];
+	    uint8_t pattern_byte = vram[((pattern_base + (name_byte << 3)) & vram_mask)];
+	    BeeVDPRGB *pixels = &line[(tile_col << 4)];
+	    fill(pixels, (pixels + 8), get_color(pattern_byte >> 4));
+	    fill((pixels + 8), (pixels + 16), get_color(pattern_byte & 0xF));
+	}
+    }
+
+    // Render in GRAPHIC 4-7 modes
+    void V9938::render_bitmap(BeeVDPRGB *line, int ypos, int mode)
+    {
+	switch (mode)
+	{
+	    // GRAPHIC 4 (256 pixels, 4 bits per pixel)
+	    case ModeGraphic4:
+	    {
+		uint32_t line_addr = (((regs[2] & 0x60) << 10) | (ypos << 7));
+
+		for (int xpos = 0; xpos < 128; xpos++)
+		{
+		    uint8_t data = vram[((line_addr + xpos) & vram_mask)];
+		    BeeVDPRGB left_color = get_color(data >> 4);
+		    BeeVDPRGB right_color = get_color(data & 0xF);
+		    line[(xpos << 2)] = left_color;
+		    line[((xpos << 2) + 1)] = left_color;
+		    line[((xpos << 2) + 2)] = right_color;
+		    line[((xpos << 2) + 3)] = right_color;
+		}
+	    }
+	    break;
+	    // GRAPHIC 5 (512 pixels, 2 bits per pixel)
+	    case ModeGraphic5:
+	    {
+		uint32_t line_addr = (((regs[2] & 0x60) << 10) | (ypos << 7));
+
+		for (int xpos = 0; xpos < 128; xpos++)
+		{
+		    uint8_t data = vram[((line_addr + xpos) & vram_mask)];
+
+		    for (int pixel = 0; pixel < 4; pixel++)
+		    {
+			line[((xpos << 2) + pixel)] = get_color((data >> (6 - (pixel << 1))) & 0x3);
+		    }
+		}
+	    }
+	    break;
+	    // GRAPHIC 6 (512 pixels, 4 bits per pixel)
+	    case ModeGraphic6:
+	    {
+		uint32_t line_addr = (((regs[2] & 0x20) << 11) | (ypos << 8));
+
+		for (int xpos = 0; xpos < 256; xpos++)
+		{
+		    uint8_t data = vram[((line_addr + xpos) & vram_mask)];
+		    line[(xpos << 1)] = get_color(data >> 4);
+		    line[((xpos << 1) + 1)] = get_color(data & 0xF);
+		}
+	    }
+	    break;
+	    // GRAPHIC 7 (256 pixels, 8 bits per pixel in GGGRRRBB format)
+	    case ModeGraphic7:
+	    {
+		uint32_t line_addr = (((regs[2] & 0x20) << 11) | (ypos << 8));
+
+		for (int xpos = 0; xpos < 256; xpos++)
+		{
+		    BeeVDPRGB color = graphic7_rgb[vram[((line_addr + xpos) & vram_mask)]];
+		    line[(xpos << 1)] = color;
+		    line[((xpos << 1) + 1)] = color;
+		}
+	    }
+	    break;
+	    default: break;
+	}
+    }
+
+    // Fetch the number of pixels stored in each VRAM byte
+    int V9938::pixels_per_byte() const
+    {
+	switch (get_mode())
+	{
+	    case ModeGraphic5: return 4;
+	    case ModeGraphic7: return 1;
+	    default: return 2;
+	}
+    }
+
+    // Fetch the width of the bitmap the command engine operates on
+    int V9938::screen_width() const
+    {
+	switch (get_mode())
+	{
+	    case ModeGraphic5:
+	    case ModeGraphic6: return 512;
+	    default: return 256;
+	}
+    }
+
+    // Fetch the number of lines that fit in VRAM in the current mode
+    int V9938::screen_height() const
+    {
+	switch (get_mode())
+	{
+	    case ModeGraphic6:
+	    case ModeGraphic7: return 512;
+	    default: return 1024;
+	}
+    }
+
+    // Fetch the VRAM address of the byte holding pixel ('xpos', 'ypos')
+    uint32_t V9938::pixel_addr(int xpos, int ypos) const
+    {
+	int bytes_per_line = (screen_width() / pixels_per_byte());
+	int line = (ypos & (screen_height() - 1));
+	return (((line * bytes_per_line) + (xpos / pixels_per_byte())) & vram_mask);
+    }
+
+    // Fetch the color of pixel ('xpos', 'ypos')
+    uint8_t V9938::point(int xpos, int ypos) const
+    {
+	uint8_t data = vram[pixel_addr(xpos, ypos)];
+
+	switch (pixels_per_byte())
+	{
+	    case 1: return data;
+	    case 4: return ((data >> ((3 - (xpos & 0x3)) << 1)) & 0x3);
+	    default: return testbit(xpos, 0) ? (data & 0xF) : (data >> 4);
+	}
+    }
+
+    // Apply a logical operation to a single pixel
+    uint8_t V9938::apply_logic_op(uint8_t src, uint8_t dst, int logic_op, uint8_t mask) const
+    {
+	// The T-prefixed operations leave the destination alone
+	// if the source color is 0 (i.e. transparent)
+	if (testbit(logic_op, 3) && (src == 0))
+	{
+	    return dst;
+	}
+
+	switch (logic_op & 0x7)
+	{
+	    case 0: return src; // IMP
+	    case 1: return (src & dst); // AND
+	    case 2: return (src | dst); // OR
+	    case 3: return (src ^ dst); // EOR
+	    case 4: return (~src & mask); // NOT
+	    default: return dst;
+	}
+    }
+
+    // Set pixel ('xpos', 'ypos') to 'color' using the given logical operation
+    void V9938::pset(int xpos, int ypos, uint8_t color, int logic_op)
+    {
+	uint32_t addr = pixel_addr(xpos, ypos);
+	uint8_t data = vram[addr];
+	int ppb = pixels_per_byte();
+	int bits = (8 / ppb);
+	uint8_t mask = ((1 << bits) - 1);
+	int shift = (((ppb - 1) - (xpos & (ppb - 1))) * bits);
+
+	uint8_t dst = ((data >> shift) & mask);
+	uint8_t result = apply_logic_op((color & mask), dst, logic_op, mask);
+	vram[addr] = ((data & ~(mask << shift)) | (result << shift));
+    }
+
+    // Start executing the command written to R#46
+    void V9938::start_command()
+    {
+	command.sx = (((regs[33] & 0x1) << 8) | regs[32]);
+	command.sy = (((regs[35] & 0x3) << 8) | regs[34]);
+	command.dx = (((regs[37] & 0x1) << 8) | regs[36]);
+	command.dy = (((regs[39] & 0x3) << 8) | regs[38]);
+	command.nx = (((regs[41] & 0x1) << 8) | regs[40]);
+	command.ny = (((regs[43] & 0x3) << 8) | regs[42]);
+	command.clr = regs[44];
+	command.arg = regs[45];
+	command.cmd = regs[46];
+
+	command.is_executing = false;
+	command.is_transfer_ready = false;
+	command.remaining_cycles = 0;
+
+	// The command engine only operates in the bitmap modes
+	if (!is_bitmap_mode())
+	{
+	    return;
+	}
+
+	switch (command.cmd >> 4)
+	{
+	    case CmdStop: break;
+	    case CmdPoint: command_point(); break;
+	    case CmdPset: command_pset(); break;
+	    case CmdSrch: command_search(); break;
+	    case CmdLine: command_line(); break;
+	    case CmdLmmv: command_lmmv(); break;
+	    case CmdLmmm: command_lmmm(); break;
+	    case CmdHmmv: command_hmmv(); break;
+	    case CmdHmmm: command_hmmm(); break;
+	    case CmdYmmm: command_ymmm(); break;
+	    case CmdLmcm:
+	    case CmdLmmc:
+	    case CmdHmmc: begin_transfer(); break;
+	    default: break;
+	}
+    }
+
+    // Mark the current command as complete
+    // ('num_ops' pixels or bytes were processed, at roughly
+    // 'op_cycles' master clock cycles each)
+    void V9938::finish_command(int64_t num_ops, int op_cycles)
+    {
+	if (is_command_timing)
+	{
+	    command.remaining_cycles = (num_ops * op_cycles);
+	    command.is_executing = (command.remaining_cycles > 0);
+	}
+	else
+	{
+	    command.is_executing = false;
+	}
+    }
+
+    // POINT: read the color of pixel (SX, SY) into S#7
+    void V9938::command_point()
+    {
+	color_status = point(command.sx, command.sy);
+	finish_command(1, 88);
+    }
+
+    // PSET: draw pixel (DX, DY)
+    void V9938::command_pset()
+    {
+	pset(command.dx, command.dy, command.clr, (command.cmd & 0xF));
+	finish_command(1, 88);
+    }
+
+    // SRCH: search for a border color along the X axis, starting from (SX, SY)
+    void V9938::command_search()
+    {
+	int dix = testbit(command.arg, 2) ? -1 : 1;
+	bool is_eq = testbit(command.arg, 1);
+	uint8_t color = (command.clr & ((1 << (8 / pixels_per_byte())) - 1));
+	int width = screen_width();
+	int64_t num_ops = 0;
+
+	is_border_detected = false;
+
+	for (int xpos = command.sx; (xpos >= 0) && (xpos < width); xpos += dix)
+	{
+	    num_ops += 1;
+
+	    // EQ = 0 stops on the border color, while
+	    // EQ = 1 stops on any other color
+	    if ((point(xpos, command.sy) == color) != is_eq)
+	    {
+		is_border_detected = true;
+		border_x = xpos;
+		break;
+	    }
+	}
+
+	finish_command(num_ops, 88);
+    }
+
+    // LINE: draw a line starting from (DX, DY)
+    // (NX is the length of the long side, and NY the length of the short side)
+    void V9938::command_line()
+    {
+	int dix = testbit(command.arg, 2) ? -1 : 1;
+	int diy = testbit(command.arg, 3) ? -1 : 1;
+	bool is_y_major = testbit(command.arg, 0);
+	int logic_op = (command.cmd & 0xF);
+	int width = screen_width();
+
+	int xpos = command.dx;
+	int ypos = command.dy;
+	int error = ((command.nx - 1) >> 1);
+	int64_t num_ops = 0;
+
+	for (int i = 0; i <= command.nx; i++)
+	{
+	    if ((xpos < 0) || (xpos >= width))
+	    {
+		break;
+	    }
+
+	    pset(xpos, ypos, command.clr, logic_op);
+	    num_ops += 1;
+
+	    if (is_y_major)
+	    {
+		ypos += diy;
+	    }
+	    else
+	    {
+		xpos += dix;
+	    }
+
+	    error -= command.ny;
+
+	    if (error < 0)
+	    {
+		error += command.nx;
+
+		if (is_y_major)
+		{
+		    xpos += dix;
+		}
+		else
+		{
+		    ypos += diy;
+		}
+	    }
+	}
+
+	finish_command(num_ops, 88);
+    }
+
+    // LMMV: logical fill of a rectangle at (DX, DY)
+    void V9938::command_lmmv()
+    {
+	int dix = testbit(command.arg, 2) ? -1 : 1;
+	int diy = testbit(command.arg, 3) ? -1 : 1;
+	int nx = (command.nx != 0) ? command.nx : 512;
+	int ny = (command.ny != 0) ? command.ny : 1024;
+	int logic_op = (command.cmd & 0xF);
+	int width = screen_width();
+	int64_t num_ops = 0;
+
+	for (int row = 0; row < ny; row++)
+	{
+	    int ypos = (command.dy + (row * diy));
+
+	    for (int col = 0, xpos = command.dx; (col < nx) && (xpos >= 0) && (xpos < width); col++, xpos += dix)
+	    {
+		pset(xpos, ypos, command.clr, logic_op);
+		num_ops += 1;
+	    }
+	}
+
+	command.dy = ((command.dy + (ny * diy)) & 0x3FF);
+	finish_command(num_ops, 72);
+    }
+
+    // LMMM: logical copy of a rectangle from (SX, SY) to (DX, DY)
+    void V9938::command_lmmm()
+    {
+	int dix = testbit(command.arg, 2) ? -1 : 1;
+	int diy = testbit(command.arg, 3) ? -1 : 1;
+	int nx = (command.nx != 0) ? command.nx : 512;
+	int ny = (command.ny != 0) ? command.ny : 1024;
+	int logic_op = (command.cmd & 0xF);
+	int width = screen_width();
+	int64_t num_ops = 0;
+
+	for (int row = 0; row < ny; row++)
+	{
+	    int src_y = (command.sy + (row * diy));
+	    int dst_y = (command.dy + (row * diy));
+	    int src_x = command.sx;
+	    int dst_x = command.dx;
+
+	    for (int col = 0; col < nx; col++)
+	    {
+		if ((src_x < 0) || (src_x >= width) || (dst_x < 0) || (dst_x >= width))
+		{
+		    break;
+		}
+
+		pset(dst_x, dst_y, point(src_x, src_y), logic_op);
+		num_ops += 1;
+		src_x += dix;
+		dst_x += dix;
+	    }
+	}
+
+	command.sy = ((command.sy + (ny * diy)) & 0x3FF);
+	command.dy = ((command.dy + (ny * diy)) & 0x3FF);
+	finish_command(num_ops, 96);
+    }
+
+    // HMMV: high-speed fill of a rectangle at (DX, DY), in byte units
+    void V9938::command_hmmv()
+    {
+	int dix = testbit(command.arg, 2) ? -1 : 1;
+	int diy = testbit(command.arg, 3) ? -1 : 1;
+	int ppb = pixels_per_byte();
+	int bytes_per_line = (screen_width() / ppb);
+	int num_bytes = (((command.nx != 0) ? command.nx : 512) / ppb);
+	int ny = (command.ny != 0) ? command.ny : 1024;
+	int start_byte = min((command.dx / ppb), (bytes_per_line - 1));
+	int64_t num_ops = 0;
+
+	// Clip the run of bytes to the edge of the screen
+	// (Note: like LMMV, nothing is drawn if DX is past the edge)
+	bool is_off_screen = ((command.dx / ppb) >= bytes_per_line);
+	int first_byte = (dix > 0) ? start_byte : max((start_byte - num_bytes + 1), 0);
+	int last_byte = (dix > 0) ? min((start_byte + num_bytes), bytes_per_line) : (start_byte + 1);
+	int run_length = is_off_screen ? 0 : clamp((last_byte - first_byte), 0, (bytes_per_line - first_byte));
+
+	for (int row = 0; row < ny; row++)
+	{
+	    uint32_t line_addr = pixel_addr(0, (command.dy + (row * diy)));
+	    memset(&vram[(line_addr + first_byte)], command.clr, run_length);
+	    num_ops += run_length;
+	}
+
+	command.dy = ((command.dy + (ny * diy)) & 0x3FF);
+	finish_command(num_ops, 48);
+    }
+
+    // HMMM: high-speed copy of a rectangle from (SX, SY) to (DX, DY), in byte units
+    void V9938::command_hmmm()
+    {
+	int dix = testbit(command.arg, 2) ? -1 : 1;
+	int diy = testbit(command.arg, 3) ? -1 : 1;
+	int ppb = pixels_per_byte();
+	int bytes_per_line = (screen_width() / ppb);
+	int num_bytes = (((command.nx != 0) ? command.nx : 512) / ppb);
+	int ny = (command.ny != 0) ? command.ny : 1024;
+	int src_byte = min((command.sx / ppb), (bytes_per_line - 1));
+	int dst_byte = min((command.dx / ppb), (bytes_per_line - 1));
+	int64_t num_ops = 0;
+
+	// Clip the run of bytes to the edges of both the source and the destination
+	// (Note: like LMMM, nothing is copied if SX or DX is past the edge)
+	bool is_off_screen = (((command.sx / ppb) >= bytes_per_line) || ((command.dx / ppb) >= bytes_per_line));
+	int run_length = 0;
+
+	if (dix > 0)
+	{
+	    run_length = min({num_bytes, (bytes_per_line - src_byte), (bytes_per_line - dst_byte)});
+	}
+	else
+	{
+	    run_length = min({num_bytes, (src_byte + 1), (dst_byte + 1)});
+	    src_byte -= (run_length - 1);
+	    dst_byte -= (run_length - 1);
+	}
+
+	run_length = is_off_screen ? 0 : clamp(run_length, 0, (bytes_per_line - max(src_byte, dst_byte)));
+
+	for (int row = 0; row < ny; row++)
+	{
+	    uint8_t *src = &vram[(pixel_addr(0, (command.sy + (row * diy))) + src_byte)];
+	    uint8_t *dst = &vram[(pixel_addr(0, (command.dy + (row * diy))) + dst_byte)];
+
+	    // Overlapping runs on the same line are copied byte by byte
+	    // in the direction the real hardware uses
+	    bool is_overlapped = (dst > src) ? (dst < (src + run_length)) : (src < (dst + run_length));
+	    bool is_smeared = is_overlapped && ((dix > 0) ? (dst > src) : (dst < src));
+
+	    if (is_smeared && (dix > 0))
+	    {
+		for (int i = 0; i < run_length; i++)
+		{
+		    dst[i] = src[i];
+		}
+	    }
+	    else if (is_smeared)
+	    {
+		for (int i = (run_length - 1); i >= 0; i--)
+		{
+		    dst[i] = src[i];
+		}
+	    }
+	    else
+	    {
+		memmove(dst, src, run_length);
+	    }
+
+	    num_ops += run_length;
+	}
+
+	command.sy = ((command.sy + (ny * diy)) & 0x3FF);
+	command.dy = ((command.dy + (ny * diy)) & 0x3FF);
+	finish_command(num_ops, 64);
+    }
+
+    // YMMM: high-speed copy along the Y axis, from (DX, SY) to (DX, DY),
+    // from DX to the edge of the screen
+    void V9938::command_ymmm()
+    {
+	int dix = testbit(command.arg, 2) ? -1 : 1;
+	int diy = testbit(command.arg, 3) ? -1 : 1;
+	int ppb = pixels_per_byte();
+	int bytes_per_line = (screen_width() / ppb);
+	int ny = (command.ny != 0) ? command.ny : 1024;
+	int start_byte = min((command.dx / ppb), (bytes_per_line - 1));
+	int first_byte = (dix > 0) ? start_byte : 0;
+	int run_length = (dix > 0) ? (bytes_per_line - start_byte) : (start_byte + 1);
+	int64_t num_ops = 0;
+
+	// (Note: nothing is copied if DX is past the edge of the screen)
+	if ((command.dx / ppb) >= bytes_per_line)
+	{
+	    run_length = 0;
+	}
+
+	run_length = clamp(run_length, 0, (bytes_per_line - first_byte));
+
+	for (int row = 0; row < ny; row++)
+	{
+	    uint8_t *src = &vram[(pixel_addr(0, (command.sy + (row * diy))) + first_byte)];
+	    uint8_t *dst = &vram[(pixel_addr(0, (command.dy + (row * diy))) + first_byte)];
+	    memmove(dst, src, run_length);
+	    num_ops += run_length;
+	}
+
+	command.sy = ((command.sy + (ny * diy)) & 0x3FF);
+	command.dy = ((command.dy + (ny * diy)) & 0x3FF);
+	finish_command(num_ops, 56);
+    }
+
+    // Start a CPU transfer command (i.e. LMMC, HMMC or LMCM)
+    void V9938::begin_transfer()
+    {
+	int opcode = (command.cmd >> 4);
+	command.cur_x = (opcode == CmdLmcm) ? command.sx : command.dx;
+	command.cur_y = (opcode == CmdLmcm) ? command.sy : command.dy;
+	command.count_x = (command.nx != 0) ? command.nx : 512;
+	command.count_y = (command.ny != 0) ? command.ny : 1024;
+	command.is_executing = true;
+
+	if (opcode == CmdLmcm)
+	{
+	    // The first pixel is available in S#7 straight away
+	    color_status = point(command.cur_x, command.cur_y);
+	    command.is_transfer_ready = true;
+	}
+	else
+	{
+	    // The first pixel (or byte) is taken from R#44
+	    command.is_transfer_ready = true;
+	    transfer_data(command.clr);
+	}
+    }
+
+    // Move a CPU transfer on to the next pixel (or byte)
+    // (Note: returns false once the transfer is complete)
+    bool V9938::advance_transfer()
+    {
+	int opcode = (command.cmd >> 4);
+	int dix = testbit(command.arg, 2) ? -1 : 1;
+	int diy = testbit(command.arg, 3) ? -1 : 1;
+	int step = (opcode == CmdHmmc) ? pixels_per_byte() : 1;
+
+	command.cur_x += (dix * step);
+	command.count_x -= step;
+
+	// Move on to the next line at the end of each row
+	// (or at the edge of the screen)
+	if ((command.count_x <= 0) || (command.cur_x < 0) || (command.cur_x >= screen_width()))
+	{
+	    command.cur_x = (opcode == CmdLmcm) ? command.sx : command.dx;
+	    command.count_x = (command.nx != 0) ? command.nx : 512;
+	    command.cur_y += diy;
+	    command.count_y -= 1;
+	}
+
+	if (command.count_y <= 0)
+	{
+	    command.is_executing = false;
+	    command.is_transfer_ready = false;
+	    return false;
+	}
+
+	return true;
+    }
+
+    // Transfer a pixel (or byte) from the CPU to VRAM
+    void V9938::transfer_data(uint8_t data)
+    {
+	if ((command.cmd >> 4) == CmdHmmc)
+	{
+	    vram[pixel_addr(command.cur_x, command.cur_y)] = data;
+	}
+	else
+	{
+	    pset(command.cur_x, command.cur_y, data, (command.cmd & 0xF));
+	}
+
+	advance_transfer();
+    }
+
+    // Read S#7, moving an LMCM transfer on to the next pixel
+    uint8_t V9938::transfer_status()
+    {
+	uint8_t result = color_status;
+
+	if (command.is_executing && ((command.cmd >> 4) == CmdLmcm))
+	{
+	    if (advance_transfer())
+	    {
+		color_status = point(command.cur_x, command.cur_y);
+	    }
+	}
+
+	return result;
+    }
+}
@@ -0,0 +1,242 @@
+/*
+    This file is part of the BeeVDP engine.
+    Copyright (C) 2021 BueniaDev.
+
+    BeeVDP is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    BeeVDP is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef BEEVDP_V9938_H
+#define BEEVDP_V9938_H
+
+#include "beevdp.h"
+
+namespace beevdp
+{
+    // A completed V9938 frame
+    // (Note: the framebuffer is always 512 pixels wide,
+    // and pixels are doubled horizontally in 256-pixel wide modes)
+    struct V9938Frame
+    {
+	// Frame sequence number (starts at 1)
+	uint64_t sequence = 0;
+	// Time at which the frame was completed
+	// (in nanoseconds, from std::chrono::steady_clock)
+	int64_t timestamp = 0;
+	// Number of active lines (i.e. 192 or 212)
+	int height = 192;
+	std::array<BeeVDPRGB, (512 * 212)> pixels;
+
+	void clear()
+	{
+	    sequence = 0;
+	    timestamp = 0;
+	    pixels.fill({0, 0, 0});
+	}
+    };
+
+    // State of the V9938's hardware command engine
+    struct V9938Command
+    {
+	// Command and argument registers (R#32-R#46)
+	int sx = 0;
+	int sy = 0;
+	int dx = 0;
+	int dy = 0;
+	int nx = 0;
+	int ny = 0;
+	uint8_t clr = 0;
+	uint8_t arg = 0;
+	uint8_t cmd = 0;
+
+	// Progress of CPU transfer commands (i.e. LMMC, HMMC and LMCM)
+	int cur_x = 0;
+	int cur_y = 0;
+	int count_x = 0;
+	int count_y = 0;
+
+	// Set while a command is executing (i.e. the CE bit of S#2)
+	bool is_executing = false;
+	// Set while a CPU transfer is waiting for the CPU (i.e. the TR bit of S#2)
+	bool is_transfer_ready = false;
+	// Estimated number of master clock cycles left before the command completes
+	// (only used if the timing model is enabled)
+	int64_t remaining_cycles = 0;
+    };
+
+    // V9938 core (aka. the MSX2 VDP)
+    class V9938
+    {
+	public:
+	    V9938();
+	    ~V9938();
+
+	    V9938(const V9938&) = delete;
+	    V9938 &operator=(const V9938&) = delete;
+
+	    // Storage configuration
+	    // (Note: these should be called before init())
+	    void setMemoryResource(std::pmr::memory_resource *resource);
+	    void setHeadless(bool is_enabled);
+
+	    // Keep the CE bit set for roughly as long as the real
+	    // command engine would take to execute each command
+	    // (Note: the effects of each command are always applied at once)
+	    void setCommandTiming(bool is_enabled);
+
+	    // Render only every 'interval'th frame (or no frames at all if 'interval' is 0)
+	    // (Note: a new interval takes effect at the next frame boundary, so the
+	    // frame in progress is always either rendered in full or skipped in full)
+	    void setRenderInterval(int interval);
+
+	    // Hand over each finished scanline (and the start of each VBlank)
+	    // without waiting for the frame to complete
+	    void setLineCallback(BeeVDPLineCallback callback);
+	    void setVBlankCallback(BeeVDPVBlankCallback callback);
+
+	    void init();
+	    void shutdown();
+
+	    // Port 0 (VRAM access)
+	    void writeData(uint8_t data);
+	    uint8_t readData();
+
+	    // Port 1 (register writes, address setup and status reads)
+	    void writeControl(uint8_t data);
+	    uint8_t readStatus();
+
+	    // Port 2 (palette writes)
+	    void writePalette(uint8_t data);
+
+	    // Port 3 (indirect register writes)
+	    void writeIndirect(uint8_t data);
+
+	    bool isInterrupt();
+
+	    const V9938Frame *acquireFrame();
+
+	    int getWidth() const;
+	    int getHeight() const;
+	    int numScanlines() const;
+
+	    void chipClock();
+
+	private:
+	    static constexpr uint32_t vram_size = 0x20000;
+	    static constexpr uint32_t vram_mask = (vram_size - 1);
+
+	    uint8_t *vram = nullptr;
+
+	    uint16_t vcounter = 0;
+
+	    std::array<uint8_t, 64> regs = {};
+
+	    bool is_second_control_write = false;
+	    uint8_t control_latch = 0;
+	    uint16_t addr_register = 0;
+	    uint8_t read_buffer = 0;
+
+	    bool is_second_palette_write = false;
+	    uint8_t palette_latch = 0;
+
+	    // Status flags
+	    bool is_vblank_flag = false;
+	    bool is_line_flag = false;
+	    bool is_hblank_toggle = false;
+	    bool is_border_detected = false;
+	    uint8_t color_status = 0;
+	    uint16_t border_x = 0;
+
+	    V9938Command command;
+	    bool is_command_timing = false;
+
+	    int blink_counter = 0;
+	    bool is_blink_phase = false;
+
+	    // Palette in 9-bit RGB (laid out as 0GGG0RRR0BBB), and converted to 24-bit RGB
+	    std::array<uint16_t, 16> palette = {};
+	    std::array<BeeVDPRGB, 16> palette_rgb;
+	    std::array<BeeVDPRGB, 256> graphic7_rgb;
+
+	    std::pmr::memory_resource *memory_resource = nullptr;
+	    BeeVDPTripleBuffer<V9938Frame> *frame_ring = nullptr;
+	    uint64_t frame_count = 0;
+	    bool is_headless = false;
+	    int render_interval = 1;
+	    bool is_frame_rendered = true;
+
+	    BeeVDPLineCallback line_callback;
+	    BeeVDPVBlankCallback vblank_callback;
+
+	    void allocate_storage();
+	    void free_storage();
+
+	    int get_mode() const;
+	    bool is_bitmap_mode() const;
+	    int active_lines() const;
+
+	    uint32_t vram_addr() const;
+	    void increment_addr();
+
+	    void write_reg(int reg, uint8_t data);
+	    void update_palette(int index);
+
+	    void publish_frame();
+	    void update_blink();
+
+	    // Renderer
+	    void render_scanline();
+	    void render_text(BeeVDPRGB *line, int ypos, bool is_text2);
+	    void render_pattern(BeeVDPRGB *line, int ypos, bool is_graphics2);
+	    void render_multicolor(BeeVDPRGB *line, int ypos);
+	    void render_bitmap(BeeVDPRGB *line, int ypos, int mode);
+
+	    BeeVDPRGB get_color(int color_val) const;
+	    BeeVDPRGB backdrop_rgb() const;
+
+	    // Command engine
+	    void start_command();
+	    void finish_command(int64_t num_ops, int op_cycles);
+	    void transfer_data(uint8_t data);
+	    uint8_t transfer_status();
+
+	    int pixels_per_byte() const;
+	    int screen_width() const;
+	    int screen_height() const;
+	    uint32_t pixel_addr(int xpos, int ypos) const;
+	    uint8_t point(int xpos, int ypos) const;
+	    void pset(int xpos, int ypos, uint8_t color, int logic_op);
+	    uint8_t apply_logic_op(uint8_t src, uint8_t dst, int logic_op, uint8_t mask) const;
+
+	    void command_point();
+	    void command_pset();
+	    void command_search();
+	    void command_line();
+	    void command_lmmv();
+	    void command_lmmm();
+	    void command_hmmv();
+	    void command_hmmm();
+	    void command_ymmm();
+	    void begin_transfer();
+	    bool advance_transfer();
+
+	    template<typename T>
+	    bool testbit(T reg, int bit) const
+	    {
+		return ((reg >> bit) & 1) ? true : false;
+	    }
+    };
+};
+
+#endif // BEEVDP_V9938_H
@@ -17,109 +17,476 @@
 */
 
 // Buenia's Notes:
-// This implementation currently covers the TMS9918A VDP.
-// All other variants of the TMS99XXA, as well as V9938 and V9958 implementations,
-// are currently unsupported at the moment, but I plan to
-// support these varaints in the future.
+// This implementation currently covers the TMS9918A VDP,
+// as well as the TMS9928A, TMS9929A, TMS9118, TMS9128 and TMS9129 variants
+// (see the variant traits in beevdp.h).
+// The V9938 lives in its own core (see beevdp-v9938.cpp),
+// while the V9958 is currently unsupported at the moment.
 //
 // Note that the term "V9938 syntax" is used in this implementation 
 // in order to describe a specific TMS9918A mode
 // as it is refered to in the V9938 Technical Data Book.
 //
 // TODO list:
-// Implement remaining undocumented modes (i.e. mode 1+2 and mode 2+3)
 // Figure out RGB colors for PAL VDP (i.e. TMS9929A)
-// Implement 4K/16K VRAM bank selection
 // Implement sprite rendering
-// TMS9929A support
 // Support for other VDP implementations?
 
+#include <cstring>
+#include <algorithm>
 #include "beevdp.h"
+#include "beevdp-profiler.h"
+#include "beevdp-debug.h"
+#include "beevdp-perf.h"
+#include "beevdp-shm.h"
+#include "beevdp-simd.h"
 using namespace beevdp;
 using namespace std;
 
+static_assert(sizeof(BeeVDPRGB) == 3, "The scanline kernels expect packed 24-bit RGB pixels");
+
+// Performance counter updates compile to nothing
+// unless BEEVDP_ENABLE_STATS is defined
+#ifdef BEEVDP_ENABLE_STATS
+#define BEEVDP_STAT(expr) expr
+#else
+#define BEEVDP_STAT(expr)
+#endif
+
 namespace beevdp
 {
-    TMS9918A::TMS9918A()
+    void BeeVDPFrame::getDirtyRects(uint64_t prev_sequence, vector<BeeVDPRect> &rects) const
     {
+	rects.clear();
+
+	if ((prev_sequence == 0) || (prev_sequence != dirty_base))
+	{
+	    rects.push_back({0, 0, 256, 192});
+	    return;
+	}
+
+	// Turn each run of dirty columns into a span,
+	// and stack identical spans on consecutive lines into rectangles
+	vector<size_t> open_rects;
+	vector<size_t> next_rects;
+
+	for (int ypos = 0; ypos < 192; ypos++)
+	{
+	    uint32_t columns = dirty_columns[ypos];
+	    next_rects.clear();
+	    int column = 0;
+
+	    while (column < 32)
+	    {
+		if (((columns >> column) & 1) == 0)
+		{
+		    column += 1;
+		    continue;
+		}
+
+		int start = column;
+
+		while ((column < 32) && ((columns >> column) & 1))
+		{
+		    column += 1;
+		}
+
+		BeeVDPRect span = {(start * 8), ypos, ((column - start) * 8), 1};
+		auto match = find_if(open_rects.begin(), open_rects.end(), [&](size_t index)
+		{
+		    return (rects[index].x == span.x) && (rects[index].width == span.width);
+		});
 
+		if (match != open_rects.end())
+		{
+		    rects[*match].height += 1;
+		    next_rects.push_back(*match);
+		}
+		else
+		{
+		    next_rects.push_back(rects.size());
+		    rects.push_back(span);
+		}
+	    }
+
+	    open_rects.swap(next_rects);
+	}
+    }
+
+    template<typename Variant>
+    TMS99xxA<Variant>::TMS99xxA()
+    {
+	memory_resource = pmr::get_default_resource();
     }
 
-    TMS9918A::~TMS9918A()
+    template<typename Variant>
+    TMS99xxA<Variant>::~TMS99xxA()
     {
+	free_storage();
+    }
+
+    // Set the memory resource used to allocate VRAM and the framebuffers
+    // (e.g. a pmr::monotonic_buffer_resource shared by many VDPs)
+    template<typename Variant>
+    void TMS99xxA<Variant>::setMemoryResource(pmr::memory_resource *resource)
+    {
+	free_storage();
+	memory_resource = (resource != nullptr) ? resource : pmr::get_default_resource();
+    }
 
+    // Set the amount of VRAM attached to the VDP
+    template<typename Variant>
+    void TMS99xxA<Variant>::setVRAMSize(BeeVDPVRAMSize size)
+    {
+	free_storage();
+	vram_size = size;
+	vram_image = nullptr;
     }
 
-    // Increment address register
-    void TMS9918A::increment_addr()
+    // Use an externally owned buffer of 'size' bytes as VRAM
+    // (Note: the buffer must outlive the VDP, and its contents
+    // are left untouched by init())
+    template<typename Variant>
+    void TMS99xxA<Variant>::setVRAMBuffer(uint8_t *buffer, BeeVDPVRAMSize size)
     {
-	// The address register wraps around to 0
-	// when it exceeds 0x3FFF
-	if (addr_register == 0x3FFF)
+	free_storage();
+	vram = buffer;
+	vram_size = size;
+	vram_image = nullptr;
+	is_vram_external = (buffer != nullptr);
+    }
+
+    // Start from a shared VRAM image, copying each page on the first write to it
+    // (Note: the image must outlive the VDP, and its contents
+    // are left untouched by init(), see BeeVDPVRAMImage)
+    template<typename Variant>
+    void TMS99xxA<Variant>::setVRAMImage(const BeeVDPVRAMImage *image)
+    {
+	free_storage();
+	vram_image = ((image != nullptr) && image->isOpen()) ? image : nullptr;
+
+	if (vram_image != nullptr)
 	{
-	    addr_register = 0;
+	    vram_size = vram_image->getSize();
+	}
+    }
+
+    // Render into an externally owned frame ring
+    // (e.g. one in shared memory, see BeeVDPSharedFrames)
+    // (Note: the ring must outlive the VDP, or be detached with setFrameRing(nullptr),
+    // since it stays attached while the other storage options are changed)
+    template<typename Variant>
+    void TMS99xxA<Variant>::setFrameRing(BeeVDPFrameRing *ring)
+    {
+	if ((frame_ring != nullptr) && !is_ring_external)
+	{
+	    frame_ring->~BeeVDPFrameRing();
+	    memory_resource->deallocate(frame_ring, sizeof(BeeVDPFrameRing), alignof(BeeVDPFrameRing));
+	}
+
+	frame_ring = ring;
+	last_frame = nullptr;
+	is_ring_external = (ring != nullptr);
+    }
+
+    // Run without any framebuffers
+    // (Note: no pixels are rendered in headless mode,
+    // but VBlank and IRQ generation work as usual)
+    template<typename Variant>
+    void TMS99xxA<Variant>::setHeadless(bool is_enabled)
+    {
+	free_storage();
+	is_headless = is_enabled;
+    }
+
+    // Allocate the buffers for snapshots of the VDP state
+    template<typename Variant>
+    void TMS99xxA<Variant>::setSnapshotsEnabled(bool is_enabled)
+    {
+	free_storage();
+	is_snapshots_enabled = is_enabled;
+    }
+
+    // Honor the 4K/16K bit in register 1
+    template<typename Variant>
+    void TMS99xxA<Variant>::set4KModeEnabled(bool is_enabled)
+    {
+	is_4k_mode_enabled = is_enabled;
+	update_vram_mask();
+    }
+
+    // Set how often frames are rendered
+    template<typename Variant>
+    void TMS99xxA<Variant>::setRenderInterval(int interval)
+    {
+	// (Note: the frame in progress keeps its current setting,
+	// and publish_frame() applies the new interval from the next frame on)
+	render_interval = max(interval, 0);
+    }
+
+    // Set the part of the screen that gets rendered
+    template<typename Variant>
+    void TMS99xxA<Variant>::setRegionOfInterest(const BeeVDPRect &region)
+    {
+	int first_xpos = clamp(region.x, 0, getWidth());
+	int first_ypos = clamp(region.y, 0, getHeight());
+	int end_xpos = clamp((region.x + region.width), first_xpos, getWidth());
+	int end_ypos = clamp((region.y + region.height), first_ypos, getHeight());
+	render_region = {first_xpos, first_ypos, (end_xpos - first_xpos), (end_ypos - first_ypos)};
+    }
+
+    // Fetch the part of the screen that gets rendered
+    template<typename Variant>
+    BeeVDPRect TMS99xxA<Variant>::getRegionOfInterest() const
+    {
+	return render_region;
+    }
+
+    // Evaluate a single pixel of the current VRAM and register state
+    // (Note: this follows the same steps as the fast renderer,
+    // but only fetches the cell the pixel is in)
+    template<typename Variant>
+    uint8_t TMS99xxA<Variant>::peekPixel(int xpos, int ypos)
+    {
+	if (!inRange(xpos, 0, getWidth()) || !inRange(ypos, 0, getHeight()))
+	{
+	    return 0;
+	}
+
+	if (!is_vdp_enabled)
+	{
+	    return backdrop_color;
+	}
+
+	const BeeVDPModeDesc &desc = tms99xx_modes[(mode_val & 0x7)];
+	int cell_xpos = (xpos - desc.border);
+
+	// The left and right borders show the backdrop color
+	if (!inRange(cell_xpos, 0, (desc.num_cols * desc.cell_width)))
+	{
+	    return backdrop_color;
+	}
+
+	int tile_col = (cell_xpos / desc.cell_width);
+	int pixel = (cell_xpos % desc.cell_width);
+	uint8_t text_fg = (text_color != 0) ? text_color : backdrop_color;
+
+	if (desc.source == CellBars)
+	{
+	    return (pixel < 4) ? text_fg : backdrop_color;
+	}
+
+	uint32_t name_addr = ((pattern_name << 10) + ((ypos >> 3) * desc.num_cols) + tile_col);
+	uint32_t pattern_row = ((ypos >> desc.row_shift) & 0x7);
+	uint32_t pattern_base = ((pattern_gen << 11) + pattern_row);
+	uint32_t color_base = (color_table << 6);
+	uint16_t pattern_mask = 0xFF;
+	uint16_t color_mask = 0xFF;
+	uint16_t name_offs = 0;
+
+	if (desc.is_bank_split)
+	{
+	    pattern_base = ((testbit(pattern_gen, 2) << 13) + pattern_row);
+	    pattern_mask = (((pattern_gen & 0x3) << 8) | 0xFF);
+	    color_base = ((testbit(color_table, 7) << 13) + (ypos & 0x7));
+	    color_mask = (((color_table & 0x7F) << 3) | 0x7);
+	    name_offs = ((ypos >> 6) << 8);
+	}
+
+	uint16_t name_word = (fetch_vram(name_addr) + name_offs);
+	uint8_t pattern_byte = fetch_vram(pattern_base + ((name_word & pattern_mask) << 3));
+
+	if (desc.source == CellMulticolor)
+	{
+	    uint8_t color_val = (pixel < 4) ? (pattern_byte >> 4) : (pattern_byte & 0xF);
+	    return (color_val != 0) ? color_val : backdrop_color;
+	}
+
+	bool is_foreground = testbit(pattern_byte, (7 - pixel));
+
+	if (!desc.has_color_table)
+	{
+	    return is_foreground ? text_fg : backdrop_color;
+	}
+
+	uint8_t color_byte = 0;
+
+	if (desc.is_bank_split)
+	{
+	    color_byte = fetch_vram(color_base + ((name_word & color_mask) << 3));
 	}
 	else
 	{
-	    addr_register += 1;
+	    color_byte = fetch_vram(color_base + (name_word >> 3));
+	}
+
+	uint8_t color_val = is_foreground ? (color_byte >> 4) : (color_byte & 0xF);
+	return (color_val != 0) ? color_val : backdrop_color;
+    }
+
+    // Set the callback for finished scanlines
+    template<typename Variant>
+    void TMS99xxA<Variant>::setLineCallback(BeeVDPLineCallback callback)
+    {
+	line_callback = move(callback);
+    }
+
+    // Set the callback for the start of VBlank
+    template<typename Variant>
+    void TMS99xxA<Variant>::setVBlankCallback(BeeVDPVBlankCallback callback)
+    {
+	vblank_callback = move(callback);
+    }
+
+    // Allocate VRAM and the framebuffers (if needed)
+    template<typename Variant>
+    void TMS99xxA<Variant>::allocate_storage()
+    {
+	if (vram == nullptr)
+	{
+	    // Map the shared image (if any), or fall back to a plain copy of it
+	    vram = (vram_image != nullptr) ? vram_image->mapCopy() : nullptr;
+	    is_vram_mapped = (vram != nullptr);
+
+	    if (vram == nullptr)
+	    {
+		vram = static_cast<uint8_t*>(memory_resource->allocate(vram_size, alignof(uint64_t)));
+
+		if (vram_image != nullptr)
+		{
+		    memcpy(vram, vram_image->getData(), vram_size);
+		}
+	    }
+	}
+
+	if (!is_headless && (frame_ring == nullptr))
+	{
+	    void *ring_mem = memory_resource->allocate(sizeof(BeeVDPFrameRing), alignof(BeeVDPFrameRing));
+	    frame_ring = new (ring_mem) BeeVDPFrameRing();
+	}
+
+	if (is_snapshots_enabled && (snapshot_ring == nullptr))
+	{
+	    void *ring_mem = memory_resource->allocate(sizeof(BeeVDPSnapshotRing), alignof(BeeVDPSnapshotRing));
+	    snapshot_ring = new (ring_mem) BeeVDPSnapshotRing();
+	}
+
+	update_vram_mask();
+    }
+
+    // Release any storage owned by the VDP
+    template<typename Variant>
+    void TMS99xxA<Variant>::free_storage()
+    {
+	// (Note: an external frame ring stays attached,
+	// so that the other storage options can be set in any order)
+	if ((frame_ring != nullptr) && !is_ring_external)
+	{
+	    frame_ring->~BeeVDPFrameRing();
+	    memory_resource->deallocate(frame_ring, sizeof(BeeVDPFrameRing), alignof(BeeVDPFrameRing));
+	    frame_ring = nullptr;
+	}
+
+	if (snapshot_ring != nullptr)
+	{
+	    snapshot_ring->~BeeVDPSnapshotRing();
+	    memory_resource->deallocate(snapshot_ring, sizeof(BeeVDPSnapshotRing), alignof(BeeVDPSnapshotRing));
+	    snapshot_ring = nullptr;
+	}
+
+	if (run_ahead_state != nullptr)
+	{
+	    memory_resource->deallocate(run_ahead_state, sizeof(BeeVDPState), alignof(BeeVDPState));
+	    run_ahead_state = nullptr;
+	}
+
+	if ((vram != nullptr) && is_vram_mapped)
+	{
+	    vram_image->unmapCopy(vram);
+	}
+	else if ((vram != nullptr) && !is_vram_external)
+	{
+	    memory_resource->deallocate(vram, vram_size, alignof(uint64_t));
 	}
+
+	last_frame = nullptr;
+	vram = nullptr;
+	is_vram_external = false;
+	is_vram_mapped = false;
     }
 
-    // Fetch the color corresponding to the given palette number
-    BeeVDPRGB TMS9918A::get_color(int color_val)
+    // Update the mask applied to all VRAM accesses
+    template<typename Variant>
+    void TMS99xxA<Variant>::update_vram_mask()
     {
-	// Mask the palette number to between 0 and 15
-	color_val &= 0xF;
+	// The 4K/16K bit in register 1 (if enabled) selects how many address bits
+	// the VDP drives, and the installed VRAM size limits this further
+	bool is_4k_addressing = (Variant::has_4k_mode && is_4k_mode_enabled && !is_16k_mode);
+	uint16_t addr_mask = is_4k_addressing ? 0x0FFF : 0x3FFF;
+	vram_mask = ((vram_size - 1) & addr_mask);
+    }
 
-	// Return the color corresponding to the palette number
-	// (Note: Format of a BeeVDPRGB struct is {red, green, blue})
-	switch (color_val)
+    // Overlay this VDP on a caller-provided 256x192 frame
+    // (or remove the external video with a null pointer)
+    template<typename Variant>
+    void TMS99xxA<Variant>::setExternalVideo(const BeeVDPRGB *frame)
+    {
+	if (frame == nullptr)
 	{
-	    case 0: return {0, 0, 0}; break; // Transparent (but return black color here)
-	    case 1: return {0, 0, 0}; break; // Black
-	    case 2: return {33, 200, 66}; break; // Medium green
-	    case 3: return {94, 200, 120}; break; // Light green
-	    case 4: return {84, 85, 237}; break; // Dark blue
-	    case 5: return {125, 118, 252}; break; // Light blue
-	    case 6: return {212, 82, 77}; break; // Dark red
-	    case 7: return {66, 235, 245}; break; // Cyan
-	    case 8: return {252, 85, 84}; break; // Medium red
-	    case 9: return {255, 121, 120}; break; // Light red
-	    case 10: return {212, 193, 84}; break; // Dark yellow
-	    case 11: return {230, 206, 128}; break; // Light yellow
-	    case 12: return {33, 176, 59}; break; // Dark green
-	    case 13: return {201, 91, 186}; break; // Magenta
-	    case 14: return {204, 204, 204}; break; // Gray
-	    case 15: return {255, 255, 255}; break; // White
+	    external_video = nullptr;
+	    return;
 	}
 
-	// This shouldn't happen
-	return {0, 0, 0};
+	external_video = [frame](int line) -> const BeeVDPRGB*
+	{
+	    return &frame[(line * 256)];
+	};
+    }
+
+    // Overlay this VDP on any other video source
+    template<typename Variant>
+    void TMS99xxA<Variant>::setExternalVideo(BeeVDPVideoSource source)
+    {
+	external_video = std::move(source);
+    }
+
+    // Fetch a scanline of the frame being rendered
+    // (Note: returns a null pointer in headless mode)
+    template<typename Variant>
+    const BeeVDPRGB *TMS99xxA<Variant>::getScanline(int line) const
+    {
+	if ((frame_ring == nullptr) || (line < 0) || (line >= getHeight()))
+	{
+	    return nullptr;
+	}
+
+	return &frame_ring->backFrame().pixels[(line * getWidth())];
     }
 
     // Renders a blank screen
     // (Note: this function is called when the VDP is disabled)
-    void TMS9918A::render_disabled()
+    template<typename Variant>
+    void TMS99xxA<Variant>::render_disabled()
     {
 	render_backdrop();
-	update_framebuffer();
     }
 
     // Render the backdrop
-    void TMS9918A::render_backdrop()
+    template<typename Variant>
+    void TMS99xxA<Variant>::render_backdrop()
     {
 	// Fill the screen with the backdrop color
 	uint16_t vcount = vcounter;
 
 	for (int xpos = 0; xpos < 256; xpos++)
 	{
-	    BeeVDPRGB color = get_color(backdrop_color);
-	    set_pixel(xpos, vcount, color);
+	    set_pixel(xpos, vcount, backdrop_color);
 	}
     }
 
-    // Sets an individual pixel at ('xpos', 'ypos') to RGB color of 'color'
-    void TMS9918A::set_pixel(int xpos, int ypos, BeeVDPRGB color)
+    // Sets an individual pixel at ('xpos', 'ypos') to palette number of 'color_val'
+    template<typename Variant>
+    void TMS99xxA<Variant>::set_pixel(int xpos, int ypos, int color_val)
     {
 	// Sanity check to avoid possible buffer overflows
 	if (!inRange(xpos, 0, getWidth()) || !inRange(ypos, 0, getHeight()))
@@ -130,11 +497,49 @@ namespace beevdp
 	// Set current render line
 	render_line = ypos;
 	// Update internal linebuffer
-	linebuffer[xpos] = color;
+	linebuffer[xpos] = color_val;
+
+	// Flag the pixel as transparent (or not) for the external video
+	uint64_t pixel_bit = (1ULL << (xpos & 63));
+	uint64_t &mask = transparent_mask[(xpos >> 6)];
+	mask = (color_val == 0) ? (mask | pixel_bit) : (mask & ~pixel_bit);
+    }
+
+    // Compare columns 'first_column' to 'end_column' - 1 of a finished scanline
+    // against the same line of the last published frame, 8 pixels (i.e. 24 bytes) at a time
+    // (Note: this compares the RGB pixels rather than the palette numbers,
+    // since external video can change without the palette numbers changing)
+    template<typename Variant>
+    uint32_t TMS99xxA<Variant>::diff_columns(const BeeVDPFrame &frame, int ypos, int first_column, int end_column) const
+    {
+	if (last_frame == nullptr)
+	{
+	    return 0xFFFFFFFF;
+	}
+
+	const uint8_t *line = reinterpret_cast<const uint8_t*>(&frame.pixels[(ypos * 256)]);
+	const uint8_t *last_line = reinterpret_cast<const uint8_t*>(&last_frame->pixels[(ypos * 256)]);
+	return getKernels().diff_columns(line, last_line, first_column, end_column);
+    }
+
+    // Copy pixels 'first_xpos' to 'end_xpos' - 1 of a scanline from the last published frame,
+    // for the parts of the screen outside the region of interest
+    template<typename Variant>
+    void TMS99xxA<Variant>::keep_pixels(BeeVDPFrame &frame, int ypos, int first_xpos, int end_xpos)
+    {
+	if ((last_frame == nullptr) || (first_xpos >= end_xpos))
+	{
+	    return;
+	}
+
+	int offset = (first_xpos + (ypos * getWidth()));
+	memcpy(&frame.pixels[offset], &last_frame->pixels[offset], ((end_xpos - first_xpos) * sizeof(BeeVDPRGB)));
+	memcpy(&frame.indices[offset], &last_frame->indices[offset], (end_xpos - first_xpos));
     }
 
     // Update the framebuffer used to display the screen
-    void TMS9918A::update_framebuffer()
+    template<typename Variant>
+    void TMS99xxA<Variant>::update_framebuffer()
     {
 	// Sanity check to avoid possible buffer overflows
 	if (!inRange(render_line, 0, getHeight()))
@@ -145,62 +550,361 @@ namespace beevdp
 	// Set y-position
 	int ypos = render_line;
 
-	// Copy contents of the linebuffer to the current
-	// scanline on the framebuffer
-	for (int xpos = 0; xpos < getWidth(); xpos++)
+	// Only the columns inside the region of interest are updated,
+	// and the rest of the scanline is kept from the last published frame
+	// (Note: with no published frame to keep them from, the whole scanline is updated)
+	bool is_clipped = (last_frame != nullptr);
+	int first_xpos = is_clipped ? render_region.x : 0;
+	int end_xpos = is_clipped ? (render_region.x + render_region.width) : getWidth();
+
+	BeeVDPFrame &frame = frame_ring->backFrame();
+	auto &framebuffer = frame.pixels;
+	keep_pixels(frame, ypos, 0, first_xpos);
+	keep_pixels(frame, ypos, end_xpos, getWidth());
+
+	// Convert the contents of the linebuffer to RGB colors
+	// on the current scanline of the framebuffer
+	// (Note: the conversion kernel is picked for the CPU at runtime, see beevdp-simd.cpp)
+
+	uint8_t *line_pixels = reinterpret_cast<uint8_t*>(&framebuffer[(first_xpos + (ypos * getWidth()))]);
+	const uint8_t *palette = reinterpret_cast<const uint8_t*>(Variant::palette.data());
+	getKernels().convert_line(line_pixels, &linebuffer[first_xpos], palette, (end_xpos - first_xpos));
+
+	// Keep the palette numbers as well
+	memcpy(&frame.indices[(first_xpos + (ypos * getWidth()))], &linebuffer[first_xpos], (end_xpos - first_xpos));
+
+	// Let the external video through the transparent pixels
+	if (is_external_video && external_video)
 	{
-	    uint32_t screen_pos = (xpos + (ypos * getWidth()));
-	    framebuffer[screen_pos] = linebuffer[xpos];
+	    const BeeVDPRGB *source = external_video(ypos);
+
+	    if (source != nullptr)
+	    {
+		// (Note: the kept pixels outside the region of interest stay as they were)
+		for (int word = 0; word < 4; word++)
+		{
+		    int first_bit = clamp((first_xpos - (word * 64)), 0, 64);
+		    int end_bit = clamp((end_xpos - (word * 64)), 0, 64);
+		    uint64_t word_mask = (end_bit == 64) ? ~0ULL : ((1ULL << end_bit) - 1);
+		    transparent_mask[word] &= ((first_bit == 64) ? 0 : (word_mask & (~0ULL << first_bit)));
+		}
+
+		// (Note: the blend kernel is picked for the CPU at runtime as well)
+		uint8_t *line_start = reinterpret_cast<uint8_t*>(&framebuffer[(ypos * getWidth())]);
+		getKernels().blend_line(line_start, reinterpret_cast<const uint8_t*>(source), transparent_mask.data());
+	    }
+	}
+
+	// Note which parts of the scanline changed since the last published frame
+	frame.dirty_columns[ypos] = diff_columns(frame, ypos, (first_xpos >> 3), ((end_xpos + 7) >> 3));
+
+	// Hand the finished scanline over straight away
+	if (line_callback)
+	{
+	    line_callback(ypos, &framebuffer[(ypos * getWidth())]);
 	}
 
 	// Clear the linebuffer afterwards
 	// to prepare for the next line
-	linebuffer.fill({0, 0, 0});
+	linebuffer.fill(0);
     }
 
     // Render an individual scanline
-    void TMS9918A::render_scanline()
+    template<typename Variant>
+    void TMS99xxA<Variant>::render_scanline()
     {
+	// Render the current scanline into the linebuffer...
+	// (Note: every mode combination has a renderer,
+	// so this can't fail)
+	render_linebuffer(current_renderer);
+
+	// ...and update the framebuffer
+	update_framebuffer();
+    }
+
+    // Render the current scanline into the linebuffer
+    // with the given renderer
+    // (Note: returns false if the current mode is unsupported)
+    template<typename Variant>
+    bool TMS99xxA<Variant>::render_linebuffer(BeeVDPRenderer renderer)
+    {
+	if (renderer == RendererFast)
+	{
+	    return render_fast();
+	}
+
+	return render_reference();
+    }
+
+    // Render the current scanline with the reference renderer
+    // (Note: this renderer is deliberately kept simple,
+    // and is the one all other renderers are verified against)
+    template<typename Variant>
+    bool TMS99xxA<Variant>::render_reference()
+    {
+	BEEVDP_STAT(auto start_time = start_render_time());
+
 	// If the VDP is disabled, render just the backdrop
 	if (!is_vdp_enabled)
 	{
 	    render_disabled();
-	    return;
+	    BEEVDP_STAT(current_stats.lines_disabled += 1);
+	    BEEVDP_STAT(add_render_time(RenderDisabled, start_time));
+	    return true;
 	}
 
 	// Render the backdrop
 	render_backdrop();
+	BEEVDP_STAT(start_time = add_render_time(RenderBackdrop, start_time));
+	BEEVDP_STAT(current_stats.lines_per_mode[mode_val] += 1);
 
 	// Render the background contents
 	switch (mode_val)
 	{
 	    // Mode 0 (aka. graphics I mode)
-	    case 0: render_graphics1(); break;
+	    case 0:
+	    {
+		render_graphics1();
+		BEEVDP_STAT(add_render_time(RenderGraphics1, start_time));
+	    }
+	    break;
 	    // Mode 1 (aka. text mode)
-	    case 1: render_text1(); break;
+	    case 1:
+	    {
+		render_text1();
+		BEEVDP_STAT(add_render_time(RenderText1, start_time));
+	    }
+	    break;
 	    // Mode 2 (aka. graphics II mode)
-	    case 2: render_graphics2(); break;
+	    case 2:
+	    {
+		render_graphics2();
+		BEEVDP_STAT(add_render_time(RenderGraphics2, start_time));
+	    }
+	    break;
+	    // Mode 1+2 (aka. undocumented text mode with graphics II addressing)
+	    case 3:
+	    {
+		render_undocumented_text();
+		BEEVDP_STAT(add_render_time(RenderText1, start_time));
+	    }
+	    break;
 	    // Mode 3 (aka. multicolor mode)
-	    case 4: render_multicolor(); break;
+	    case 4:
+	    {
+		render_multicolor();
+		BEEVDP_STAT(add_render_time(RenderMulticolor, start_time));
+	    }
+	    break;
 	    // Mode 1+3 (aka. undocumented 'bogus' mode A)
-	    case 5: render_bogus_mode(); break;
 	    // Mode 1+2+3 (aka. undocumented 'bogus' mode B)
-	    case 7: render_bogus_mode(); break;
-	    default:
+	    case 5:
+	    case 7:
+	    {
+		render_bogus_mode();
+		BEEVDP_STAT(add_render_time(RenderBogusMode, start_time));
+	    }
+	    break;
+	    // Mode 2+3 (aka. undocumented multicolor mode with graphics II addressing)
+	    case 6:
 	    {
-		cout << "Unrecognized VDP mode of " << dec << int(mode_val) << endl;
-		exit(0);
+		render_undocumented_multicolor();
+		BEEVDP_STAT(add_render_time(RenderMulticolor, start_time));
 	    }
 	    break;
+	    default: return false;
 	}
 
-	// Update the framebuffer
-	update_framebuffer();
+	return true;
+    }
+
+    // Render the current scanline with the fast renderer
+    // (Note: this renderer writes palette numbers straight into the linebuffer,
+    // and must produce exactly the same output as the reference renderer)
+    template<typename Variant>
+    bool TMS99xxA<Variant>::render_fast()
+    {
+	BEEVDP_STAT(auto start_time = start_render_time());
+	uint8_t *line = linebuffer.data();
+	render_line = vcounter;
+
+	// The kernels also flag the transparent pixels when overlaying external video
+	bool is_overlay = (is_external_video && external_video);
+
+	// If the VDP is disabled, render just the backdrop
+	if (!is_vdp_enabled)
+	{
+	    memset(line, backdrop_color, 256);
+	    transparent_mask.fill((is_overlay && (backdrop_color == 0)) ? ~0ULL : 0);
+	    BEEVDP_STAT(current_stats.lines_disabled += 1);
+	    BEEVDP_STAT(add_render_time(RenderDisabled, start_time));
+	    return true;
+	}
+
+	BEEVDP_STAT(current_stats.lines_per_mode[mode_val] += 1);
+
+	// Every mode combination has its own specialized kernel (with and without overlay)
+	static constexpr void (TMS99xxA::*mode_kernels[2][8])(uint8_t *line) =
+	{
+	    {
+		&TMS99xxA::fast_mode<0, false>, &TMS99xxA::fast_mode<1, false>,
+		&TMS99xxA::fast_mode<2, false>, &TMS99xxA::fast_mode<3, false>,
+		&TMS99xxA::fast_mode<4, false>, &TMS99xxA::fast_mode<5, false>,
+		&TMS99xxA::fast_mode<6, false>, &TMS99xxA::fast_mode<7, false>,
+	    },
+	    {
+		&TMS99xxA::fast_mode<0, true>, &TMS99xxA::fast_mode<1, true>,
+		&TMS99xxA::fast_mode<2, true>, &TMS99xxA::fast_mode<3, true>,
+		&TMS99xxA::fast_mode<4, true>, &TMS99xxA::fast_mode<5, true>,
+		&TMS99xxA::fast_mode<6, true>, &TMS99xxA::fast_mode<7, true>,
+	    },
+	};
+
+	(this->*mode_kernels[is_overlay][(mode_val & 0x7)])(line);
+	BEEVDP_STAT(add_render_time(tms99xx_modes[mode_val].render_path, start_time));
+	return true;
+    }
+
+    // Expand the topmost 'width' bits of a pattern byte into 'width' pixels
+    template<typename Variant>
+    void TMS99xxA<Variant>::expand_pattern(uint8_t *pixels, uint8_t pattern_byte, uint8_t fg_color, uint8_t bg_color, int width)
+    {
+	for (int pixel = 0; pixel < width; pixel++)
+	{
+	    pixels[pixel] = testbit(pattern_byte, (7 - pixel)) ? fg_color : bg_color;
+	}
+    }
+
+    // Fast renderer for the mode combination described by tms99xx_modes[Mode]
+    // (Note: the descriptor is a compile-time constant, so each mode gets
+    // its own kernel, with everything that doesn't apply to it compiled out.
+    // With 'IsOverlay' set, each cell also flags its transparent pixels
+    // in the transparency mask as it's drawn.)
+    template<typename Variant>
+    template<int Mode, bool IsOverlay>
+    void TMS99xxA<Variant>::fast_mode(uint8_t *line)
+    {
+	constexpr BeeVDPModeDesc desc = tms99xx_modes[Mode];
+	constexpr int display_width = (desc.border + (desc.num_cols * desc.cell_width));
+	constexpr uint32_t cell_mask = ((1u << desc.cell_width) - 1);
+	static_assert((desc.border <= 56) && ((256 - display_width) <= 56), "Borders must fit in the transparency mask");
+	uint16_t vcount = vcounter;
+	uint8_t *cells = &line[desc.border];
+
+	if constexpr (IsOverlay)
+	{
+	    transparent_mask.fill(0);
+	}
+
+	// The left and right borders are filled with the backdrop color
+	if constexpr (display_width < 256)
+	{
+	    memset(line, backdrop_color, 256);
+
+	    if (IsOverlay && (backdrop_color == 0))
+	    {
+		mark_transparent(0, ((1ULL << desc.border) - 1));
+		mark_transparent(display_width, ((1ULL << (256 - display_width)) - 1));
+	    }
+	}
+
+	if constexpr (desc.source == CellBars)
+	{
+	    uint8_t fg_color = (text_color != 0) ? text_color : backdrop_color;
+	    uint32_t clear_bits = (((fg_color == 0) ? 0x0F : 0) | ((backdrop_color == 0) ? (cell_mask & ~0x0F) : 0));
+
+	    for (int tile_col = 0; tile_col < desc.num_cols; tile_col++)
+	    {
+		memset(&cells[(tile_col * desc.cell_width)], fg_color, 4);
+
+		if constexpr (IsOverlay)
+		{
+		    mark_transparent((desc.border + (tile_col * desc.cell_width)), clear_bits);
+		}
+	    }
+
+	    return;
+	}
+
+	uint32_t name_base = ((pattern_name << 10) + ((vcount >> 3) * desc.num_cols));
+	uint32_t pattern_row = ((vcount >> desc.row_shift) & 0x7);
+	uint32_t pattern_base = ((pattern_gen << 11) + pattern_row);
+	uint32_t color_base = (color_table << 6);
+	uint16_t pattern_mask = 0xFF;
+	uint16_t color_mask = 0xFF;
+	uint16_t name_offs = 0;
+
+	if constexpr (desc.is_bank_split)
+	{
+	    // The screen is split into three banks of 256 patterns
+	    pattern_base = ((testbit(pattern_gen, 2) << 13) + pattern_row);
+	    pattern_mask = (((pattern_gen & 0x3) << 8) | 0xFF);
+	    color_base = ((testbit(color_table, 7) << 13) + (vcount & 0x7));
+	    color_mask = (((color_table & 0x7F) << 3) | 0x7);
+	    name_offs = ((vcount >> 6) << 8);
+	}
+
+	uint8_t text_fg = (text_color != 0) ? text_color : backdrop_color;
+
+	for (int tile_col = 0; tile_col < desc.num_cols; tile_col++)
+	{
+	    uint8_t *pixels = &cells[(tile_col * desc.cell_width)];
+	    uint16_t name_word = (fetch_vram(name_base + tile_col) + name_offs);
+	    uint8_t pattern_byte = fetch_vram(pattern_base + ((name_word & pattern_mask) << 3));
+	    uint8_t fg_color = text_fg;
+	    uint8_t bg_color = backdrop_color;
+
+	    if constexpr (desc.source == CellMulticolor)
+	    {
+		uint8_t left_color = (pattern_byte >> 4);
+		uint8_t right_color = (pattern_byte & 0xF);
+		fg_color = (left_color != 0) ? left_color : backdrop_color;
+		bg_color = (right_color != 0) ? right_color : backdrop_color;
+		memset(pixels, fg_color, 4);
+		memset(&pixels[4], bg_color, 4);
+
+		// (Note: the left half of the cell is the pattern's "foreground")
+		pattern_byte = 0xF0;
+	    }
+	    else if constexpr (desc.has_color_table)
+	    {
+		uint8_t color_byte = 0;
+
+		if constexpr (desc.is_bank_split)
+		{
+		    color_byte = fetch_vram(color_base + ((name_word & color_mask) << 3));
+		}
+		else
+		{
+		    color_byte = fetch_vram(color_base + (name_word >> 3));
+		}
+
+		fg_color = (color_byte >> 4);
+		bg_color = (color_byte & 0xF);
+		fg_color = (fg_color != 0) ? fg_color : backdrop_color;
+		bg_color = (bg_color != 0) ? bg_color : backdrop_color;
+		expand_pattern(pixels, pattern_byte, fg_color, bg_color, desc.cell_width);
+	    }
+	    else
+	    {
+		expand_pattern(pixels, pattern_byte, fg_color, bg_color, desc.cell_width);
+	    }
+
+	    if constexpr (IsOverlay)
+	    {
+		// Reverse the pattern byte, so that bit N is pixel N of the cell...
+		uint32_t pattern_bits = uint32_t(((((pattern_byte * 0x80200802ULL) & 0x0884422110ULL) * 0x0101010101ULL) >> 32) & 0xFF);
+		// ...then flag the pixels drawn in color 0
+		uint32_t clear_bits = (((fg_color == 0) ? pattern_bits : 0) | ((bg_color == 0) ? ~pattern_bits : 0));
+		mark_transparent((desc.border + (tile_col * desc.cell_width)), (clear_bits & cell_mask));
+	    }
+	}
     }
 
     // Render in mode 0
     // (aka. SCREEN 1 in MSX BASIC, and GRAPHIC 1 in V9938 syntax)
-    void TMS9918A::render_graphics1()
+    template<typename Variant>
+    void TMS99xxA<Variant>::render_graphics1()
     {
 	uint16_t vcount = vcounter;
 	uint32_t name_base = (pattern_name << 10);
@@ -211,13 +915,13 @@ namespace beevdp
 	for (int tile_col = 0; tile_col < 32; tile_col++)
 	{
 	    uint32_t name_addr = (name_base + ypos + tile_col);
-	    uint8_t name_byte = vram[name_addr];
+	    uint8_t name_byte = fetch_vram(name_addr);
 
 	    uint32_t pattern_addr = (pattern_base + (name_byte << 3) + (vcount & 0x7));
-	    uint8_t pattern_byte = vram[pattern_addr];
+	    uint8_t pattern_byte = fetch_vram(pattern_addr);
 
 	    uint32_t color_addr = (color_base + (name_byte >> 3));
-	    uint8_t color_byte = vram[color_addr];
+	    uint8_t color_byte = fetch_vram(color_addr);
 
 	    for (int pixel = 0; pixel < 8; pixel++)
 	    {
@@ -240,11 +944,9 @@ namespace beevdp
 		    pixel_color = backdrop_color;
 		}
 
-		BeeVDPRGB color = get_color(pixel_color);
-
 		if (xpos < getWidth())
 		{
-		    set_pixel(xpos, vcount, color);
+		    set_pixel(xpos, vcount, pixel_color);
 		}
 	    }
 	}
@@ -252,7 +954,8 @@ namespace beevdp
 
     // Render in mode 1
     // (aka. SCREEN 0 in MSX BASIC, and TEXT 1 in V9938 syntax)
-    void TMS9918A::render_text1()
+    template<typename Variant>
+    void TMS99xxA<Variant>::render_text1()
     {
 	uint16_t vcount = vcounter;
 	uint32_t name_base = (pattern_name << 10);
@@ -262,10 +965,10 @@ namespace beevdp
 	for (int tile_col = 0; tile_col < 40; tile_col++)
 	{
 	    uint32_t name_addr = (name_base + ypos + tile_col);
-	    uint8_t name_byte = vram[name_addr];
+	    uint8_t name_byte = fetch_vram(name_addr);
 
 	    uint32_t pattern_addr = (pattern_base + (name_byte << 3) + (vcount & 0x7));
-	    uint8_t pattern_byte = vram[pattern_addr];
+	    uint8_t pattern_byte = fetch_vram(pattern_addr);
 
 	    for (int pixel = 0; pixel < 6; pixel++)
 	    {
@@ -288,11 +991,9 @@ namespace beevdp
 		    pixel_color = backdrop_color;
 		}
 
-		BeeVDPRGB color = get_color(pixel_color);
-
 		if (xpos < getWidth())
 		{
-		    set_pixel(xpos, vcount, color);
+		    set_pixel(xpos, vcount, pixel_color);
 		}
 	    }
 	}
@@ -300,7 +1001,8 @@ namespace beevdp
 
     // Render in mode 2
     // (aka. SCREEN 2 in MSX BASIC, and GRAPHIC 2 in V9938 syntax)
-    void TMS9918A::render_graphics2()
+    template<typename Variant>
+    void TMS99xxA<Variant>::render_graphics2()
     {
 	uint16_t vcount = vcounter;
 	uint32_t name_base = (pattern_name << 10);
@@ -313,15 +1015,15 @@ namespace beevdp
 	for (int tile_col = 0; tile_col < 32; tile_col++)
 	{
 	    uint32_t name_addr = (name_base + ypos + tile_col);
-	    uint16_t name_word = (vram[name_addr] + ((vcount >> 6) << 8));
+	    uint16_t name_word = (fetch_vram(name_addr) + ((vcount >> 6) << 8));
 
 	    uint16_t pattern_word = (name_word & pattern_mask);
 	    uint32_t pattern_addr = (pattern_base + (pattern_word << 3) + (vcount & 0x7));
-	    uint8_t pattern_byte = vram[pattern_addr];
+	    uint8_t pattern_byte = fetch_vram(pattern_addr);
 
 	    uint16_t color_word = (name_word & color_mask);
 	    uint32_t color_addr = (color_base + (color_word << 3) + (vcount & 0x7));
-	    uint8_t color_byte = vram[color_addr];
+	    uint8_t color_byte = fetch_vram(color_addr);
 
 	    for (int pixel = 0; pixel < 8; pixel++)
 	    {
@@ -344,11 +1046,9 @@ namespace beevdp
 		    pixel_color = backdrop_color;
 		}
 
-		BeeVDPRGB color = get_color(pixel_color);
-
 		if (xpos < getWidth())
 		{
-		    set_pixel(xpos, vcount, color);
+		    set_pixel(xpos, vcount, pixel_color);
 		}
 	    }
 	}
@@ -356,7 +1056,8 @@ namespace beevdp
 
     // Render in mode 3
     // (aka. SCREEN 3 in MSX BASIC, and MULTICOLOR in V9938 syntax)
-    void TMS9918A::render_multicolor()
+    template<typename Variant>
+    void TMS99xxA<Variant>::render_multicolor()
     {
 	uint16_t vcount = vcounter;
 	uint32_t name_base = (pattern_name << 10);
@@ -366,23 +1067,111 @@ namespace beevdp
 	for (int tile_col = 0; tile_col < 32; tile_col++)
 	{
 	    uint32_t name_addr = (name_base + ypos + tile_col);
-	    uint8_t name_byte = vram[name_addr];
+	    uint8_t name_byte = fetch_vram(name_addr);
 
 	    uint32_t pattern_addr = (pattern_base + (name_byte << 3) + ((vcount >> 2) & 0x7));
-	    uint8_t pattern_byte = vram[pattern_addr];
+	    uint8_t pattern_byte = fetch_vram(pattern_addr);
 
 	    for (int pixel = 0; pixel < 8; pixel++)
 	    {
 		int xpos = ((tile_col << 3) + pixel);
 		int pixel_color = 0;
 
-		if (pixel < 4)
+		if (pixel < 4)
+		{
+		    pixel_color = (pattern_byte >> 4);
+		}
+		else
+		{
+		    pixel_color = (pattern_byte & 0xF);
+		}
+
+		if (pixel_color == 0)
+		{
+		    pixel_color = backdrop_color;
+		}
+
+		if (xpos < getWidth())
+		{
+		    set_pixel(xpos, vcount, pixel_color);
+		}
+	    }
+	}
+    }
+
+    // Render undocumented 'bogus' mode (aka. mode 1+3/mode 1+2+3)
+    template<typename Variant>
+    void TMS99xxA<Variant>::render_bogus_mode()
+    {
+	uint16_t vcount = vcounter;
+	int fg_color = text_color;
+	int bg_color = backdrop_color;
+
+	for (int tile_col = 0; tile_col < 40; tile_col++)
+	{
+	    for (int pixel = 0; pixel < 6; pixel++)
+	    {
+		// This mode has a left border of 6 pixels
+		int xpos = ((tile_col * 6) + (6 + pixel));
+
+		int pixel_color = 0;
+
+		if (pixel < 4)
+		{
+		    pixel_color = fg_color;
+		}
+		else
+		{
+		    pixel_color = bg_color;
+		}
+
+		if (pixel_color == 0)
+		{
+		    pixel_color = backdrop_color;
+		}
+
+		if (xpos < getWidth())
+		{
+		    set_pixel(xpos, vcount, pixel_color);
+		}
+	    }
+	}
+    }
+
+    // Render undocumented mode 1+2
+    // (aka. text mode, with the patterns split into three banks like in mode 2)
+    template<typename Variant>
+    void TMS99xxA<Variant>::render_undocumented_text()
+    {
+	uint16_t vcount = vcounter;
+	uint32_t name_base = (pattern_name << 10);
+	uint32_t pattern_base = (testbit(pattern_gen, 2) << 13);
+	uint16_t pattern_mask = (((pattern_gen & 0x3) << 8) | 0xFF);
+	uint32_t ypos = ((vcount >> 3) * 40);
+
+	for (int tile_col = 0; tile_col < 40; tile_col++)
+	{
+	    uint32_t name_addr = (name_base + ypos + tile_col);
+	    uint16_t name_word = (fetch_vram(name_addr) + ((vcount >> 6) << 8));
+
+	    uint16_t pattern_word = (name_word & pattern_mask);
+	    uint32_t pattern_addr = (pattern_base + (pattern_word << 3) + (vcount & 0x7));
+	    uint8_t pattern_byte = fetch_vram(pattern_addr);
+
+	    for (int pixel = 0; pixel < 6; pixel++)
+	    {
+		int xpos = ((tile_col * 6) + (8 + pixel));
+		int colorline = (7 - pixel);
+
+		int pixel_color = 0;
+
+		if (testbit(pattern_byte, colorline))
 		{
-		    pixel_color = (pattern_byte >> 4);
+		    pixel_color = text_color;
 		}
 		else
 		{
-		    pixel_color = (pattern_byte & 0xF);
+		    pixel_color = backdrop_color;
 		}
 
 		if (pixel_color == 0)
@@ -390,39 +1179,46 @@ namespace beevdp
 		    pixel_color = backdrop_color;
 		}
 
-		BeeVDPRGB color = get_color(pixel_color);
-
 		if (xpos < getWidth())
 		{
-		    set_pixel(xpos, vcount, color);
+		    set_pixel(xpos, vcount, pixel_color);
 		}
 	    }
 	}
     }
 
-    // Render undocumented 'bogus' mode (aka. mode 1+3/mode 1+2+3)
-    void TMS9918A::render_bogus_mode()
+    // Render undocumented mode 2+3
+    // (aka. multicolor mode, with the patterns split into three banks like in mode 2)
+    template<typename Variant>
+    void TMS99xxA<Variant>::render_undocumented_multicolor()
     {
 	uint16_t vcount = vcounter;
-	int fg_color = text_color;
-	int bg_color = backdrop_color;
+	uint32_t name_base = (pattern_name << 10);
+	uint32_t pattern_base = (testbit(pattern_gen, 2) << 13);
+	uint16_t pattern_mask = (((pattern_gen & 0x3) << 8) | 0xFF);
+	uint32_t ypos = ((vcount >> 3) << 5);
 
-	for (int tile_col = 0; tile_col < 40; tile_col++)
+	for (int tile_col = 0; tile_col < 32; tile_col++)
 	{
-	    for (int pixel = 0; pixel < 6; pixel++)
-	    {
-		// This mode has a left border of 6 pixels
-		int xpos = ((tile_col * 6) + (6 + pixel));
+	    uint32_t name_addr = (name_base + ypos + tile_col);
+	    uint16_t name_word = (fetch_vram(name_addr) + ((vcount >> 6) << 8));
+
+	    uint16_t pattern_word = (name_word & pattern_mask);
+	    uint32_t pattern_addr = (pattern_base + (pattern_word << 3) + ((vcount >> 2) & 0x7));
+	    uint8_t pattern_byte = fetch_vram(pattern_addr);
 
+	    for (int pixel = 0; pixel < 8; pixel++)
+	    {
+		int xpos = ((tile_col << 3) + pixel);
 		int pixel_color = 0;
 
 		if (pixel < 4)
 		{
-		    pixel_color = fg_color;
+		    pixel_color = (pattern_byte >> 4);
 		}
 		else
 		{
-		    pixel_color = bg_color;
+		    pixel_color = (pattern_byte & 0xF);
 		}
 
 		if (pixel_color == 0)
@@ -430,24 +1226,24 @@ namespace beevdp
 		    pixel_color = backdrop_color;
 		}
 
-		BeeVDPRGB color = get_color(pixel_color);
-
 		if (xpos < getWidth())
 		{
-		    set_pixel(xpos, vcount, color);
+		    set_pixel(xpos, vcount, pixel_color);
 		}
 	    }
 	}
     }
 
     // Update current VDP mode
-    void TMS9918A::update_mode()
+    template<typename Variant>
+    void TMS99xxA<Variant>::update_mode()
     {
 	mode_val = ((m3_bit << 2) | (m2_bit << 1) | m1_bit);
     }
 
     // Write to a VDP register
-    void TMS9918A::write_reg(int reg, uint8_t data)
+    template<typename Variant>
+    void TMS99xxA<Variant>::write_reg(int reg, uint8_t data)
     {
 	// Ignore writes to invalid registers
 	// (i.e. not registers 0-7)
@@ -456,6 +1252,24 @@ namespace beevdp
 	    return;
 	}
 
+	BEEVDP_STAT(current_stats.reg_writes[reg] += 1);
+	decode_reg(reg, data);
+
+	// Enabling IRQs during VBlank raises the pending IRQ right away
+	if ((reg == 1) && is_vblank && is_irq)
+	{
+	    is_irq_gen = true;
+	}
+    }
+
+    // Update the settings controlled by a VDP register
+    // (Note: this has no side effects beyond the register itself,
+    // so it's also used to restore saved states)
+    template<typename Variant>
+    void TMS99xxA<Variant>::decode_reg(int reg, uint8_t data)
+    {
+	reg_values[reg] = data;
+
 	switch (reg)
 	{
 	    // Register 0 (m2 bit and external video input bit)
@@ -463,6 +1277,8 @@ namespace beevdp
 	    {
 		m2_bit = testbit(data, 1);
 		update_mode();
+
+		is_external_video = testbit(data, 0);
 	    }
 	    break;
 	    // Register 1 (m1 and m3 bits, VDP and IRQ enable bits,
@@ -475,10 +1291,8 @@ namespace beevdp
 		m3_bit = testbit(data, 3);
 		update_mode();
 
-		if (is_vblank && is_irq)
-		{
-		    is_irq_gen = true;
-		}
+		is_16k_mode = testbit(data, 7);
+		update_vram_mask();
 	    }
 	    break;
 	    // Register 2 (pattern name table address)
@@ -499,6 +1313,18 @@ namespace beevdp
 		pattern_gen = (data & 0x7);
 	    }
 	    break;
+	    // Register 5 (sprite attribute table address)
+	    case 5:
+	    {
+		sprite_attrib = (data & 0x7F);
+	    }
+	    break;
+	    // Register 6 (sprite pattern generator address)
+	    case 6:
+	    {
+		sprite_gen = (data & 0x7);
+	    }
+	    break;
 	    // Register 7 (text and backdrop colors)
 	    case 7:
 	    {
@@ -511,91 +1337,204 @@ namespace beevdp
     }
 
     // Initialize the VDP
-    void TMS9918A::init()
+    template<typename Variant>
+    void TMS99xxA<Variant>::init()
     {
+	allocate_storage();
+
 	// Fill VRAM with random data to simulate
 	// the real hardware
-	srand(time(NULL));
-	for (int i = 0; i < 0x4000; i++)
+	// (Note: externally owned VRAM and shared images are left as is)
+	if (!is_vram_external && (vram_image == nullptr))
 	{
-	    vram[i] = (rand() & 0xFF);
+	    srand(time(NULL));
+	    for (int i = 0; i < vram_size; i++)
+	    {
+		vram[i] = (rand() & 0xFF);
+	    }
 	}
 
 	// Clear framebuffer and linebuffer
-	framebuffer.fill({0, 0, 0});
-	linebuffer.fill({0, 0, 0});
+	if (frame_ring != nullptr)
+	{
+	    frame_ring->clear();
+	}
+
+	last_frame = nullptr;
+
+	if (snapshot_ring != nullptr)
+	{
+	    snapshot_ring->clear();
+	}
+
+	frame_count = 0;
+	snapshot_count = 0;
+	reg_values.fill(0);
+	is_frame_rendered = (render_interval != 0);
+	linebuffer.fill(0);
 	is_vblank = true;
-	cout << "TMS9918A::Initialized" << endl;
+	cout << Variant::name << "::Initialized" << endl;
     }
 
     // Power off the VDP
-    void TMS9918A::shutdown()
+    template<typename Variant>
+    void TMS99xxA<Variant>::shutdown()
+    {
+	cout << Variant::name << "::Shutting down..." << endl;
+    }
+
+    // Write to a VDP register through the control port (codes 2 and 3)
+    template<typename Variant>
+    void TMS99xxA<Variant>::port_register()
+    {
+	int vdp_reg = ((command_word >> 8) & 0x7);
+	uint8_t vdp_data = (command_word & 0xFF);
+	write_reg(vdp_reg, vdp_data);
+    }
+
+    // Select the renderer used to draw each scanline
+    template<typename Variant>
+    void TMS99xxA<Variant>::setRenderer(BeeVDPRenderer renderer)
+    {
+	current_renderer = renderer;
+    }
+
+    // Render scanline 'line' of the current VRAM and register state
+    // into 'line_out' (as palette numbers) with the given renderer,
+    // without touching the framebuffer
+    // (Note: this is meant for verifying renderers against each other,
+    // and returns false if the renderer doesn't support the current mode)
+    template<typename Variant>
+    bool TMS99xxA<Variant>::renderLine(int line, BeeVDPRenderer renderer, array<uint8_t, 256> &line_out)
+    {
+	uint16_t prev_vcounter = vcounter;
+	int prev_render_line = render_line;
+
+	vcounter = line;
+	linebuffer.fill(0);
+	bool is_rendered = render_linebuffer(renderer);
+	line_out = linebuffer;
+	linebuffer.fill(0);
+
+	vcounter = prev_vcounter;
+	render_line = prev_render_line;
+	return is_rendered;
+    }
+
+    // Attach a VRAM access profiler to the VDP
+    // (Note: the profiler must outlive the VDP, or be detached
+    // by passing a null pointer)
+    template<typename Variant>
+    void TMS99xxA<Variant>::setVRAMProfiler(BeeVDPVRAMProfiler *profiler)
+    {
+	vram_profiler = profiler;
+    }
+
+    // Attach hardware performance counters to the VDP
+    // (Note: the counters must outlive the VDP, or be detached
+    // by passing a null pointer)
+    template<typename Variant>
+    void TMS99xxA<Variant>::setPerfCounters(BeeVDPPerfCounters *counters)
     {
-	cout << "TMS9918A::Shutting down..." << endl;
+	perf_counters = counters;
     }
 
-    // Write to TMS9918A control port
-    void TMS9918A::writeControl(uint8_t data)
+    // Attach debug views to this VDP
+    // (Note: the views are redrawn in full on the next update)
+    template<typename Variant>
+    void TMS99xxA<Variant>::setDebugViews(BeeVDPDebugViews *views)
     {
-	if (is_second_control_write)
+	debug_views = views;
+
+	if (debug_views != nullptr)
 	{
-	    // Update command word, address register and code register
-	    command_word = ((command_word & 0xFF) | (data << 8));
-	    addr_register = (command_word & 0x3FFF);
-	    code_register = (command_word >> 14);
+	    debug_views->invalidate();
+	}
+    }
 
-	    switch (code_register)
-	    {
-		// Read VRAM
-		case 0:
-		{
-		    // Update the read buffer...
-		    read_buffer = vram[addr_register];
-		    // ...and increment the address register
-		    increment_addr();
-		}
-		break;
-		// Write VRAM
-		case 1: break;
-		// Write to VDP register
-		case 2:
-		case 3:
-		{
-		    int vdp_reg = ((command_word >> 8) & 0x7);
-		    uint8_t vdp_data = (command_word & 0xFF);
-		    cout << "Writing value of " << hex << int(vdp_data) << " to VDP register of " << dec << int(vdp_reg) << endl;
-		    write_reg(vdp_reg, vdp_data);
-		}
-		break;
-		default: break;
-	    }
+    // Bring the attached debug views up to date
+    template<typename Variant>
+    void TMS99xxA<Variant>::updateDebugViews()
+    {
+	if ((debug_views == nullptr) || (vram == nullptr))
+	{
+	    return;
+	}
+
+	BeeVDPTableState state;
+	state.mode_val = mode_val;
+	state.pattern_name = pattern_name;
+	state.color_table = color_table;
+	state.pattern_gen = pattern_gen;
+	state.sprite_attrib = sprite_attrib;
+	state.sprite_gen = sprite_gen;
+	state.text_color = text_color;
+	state.backdrop_color = backdrop_color;
+	state.vram_mask = vram_mask;
+	debug_views->update(vram, state);
+    }
 
-	    is_second_control_write = false;
+    // Fetch the number of CPU access slots available
+    // on the current scanline (or -1 if accesses are unrestricted)
+    // (see beevdp-profiler.cpp for more details)
+    template<typename Variant>
+    int TMS99xxA<Variant>::access_slots() const
+    {
+	// Accesses are unrestricted during VBlank
+	// and while the display is disabled
+	if (!is_vdp_enabled || (vcounter >= getHeight()))
+	{
+	    return -1;
 	}
-	else
+
+	// A scanline lasts about 63.7us
+	if (m1_bit)
+	{
+	    // Text mode (and the other modes with the M1 bit set),
+	    // with an access window of 2us
+	    return 31;
+	}
+	else if (m3_bit)
 	{
-	    // Update command word and address register
-	    command_word = ((command_word & 0xFF00) | data);
-	    addr_register = (command_word & 0x3FFF);
-	    is_second_control_write = true;
+	    // Multicolor mode, with an access window of 3.5us
+	    return 18;
 	}
+
+	// Graphics I and II modes, with an access window of 8us
+	return 7;
     }
 
-    // Write to TMS9918A data port
-    void TMS9918A::writeData(uint8_t data)
+    // Reset the control port's "is_second_byte" flag
+    template<typename Variant>
+    void TMS99xxA<Variant>::reset_latch()
     {
-	// Write data to VRAM and read buffer
-	vram[addr_register] = data;
-	read_buffer = data;
-	// Increment address register
-	increment_addr();
-	// Reset "is_second_byte" flag
+	BEEVDP_STAT(current_stats.latch_resets += is_second_control_write);
 	is_second_control_write = false;
-	read_buffer = data;
+    }
+
+    // Write data port bytes to VRAM
+    template<typename Variant>
+    void TMS99xxA<Variant>::port_write(uint16_t addr, uint8_t data)
+    {
+	uint32_t vram_addr = (addr & vram_mask);
+
+	if (vram_profiler != nullptr)
+	{
+	    vram_profiler->recordWrite(vram_addr, (vram[vram_addr] == data), vcounter, access_slots());
+	}
+
+	if (debug_views != nullptr)
+	{
+	    debug_views->markWrite(vram_addr);
+	}
+
+	vram[vram_addr] = data;
+	BEEVDP_STAT(current_stats.vram_writes += 1);
     }
 
     // Check if an IRQ has been generated
-    bool TMS9918A::isInterrupt()
+    template<typename Variant>
+    bool TMS99xxA<Variant>::isInterrupt()
     {
 	// Prevent IRQ from being fired off more than once per frame
 	bool irq_gen = is_irq_gen;
@@ -604,81 +1543,454 @@ namespace beevdp
     }
 
     // Read from TMS9918A status port
-    uint8_t TMS9918A::readStatus()
+    template<typename Variant>
+    uint8_t TMS99xxA<Variant>::readStatus()
     {
 	// Format of status byte:
 	// INT | 5S | C | FS4 | FS3 | FS2 | FS1 | FS0
 	uint8_t status_byte = (is_vblank << 7);
 	// Reset vblank and "is_second_byte" flags
 	is_vblank = false;
-	is_second_control_write = false;
+	reset_latch();
 	return status_byte;
     }
 
-    // Read from TMS9918A data port
-    uint8_t TMS9918A::readData()
+    // Fetch VRAM bytes for the data port's read buffer
+    template<typename Variant>
+    uint8_t TMS99xxA<Variant>::port_read(uint16_t addr)
     {
-	// Reset "is_second_byte" flag
-	is_second_control_write = false;
-	// Return previous value from read buffer
-	uint8_t result = read_buffer;
-	// Update the read buffer...
-	read_buffer = vram[addr_register];
-	// ...and increment the address register
-	increment_addr();
-	return result;
+	BEEVDP_STAT(current_stats.vram_reads += 1);
+
+	if (vram_profiler != nullptr)
+	{
+	    vram_profiler->recordRead((addr & vram_mask), vcounter, access_slots());
+	}
+
+	return fetch_vram(addr);
     }
 
     // Fetch TMS9918A framebuffer
     // (note: format of BeeVDPRGB struct is {red, green, blue})
-    array<BeeVDPRGB, (256 * 192)> TMS9918A::getFramebuffer()
+    // (Note: this copies the last published frame on the emulation thread,
+    // without acquiring it, so it never takes frames away from the presenter.
+    // Before the first frame is published, this is the frame being drawn.)
+    template<typename Variant>
+    array<BeeVDPRGB, (256 * 192)> TMS99xxA<Variant>::getFramebuffer()
     {
+	// No frames are produced in headless mode
+	if (frame_ring == nullptr)
+	{
+	    return {};
+	}
+
 	// The TMS9918A resolution is 256x192
-	return framebuffer;
+	// (Note: the VDP never draws into the last published frame,
+	// so it can't change while it's being copied here)
+	const BeeVDPFrame *frame = (last_frame != nullptr) ? last_frame : &frame_ring->backFrame();
+	return frame->pixels;
+    }
+
+    // Fetch the most recently completed frame without copying it
+    // (Note: this is safe to call from a presenter thread while the VDP
+    // is being clocked on another one, but only one thread at a time
+    // may act as the presenter)
+    template<typename Variant>
+    const BeeVDPFrame *TMS99xxA<Variant>::acquireFrame()
+    {
+	// No frames are produced in headless mode
+	if (frame_ring == nullptr)
+	{
+	    return nullptr;
+	}
+
+	return frame_ring->acquire();
+    }
+
+    // Save the emulated chip's state
+    // (Note: this is a plain copy, cheap enough to do every frame)
+    template<typename Variant>
+    bool TMS99xxA<Variant>::saveState(BeeVDPState &state) const
+    {
+	if (vram == nullptr)
+	{
+	    return false;
+	}
+
+	state.regs = reg_values;
+	state.vcounter = vcounter;
+	state.command_word = command_word;
+	state.addr_register = addr_register;
+	state.code_register = code_register;
+	state.read_buffer = read_buffer;
+	state.is_second_control_write = is_second_control_write;
+	state.is_vblank = is_vblank;
+	state.is_irq_pending = is_irq_gen;
+	state.frame_count = frame_count;
+	state.vram_size = vram_size;
+	memcpy(state.vram.data(), vram, vram_size);
+	return true;
+    }
+
+    // Restore a state saved by saveState()
+    template<typename Variant>
+    bool TMS99xxA<Variant>::loadState(const BeeVDPState &state)
+    {
+	if ((vram == nullptr) || (state.vram_size != vram_size))
+	{
+	    return false;
+	}
+
+	// Only copy back the parts of VRAM that changed since the save,
+	// which also keeps untouched pages of a shared image from being copied
+	constexpr int chunk_size = 1024;
+
+	for (int offs = 0; offs < vram_size; offs += chunk_size)
+	{
+	    int size = min(chunk_size, (vram_size - offs));
+
+	    if (memcmp(&vram[offs], &state.vram[offs], size) != 0)
+	    {
+		memcpy(&vram[offs], &state.vram[offs], size);
+	    }
+	}
+
+	for (int reg = 0; reg < 8; reg++)
+	{
+	    decode_reg(reg, state.regs[reg]);
+	}
+
+	vcounter = state.vcounter;
+	command_word = state.command_word;
+	addr_register = state.addr_register;
+	code_register = state.code_register;
+	read_buffer = state.read_buffer;
+	is_second_control_write = state.is_second_control_write;
+	is_vblank = state.is_vblank;
+	is_irq_gen = state.is_irq_pending;
+	frame_count = state.frame_count;
+	is_frame_rendered = (render_interval != 0) && ((frame_count % render_interval) == 0);
+
+	if (debug_views != nullptr)
+	{
+	    debug_views->invalidate();
+	}
+
+	return true;
+    }
+
+    // Run ahead of the current state to render a future frame,
+    // then go back to the current state
+    // (Note: the ahead frames don't reach the callbacks or the VRAM profiler,
+    // and only the last one is rendered at all)
+    template<typename Variant>
+    bool TMS99xxA<Variant>::runAhead(int num_frames, const BeeVDPFrameRunner &run_frame)
+    {
+	if ((frame_ring == nullptr) || (vram == nullptr) || (num_frames <= 0))
+	{
+	    return false;
+	}
+
+	// Frames can only be run ahead from the start of a frame
+	// (Note: otherwise the first frame rendered would be torn,
+	// with the lines above the current one left over from the real frame)
+	if (vcounter != 0)
+	{
+	    return false;
+	}
+
+	if (run_ahead_state == nullptr)
+	{
+	    void *state_mem = memory_resource->allocate(sizeof(BeeVDPState), alignof(BeeVDPState));
+	    run_ahead_state = new (state_mem) BeeVDPState();
+	}
+
+	saveState(*run_ahead_state);
+
+	BeeVDPLineCallback prev_line_callback = move(line_callback);
+	BeeVDPVBlankCallback prev_vblank_callback = move(vblank_callback);
+	BeeVDPVRAMProfiler *prev_vram_profiler = vram_profiler;
+	line_callback = nullptr;
+	vblank_callback = nullptr;
+	vram_profiler = nullptr;
+
+	run_ahead_frames = num_frames;
+	is_frame_rendered = (num_frames == 1);
+
+	for (int frame = 0; frame < num_frames; frame++)
+	{
+	    if (run_frame)
+	    {
+		run_frame(frame);
+	    }
+	    else
+	    {
+		for (int line = 0; line < numScanlines(); line++)
+		{
+		    chipClock();
+		}
+	    }
+	}
+
+	// The frame is only rendered if the host ran through every VBlank
+	bool is_rendered = (run_ahead_frames == 0);
+	run_ahead_frames = 0;
+
+	line_callback = move(prev_line_callback);
+	vblank_callback = move(prev_vblank_callback);
+	vram_profiler = prev_vram_profiler;
+	loadState(*run_ahead_state);
+	return is_rendered;
+    }
+
+    // Fetch the performance counters of the last completed frame
+    template<typename Variant>
+    const BeeVDPStats &TMS99xxA<Variant>::getFrameStats() const
+    {
+	return frame_stats;
+    }
+
+    // Fetch the performance counters of the frame in progress
+    template<typename Variant>
+    const BeeVDPStats &TMS99xxA<Variant>::getCurrentStats() const
+    {
+	return current_stats;
+    }
+
+    // Check if the current scanline is one of the timed samples
+    template<typename Variant>
+    bool TMS99xxA<Variant>::is_sampled_line() const
+    {
+	return (((vcounter + frame_count) % BeeVDPStats::sample_interval) == 0);
+    }
+
+    // Read the attached hardware counters (if any)
+    template<typename Variant>
+    BeeVDPPerfSample TMS99xxA<Variant>::read_perf_counters() const
+    {
+	return (perf_counters != nullptr) ? perf_counters->read() : BeeVDPPerfSample();
+    }
+
+    // Start timing a render path
+    // (Note: only sampled scanlines are timed, which keeps
+    // the clock and counter reads off most scanlines)
+    template<typename Variant>
+    chrono::steady_clock::time_point TMS99xxA<Variant>::start_render_time()
+    {
+	is_line_timed = is_sampled_line();
+
+	if (!is_line_timed)
+	{
+	    return {};
+	}
+
+	render_mark = read_perf_counters();
+	return chrono::steady_clock::now();
+    }
+
+    // Add the time elapsed since 'start_time' to the given render path,
+    // scaled up to account for the scanlines that weren't timed
+    // (Note: returns the current time so that timings can be chained)
+    template<typename Variant>
+    chrono::steady_clock::time_point TMS99xxA<Variant>::add_render_time(BeeVDPRenderPath path, chrono::steady_clock::time_point start_time)
+    {
+	if (!is_line_timed)
+	{
+	    return start_time;
+	}
+
+	auto end_time = chrono::steady_clock::now();
+	auto elapsed = chrono::duration_cast<chrono::nanoseconds>(end_time - start_time).count();
+	current_stats.render_time[path] += (elapsed * BeeVDPStats::sample_interval);
+
+	if (perf_counters != nullptr)
+	{
+	    BeeVDPPerfSample sample = perf_counters->read();
+	    current_stats.render_counters[path] += ((sample - render_mark) * BeeVDPStats::sample_interval);
+	    render_mark = sample;
+	}
+
+	return end_time;
+    }
+
+    // Stamp the completed frame and hand it over to the presenter
+    template<typename Variant>
+    void TMS99xxA<Variant>::publish_frame()
+    {
+	frame_count += 1;
+
+	// Snapshot the performance counters for this frame
+	BEEVDP_STAT(frame_stats = current_stats);
+	BEEVDP_STAT(current_stats = BeeVDPStats());
+
+	// Snapshot the VRAM heatmap for this frame
+	if (vram_profiler != nullptr)
+	{
+	    vram_profiler->endFrame(frame_count);
+	}
+
+	// Skipped frames are never handed over to the presenter
+	// (Note: while running ahead, only the last frame is rendered)
+	bool is_published = is_frame_rendered;
+
+	if (run_ahead_frames > 0)
+	{
+	    run_ahead_frames -= 1;
+	    is_frame_rendered = (run_ahead_frames == 1);
+	}
+	else
+	{
+	    is_frame_rendered = (render_interval != 0) && ((frame_count % render_interval) == 0);
+	}
+
+	if ((frame_ring == nullptr) || !is_published)
+	{
+	    return;
+	}
+
+	// (Note: frames are numbered in the order they're published rather than by frame_count,
+	// since a frame run ahead is published before the real frames leading up to it)
+	published_count += 1;
+	BeeVDPFrame &frame = frame_ring->backFrame();
+	frame.sequence = published_count;
+	frame.timestamp = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+	frame.dirty_base = (last_frame != nullptr) ? last_frame->sequence : 0;
+	last_frame = &frame;
+	frame_ring->publish();
+    }
+
+    // Ask the emulation thread for a snapshot
+    template<typename Variant>
+    void TMS99xxA<Variant>::requestSnapshot()
+    {
+	is_snapshot_requested.store(true, memory_order_release);
+    }
+
+    // Fetch the most recent snapshot without copying it
+    // (Note: the snapshot stays valid until the next call)
+    template<typename Variant>
+    const BeeVDPSnapshot *TMS99xxA<Variant>::acquireSnapshot()
+    {
+	if (snapshot_ring == nullptr)
+	{
+	    return nullptr;
+	}
+
+	return snapshot_ring->acquire();
+    }
+
+    // Copy the VDP state into the snapshot ring and hand it over to the observer
+    // (Note: this runs on the emulation thread between port accesses,
+    // so the copy is always consistent)
+    template<typename Variant>
+    void TMS99xxA<Variant>::take_snapshot()
+    {
+	is_snapshot_requested.store(false, memory_order_relaxed);
+
+	if (snapshot_ring == nullptr)
+	{
+	    return;
+	}
+
+	snapshot_count += 1;
+	BeeVDPSnapshot &snapshot = snapshot_ring->backFrame();
+	snapshot.sequence = snapshot_count;
+	snapshot.frame_number = frame_count;
+	snapshot.regs = reg_values;
+	snapshot.vcounter = vcounter;
+	snapshot.status = (is_vblank << 7);
+	snapshot.is_irq_pending = is_irq_gen;
+	snapshot.addr_register = addr_register;
+	snapshot.is_second_control_write = is_second_control_write;
+	snapshot.vram_size = vram_size;
+	memcpy(snapshot.vram.data(), vram, vram_size);
+	snapshot_ring->publish();
     }
 
     // Fetch width of TMS9918A framebuffer
-    int TMS9918A::getWidth() const
+    template<typename Variant>
+    int TMS99xxA<Variant>::getWidth() const
     {
 	// The TMS9918A resolution is 256 pixels wide
 	return 256;
     }
 
     // Fetch height of TMS9918A framebuffer
-    int TMS9918A::getHeight() const
+    template<typename Variant>
+    int TMS99xxA<Variant>::getHeight() const
     {
 	// The TMS9918A resolution is 192 pixels high
 	return 192;
     }
 
-    // Fetch maximum number of scanlines in TMS9918A
-    // (useful for appropriately clocking the VDP)
-    int TMS9918A::numScanlines() const
-    {
-	return 262;
-    }
-
     // Clock the emulated TMS9918A once
-    void TMS9918A::chipClock()
+    template<typename Variant>
+    void TMS99xxA<Variant>::chipClock()
     {
-	// If the internal vcounter is equal 
-	// to the VDP height, we've reached VBlank
-	if (vcounter == getHeight())
+	// (Note: like the render paths, only sampled scanlines are counted)
+	BEEVDP_STAT(bool is_clock_timed = is_sampled_line());
+	BEEVDP_STAT(BeeVDPPerfSample clock_start = (is_clock_timed ? read_perf_counters() : BeeVDPPerfSample()));
+
+	// Serve a pending snapshot request
+	// (Note: a relaxed load is all this costs while no one is watching,
+	// and snapshots are never taken of frames being run ahead)
+	if (is_snapshot_requested.load(memory_order_relaxed) && (run_ahead_frames == 0))
+	{
+	    take_snapshot();
+	}
+
+	// If the internal vcounter is equal
+	// to the VBlank line, we've reached VBlank
+	if (vcounter == Variant::vblank_line)
 	{
 	    is_vblank = true;
 
+	    // Publish the completed frame
+	    publish_frame();
+
 	    // Generate frame IRQ (if enabled)
 	    if (is_irq)
 	    {
 		is_irq_gen = true;
 	    }
+
+	    if (vblank_callback)
+	    {
+		vblank_callback(frame_count);
+	    }
 	}
 
 	// If the internal vcounter is less than the VDP height,
 	// render the current scanline
 	if (vcounter < getHeight())
 	{
-	    render_scanline();
+	    // There's nothing to render to in headless mode,
+	    // during frames that are being skipped, or outside the region of interest
+	    // (Note: with no published frame to keep the other lines from, the whole frame is rendered)
+	    bool is_line_in_region = inRange(int(vcounter), render_region.y, (render_region.y + render_region.height)) || (last_frame == nullptr);
+
+	    if ((frame_ring != nullptr) && is_frame_rendered && is_line_in_region)
+	    {
+		render_scanline();
+	    }
+	    else
+	    {
+		BEEVDP_STAT(current_stats.lines_skipped += 1);
+
+		// Lines outside the region of interest are kept from the last published frame,
+		// so they can't have changed since then
+		// (Note: they're still handed over to the line callback like rendered lines)
+		if ((frame_ring != nullptr) && is_frame_rendered)
+		{
+		    BeeVDPFrame &frame = frame_ring->backFrame();
+		    keep_pixels(frame, vcounter, 0, getWidth());
+		    frame.dirty_columns[vcounter] = 0;
+
+		    if (line_callback)
+		    {
+			line_callback(vcounter, &frame.pixels[(vcounter * getWidth())]);
+		    }
+		}
+	    }
 	}
 
 	// Increment the internal vcounter
@@ -686,9 +1998,18 @@ namespace beevdp
 
 	// The internal vcounter wraps around to 0
 	// when it exceeds the total number of VDP scanlines
-	if (vcounter == numScanlines())
+	if (vcounter == Variant::num_scanlines)
 	{
 	    vcounter = 0;
 	}
+
+	BEEVDP_STAT(if (is_clock_timed) current_stats.clock_counters += ((read_perf_counters() - clock_start) * BeeVDPStats::sample_interval));
     }
-}
\ No newline at end of file
+
+    template class TMS99xxA<TMS9918AVariant>;
+    template class TMS99xxA<TMS9928AVariant>;
+    template class TMS99xxA<TMS9929AVariant>;
+    template class TMS99xxA<TMS9118Variant>;
+    template class TMS99xxA<TMS9128Variant>;
+    template class TMS99xxA<TMS9129Variant>;
+}
\ No newline at end of file
@@ -16,15 +16,27 @@
     along with BeeVDP.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#ifndef BEEVDP_H
+#define BEEVDP_H
+
 #include <iostream>
 #include <cstdint>
 #include <array>
+#include <vector>
 #include <random>
 #include <ctime>
-using namespace std;
+#include <atomic>
+#include <chrono>
+#include <memory_resource>
+#include <functional>
 
 namespace beevdp
 {
+    class BeeVDPVRAMProfiler;
+    class BeeVDPPerfCounters;
+    class BeeVDPVRAMImage;
+    class BeeVDPDebugViews;
+
     struct BeeVDPRGB
     {
 	uint8_t red = 0;
@@ -32,86 +44,838 @@ namespace beevdp
 	uint8_t blue = 0;
     };
 
-    class TMS9918A
+    // Rectangular region of a frame, in pixels
+    struct BeeVDPRect
+    {
+	int x = 0;
+	int y = 0;
+	int width = 0;
+	int height = 0;
+    };
+
+    // A completed frame, as handed over to the presenter
+    struct BeeVDPFrame
+    {
+	// Frame sequence number (starts at 1, and goes up by 1 with every frame published)
+	uint64_t sequence = 0;
+	// Time at which the frame was completed
+	// (in nanoseconds, from std::chrono::steady_clock)
+	int64_t timestamp = 0;
+	std::array<BeeVDPRGB, (256 * 192)> pixels;
+	// Palette number of each pixel (e.g. for the NTSC filter)
+	std::array<uint8_t, (256 * 192)> indices;
+	// Sequence number of the frame published before this one
+	// (0 if there was none)
+	uint64_t dirty_base = 0;
+	// Columns of 8 pixels on each scanline that differ from frame 'dirty_base'
+	// (bit N covers pixels 8N to 8N+7)
+	std::array<uint32_t, 192> dirty_columns;
+
+	void clear()
+	{
+	    sequence = 0;
+	    timestamp = 0;
+	    pixels.fill({0, 0, 0});
+	    indices.fill(0);
+	    dirty_base = 0;
+	    dirty_columns.fill(0xFFFFFFFF);
+	}
+
+	// Collect the regions that changed since the frame numbered 'prev_sequence'
+	// (e.g. the last frame uploaded to a texture)
+	// (Note: this is the whole screen if frames were missed in between,
+	// and nothing at all if the frame is unchanged)
+	void getDirtyRects(uint64_t prev_sequence, std::vector<BeeVDPRect> &rects) const;
+    };
+
+    // Lock-free triple buffer used to hand completed frames
+    // from the VDP over to a (single) presenter thread
+    // (Note: 'Frame' must provide the 'sequence' field and the clear() method
+    // of BeeVDPFrame)
+    template<typename Frame>
+    class BeeVDPTripleBuffer
+    {
+	public:
+	    BeeVDPTripleBuffer() : middle_index(2)
+	    {
+
+	    }
+
+	    // Reset all three frames and the buffer indices
+	    void clear()
+	    {
+		for (auto &frame : frames)
+		{
+		    frame.clear();
+		}
+
+		back_index = 0;
+		front_index = 1;
+		middle_index.store(2, std::memory_order_release);
+	    }
+
+	    // Producer side (i.e. the VDP)
+	    // Fetch the frame currently being drawn by the VDP
+	    Frame &backFrame()
+	    {
+		return frames[back_index];
+	    }
+
+	    // Hand the completed back frame over to the presenter
+	    // (Note: this never blocks, even if the presenter hasn't
+	    // picked up the previously published frame yet)
+	    void publish()
+	    {
+		int prev_index = middle_index.exchange((back_index | fresh_bit), std::memory_order_acq_rel);
+		back_index = (prev_index & 0x3);
+	    }
+
+	    // Consumer side (i.e. the presenter)
+	    // Fetch the most recently completed frame
+	    // (Note: the returned frame stays valid and unmodified
+	    // until the next call to this function,
+	    // and is a null pointer if no frame has been completed yet)
+	    const Frame *acquire()
+	    {
+		if (middle_index.load(std::memory_order_relaxed) & fresh_bit)
+		{
+		    int prev_index = middle_index.exchange(front_index, std::memory_order_acq_rel);
+		    front_index = (prev_index & 0x3);
+		}
+
+		const Frame *frame = &frames[front_index];
+		return (frame->sequence != 0) ? frame : nullptr;
+	    }
+
+	    // Layout of the buffer, for presenters in other processes
+	    // (see beevdp-shm.h)
+	    const Frame *frameData() const
+	    {
+		return frames.data();
+	    }
+
+	    const std::atomic<int> *sharedIndex() const
+	    {
+		return &middle_index;
+	    }
+
+	private:
+	    std::array<Frame, 3> frames;
+
+	    // Bit 2 of the shared index is set when the frame
+	    // it points to has not been acquired yet
+	    static constexpr int fresh_bit = 4;
+
+	    int back_index = 0;
+	    int front_index = 1;
+	    std::atomic<int> middle_index;
+    };
+
+    using BeeVDPFrameRing = BeeVDPTripleBuffer<BeeVDPFrame>;
+
+    // Consistent copy of the VDP state, for debuggers and monitors on other threads
+    struct BeeVDPSnapshot
+    {
+	// Number of the snapshot (0 if no snapshot has been taken yet)
+	uint64_t sequence = 0;
+	// Number of frames completed when the snapshot was taken
+	uint64_t frame_number = 0;
+	// Values last written to registers 0-7
+	std::array<uint8_t, 8> regs = {};
+	uint16_t vcounter = 0;
+	// Status register, as readStatus() would return it
+	uint8_t status = 0;
+	bool is_irq_pending = false;
+	uint16_t addr_register = 0;
+	bool is_second_control_write = false;
+	// Only the first 'vram_size' bytes of 'vram' are valid
+	int vram_size = 0;
+	std::array<uint8_t, 0x4000> vram;
+
+	void clear()
+	{
+	    sequence = 0;
+	    vram_size = 0;
+	}
+    };
+
+    using BeeVDPSnapshotRing = BeeVDPTripleBuffer<BeeVDPSnapshot>;
+
+    // Saved state of the emulated chip, e.g. for run-ahead
+    // (Note: this doesn't cover the storage configuration, callbacks,
+    // statistics or the frames already handed over to the presenter)
+    struct BeeVDPState
+    {
+	// Values last written to registers 0-7
+	std::array<uint8_t, 8> regs = {};
+	uint16_t vcounter = 0;
+	uint16_t command_word = 0;
+	uint16_t addr_register = 0;
+	uint8_t code_register = 0;
+	uint8_t read_buffer = 0;
+	bool is_second_control_write = false;
+	bool is_vblank = false;
+	bool is_irq_pending = false;
+	uint64_t frame_count = 0;
+	// Only the first 'vram_size' bytes of 'vram' are valid
+	int vram_size = 0;
+	std::array<uint8_t, 0x4000> vram;
+    };
+
+    // Called with each scanline as soon as it's finished
+    // ('pixels' holds getWidth() pixels, and is only valid during the call)
+    using BeeVDPLineCallback = std::function<void(int line, const BeeVDPRGB *pixels)>;
+
+    // Called at the start of VBlank, after the completed frame has been published
+    // (Note: 'frame_number' counts every frame emulated, including the ones that aren't rendered,
+    // so it's not the same as the BeeVDPFrame::sequence of the frame just published)
+    using BeeVDPVBlankCallback = std::function<void(uint64_t frame_number)>;
+
+    // Runs one frame of the host machine during run-ahead
+    // (i.e. the host's CPU, along with numScanlines() calls to chipClock())
+    using BeeVDPFrameRunner = std::function<void(int frame_index)>;
+
+    // Source of the external video input, returning the 256 pixels
+    // of the given scanline (or a null pointer if there's no signal)
+    using BeeVDPVideoSource = std::function<const BeeVDPRGB*(int line)>;
+
+    // Render paths timed by the performance counters
+    enum BeeVDPRenderPath : int
+    {
+	RenderBackdrop = 0,
+	RenderDisabled,
+	RenderGraphics1,
+	RenderText1,
+	RenderGraphics2,
+	RenderMulticolor,
+	RenderBogusMode,
+	NumRenderPaths,
+    };
+
+    // Where the pixels of each cell come from
+    enum BeeVDPCellSource : int
+    {
+	// One bit per pixel of a pattern byte, in two colors
+	CellPattern = 0,
+	// Two 4-pixel blocks, with their colors taken from the pattern byte
+	CellMulticolor,
+	// Fixed 4-pixel bars, without any VRAM fetches
+	CellBars,
+    };
+
+    // Layout of one of the eight M1/M2/M3 mode combinations
+    struct BeeVDPModeDesc
+    {
+	// Cells per scanline, width of each cell (in pixels) and width of the left border
+	int num_cols;
+	int cell_width;
+	int border;
+	BeeVDPCellSource source;
+	// Colors come from the color table, rather than from register 7
+	bool has_color_table;
+	// Names are split into three banks of 256 (one per third of the screen),
+	// and the pattern and color tables are masked by registers 3 and 4
+	// (aka. graphics II addressing)
+	bool is_bank_split;
+	// Each row of a pattern covers (1 << row_shift) scanlines
+	int row_shift;
+	BeeVDPRenderPath render_path;
+    };
+
+    // Descriptors of all mode combinations, indexed by mode number (M3 | M2 | M1)
+    inline constexpr std::array<BeeVDPModeDesc, 8> tms99xx_modes =
+    {{
+	// Mode 0 (aka. graphics I mode)
+	{32, 8, 0, CellPattern, true, false, 0, RenderGraphics1},
+	// Mode 1 (aka. text mode)
+	{40, 6, 8, CellPattern, false, false, 0, RenderText1},
+	// Mode 2 (aka. graphics II mode)
+	{32, 8, 0, CellPattern, true, true, 0, RenderGraphics2},
+	// Mode 1+2 (aka. undocumented text mode with graphics II addressing)
+	{40, 6, 8, CellPattern, false, true, 0, RenderText1},
+	// Mode 3 (aka. multicolor mode)
+	{32, 8, 0, CellMulticolor, false, false, 2, RenderMulticolor},
+	// Mode 1+3 (aka. undocumented 'bogus' mode A)
+	{40, 6, 6, CellBars, false, false, 0, RenderBogusMode},
+	// Mode 2+3 (aka. undocumented multicolor mode with graphics II addressing)
+	{32, 8, 0, CellMulticolor, false, true, 2, RenderMulticolor},
+	// Mode 1+2+3 (aka. undocumented 'bogus' mode B)
+	{40, 6, 6, CellBars, false, false, 0, RenderBogusMode},
+    }};
+
+    // Hardware events counted by BeeVDPPerfCounters
+    enum BeeVDPPerfEvent : int
+    {
+	PerfCycles = 0,
+	PerfInstructions,
+	PerfBranchMisses,
+	// Level 1 data cache read misses
+	PerfL1DMisses,
+	// Last level cache misses
+	PerfLLCMisses,
+	NumPerfEvents,
+    };
+
+    // Counts of each hardware event
+    struct BeeVDPPerfSample
+    {
+	std::array<uint64_t, NumPerfEvents> counts = {};
+
+	BeeVDPPerfSample &operator+=(const BeeVDPPerfSample &other)
+	{
+	    for (int event = 0; event < NumPerfEvents; event++)
+	    {
+		counts[event] += other.counts[event];
+	    }
+
+	    return *this;
+	}
+
+	BeeVDPPerfSample operator-(const BeeVDPPerfSample &other) const
+	{
+	    BeeVDPPerfSample result;
+
+	    for (int event = 0; event < NumPerfEvents; event++)
+	    {
+		result.counts[event] = (counts[event] - other.counts[event]);
+	    }
+
+	    return result;
+	}
+
+	BeeVDPPerfSample operator*(uint64_t factor) const
+	{
+	    BeeVDPPerfSample result;
+
+	    for (int event = 0; event < NumPerfEvents; event++)
+	    {
+		result.counts[event] = (counts[event] * factor);
+	    }
+
+	    return result;
+	}
+    };
+
+    // Per-frame performance counters
+    // (Note: these are only updated if the library
+    // is built with BEEVDP_ENABLE_STATS defined)
+    struct BeeVDPStats
+    {
+	// Only one scanline in every 'sample_interval' is timed,
+	// and its timings are scaled up to stand in for the rest
+	// (Note: the sampled lines rotate from frame to frame)
+	static constexpr int sample_interval = 16;
+
+	uint64_t vram_reads = 0;
+	uint64_t vram_writes = 0;
+	// Register writes, indexed by register number
+	std::array<uint64_t, 8> reg_writes = {};
+	// Control port writes discarded by a data port access
+	// or a status read
+	uint64_t latch_resets = 0;
+	// Rendered scanlines, indexed by mode number (M3 | M2 | M1)
+	std::array<uint64_t, 8> lines_per_mode = {};
+	// Scanlines rendered while the display was disabled
+	uint64_t lines_disabled = 0;
+	// Active scanlines that were not rendered at all
+	uint64_t lines_skipped = 0;
+	// Estimated time spent in each render path (in nanoseconds)
+	std::array<int64_t, NumRenderPaths> render_time = {};
+	// Estimated hardware events in each render path, and in all of chipClock()
+	// (Note: these stay at 0 unless counters are attached with setPerfCounters())
+	std::array<BeeVDPPerfSample, NumRenderPaths> render_counters = {};
+	BeeVDPPerfSample clock_counters;
+    };
+
+    // Available scanline renderers
+    enum BeeVDPRenderer : int
+    {
+	// Straightforward renderer, used as the reference
+	// all other renderers are verified against
+	RendererReference = 0,
+	RendererFast,
+	NumRenderers,
+    };
+
+    // Supported VRAM configurations
+    enum BeeVDPVRAMSize : int
+    {
+	VRAM4K = 0x1000,
+	VRAM16K = 0x4000,
+    };
+
+    // Palette shared by all TMS99xxA variants
+    // (Note: the TMS9928A and TMS9929A output YPbPr instead of RGB,
+    // and the exact colors of the PAL variants are still unknown,
+    // so all variants currently use the same RGB approximation)
+    inline constexpr std::array<BeeVDPRGB, 16> tms99xx_palette =
+    {{
+	{0, 0, 0}, // Transparent (but return black color here)
+	{0, 0, 0}, // Black
+	{33, 200, 66}, // Medium green
+	{94, 200, 120}, // Light green
+	{84, 85, 237}, // Dark blue
+	{125, 118, 252}, // Light blue
+	{212, 82, 77}, // Dark red
+	{66, 235, 245}, // Cyan
+	{252, 85, 84}, // Medium red
+	{255, 121, 120}, // Light red
+	{212, 193, 84}, // Dark yellow
+	{230, 206, 128}, // Light yellow
+	{33, 176, 59}, // Dark green
+	{201, 91, 186}, // Magenta
+	{204, 204, 204}, // Gray
+	{255, 255, 255}, // White
+    }};
+
+    // Variant traits for the TMS99xxA family
+    // Each variant provides:
+    // name - name of the chip
+    // num_scanlines - total number of scanlines per frame
+    // vblank_line - scanline on which the VBlank flag (and frame IRQ) is raised
+    // has_4k_mode - whether the 4K/16K bit in register 1 is honored
+    // (the TMS91xx variants only support 4416 DRAMs, and are always in 16K mode)
+    // palette - RGB colors for each palette number
+
+    // NTSC variants (262 scanlines at 60 Hz)
+    struct TMS9918AVariant
+    {
+	static constexpr const char *name = "TMS9918A";
+	static constexpr int num_scanlines = 262;
+	static constexpr int vblank_line = 192;
+	static constexpr bool has_4k_mode = true;
+	static constexpr const std::array<BeeVDPRGB, 16> &palette = tms99xx_palette;
+    };
+
+    struct TMS9928AVariant : TMS9918AVariant
+    {
+	static constexpr const char *name = "TMS9928A";
+    };
+
+    struct TMS9118Variant : TMS9918AVariant
+    {
+	static constexpr const char *name = "TMS9118";
+	static constexpr bool has_4k_mode = false;
+    };
+
+    struct TMS9128Variant : TMS9118Variant
+    {
+	static constexpr const char *name = "TMS9128";
+    };
+
+    // PAL variants (313 scanlines at 50 Hz)
+    struct TMS9929AVariant : TMS9918AVariant
+    {
+	static constexpr const char *name = "TMS9929A";
+	static constexpr int num_scanlines = 313;
+    };
+
+    struct TMS9129Variant : TMS9929AVariant
+    {
+	static constexpr const char *name = "TMS9129";
+	static constexpr bool has_4k_mode = false;
+    };
+
+    // Control and data port state machine shared by the TMS99xxA and Sega VDP cores
+    // (i.e. the two-write address/register latch, the code register and the read-ahead buffer)
+    // 'VDP' derives from this class, and provides what's behind the ports:
+    // port_read(addr) - fetch the VRAM byte at 'addr' for the read-ahead buffer
+    // port_write(addr, data) - store a byte written to the data port
+    // port_register() - carry out codes 2 and 3 of the command word (i.e. register writes)
+    // and may also provide reset_latch(), to track when the latch is reset
+    template<typename VDP>
+    class BeeVDPPorts
     {
 	public:
-	    TMS9918A();
-	    ~TMS9918A();
+	    // Write to the control port
+	    void writeControl(uint8_t data)
+	    {
+		if (!is_second_control_write)
+		{
+		    // Update command word and address register
+		    command_word = ((command_word & 0xFF00) | data);
+		    addr_register = (command_word & 0x3FFF);
+		    is_second_control_write = true;
+		    return;
+		}
+
+		// Update command word, address register and code register
+		command_word = ((command_word & 0xFF) | (data << 8));
+		addr_register = (command_word & 0x3FFF);
+		code_register = (command_word >> 14);
+		is_second_control_write = false;
+
+		switch (code_register)
+		{
+		    // Read VRAM (the first byte is prefetched into the read buffer)
+		    case 0:
+		    {
+			read_buffer = vdp().port_read(addr_register);
+			increment_addr();
+		    }
+		    break;
+		    // Write VRAM (which only takes effect on the data port)
+		    case 1: break;
+		    // Write to VDP register (or anything else the VDP maps to these codes)
+		    case 2:
+		    case 3: vdp().port_register(); break;
+		    default: break;
+		}
+	    }
+
+	    // Write to the data port
+	    void writeData(uint8_t data)
+	    {
+		vdp().port_write(addr_register, data);
+		read_buffer = data;
+		increment_addr();
+		vdp().reset_latch();
+	    }
+
+	    // Read from the data port
+	    uint8_t readData()
+	    {
+		vdp().reset_latch();
+		// Return previous value from read buffer...
+		uint8_t result = read_buffer;
+		// ...then update the read buffer and increment the address register
+		read_buffer = vdp().port_read(addr_register);
+		increment_addr();
+		return result;
+	    }
+
+	protected:
+	    bool is_second_control_write = false;
+	    uint16_t command_word = 0;
+	    uint16_t addr_register = 0;
+	    uint8_t code_register = 0;
+	    uint8_t read_buffer = 0;
+
+	    // Reset the control port's "is_second_byte" flag
+	    void reset_latch()
+	    {
+		is_second_control_write = false;
+	    }
+
+	    // The address register wraps around to 0
+	    // when it exceeds 0x3FFF
+	    void increment_addr()
+	    {
+		addr_register = ((addr_register + 1) & 0x3FFF);
+	    }
+
+	private:
+	    VDP &vdp()
+	    {
+		return static_cast<VDP&>(*this);
+	    }
+    };
+
+    // TMS99xxA core, specialized at compile time for each variant
+    template<typename Variant>
+    class TMS99xxA : public BeeVDPPorts<TMS99xxA<Variant>>
+    {
+	public:
+	    TMS99xxA();
+	    ~TMS99xxA();
+
+	    TMS99xxA(const TMS99xxA&) = delete;
+	    TMS99xxA &operator=(const TMS99xxA&) = delete;
+
+	    // Storage configuration
+	    // (Note: these should be called before init())
+	    void setMemoryResource(std::pmr::memory_resource *resource);
+	    void setVRAMSize(BeeVDPVRAMSize size);
+	    void setVRAMBuffer(uint8_t *buffer, BeeVDPVRAMSize size);
+	    void setVRAMImage(const BeeVDPVRAMImage *image);
+	    // (Note: an external frame ring stays attached until setFrameRing(nullptr),
+	    // and headless mode only stops the VDP from allocating a ring of its own)
+	    void setFrameRing(BeeVDPFrameRing *ring);
+	    void setHeadless(bool is_enabled);
+	    void setSnapshotsEnabled(bool is_enabled);
 
 	    void init();
 	    void shutdown();
 
-	    void writeControl(uint8_t data);
-	    void writeData(uint8_t data);
-
+	    // (Note: the control and data ports are provided by BeeVDPPorts)
 	    bool isInterrupt();
 	    uint8_t readStatus();
-	    uint8_t readData();
 
-	    array<BeeVDPRGB, (256 * 192)> getFramebuffer();
+	    // Honor the 4K/16K bit in register 1
+	    // (Note: this is off by default, so VRAM is always addressed as 16K.
+	    // 4K mode masks addresses to 4K, as on machines with 4K of VRAM,
+	    // rather than remapping them the way 16K DRAMs see them.
+	    // Variants without 4K mode ignore this.)
+	    void set4KModeEnabled(bool is_enabled);
+
+	    // Render only every 'interval'th frame (or no frames at all if 'interval' is 0)
+	    // (Note: timing, status flags and IRQs are unaffected by skipped frames,
+	    // and a new interval only takes effect at the next frame boundary,
+	    // so the frame in progress is always rendered or skipped in full)
+	    void setRenderInterval(int interval);
+
+	    // Only render the scanlines and columns inside 'region' (clipped to the screen)
+	    // (Note: pixels outside the region are kept from the last published frame,
+	    // or rendered as well when there isn't one;
+	    // the line callback still gets every scanline of the frame,
+	    // and timing, status flags and IRQs are unaffected)
+	    void setRegionOfInterest(const BeeVDPRect &region);
+	    BeeVDPRect getRegionOfInterest() const;
+
+	    // Evaluate the palette number of the pixel at ('xpos', 'ypos')
+	    // straight from the current VRAM and registers, without rendering anything
+	    // (Note: this also works in headless mode and during skipped frames,
+	    // and returns 0 for pixels outside the screen)
+	    uint8_t peekPixel(int xpos, int ypos);
+
+	    // Hand over each finished scanline (and the start of each VBlank)
+	    // without waiting for the frame to complete
+	    // (Note: these are called from chipClock(), so the callbacks may also
+	    // write to the VDP to apply raster effects on the following lines)
+	    void setLineCallback(BeeVDPLineCallback callback);
+	    void setVBlankCallback(BeeVDPVBlankCallback callback);
+
+	    // Overlay this VDP on an external video source while register 0 bit 0 is set,
+	    // either a caller-provided 256x192 frame or any other source
+	    // (Note: pixels of color 0, including the backdrop, let the external video through)
+	    void setExternalVideo(const BeeVDPRGB *frame);
+	    void setExternalVideo(BeeVDPVideoSource source);
+
+	    // Fetch a scanline of the frame being rendered, e.g. to stack several VDPs
+	    // (Note: the scanline is complete once this VDP has been clocked through it,
+	    // so clock the background VDP before the VDPs overlaid on it)
+	    const BeeVDPRGB *getScanline(int line) const;
+
+	    // Ask for a snapshot of the registers, status flags and VRAM from another thread,
+	    // and fetch the most recent one (or a null pointer if there's none yet)
+	    // (Note: snapshots are taken at the start of the next chipClock(),
+	    // so the emulation thread never waits for an observer.
+	    // Only one thread at a time may act as the observer.)
+	    void requestSnapshot();
+	    const BeeVDPSnapshot *acquireSnapshot();
+
+	    std::array<BeeVDPRGB, (256 * 192)> getFramebuffer();
+	    const BeeVDPFrame *acquireFrame();
+
+	    // Save or restore the emulated chip's state
+	    // (Note: loadState() returns false if the state was saved
+	    // with a different VRAM size, and leaves the VDP untouched)
+	    bool saveState(BeeVDPState &state) const;
+	    bool loadState(const BeeVDPState &state);
+
+	    // Run 'num_frames' frames ahead of the current state, with only the last one rendered,
+	    // then go back to the current state (returns false if nothing was rendered)
+	    // 'run_frame' runs each frame of the host machine, or if it's empty,
+	    // the VDP is clocked through each frame on its own
+	    // (Note: this may only be called between frames, i.e. before the first chipClock() of a frame.
+	    // Called in the middle of a frame, it returns false and leaves the VDP untouched.)
+	    // (Note: the host saves and restores its own state around this call.
+	    // The rendered frame is handed over to the presenter as usual, with the next sequence number,
+	    // so set the render interval to 0 to keep the real frames from reaching it.
+	    // The callbacks and the VRAM profiler don't see the frames run ahead.)
+	    bool runAhead(int num_frames, const BeeVDPFrameRunner &run_frame = nullptr);
 
 	    int getWidth() const;
 	    int getHeight() const;
-	    int numScanlines() const;
+	    constexpr int numScanlines() const
+	    {
+		return Variant::num_scanlines;
+	    }
 
-	    void chipClock();
+	    const BeeVDPStats &getFrameStats() const;
+	    const BeeVDPStats &getCurrentStats() const;
 
-	private:
-	    array<BeeVDPRGB, (256 * 192)> framebuffer;
+	    void setRenderer(BeeVDPRenderer renderer);
+	    bool renderLine(int line, BeeVDPRenderer renderer, std::array<uint8_t, 256> &line_out);
 
-	    int render_line = 0;
-	    array<BeeVDPRGB, 256> linebuffer;
+	    // Attach a VRAM access profiler (or detach it with a null pointer)
+	    void setVRAMProfiler(BeeVDPVRAMProfiler *profiler);
+	    // Attach hardware performance counters (or detach them with a null pointer)
+	    void setPerfCounters(BeeVDPPerfCounters *counters);
 
-	    bool is_second_control_write = false;
-	    uint16_t command_word = 0;
-	    uint16_t addr_register = 0;
-	    int code_register = 0;
+	    // Attach debug views (or detach them with a null pointer),
+	    // and bring them up to date with the VRAM writes since the last call
+	    void setDebugViews(BeeVDPDebugViews *views);
+	    void updateDebugViews();
 
-	    uint8_t read_buffer = 0;
+	    void chipClock();
+
+	private:
+	    // Hot state (kept together at the start of the object)
+	    uint8_t *vram = nullptr;
+	    uint16_t vram_mask = 0x0FFF;
 
 	    uint16_t vcounter = 0;
+	    int render_line = 0;
 
-	    bool is_vblank = false;
+	    // Port state (which comes first, as part of the base class)
+	    using Ports = BeeVDPPorts<TMS99xxA>;
+	    friend Ports;
+	    using Ports::is_second_control_write;
+	    using Ports::command_word;
+	    using Ports::addr_register;
+	    using Ports::code_register;
+	    using Ports::read_buffer;
+	    using Ports::increment_addr;
 
-	    array<uint8_t, 0x4000> vram;
+	    uint8_t port_read(uint16_t addr);
+	    void port_write(uint16_t addr, uint8_t data);
+	    void port_register();
 
-	    void write_reg(int reg, uint8_t data);
+	    bool is_vblank = false;
 
 	    bool m2_bit = false;
 	    bool m1_bit = false;
 	    bool m3_bit = false;
-	    int mode_val = 0;
+	    uint8_t mode_val = 0;
 
 	    bool is_vdp_enabled = false;
 	    bool is_irq = false;
+	    bool is_16k_mode = false;
+	    bool is_4k_mode_enabled = false;
 
 	    bool is_irq_gen = false;
+	    bool is_external_video = false;
+
+	    uint8_t pattern_name = 0;
+	    uint8_t color_table = 0;
+	    uint8_t pattern_gen = 0;
+
+	    uint8_t text_color = 0;
+	    uint8_t backdrop_color = 0;
+
+	    uint8_t sprite_attrib = 0;
+	    uint8_t sprite_gen = 0;
+
+	    std::atomic<bool> is_snapshot_requested = false;
+
+	    // Palette numbers of the scanline being rendered
+	    std::array<uint8_t, 256> linebuffer;
+
+	    // Transparent pixels of the scanline being rendered (one bit per pixel),
+	    // flagged by the renderers as they draw each cell
+	    std::array<uint64_t, 4> transparent_mask = {};
+
+	    // Cold state (storage configuration and frame output)
+	    std::pmr::memory_resource *memory_resource = nullptr;
+	    BeeVDPFrameRing *frame_ring = nullptr;
+	    // Last frame handed over to the presenter
+	    // (Note: the VDP never writes to it until the next frame is published)
+	    const BeeVDPFrame *last_frame = nullptr;
+	    uint64_t frame_count = 0;
+	    // Number of frames handed over to the presenter, which numbers them
+	    // (Note: this isn't saved with the state, and keeps counting across init(),
+	    // so a sequence number is never reused)
+	    uint64_t published_count = 0;
+
+	    BeeVDPVRAMSize vram_size = VRAM16K;
+	    bool is_vram_external = false;
+	    // Shared base image VRAM is mapped from (if any)
+	    const BeeVDPVRAMImage *vram_image = nullptr;
+	    bool is_vram_mapped = false;
+	    bool is_ring_external = false;
+	    bool is_headless = false;
+
+	    // Raw register values, kept for snapshots
+	    std::array<uint8_t, 8> reg_values = {};
+	    bool is_snapshots_enabled = false;
+	    BeeVDPSnapshotRing *snapshot_ring = nullptr;
+	    uint64_t snapshot_count = 0;
+
+	    int render_interval = 1;
+	    bool is_frame_rendered = true;
+	    BeeVDPRect render_region = {0, 0, 256, 192};
+
+	    // VBlanks left before the frame being run ahead to
+	    // (or 0 if the VDP isn't running ahead)
+	    int run_ahead_frames = 0;
+	    BeeVDPState *run_ahead_state = nullptr;
+
+	    BeeVDPLineCallback line_callback;
+	    BeeVDPVBlankCallback vblank_callback;
+	    BeeVDPVideoSource external_video;
+
+	    BeeVDPRenderer current_renderer = RendererFast;
+
+	    BeeVDPVRAMProfiler *vram_profiler = nullptr;
+	    BeeVDPPerfCounters *perf_counters = nullptr;
+	    BeeVDPDebugViews *debug_views = nullptr;
+	    int access_slots() const;
+
+	    // Counters for the current frame and the last completed frame
+	    // (Note: these are present even without BEEVDP_ENABLE_STATS,
+	    // so that the class layout never depends on it)
+	    BeeVDPStats current_stats;
+	    BeeVDPStats frame_stats;
+
+	    // Hardware counts at the start of the render path being timed,
+	    // and whether the current scanline is timed at all
+	    BeeVDPPerfSample render_mark;
+	    bool is_line_timed = false;
+
+	    bool is_sampled_line() const;
+	    BeeVDPPerfSample read_perf_counters() const;
+	    std::chrono::steady_clock::time_point start_render_time();
+	    std::chrono::steady_clock::time_point add_render_time(BeeVDPRenderPath path, std::chrono::steady_clock::time_point start_time);
+
+	    void reset_latch();
+
+	    void allocate_storage();
+	    void free_storage();
+	    void update_vram_mask();
+	    uint32_t diff_columns(const BeeVDPFrame &frame, int ypos, int first_column, int end_column) const;
+	    void keep_pixels(BeeVDPFrame &frame, int ypos, int first_xpos, int end_xpos);
+
+	    uint8_t fetch_vram(uint32_t addr)
+	    {
+		return vram[(addr & vram_mask)];
+	    }
 
-	    int pattern_name = 0;
-	    int color_table = 0;
-	    int pattern_gen = 0;
-
-	    int text_color = 0;
-	    int backdrop_color = 0;
+	    void write_reg(int reg, uint8_t data);
+	    void decode_reg(int reg, uint8_t data);
 
 	    void update_mode();
 
 	    void render_scanline();
+	    bool render_linebuffer(BeeVDPRenderer renderer);
+
+	    // Flag the transparent pixels of a cell for overlay compositing
+	    // (bit N of 'bits' is pixel 'xpos' + N, and cells may straddle two words of the mask)
+	    void mark_transparent(int xpos, uint64_t bits)
+	    {
+		int word = (xpos >> 6);
+		int shift = (xpos & 63);
+		transparent_mask[word] |= (bits << shift);
+
+		if ((shift != 0) && (word < 3))
+		{
+		    transparent_mask[(word + 1)] |= (bits >> (64 - shift));
+		}
+	    }
+
+	    // Reference renderer
+	    bool render_reference();
 	    void render_backdrop();
 	    void render_graphics1();
 	    void render_text1();
 	    void render_graphics2();
 	    void render_multicolor();
 	    void render_bogus_mode();
+	    void render_undocumented_text();
+	    void render_undocumented_multicolor();
 
 	    void render_disabled();
 
-	    void set_pixel(int xpos, int ypos, BeeVDPRGB color);
-	    void update_framebuffer();
-
-	    BeeVDPRGB get_color(int color_val);
+	    // Fast renderer
+	    bool render_fast();
+	    void expand_pattern(uint8_t *pixels, uint8_t pattern_byte, uint8_t fg_color, uint8_t bg_color, int width);
+	    template<int Mode, bool IsOverlay>
+	    void fast_mode(uint8_t *line);
 
-	    void increment_addr();
+	    void set_pixel(int xpos, int ypos, int color_val);
+	    void update_framebuffer();
+	    void publish_frame();
+	    void take_snapshot();
 
 	    template<typename T>
 	    bool testbit(T reg, int bit)
@@ -125,4 +889,13 @@ namespace beevdp
 		return ((val >= low) && (val < high));
 	    }
     };
-};
\ No newline at end of file
+
+    using TMS9918A = TMS99xxA<TMS9918AVariant>;
+    using TMS9928A = TMS99xxA<TMS9928AVariant>;
+    using TMS9929A = TMS99xxA<TMS9929AVariant>;
+    using TMS9118 = TMS99xxA<TMS9118Variant>;
+    using TMS9128 = TMS99xxA<TMS9128Variant>;
+    using TMS9129 = TMS99xxA<TMS9129Variant>;
+};
+
+#endif // BEEVDP_H